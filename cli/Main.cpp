@@ -38,17 +38,27 @@
 #include "libnebula/ZeroedArray.h"
 #include "libnebula/Exception.h"
 #include "libnebula/FileInfo.h"
+#include "libnebula/FilesCache.h"
+#include "libnebula/Catalog.h"
+#include "libnebula/ObjectIndex.h"
+#include "libnebula/ReferenceCounts.h"
 #include "libnebula/Repository.h"
+#include "libnebula/SnapshotSummary.h"
 
 static void printHelp()
 {
 	printf("usage: NebulaBackup [options] init <repo>\n");
 	printf("       NebulaBackup [options] backup <repo> <snapshot> <file> [<file>...]\n");
 	printf("       NebulaBackup [options] restore <repo> <snapshot> [<file>...] <destdir>\n");
-	printf("       NebulaBackup [options] list <repo>\n");
+	printf("       NebulaBackup [options] list [-l] <repo>\n");
 	printf("       NebulaBackup [options] list <repo> <snapshot>\n");
+	printf("       NebulaBackup [options] find <repo> <pattern>\n");
+	printf("       NebulaBackup [options] diff <repo> <snapshot> <snapshot>\n");
 	printf("       NebulaBackup [options] delete <repo> <snapshot>\n");
-	printf("       NebulaBackup [options] compact <repo>\n");
+	printf("       NebulaBackup [options] compact [-n] <repo>\n");
+	printf("       NebulaBackup [options] repack <repo>\n");
+	printf("       NebulaBackup [options] check [--sample=PERCENT] <repo>\n");
+	printf("       NebulaBackup [options] sync <src-repo> <dst-repo> [<snapshot>...]\n");
 	printf("       NebulaBackup [options] password <repo>\n");
 	printf("\n");
 	printf("<repo> can be in the format of:\n");
@@ -60,6 +70,19 @@ static void printHelp()
 	printf("     --no-verify          Don't downloaded files\n");
 	printf(" -n, --dry-run            Dry-run\n");
 	printf(" -f, --force              Don't prompt for overwrite\n");
+	printf(" -j, --jobs=N             Number of objects to restore in parallel\n");
+	printf(" -l, --long               List snapshots with their size, file count and host\n");
+	printf("     --parent=SNAPSHOT    Reuse unchanged files from a previous snapshot\n");
+	printf("     --cache-dir=DIR      Local cache directory (default ~/.cache/nebula)\n");
+	printf("     --no-cache           Don't use the local files and metadata caches\n");
+	printf("     --tree               Store the snapshot as a tree of directories\n");
+	printf("     --liveness=RATIO     Repack packs with less than RATIO in use (default 0.5)\n");
+	printf("     --max-bytes=BYTES    Download at most BYTES of packs when repacking\n");
+	printf("     --max-time=SECONDS   Stop downloading packs to repack after SECONDS\n");
+	printf("     --sample=PERCENT     Also restore PERCENT of the files when checking\n");
+	printf("     --checkpoint=SECONDS Save a backup's progress every SECONDS (default 600)\n");
+	printf("     --seed=PATH          Copy contents found in PATH instead of downloading them\n");
+	printf("     --delta              Reuse the contents of the files restored over\n");
 	printf("\n");
 	printf("ssh backend options:\n");
 	printf(" -u, --username=USER      SSH username\n");
@@ -84,13 +107,36 @@ struct Options
 	bool verify;
 	bool dryRun;
 	bool force;
+	int jobs;
 	std::string backend;
+	std::string parent;
+	std::string cacheDir;
+	bool useCache;
+	bool tree;
+	bool longList;
+	double liveness;
+	uint64_t maxBytes;
+	int maxTime;
+	double samplePercent;
+	int checkpointInterval;
+	std::vector<std::string> seeds;
+	bool delta;
 
 	Options()
 	: quiet(false)
 	, verify(true)
 	, dryRun(false)
-	, force(false) { }
+	, force(false)
+	, jobs(0)
+	, useCache(true)
+	, tree(false)
+	, longList(false)
+	, liveness(0.5)
+	, maxBytes(0)
+	, maxTime(0)
+	, samplePercent(0)
+	, checkpointInterval(600)
+	, delta(false) { }
 };
 
 static Options options;
@@ -293,73 +339,197 @@ static void printProgress(int blockNo, int blockMax, long bytesTransferred, long
 	fflush(stdout);
 }
 
+static boost::filesystem::path cacheDirectory(Nebula::Repository& repo)
+{
+	using namespace boost;
+	
+	filesystem::path cacheDir;
+	if(!options.cacheDir.empty()) {
+		cacheDir = options.cacheDir;
+	} else if(getenv("XDG_CACHE_HOME")) {
+		cacheDir = filesystem::path(getenv("XDG_CACHE_HOME")) / "nebula";
+	} else if(getenv("HOME")) {
+		cacheDir = filesystem::path(getenv("HOME")) / ".cache" / "nebula";
+	} else {
+		return filesystem::path();
+	}
+	
+	cacheDir /= repo.repositoryId();
+	filesystem::create_directories(cacheDir);
+	return cacheDir;
+}
+
+static void useMetadataCache(Nebula::Repository& repo)
+{
+	using namespace Nebula;
+	using namespace boost;
+	
+	if(!options.useCache) {
+		return;
+	}
+	
+	try {
+		filesystem::path cacheDir = cacheDirectory(repo);
+		if(!cacheDir.empty()) {
+			repo.setMetadataCache(std::make_shared<FileDataStore>(cacheDir / "metadata"));
+		}
+	} catch(std::exception& e) {
+		fprintf(stderr, "Not using the metadata cache: %s\n", e.what());
+	}
+}
+
+static void useObjectIndex(Nebula::Repository& repo)
+{
+	using namespace Nebula;
+	using namespace boost;
+	
+	if(!options.useCache) {
+		return;
+	}
+	
+	try {
+		filesystem::path cacheDir = cacheDirectory(repo);
+		if(!cacheDir.empty()) {
+			repo.setObjectIndex(std::make_shared<ObjectIndex>((cacheDir / "objects").c_str()));
+		}
+	} catch(std::exception& e) {
+		fprintf(stderr, "Not using the object index: %s\n", e.what());
+	}
+}
+
 static void backupFiles(const char *repository, const char *snapshotName, int argc, char * const *argv)
 {
 	using namespace Nebula;
 	using namespace boost;
 	
+	Repository::Options repoOptions;
+	repoOptions.treeSnapshots = options.tree;
+
 	auto dataStore = createDataStoreFromRepository(repository);
-	Repository repo(dataStore.get());
+	Repository repo(dataStore.get(), &repoOptions);
 	
 	ZeroedString password = promptReadPassword(false);
 	if(!repo.unlockRepository(password.c_str())) {
 		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
 	}
+	
+	// before loading the caches and the parent, whose objects the backup
+	// reuses
+	repo.takeSharedLease();
 
-	std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+	if(options.useCache && !options.dryRun) {
+		try {
+			filesystem::path cacheDir = cacheDirectory(repo);
+			if(!cacheDir.empty()) {
+				repo.setFilesCache(std::make_shared<FilesCache>((cacheDir / "files").c_str()));
+			}
+		} catch(std::exception& e) {
+			fprintf(stderr, "Not using the files cache: %s\n", e.what());
+		}
+	}
+
+	useMetadataCache(repo);
+	if(!options.dryRun) {
+		useObjectIndex(repo);
+	}
+
+	std::shared_ptr<Snapshot> parentSnapshot;
+	if(!options.parent.empty()) {
+		parentSnapshot = repo.loadSnapshot(options.parent.c_str());
+	}
+	
+	// an interrupted backup resumes with the files it already uploaded
+	if(!options.dryRun) {
+		std::shared_ptr<Snapshot> checkpoint = repo.loadCheckpoint(snapshotName);
+		if(checkpoint) {
+			if(!options.quiet) {
+				printf("Resuming the interrupted backup of %s\n", snapshotName);
+			}
+			checkpoint->setParent(parentSnapshot);
+			parentSnapshot = checkpoint;
+		}
+	}
+
+	std::shared_ptr<Snapshot> snapshot(repo.createSnapshot(parentSnapshot));
 	
 	std::shared_ptr<Repository::PackUploadState> packState = repo.createPackState();
-	for(int i = 0; i < argc; ++i) {
-		if(filesystem::is_directory(argv[i])) {
-			filesystem::recursive_directory_iterator dirIterator(argv[i]);
+	time_t lastCheckpoint = time(nullptr);
+	auto checkpoint = [&]() {
+		repo.finalizePack(snapshot, packState);
+		repo.checkpointSnapshot(snapshot, snapshotName);
+		lastCheckpoint = time(nullptr);
+	};
+	auto checkpointIfDue = [&]() {
+		if(options.checkpointInterval > 0 && time(nullptr) - lastCheckpoint >= options.checkpointInterval) {
+			checkpoint();
+		}
+	};
+	
+	try {
+		for(int i = 0; i < argc; ++i) {
+			if(filesystem::is_directory(argv[i])) {
+				filesystem::recursive_directory_iterator dirIterator(argv[i]);
 			
-			for(auto& file : dirIterator)
-			{
-				if(!filesystem::is_directory(file))
+				for(auto& file : dirIterator)
 				{
-					if(!options.quiet) {
-						printf("%s\n", file.path().c_str());
-					}
+					if(!filesystem::is_directory(file))
+					{
+						if(!options.quiet) {
+							printf("%s\n", file.path().c_str());
+						}
 					
-					if(!options.dryRun) {
-						time_t startTime = time(nullptr);
-						FileStream fs(file.path().c_str(), FileMode::Read);
-						int lastBlockNo = 0;
-						repo.uploadFile(packState, snapshot, file.path().c_str(), fs,
-							[&lastBlockNo, startTime](int blockNo, int blockMax, long bytesUploaded, long bytesTotal) -> bool {
-								if(lastBlockNo != blockNo) {
-									lastBlockNo = blockNo;
-									fputs("\n", stdout);
-								}
-								printProgress(blockNo, blockMax, bytesUploaded, bytesTotal, startTime);
-								return !sUserCancelled;
-							});
-						if(!options.quiet) fputs("\n", stdout);
-					}
-				}
-			}
-		} else {
-			if(!options.quiet) {
-				printf("%s\n", argv[i]);
-			}
-			if(!options.dryRun) {
-				time_t startTime = time(nullptr);
-				FileStream fs(argv[i], FileMode::Read);
-				int lastBlockNo = 0;
-				repo.uploadFile(packState, snapshot, argv[i], fs,
-								[&lastBlockNo, startTime](int blockNo, int blockMax, long bytesDownloaded, long bytesTotal) -> bool {
+						if(!options.dryRun) {
+							time_t startTime = time(nullptr);
+							FileStream fs(file.path().c_str(), FileMode::Read);
+							int lastBlockNo = 0;
+							repo.uploadFile(packState, snapshot, file.path().c_str(), fs,
+								[&lastBlockNo, startTime](int blockNo, int blockMax, long bytesUploaded, long bytesTotal) -> bool {
 									if(lastBlockNo != blockNo) {
 										lastBlockNo = blockNo;
 										fputs("\n", stdout);
 									}
-									printProgress(blockNo, blockMax, bytesDownloaded, bytesTotal, startTime);
+									printProgress(blockNo, blockMax, bytesUploaded, bytesTotal, startTime);
 									return !sUserCancelled;
 								});
-				if(!options.quiet) fputs("\n", stdout);
+							if(!options.quiet) fputs("\n", stdout);
+							checkpointIfDue();
+						}
+					}
+				}
+			} else {
+				if(!options.quiet) {
+					printf("%s\n", argv[i]);
+				}
+				if(!options.dryRun) {
+					time_t startTime = time(nullptr);
+					FileStream fs(argv[i], FileMode::Read);
+					int lastBlockNo = 0;
+					repo.uploadFile(packState, snapshot, argv[i], fs,
+									[&lastBlockNo, startTime](int blockNo, int blockMax, long bytesDownloaded, long bytesTotal) -> bool {
+										if(lastBlockNo != blockNo) {
+											lastBlockNo = blockNo;
+											fputs("\n", stdout);
+										}
+										printProgress(blockNo, blockMax, bytesDownloaded, bytesTotal, startTime);
+										return !sUserCancelled;
+									});
+					if(!options.quiet) fputs("\n", stdout);
+					checkpointIfDue();
+				}
 			}
-		}
 		
-		repo.finalizePack(snapshot, packState);
+			repo.finalizePack(snapshot, packState);
+		}
+	} catch(const CancelledException&) {
+		// save what was uploaded, so the backup can be resumed
+		if(!options.dryRun && options.checkpointInterval > 0) {
+			try {
+				checkpoint();
+			} catch(const std::exception& e) {
+				fprintf(stderr, "Unable to checkpoint the backup: %s\n", e.what());
+			}
+		}
+		throw;
 	}
 	
 	repo.commitSnapshot(snapshot, snapshotName);
@@ -378,10 +548,30 @@ static void listSnapshots(const char *repository)
 		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
 	}
 	
-	repo.listSnapshots([](const char *snapshotName) {
-		if(snapshotName) {
-			printf("%s\n", snapshotName);	
+	if(!options.longList) {
+		repo.listSnapshots([](const char *snapshotName) {
+			if(snapshotName) {
+				printf("%s\n", snapshotName);	
+			}
+		});
+		return;
+	}
+	
+	repo.listSnapshotSummaries([](const char *snapshotName, const SnapshotSummary *summary) {
+		if(!summary) {
+			printf("%-19s %10s %12s %-16s %s\n", "-", "-", "-", "-", snapshotName);
+			return;
 		}
+		
+		char timeString[32];
+		time_t creationTime = summary->creationTime;
+		strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&creationTime));
+		printf("%-19s %10llu %12llu %-16s %s\n",
+			   timeString,
+			   (unsigned long long)summary->fileCount,
+			   (unsigned long long)summary->totalSize,
+			   summary->hostname.c_str(),
+			   snapshotName);
 	});
 }
 
@@ -398,6 +588,8 @@ static void listSnapshot(const char *repository, const char *snapshotName)
 		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
 	}
 	
+	useMetadataCache(repo);
+	
 	std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot(snapshotName));
 	snapshot->forEachFileEntry([&snapshot] (const Snapshot::FileEntry &fe) {
 		const char *user = snapshot->indexToString(fe.userIndex);
@@ -436,6 +628,311 @@ static void listSnapshot(const char *repository, const char *snapshotName)
 	});
 }
 
+static void findFiles(const char *repository, const char *pattern)
+{
+	using namespace Nebula;
+	using namespace boost;
+	
+	auto dataStore = createDataStoreFromRepository(repository);
+	Repository repo(dataStore.get());
+	
+	ZeroedString password = promptReadPassword(false);
+	if(!repo.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	filesystem::path cacheDir = options.useCache ? cacheDirectory(repo) : filesystem::path();
+	if(cacheDir.empty()) {
+		throw InvalidArgumentException("Finding files requires the local cache.");
+	}
+	
+	useMetadataCache(repo);
+	
+	Catalog catalog((cacheDir / "catalog").c_str());
+	repo.updateCatalog(catalog);
+	catalog.find(pattern, [](const Catalog::FileVersion& version) {
+		char timeString[32];
+		strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&version.mtime));
+		
+		char md5String[9];
+		for(int i = 0; i < 4; ++i) {
+			snprintf(md5String + i * 2, 3, "%02x", version.md5[i]);
+		}
+		
+		if(version.snapshots.size() == 1) {
+			printf("%10llu %-19s %s %s  %s\n",
+				   (unsigned long long)version.size,
+				   timeString,
+				   md5String,
+				   version.path.c_str(),
+				   version.snapshots.front().c_str());
+		} else {
+			printf("%10llu %-19s %s %s  %s .. %s (%zu snapshots)\n",
+				   (unsigned long long)version.size,
+				   timeString,
+				   md5String,
+				   version.path.c_str(),
+				   version.snapshots.front().c_str(),
+				   version.snapshots.back().c_str(),
+				   version.snapshots.size());
+		}
+	});
+}
+
+static void diffSnapshots(const char *repository, const char *baseName, const char *snapshotName)
+{
+	using namespace Nebula;
+	
+	auto dataStore = createDataStoreFromRepository(repository);
+	Repository repo(dataStore.get());
+	
+	ZeroedString password = promptReadPassword(false);
+	if(!repo.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	useMetadataCache(repo);
+	
+	std::shared_ptr<Snapshot> base(repo.loadSnapshot(baseName));
+	std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot(snapshotName));
+	Snapshot::DiffStats stats = snapshot->diff(*base, [](Snapshot::Change change, const char *path, const Snapshot::FileEntry *baseEntry, const Snapshot::FileEntry *entry) {
+		char type = change == Snapshot::Change::Added ? 'A' : change == Snapshot::Change::Removed ? 'D' : 'M';
+		printf("%c %s\n", type, path);
+	});
+	
+	char addedString[32], removedString[32], newString[32];
+	formatBytes(stats.addedSize, addedString, sizeof(addedString));
+	formatBytes(stats.removedSize, removedString, sizeof(removedString));
+	formatBytes(stats.newBytes, newString, sizeof(newString));
+	printf("%llu added (%s), %llu removed (%s), %llu modified, %s of new data\n",
+		   (unsigned long long)stats.added,
+		   addedString,
+		   (unsigned long long)stats.removed,
+		   removedString,
+		   (unsigned long long)stats.modified,
+		   newString);
+}
+
+static void deleteSnapshot(const char *repository, const char *snapshotName)
+{
+	using namespace Nebula;
+	using namespace boost;
+	
+	auto dataStore = createDataStoreFromRepository(repository);
+	Repository repo(dataStore.get());
+	
+	ZeroedString password = promptReadPassword(false);
+	if(!repo.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	useMetadataCache(repo);
+	
+	// with reference counts the objects freed are removed right away,
+	// otherwise they are left for compact
+	if(options.useCache) {
+		try {
+			filesystem::path cacheDir = cacheDirectory(repo);
+			if(!cacheDir.empty()) {
+				repo.setReferenceCounts(std::make_shared<ReferenceCounts>((cacheDir / "refs").c_str()));
+			}
+		} catch(std::exception& e) {
+			fprintf(stderr, "Not using reference counts: %s\n", e.what());
+		}
+	}
+	
+	uint64_t freedObjects = 0;
+	if(!repo.deleteSnapshot(snapshotName, &freedObjects)) {
+		throw InvalidArgumentException(std::string("No such snapshot: ") + snapshotName);
+	}
+	if(!options.quiet && freedObjects > 0) {
+		printf("%llu objects removed\n", (unsigned long long)freedObjects);
+	}
+}
+
+static void compactRepository(const char *repository)
+{
+	using namespace Nebula;
+	
+	auto dataStore = createDataStoreFromRepository(repository);
+	Repository::Options repoOptions;
+	if(options.jobs > 0) {
+		repoOptions.metadataThreads = options.jobs;
+	}
+	Repository repo(dataStore.get(), &repoOptions);
+	
+	ZeroedString password = promptReadPassword(false);
+	if(!repo.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	useMetadataCache(repo);
+	
+	Repository::CompactStats stats = repo.compactRepository(options.dryRun, [](long n, long total) {
+		if(!options.quiet) {
+			printf("%ld / %ld\r", n, total);
+			fflush(stdout);
+		}
+		return !sUserCancelled;
+	});
+	
+	if(!options.quiet) {
+		char bytesString[32];
+		formatBytes(stats.unreferencedBytes, bytesString, sizeof(bytesString));
+		printf("%llu snapshots reference %llu objects, %llu objects scanned\n",
+			   (unsigned long long)stats.snapshots,
+			   (unsigned long long)stats.referencedObjects,
+			   (unsigned long long)stats.scannedObjects);
+		if(options.dryRun) {
+			printf("%llu unreferenced objects (%s) would be deleted\n",
+				   (unsigned long long)stats.unreferencedObjects,
+				   bytesString);
+		} else {
+			printf("%llu unreferenced objects (%s) deleted\n",
+				   (unsigned long long)stats.deletedObjects,
+				   bytesString);
+		}
+	}
+}
+
+static void repackRepository(const char *repository)
+{
+	using namespace Nebula;
+	
+	auto dataStore = createDataStoreFromRepository(repository);
+	Repository::Options repoOptions;
+	if(options.jobs > 0) {
+		repoOptions.metadataThreads = options.jobs;
+	}
+	Repository repo(dataStore.get(), &repoOptions);
+	
+	ZeroedString password = promptReadPassword(false);
+	if(!repo.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	useMetadataCache(repo);
+	useObjectIndex(repo);
+	
+	Repository::RepackStats stats = repo.repackRepository(options.liveness, options.maxBytes, options.maxTime);
+	if(!options.quiet) {
+		char downloadedString[32], uploadedString[32], reclaimableString[32];
+		formatBytes(stats.downloadedBytes, downloadedString, sizeof(downloadedString));
+		formatBytes(stats.uploadedBytes, uploadedString, sizeof(uploadedString));
+		formatBytes(stats.reclaimableBytes, reclaimableString, sizeof(reclaimableString));
+		printf("%llu of %llu packs repacked into %llu (%s downloaded, %s uploaded)\n",
+			   (unsigned long long)stats.repackedPacks,
+			   (unsigned long long)stats.packs,
+			   (unsigned long long)stats.newPacks,
+			   downloadedString,
+			   uploadedString);
+		printf("%llu snapshots rewritten, %s reclaimable by compact\n",
+			   (unsigned long long)stats.rewrittenSnapshots,
+			   reclaimableString);
+	}
+}
+
+static void checkRepository(const char *repository)
+{
+	using namespace Nebula;
+	
+	auto dataStore = createDataStoreFromRepository(repository);
+	Repository::Options repoOptions;
+	if(options.jobs > 0) {
+		repoOptions.metadataThreads = options.jobs;
+	}
+	Repository repo(dataStore.get(), &repoOptions);
+	
+	ZeroedString password = promptReadPassword(false);
+	if(!repo.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	useMetadataCache(repo);
+	
+	Repository::VerifyStats stats = repo.verifyRepository(options.samplePercent, [](const char *what, const char *error) {
+		fprintf(stderr, "%s: %s\n", what, error);
+	}, [](long n, long total) {
+		if(!options.quiet) {
+			printf("%ld / %ld\r", n, total);
+			fflush(stdout);
+		}
+		return !sUserCancelled;
+	});
+	
+	if(!options.quiet) {
+		printf("%llu snapshots reference %llu objects, %llu files sampled\n",
+			   (unsigned long long)stats.snapshots,
+			   (unsigned long long)stats.objects,
+			   (unsigned long long)stats.sampledFiles);
+		printf("%llu damaged snapshots, %llu missing objects, %llu damaged objects, %llu damaged files\n",
+			   (unsigned long long)stats.damagedSnapshots,
+			   (unsigned long long)stats.missingObjects,
+			   (unsigned long long)stats.damagedObjects,
+			   (unsigned long long)stats.damagedFiles);
+	}
+	
+	if(stats.damagedSnapshots + stats.missingObjects + stats.damagedObjects + stats.damagedFiles > 0) {
+		throw RepositoryException("The repository is damaged.");
+	}
+}
+
+static void syncRepositories(const char *sourceRepository, const char *destRepository, int argc, char * const *argv)
+{
+	using namespace Nebula;
+	
+	Repository::Options repoOptions;
+	if(options.jobs > 0) {
+		repoOptions.metadataThreads = options.jobs;
+	}
+	
+	auto sourceStore = createDataStoreFromRepository(sourceRepository);
+	Repository source(sourceStore.get(), &repoOptions);
+	
+	printf("Source repository\n");
+	ZeroedString password = promptReadPassword(false);
+	if(!source.unlockRepository(password.c_str())) {
+		throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+	}
+	
+	// a new destination gets the keys of the source, so objects are copied
+	// without decrypting them
+	auto destStore = createDataStoreFromRepository(destRepository);
+	Repository dest(destStore.get(), &repoOptions);
+	if(!destStore->exist("/key")) {
+		printf("New destination repository\n");
+		ZeroedString destPassword = promptReadPassword(true);
+		dest.initializeRepository(source, destPassword.c_str());
+	} else if(!dest.unlockRepository(password.c_str())) {
+		printf("Destination repository\n");
+		ZeroedString destPassword = promptReadPassword(false);
+		if(!dest.unlockRepository(destPassword.c_str())) {
+			throw RepositoryException("Unable to unlock repository. Password was incorrect.");
+		}
+	}
+	
+	useObjectIndex(dest);
+	
+	std::vector<std::string> names(argv, argv + argc);
+	Repository::SyncStats stats = dest.syncRepository(source, names, [](long n, long total) {
+		if(!options.quiet) {
+			printf("%ld / %ld\r", n, total);
+			fflush(stdout);
+		}
+		return !sUserCancelled;
+	});
+	
+	if(!options.quiet) {
+		char bytesString[32];
+		formatBytes(stats.copiedBytes, bytesString, sizeof(bytesString));
+		printf("%llu snapshots copied, %llu of the %llu objects they reference were missing (%s)\n",
+			   (unsigned long long)stats.snapshots,
+			   (unsigned long long)stats.copiedObjects,
+			   (unsigned long long)stats.objects,
+			   bytesString);
+	}
+}
+
 static void downloadFiles(const char *repository, const char *snapshotName, int argc, const char * const *argv)
 {
 	using namespace Nebula;
@@ -452,20 +949,37 @@ static void downloadFiles(const char *repository, const char *snapshotName, int
 		argc++;
 	}
 
+	Repository::Options repoOptions;
+	repoOptions.verifyDownloads = options.verify;
+	if(options.jobs > 0) {
+		repoOptions.restoreThreads = options.jobs;
+	}
+
 	auto dataStore = createDataStoreFromRepository(repository);
-	Repository repo(dataStore.get());
+	Repository repo(dataStore.get(), &repoOptions);
 	
 	ZeroedString password = promptReadPassword(false);
 	if(!repo.unlockRepository(password.c_str())) {
 		throw RepositoryException("Invalid password.");
 	}
 	
-	std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot(snapshotName));
+	useMetadataCache(repo);
+	
+	// the objects restored files have in common with the seeds are copied
+	// from them. With --delta, each file restored over is first used for
+	// the file replacing it.
+	const std::vector<std::string>& seeds = options.seeds;
+	if(!seeds.empty() && !options.dryRun) {
+		repo.setRestoreSeeds(seeds);
+	}
+	
+	// a single path only needs its part of a tree snapshot
+	std::shared_ptr<Snapshot> snapshot(argc == 2 ? repo.loadSnapshot(snapshotName, argv[0]) : repo.loadSnapshot(snapshotName));
 	for(int i = 0; i < argc - 1; ++i) {
 		const char * srcFile = argv[i];
 
 		snapshot->forEachFileEntry(srcFile,
-			[&repo, srcFile, &snapshot, &destDir](const Snapshot::FileEntry& fe) {
+			[&repo, srcFile, &snapshot, &destDir, &seeds](const Snapshot::FileEntry& fe) {
 			std::string name = snapshot->indexToString(fe.nameIndex);
 			std::string path = snapshot->indexToString(fe.pathIndex);
 
@@ -492,10 +1006,18 @@ static void downloadFiles(const char *repository, const char *snapshotName, int
 					filesystem::create_directories(filePath.parent_path());
 				}
 
-				{
-					time_t startTime = time(nullptr);
-					FileStream outStream(filePath.c_str(), FileMode::Write);
-					int lastBlockNo = 0;
+				// a file which may be a seed is restored beside itself, and
+				// replaced once restored
+				filesystem::path restorePath = filePath;
+				bool hasPrevious = options.delta && filesystem::is_regular_file(filePath);
+				if((!seeds.empty() || options.delta) && filesystem::exists(filePath)) {
+					restorePath = filePath.parent_path() / filesystem::unique_path(".%%%%-%%%%-%%%%.restore");
+				}
+				
+				time_t startTime = time(nullptr);
+				int lastBlockNo = 0;
+				try {
+					FileStream outStream(restorePath.c_str(), FileMode::Write);
 					repo.downloadFile(snapshot, (path + "/" + name).c_str(), outStream,
 						[startTime, &lastBlockNo](int blockNo, int blockCount, long bytesDownloaded, long bytesTotal) -> bool {
 							if(lastBlockNo != blockNo) {
@@ -504,42 +1026,24 @@ static void downloadFiles(const char *repository, const char *snapshotName, int
 							}
 							printProgress(blockNo, blockCount, bytesDownloaded, bytesTotal, startTime);
 							return !sUserCancelled;
-						});
-					if(!options.quiet) printf("\n");
-				}
-				
-				if(options.verify) {
-					uint8_t buffer[8192];
-					size_t n;
-
-					FileStream inStream(filePath.c_str(), FileMode::Read);
-					
-					EVP_MD_CTX ctx;
-					EVP_MD_CTX_init(&ctx);
-					std::unique_ptr<EVP_MD_CTX, decltype(EVP_MD_CTX_cleanup) *>
-						cleanup(&ctx, EVP_MD_CTX_cleanup);
-
-					if(!EVP_DigestInit(&ctx, EVP_md5())) {
-						throw VerificationFailedException("EVP_DigestInit() failed.");
-					}
-
-					while((n = inStream.read(buffer, sizeof(buffer))) > 0) {
-						if(!EVP_DigestUpdate(&ctx, buffer, n)) {
-							throw VerificationFailedException("EVP_DigestUpdate() failed.");
-						}
-					}
-
-					uint8_t md[MD5_DIGEST_LENGTH];
-					if(!EVP_DigestFinal(&ctx, md, nullptr)) {
-						throw VerificationFailedException("EVP_DigestFinal() failed.");
+						}, hasPrevious ? filePath.c_str() : nullptr);
+				} catch(const VerificationFailedException& e) {
+					if(restorePath != filePath) {
+						filesystem::remove(restorePath);
 					}
-
-					if(memcmp(md, fe.md5, MD5_DIGEST_LENGTH) != 0) {
-						std::strstream str;
-						str << filePath.string() << ": File verification failed. ";
-						throw VerificationFailedException(str.str());
+					std::strstream str;
+					str << filePath.string() << ": File verification failed. ";
+					throw VerificationFailedException(str.str());
+				} catch(...) {
+					if(restorePath != filePath) {
+						filesystem::remove(restorePath);
 					}
+					throw;
+				}
+				if(restorePath != filePath) {
+					filesystem::rename(restorePath, filePath);
 				}
+				if(!options.quiet) printf("\n");
 			}
 		});
 		
@@ -579,16 +1083,51 @@ int main(int argc, char *argv[])
 		{ "dry-run", no_argument, 0, 'n' },
 		{ "no-verify", no_argument, 0, 0 },
 		{ "backend", required_argument, 0, 'b' },
+		{ "jobs", required_argument, 0, 'j' },
+		{ "long", no_argument, 0, 'l' },
+		{ "parent", required_argument, 0, 0 },
+		{ "cache-dir", required_argument, 0, 0 },
+		{ "no-cache", no_argument, 0, 0 },
+		{ "tree", no_argument, 0, 0 },
+		{ "liveness", required_argument, 0, 0 },
+		{ "max-bytes", required_argument, 0, 0 },
+		{ "max-time", required_argument, 0, 0 },
+		{ "sample", required_argument, 0, 0 },
+		{ "checkpoint", required_argument, 0, 0 },
+		{ "seed", required_argument, 0, 0 },
+		{ "delta", no_argument, 0, 0 },
 		{ 0, 0, 0, 0 }
 	};
 	
 	int c;
 	int optIndex;
-	while((c = getopt_long(argc, argv, "qnfb:", longOptions, &optIndex)) >= 0) {
+	while((c = getopt_long(argc, argv, "qnflb:j:", longOptions, &optIndex)) >= 0) {
 		switch (c) {
 			case 0:
 				if(strcmp(longOptions[optIndex].name, "no-verify") == 0) {
 					options.verify = false;
+				} else if(strcmp(longOptions[optIndex].name, "parent") == 0) {
+					options.parent = optarg;
+				} else if(strcmp(longOptions[optIndex].name, "cache-dir") == 0) {
+					options.cacheDir = optarg;
+				} else if(strcmp(longOptions[optIndex].name, "no-cache") == 0) {
+					options.useCache = false;
+				} else if(strcmp(longOptions[optIndex].name, "tree") == 0) {
+					options.tree = true;
+				} else if(strcmp(longOptions[optIndex].name, "liveness") == 0) {
+					options.liveness = atof(optarg);
+				} else if(strcmp(longOptions[optIndex].name, "max-bytes") == 0) {
+					options.maxBytes = strtoull(optarg, nullptr, 10);
+				} else if(strcmp(longOptions[optIndex].name, "max-time") == 0) {
+					options.maxTime = atoi(optarg);
+				} else if(strcmp(longOptions[optIndex].name, "sample") == 0) {
+					options.samplePercent = atof(optarg);
+				} else if(strcmp(longOptions[optIndex].name, "checkpoint") == 0) {
+					options.checkpointInterval = atoi(optarg);
+				} else if(strcmp(longOptions[optIndex].name, "seed") == 0) {
+					options.seeds.push_back(optarg);
+				} else if(strcmp(longOptions[optIndex].name, "delta") == 0) {
+					options.delta = true;
 				}
 				break;
 			case 'q':
@@ -603,6 +1142,12 @@ int main(int argc, char *argv[])
 			case 'b':
 				options.backend = optarg;
 				break;
+			case 'j':
+				options.jobs = atoi(optarg);
+				break;
+			case 'l':
+				options.longList = true;
+				break;
 				
 			default:
 				printHelp();
@@ -656,6 +1201,8 @@ int main(int argc, char *argv[])
 					}
 
 					downloadFiles(repo, argv[optind + 2], argc - (optind + 3), argv + optind + 3);
+				} else if(strcmp(action, "repack") == 0) {
+					repackRepository(repo);
 				} else {
 					throw InvalidArgumentException(std::string("Invalid action: ") + action);
 				}
@@ -671,6 +1218,54 @@ int main(int argc, char *argv[])
 					listSnapshot(repo, argv[optind + 2]);
 				}
 				break;
+			case 'd':
+				if(strcmp(action, "diff") == 0) {
+					if(optind + 4 > argc) {
+						throw InvalidArgumentException("Two snapshot names must be specified.");
+					}
+					
+					diffSnapshots(repo, argv[optind + 2], argv[optind + 3]);
+				} else if(strcmp(action, "delete") == 0) {
+					if(optind + 3 > argc) {
+						throw InvalidArgumentException("A snapshot name must be specified.");
+					}
+					
+					deleteSnapshot(repo, argv[optind + 2]);
+				} else {
+					throw InvalidArgumentException(std::string("Invalid action: ") + action);
+				}
+				break;
+			case 'c':
+				if(strcmp(action, "compact") == 0) {
+					compactRepository(repo);
+				} else if(strcmp(action, "check") == 0) {
+					checkRepository(repo);
+				} else {
+					throw InvalidArgumentException(std::string("Invalid action: ") + action);
+				}
+				break;
+			case 's':
+				if(strcmp(action, "sync") != 0) {
+					throw InvalidArgumentException(std::string("Invalid action: ") + action);
+				}
+				
+				if(optind + 3 > argc) {
+					throw InvalidArgumentException("A destination repository must be specified.");
+				}
+				
+				syncRepositories(repo, argv[optind + 2], argc - (optind + 3), argv + optind + 3);
+				break;
+			case 'f':
+				if(strcmp(action, "find") != 0) {
+					throw InvalidArgumentException(std::string("Invalid action: ") + action);
+				}
+				
+				if(optind + 3 > argc) {
+					throw InvalidArgumentException("A pattern must be specified.");
+				}
+				
+				findFiles(repo, argv[optind + 2]);
+				break;
 			case 'p':
 				if(strcmp(action, "password") != 0) {
 					throw InvalidArgumentException(std::string("Invalid action: ") + action);
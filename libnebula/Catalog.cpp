@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "Catalog.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "Exception.h"
+#include "Snapshot.h"
+
+namespace Nebula
+{
+	enum : uint32_t
+	{
+		CATALOG_MAGIC = 0x5443424E, // "NBCT"
+		CATALOG_VERSION = 1
+	};
+	
+	// followed by the snapshot records, entries, versions and strings
+	struct Catalog::Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t snapshotCount;
+		uint32_t nextSeq; // number of the next snapshot added
+		uint64_t entryCount;
+		uint64_t versionCount;
+		uint64_t stringsSize;
+	};
+	
+	struct Catalog::SnapshotRecord
+	{
+		uint32_t seq;
+		uint32_t nameOffset;
+	};
+	
+	// a path, sorted by Snapshot::comparePaths()
+	struct Catalog::Entry
+	{
+		uint64_t pathOffset;
+		uint64_t firstVersion;
+		uint32_t versionCount;
+		uint32_t reserved;
+	};
+	
+	// a version of a path, in every snapshot numbered firstSeq to lastSeq
+	// which is still in the catalog
+	struct Catalog::Version
+	{
+		uint64_t size;
+		int64_t mtime;
+		uint8_t md5[MD5_DIGEST_LENGTH];
+		uint32_t firstSeq;
+		uint32_t lastSeq;
+	};
+	
+	Catalog::Catalog(const char *path)
+	: mPath(path)
+	, mLockFd(-1)
+	, mMap(nullptr)
+	, mMapSize(0)
+	{
+		mLockFd = ::open((mPath + ".lock").c_str(), O_RDWR | O_CREAT, 0600);
+		if(mLockFd < 0) {
+			throw FileIOException("Failed to open the catalog.");
+		}
+		map();
+	}
+	
+	Catalog::~Catalog()
+	{
+		unmap();
+		::close(mLockFd);
+	}
+	
+	const Catalog::SnapshotRecord *Catalog::snapshotRecords() const
+	{
+		return (const SnapshotRecord *)(mMap + sizeof(Header));
+	}
+	
+	const Catalog::Entry *Catalog::entries() const
+	{
+		return (const Entry *)(snapshotRecords() + header()->snapshotCount);
+	}
+	
+	const Catalog::Version *Catalog::versions() const
+	{
+		return (const Version *)(entries() + header()->entryCount);
+	}
+	
+	const char *Catalog::strings() const
+	{
+		return (const char *)(versions() + header()->versionCount);
+	}
+	
+	void Catalog::map()
+	{
+		int fd = ::open(mPath.c_str(), O_RDONLY);
+		if(fd < 0) {
+			return;
+		}
+		
+		struct stat st;
+		void *p = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && st.st_size >= sizeof(Header)) {
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);
+		if(p == MAP_FAILED) {
+			return;
+		}
+		mMap = (uint8_t *)p;
+		mMapSize = st.st_size;
+		
+		// anything unexpected is treated as an empty catalog
+		const Header *h = header();
+		if(h->magic != CATALOG_MAGIC || h->version != CATALOG_VERSION ||
+		   h->snapshotCount > mMapSize / sizeof(SnapshotRecord) ||
+		   h->entryCount > mMapSize / sizeof(Entry) ||
+		   h->versionCount > mMapSize / sizeof(Version) ||
+		   sizeof(Header) + h->snapshotCount * sizeof(SnapshotRecord) + h->entryCount * sizeof(Entry) +
+		   h->versionCount * sizeof(Version) + h->stringsSize != mMapSize ||
+		   (h->stringsSize > 0 && strings()[h->stringsSize - 1] != 0)) {
+			unmap();
+		}
+	}
+	
+	void Catalog::unmap()
+	{
+		if(mMap) {
+			munmap(mMap, mMapSize);
+			mMap = nullptr;
+			mMapSize = 0;
+		}
+	}
+	
+	std::vector<std::string> Catalog::snapshots() const
+	{
+		std::vector<std::string> names;
+		if(mMap) {
+			for(uint32_t i = 0; i < header()->snapshotCount; ++i) {
+				names.push_back(strings() + snapshotRecords()[i].nameOffset);
+			}
+		}
+		return names;
+	}
+	
+	void Catalog::update(const std::set<std::string>& removed, const std::vector<std::pair<std::string, std::shared_ptr<Snapshot>>>& added)
+	{
+		if(flock(mLockFd, LOCK_EX) < 0) {
+			throw FileIOException("Failed to lock the catalog.");
+		}
+		std::unique_ptr<int, void (*)(int *)> onExit(&mLockFd, [](int *fd) { flock(*fd, LOCK_UN); });
+		
+		// another process may have updated the catalog since it was opened
+		unmap();
+		map();
+		
+		std::vector<std::pair<uint32_t, std::string>> liveSnapshots;
+		uint32_t nextSeq = 1;
+		if(mMap) {
+			nextSeq = header()->nextSeq;
+			for(uint32_t i = 0; i < header()->snapshotCount; ++i) {
+				const char *name = strings() + snapshotRecords()[i].nameOffset;
+				if(!removed.count(name)) {
+					liveSnapshots.push_back(std::make_pair(snapshotRecords()[i].seq, name));
+				}
+			}
+		}
+		
+		// a version is extended by a snapshot if it was in the snapshot
+		// added before it
+		std::vector<uint32_t> addedSeqs;
+		std::vector<uint32_t> previousSeqs;
+		for(const auto& snapshot : added) {
+			previousSeqs.push_back(liveSnapshots.empty() ? 0 : liveSnapshots.back().first);
+			addedSeqs.push_back(nextSeq);
+			liveSnapshots.push_back(std::make_pair(nextSeq++, snapshot.first));
+		}
+		
+		std::vector<uint32_t> liveSeqs;
+		for(const auto& snapshot : liveSnapshots) {
+			liveSeqs.push_back(snapshot.first);
+		}
+		auto isLive = [&liveSeqs](const Version& v) {
+			auto it = std::lower_bound(liveSeqs.begin(), liveSeqs.end(), v.firstSeq);
+			return it != liveSeqs.end() && *it <= v.lastSeq;
+		};
+		
+		struct AddedFile
+		{
+			std::string path;
+			uint64_t size;
+			int64_t mtime;
+			uint8_t md5[MD5_DIGEST_LENGTH];
+		};
+		std::vector<std::vector<AddedFile>> addedFiles(added.size());
+		for(size_t i = 0; i < added.size(); ++i) {
+			Snapshot& snapshot = *added[i].second;
+			std::vector<AddedFile>& files = addedFiles[i];
+			snapshot.forEachFileEntry([&snapshot, &files](const Snapshot::FileEntry& fe) {
+				AddedFile file;
+				file.path = snapshot.indexToString(fe.pathIndex);
+				file.path += file.path.empty() ? "" : "/";
+				file.path += snapshot.indexToString(fe.nameIndex);
+				file.size = fe.size;
+				file.mtime = fe.mtime;
+				memcpy(file.md5, fe.md5, MD5_DIGEST_LENGTH);
+				files.push_back(file);
+			});
+			
+			// snapshots are ordered by directory, the catalog by whole path
+			std::sort(files.begin(), files.end(), [](const AddedFile& a, const AddedFile& b) {
+				return Snapshot::comparePaths(a.path.c_str(), b.path.c_str()) < 0;
+			});
+		}
+		
+		// the regions are written to temporary files, then joined
+		std::unique_ptr<FILE, decltype(fclose) *> entryFile(tmpfile(), fclose);
+		std::unique_ptr<FILE, decltype(fclose) *> versionFile(tmpfile(), fclose);
+		std::unique_ptr<FILE, decltype(fclose) *> stringFile(tmpfile(), fclose);
+		if(!entryFile || !versionFile || !stringFile) {
+			throw FileIOException("Failed to create the catalog.");
+		}
+		
+		uint64_t stringsSize = 0;
+		auto addString = [&stringFile, &stringsSize](const std::string& str) {
+			uint64_t offset = stringsSize;
+			if(fwrite(str.c_str(), 1, str.size() + 1, stringFile.get()) != str.size() + 1) {
+				throw FileIOException("Failed to write the catalog.");
+			}
+			stringsSize += str.size() + 1;
+			return offset;
+		};
+		
+		std::vector<SnapshotRecord> snapshotRecords;
+		for(const auto& snapshot : liveSnapshots) {
+			SnapshotRecord record;
+			record.seq = snapshot.first;
+			record.nameOffset = addString(snapshot.second);
+			snapshotRecords.push_back(record);
+		}
+		
+		uint64_t entryCount = 0;
+		uint64_t versionCount = 0;
+		uint64_t oldIndex = 0;
+		uint64_t oldCount = mMap ? header()->entryCount : 0;
+		std::vector<size_t> cursors(added.size(), 0);
+		std::vector<Version> pathVersions;
+		for(;;) {
+			const char *nextPath = oldIndex < oldCount ? strings() + entries()[oldIndex].pathOffset : nullptr;
+			for(size_t i = 0; i < added.size(); ++i) {
+				if(cursors[i] < addedFiles[i].size()) {
+					const char *path = addedFiles[i][cursors[i]].path.c_str();
+					if(!nextPath || Snapshot::comparePaths(path, nextPath) < 0) {
+						nextPath = path;
+					}
+				}
+			}
+			if(!nextPath) {
+				break;
+			}
+			std::string path = nextPath;
+			
+			pathVersions.clear();
+			if(oldIndex < oldCount && path == strings() + entries()[oldIndex].pathOffset) {
+				const Entry& entry = entries()[oldIndex++];
+				for(uint32_t i = 0; i < entry.versionCount; ++i) {
+					const Version& v = versions()[entry.firstVersion + i];
+					if(isLive(v)) {
+						pathVersions.push_back(v);
+					}
+				}
+			}
+			
+			for(size_t i = 0; i < added.size(); ++i) {
+				if(cursors[i] >= addedFiles[i].size() || addedFiles[i][cursors[i]].path != path) {
+					continue;
+				}
+				const AddedFile& file = addedFiles[i][cursors[i]++];
+				if(!pathVersions.empty() &&
+				   pathVersions.back().lastSeq == previousSeqs[i] &&
+				   pathVersions.back().size == file.size &&
+				   pathVersions.back().mtime == file.mtime &&
+				   memcmp(pathVersions.back().md5, file.md5, MD5_DIGEST_LENGTH) == 0) {
+					pathVersions.back().lastSeq = addedSeqs[i];
+				} else {
+					Version v;
+					v.size = file.size;
+					v.mtime = file.mtime;
+					memcpy(v.md5, file.md5, MD5_DIGEST_LENGTH);
+					v.firstSeq = addedSeqs[i];
+					v.lastSeq = addedSeqs[i];
+					pathVersions.push_back(v);
+				}
+			}
+			
+			if(pathVersions.empty()) {
+				continue;
+			}
+			
+			Entry entry;
+			entry.pathOffset = addString(path);
+			entry.firstVersion = versionCount;
+			entry.versionCount = pathVersions.size();
+			entry.reserved = 0;
+			if(fwrite(&entry, sizeof(entry), 1, entryFile.get()) != 1 ||
+			   fwrite(pathVersions.data(), sizeof(Version), pathVersions.size(), versionFile.get()) != pathVersions.size()) {
+				throw FileIOException("Failed to write the catalog.");
+			}
+			++entryCount;
+			versionCount += pathVersions.size();
+		}
+		
+		Header h;
+		memset(&h, 0, sizeof(h));
+		h.magic = CATALOG_MAGIC;
+		h.version = CATALOG_VERSION;
+		h.snapshotCount = snapshotRecords.size();
+		h.nextSeq = nextSeq;
+		h.entryCount = entryCount;
+		h.versionCount = versionCount;
+		h.stringsSize = stringsSize;
+		
+		std::string tmpPath = mPath + ".tmp";
+		std::unique_ptr<FILE, decltype(fclose) *> out(fopen(tmpPath.c_str(), "wb"), fclose);
+		if(!out) {
+			throw FileIOException("Failed to create the catalog.");
+		}
+		bool ok = fwrite(&h, sizeof(h), 1, out.get()) == 1 &&
+			fwrite(snapshotRecords.data(), sizeof(SnapshotRecord), snapshotRecords.size(), out.get()) == snapshotRecords.size();
+		for(FILE *region : { entryFile.get(), versionFile.get(), stringFile.get() }) {
+			rewind(region);
+			char buffer[65536];
+			size_t n;
+			while(ok && (n = fread(buffer, 1, sizeof(buffer), region)) > 0) {
+				ok = fwrite(buffer, 1, n, out.get()) == n;
+			}
+			ok = ok && !ferror(region);
+		}
+		ok = ok && fflush(out.get()) == 0 && fsync(fileno(out.get())) == 0;
+		out.reset();
+		if(!ok || rename(tmpPath.c_str(), mPath.c_str()) < 0) {
+			unlink(tmpPath.c_str());
+			throw FileIOException("Failed to write the catalog.");
+		}
+		
+		unmap();
+		map();
+	}
+	
+	void Catalog::find(const char *pattern, const std::function<void (const FileVersion&)>& callback) const
+	{
+		if(!mMap) {
+			return;
+		}
+		
+		// the part of the pattern before any wildcard is a prefix of every
+		// match, and the paths with a prefix are contiguous
+		while(*pattern == '/') ++pattern;
+		const char *wildcard = strpbrk(pattern, "*?[");
+		std::string prefix(pattern, wildcard ? wildcard - pattern : strlen(pattern));
+		if(!wildcard) {
+			while(!prefix.empty() && prefix.back() == '/') {
+				prefix.pop_back();
+			}
+		}
+		
+		const Entry *begin = entries();
+		const Entry *end = begin + header()->entryCount;
+		const Entry *it = std::lower_bound(begin, end, prefix, [this](const Entry& entry, const std::string& prefix) {
+			return Snapshot::comparePaths(strings() + entry.pathOffset, prefix.c_str()) < 0;
+		});
+		
+		const SnapshotRecord *firstRecord = snapshotRecords();
+		const SnapshotRecord *lastRecord = firstRecord + header()->snapshotCount;
+		for(; it != end; ++it) {
+			const char *path = strings() + it->pathOffset;
+			if(strncmp(path, prefix.c_str(), prefix.size()) != 0) {
+				break;
+			}
+			if(wildcard) {
+				if(fnmatch(pattern, path, 0) != 0) {
+					continue;
+				}
+			} else if(!prefix.empty() && path[prefix.size()] != 0 && path[prefix.size()] != '/') {
+				continue;
+			}
+			
+			for(uint32_t i = 0; i < it->versionCount; ++i) {
+				const Version& v = versions()[it->firstVersion + i];
+				FileVersion version;
+				version.path = path;
+				version.size = v.size;
+				version.mtime = v.mtime;
+				memcpy(version.md5, v.md5, MD5_DIGEST_LENGTH);
+				
+				const SnapshotRecord *record = std::lower_bound(firstRecord, lastRecord, v.firstSeq, [](const SnapshotRecord& record, uint32_t seq) {
+					return record.seq < seq;
+				});
+				for(; record != lastRecord && record->seq <= v.lastSeq; ++record) {
+					version.snapshots.push_back(strings() + record->nameOffset);
+				}
+				if(!version.snapshots.empty()) {
+					callback(version);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <openssl/md5.h>
+
+namespace Nebula
+{
+	class Snapshot;
+
+	/**
+	 * Local index of the versions of every path across the snapshots of a
+	 * repository, so the snapshots holding a file can be found without
+	 * loading them.
+	 *
+	 * Snapshots are numbered in the order they are added. A version of a
+	 * path records the range of numbers it was seen in, and is extended
+	 * while the path is unchanged in each snapshot added. Paths are sorted
+	 * as Snapshot::comparePaths() orders them, so prefixes are found by a
+	 * binary search of the memory mapped index.
+	 *
+	 * Updates are written to a new file which replaces the old one, so
+	 * readers always see a complete index.
+	 */
+	class Catalog
+	{
+	public:
+		struct FileVersion
+		{
+			std::string path;
+			uint64_t size;
+			time_t mtime;
+			uint8_t md5[MD5_DIGEST_LENGTH];
+			
+			/// snapshots holding this version, oldest first
+			std::vector<std::string> snapshots;
+		};
+		
+		/**
+		 * Opens the catalog at @a path. A missing or unreadable catalog is
+		 * treated as empty. Throws FileIOException if it can't be created.
+		 */
+		explicit Catalog(const char *path);
+		~Catalog();
+		
+		/**
+		 * Names of the snapshots in the catalog, in the order they were added.
+		 */
+		std::vector<std::string> snapshots() const;
+		
+		/**
+		 * Removes @a removed and adds @a added, in order, rewriting the
+		 * catalog once.
+		 */
+		void update(const std::set<std::string>& removed, const std::vector<std::pair<std::string, std::shared_ptr<Snapshot>>>& added);
+		
+		/**
+		 * Calls @a callback for each version of the paths matching
+		 * @a pattern. A pattern with wildcards is matched with fnmatch(),
+		 * others match the path and everything under it.
+		 */
+		void find(const char *pattern, const std::function<void (const FileVersion&)>& callback) const;
+	private:
+		struct Header;
+		struct SnapshotRecord;
+		struct Entry;
+		struct Version;
+		
+		std::string mPath;
+		int mLockFd;
+		uint8_t *mMap;
+		size_t mMapSize;
+		
+		const Header *header() const { return (const Header *)mMap; }
+		const SnapshotRecord *snapshotRecords() const;
+		const Entry *entries() const;
+		const Version *versions() const;
+		const char *strings() const;
+		
+		void map();
+		void unmap();
+	};
+}
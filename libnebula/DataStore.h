@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <stdint.h>
 #include "ProgressFunction.h"
 
 namespace Nebula
@@ -61,5 +62,17 @@ namespace Nebula
 		 * Removes a file from the data store.
 		 */
 		virtual bool unlink(const char *path, ProgressFunction progress = DefaultProgressFunction) = 0;
+		
+		/**
+		 * Returns the size in bytes of the file at the path, or -1 if it
+		 * is missing or the data store can't tell.
+		 */
+		virtual int64_t size(const char *path, ProgressFunction progress = DefaultProgressFunction) { return -1; }
+
+		/**
+		 * True if the methods of the data store may be invoked from multiple
+		 * threads at once. Otherwise, callers must serialize access.
+		 */
+		virtual bool supportsConcurrentAccess() const { return false; }
 	};
 }
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "DigestOutputStream.h"
+#include <string.h>
+#include "Exception.h"
+
+namespace Nebula
+{
+	DigestOutputStream::DigestOutputStream(const EVP_MD *md)
+	: mStream(nullptr)
+	{
+		init(md);
+	}
+	
+	DigestOutputStream::DigestOutputStream(OutputStream& stream, const EVP_MD *md)
+	: mStream(&stream)
+	{
+		init(md);
+	}
+	
+	DigestOutputStream::~DigestOutputStream()
+	{
+		EVP_MD_CTX_cleanup(&mCtx);
+	}
+	
+	void DigestOutputStream::init(const EVP_MD *md)
+	{
+		mFinalized = false;
+		mDigestSize = 0;
+		mExpectedDigestSize = 0;
+
+		EVP_MD_CTX_init(&mCtx);
+		if(!EVP_DigestInit(&mCtx, md)) {
+			EVP_MD_CTX_cleanup(&mCtx);
+			throw EncryptionFailedException("EVP_DigestInit failed.");
+		}
+	}
+	
+	void DigestOutputStream::setExpectedDigest(const uint8_t *digest, size_t size)
+	{
+		if(size > sizeof(mExpectedDigest)) {
+			throw InvalidArgumentException("Digest is too long.");
+		}
+		
+		memcpy(mExpectedDigest, digest, size);
+		mExpectedDigestSize = size;
+	}
+	
+	void DigestOutputStream::write(const void *data, size_t size)
+	{
+		if(mFinalized) {
+			throw InvalidOperationException("Cannot write to a closed digest stream.");
+		}
+		
+		if(!EVP_DigestUpdate(&mCtx, data, size)) {
+			throw EncryptionFailedException("EVP_DigestUpdate failed.");
+		}
+		
+		if(mStream) {
+			mStream->write(data, size);
+		}
+	}
+	
+	void DigestOutputStream::flush()
+	{
+		if(mStream) {
+			mStream->flush();
+		}
+	}
+	
+	void DigestOutputStream::close()
+	{
+		if(mFinalized) {
+			return;
+		}
+		
+		mFinalized = true;
+		if(!EVP_DigestFinal(&mCtx, mDigest, &mDigestSize)) {
+			throw EncryptionFailedException("EVP_DigestFinal failed.");
+		}
+		
+		flush();
+		
+		if(mExpectedDigestSize > 0 &&
+		   (mExpectedDigestSize != mDigestSize || memcmp(mDigest, mExpectedDigest, mDigestSize) != 0)) {
+			throw VerificationFailedException("File verification failed.");
+		}
+	}
+}
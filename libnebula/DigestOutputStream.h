@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <openssl/evp.h>
+#include "OutputStream.h"
+
+namespace Nebula
+{
+	/**
+	 * Computes the digest of the data written to the stream, optionally
+	 * passing the data through to another output stream.
+	 * If an expected digest is set, close() throws VerificationFailedException
+	 * when the digest of the written data does not match.
+	 */
+	class DigestOutputStream : public OutputStream
+	{
+	public:
+		explicit DigestOutputStream(const EVP_MD *md);
+		DigestOutputStream(OutputStream& stream, const EVP_MD *md);
+		~DigestOutputStream();
+		
+		void setExpectedDigest(const uint8_t *digest, size_t size);
+		
+		/**
+		 * The digest of the data written, available after close().
+		 */
+		const uint8_t *digest() const { return mDigest; }
+		size_t digestSize() const { return mDigestSize; }
+
+		virtual void write(const void *data, size_t size) override;
+		virtual void flush() override;
+
+		/**
+		 * Finalizes the digest. The wrapped stream is flushed but not closed.
+		 */
+		virtual void close() override;
+	private:
+		OutputStream *mStream;
+		EVP_MD_CTX mCtx;
+		bool mFinalized;
+
+		uint8_t mDigest[EVP_MAX_MD_SIZE];
+		unsigned int mDigestSize;
+		uint8_t mExpectedDigest[EVP_MAX_MD_SIZE];
+		size_t mExpectedDigestSize;
+		
+		void init(const EVP_MD *md);
+	};
+}
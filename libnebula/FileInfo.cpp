@@ -27,6 +27,9 @@ namespace Nebula
 {
 	FileInfo::FileInfo(const char *path)
 	: mType(FileType::FileNotFound)
+	, mLastChangeTime(0)
+	, mDevice(0)
+	, mInode(0)
 	{
 		using namespace boost;
 
@@ -55,6 +58,9 @@ namespace Nebula
 		
 		mLength = st.st_size;
 		mLastModifyTime = st.st_mtime;
+		mLastChangeTime = st.st_ctime;
+		mDevice = st.st_dev;
+		mInode = st.st_ino;
 		
 		mMode = st.st_mode & 07777;
 		switch(st.st_mode & S_IFMT) {
@@ -18,6 +18,7 @@
 
 #include <string>
 #include <time.h>
+#include <stdint.h>
 
 namespace Nebula
 {
@@ -53,6 +54,11 @@ namespace Nebula
 		
 		size_t length() const { return mLength; }
 		time_t lastModifyTime() const { return mLastModifyTime; }
+		time_t lastChangeTime() const { return mLastChangeTime; }
+
+		/// device and inode number, 0 where not available
+		uint64_t device() const { return mDevice; }
+		uint64_t inode() const { return mInode; }
 	private:
 		FileType mType;
 
@@ -68,5 +74,9 @@ namespace Nebula
 		size_t mLength;
 		
 		time_t mLastModifyTime;
+		time_t mLastChangeTime;
+		
+		uint64_t mDevice;
+		uint64_t mInode;
 	};
 }
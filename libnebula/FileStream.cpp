@@ -15,6 +15,13 @@
  */
 #include "FileStream.h"
 #include <assert.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include <errno.h>
+#include <mutex>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include "Exception.h"
 
@@ -152,6 +159,93 @@ error:
 		}
 	}
 
+	void FileStream::writeAt(const void *data, size_t size, uint64_t offset)
+	{
+#ifndef _WIN32
+		// pending buffered writes must reach the descriptor first
+		fflush(mFp);
+
+		const uint8_t *p = (const uint8_t *)data;
+		while(size > 0) {
+			ssize_t n = pwrite(fileno(mFp), p, size, offset);
+			if(n < 0) {
+				if(errno == EINTR) continue;
+				throw FileIOException("There was an error writing the file.");
+			}
+			p += n;
+			offset += n;
+			size -= n;
+		}
+#else
+		static std::mutex sWriteMutex;
+		std::lock_guard<std::mutex> lock(sWriteMutex);
+		seek(offset);
+		write(data, size);
+#endif
+	}
+	
+	void FileStream::truncate(uint64_t size)
+	{
+		fflush(mFp);
+#ifndef _WIN32
+		if(ftruncate(fileno(mFp), size) < 0) {
+			throw FileIOException("Failed to set file length.");
+		}
+#else
+		if(_chsize_s(_fileno(mFp), size) != 0) {
+			throw FileIOException("Failed to set file length.");
+		}
+#endif
+	}
+
+	bool FileStream::findData(uint64_t offset, uint64_t& dataStart, uint64_t& dataEnd)
+	{
+		uint64_t fileSize = size();
+		if(offset >= fileSize) {
+			return false;
+		}
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		// lseek moves the descriptor underneath the FILE buffer, so the
+		// stream position is restored afterwards
+		int fd = fileno(mFp);
+		long curPos = ftell(mFp);
+		off_t start = lseek(fd, offset, SEEK_DATA);
+		off_t end = start >= 0 ? lseek(fd, start, SEEK_HOLE) : -1;
+		int lseekError = errno;
+		fseek(mFp, curPos, SEEK_SET);
+
+		if(start < 0 && lseekError == ENXIO) {
+			return false;
+		}
+		if(start >= 0 && end >= 0) {
+			dataStart = start;
+			dataEnd = std::min((uint64_t)end, fileSize);
+			return true;
+		}
+#endif
+		dataStart = offset;
+		dataEnd = fileSize;
+		return true;
+	}
+
+	void FileStream::punchHole(uint64_t offset, uint64_t length)
+	{
+		fflush(mFp);
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+		if(fallocate(fileno(mFp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+			return;
+		}
+#endif
+		static const uint8_t zeros[65536] = { 0 };
+		while(length > 0) {
+			size_t n = std::min(length, (uint64_t)sizeof(zeros));
+			writeAt(zeros, n, offset);
+			offset += n;
+			length -= n;
+		}
+	}
+	
 	void FileStream::flush()
 	{
 		fflush(mFp);
@@ -18,6 +18,7 @@
 
 #include <string>
 #include <stdio.h>
+#include <stdint.h>
 #include "InputStream.h"
 #include "OutputStream.h"
 
@@ -47,6 +48,33 @@ namespace Nebula
 		virtual size_t read(void *data, size_t size) override;
 		virtual size_t skip(size_t size) override;
 		virtual void write(const void *data, size_t size) override;
+
+		/**
+		 * Writes @a size bytes at the absolute file @a offset without
+		 * moving the stream position. Safe to call concurrently from
+		 * multiple threads for non-overlapping ranges.
+		 */
+		void writeAt(const void *data, size_t size, uint64_t offset);
+
+		/**
+		 * Sets the length of the file, extending it with zeros if needed.
+		 */
+		void truncate(uint64_t size);
+
+		/**
+		 * Finds the first region of data at or after @a offset, skipping
+		 * over holes in sparse files. Returns false if the rest of the file
+		 * is a hole. Where holes can't be detected, the rest of the file is
+		 * returned as a single region.
+		 */
+		bool findData(uint64_t offset, uint64_t& dataStart, uint64_t& dataEnd);
+		
+		/**
+		 * Zeros @a length bytes at @a offset, deallocating the range where
+		 * the file system supports it. The file length is unchanged.
+		 */
+		void punchHole(uint64_t offset, uint64_t length);
+
 		virtual void flush() override;
 		virtual void close() override;
 	private:
@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "FilesCache.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "Exception.h"
+#include "FileInfo.h"
+#include "Snapshot.h"
+
+namespace Nebula
+{
+	enum : uint32_t
+	{
+		FILES_CACHE_MAGIC = 0x4346424E, // "NBFC"
+		FILES_CACHE_VERSION = 2,
+		MIN_CAPACITY = 1024
+	};
+	
+	struct FilesCache::Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t capacity; // number of slots, a power of 2
+		uint32_t count; // slots in use, including ones of older generations
+		uint64_t dataSize; // bytes used in the record area
+		uint32_t generation; // incremented on each commit
+		uint8_t dirty; // set while a commit is being written
+		uint8_t reserved[3];
+		char snapshotName[256];
+		uint8_t snapshotDigest[SHA256_DIGEST_LENGTH]; // see SnapshotSummary
+	};
+
+	struct FilesCache::Slot
+	{
+		uint64_t device;
+		uint64_t inode;
+		uint64_t size;
+		int64_t mtime;
+		int64_t ctime;
+		uint64_t recordOffset; // offset in the record area, 0 if the slot is empty
+		uint32_t generation; // only slots of the current generation are valid
+		uint32_t reserved;
+	};
+	
+	struct FilesCache::Record
+	{
+		uint8_t md5[MD5_DIGEST_LENGTH];
+		uint8_t compression;
+		uint8_t rollingHashBits;
+		uint16_t objectCount;
+		uint32_t offset;
+		uint32_t packLength;
+		uint32_t pathLength;
+		// followed by ObjectID[objectCount], uint32_t[objectCount] sizes
+		// and the path the file was backed up as
+	};
+	
+	static uint64_t hashFile(uint64_t device, uint64_t inode)
+	{
+		uint64_t h = (inode * 0x9E3779B97F4A7C15ULL) ^ device;
+		h ^= h >> 32;
+		h *= 0xD6E8FEB86659FD93ULL;
+		h ^= h >> 32;
+		return h;
+	}
+	
+	FilesCache::FilesCache(const char *path)
+	: mPath(path)
+	, mLockFd(-1)
+	, mFd(-1)
+	, mMap(nullptr)
+	, mMapSize(0)
+	{
+		mLockFd = ::open((mPath + ".lock").c_str(), O_RDWR | O_CREAT, 0600);
+		if(mLockFd < 0) {
+			throw FileIOException("Failed to open the files cache.");
+		}
+		
+		if(flock(mLockFd, LOCK_EX | LOCK_NB) < 0) {
+			::close(mLockFd);
+			throw FileIOException("The files cache is in use.");
+		}
+		
+		try {
+			struct stat st;
+			int fd = ::open(path, O_RDWR);
+			if(fd >= 0 && (fstat(fd, &st) < 0 || st.st_size < sizeof(Header))) {
+				::close(fd);
+				fd = -1;
+			}
+			
+			if(fd >= 0) {
+				map(fd);
+				
+				const Header *h = header();
+				if(h->magic == FILES_CACHE_MAGIC &&
+				   h->version == FILES_CACHE_VERSION &&
+				   !h->dirty &&
+				   h->capacity > 0 && (h->capacity & (h->capacity - 1)) == 0 &&
+				   sizeof(Header) + (size_t)h->capacity * sizeof(Slot) + h->dataSize <= mMapSize) {
+					return;
+				}
+			}
+			
+			// missing, or left unusable by an interrupted commit
+			create(MIN_CAPACITY);
+		} catch(...) {
+			unmap();
+			::close(mLockFd);
+			throw;
+		}
+	}
+	
+	FilesCache::~FilesCache()
+	{
+		unmap();
+		if(mLockFd >= 0) {
+			::close(mLockFd);
+		}
+	}
+	
+	FilesCache::Slot *FilesCache::slots() const
+	{
+		return (Slot *)(mMap + sizeof(Header));
+	}
+	
+	uint8_t *FilesCache::records() const
+	{
+		return mMap + sizeof(Header) + (size_t)header()->capacity * sizeof(Slot);
+	}
+	
+	size_t FilesCache::recordSize(int objectCount, size_t pathLength)
+	{
+		size_t size = sizeof(Record) + objectCount * (sizeof(Snapshot::ObjectID) + sizeof(uint32_t)) + pathLength;
+		return (size + 7) & ~(size_t)7;
+	}
+	
+	size_t FilesCache::recordSize(const uint8_t *record)
+	{
+		return recordSize(((const Record *)record)->objectCount, ((const Record *)record)->pathLength);
+	}
+	
+	void FilesCache::map(int fd)
+	{
+		struct stat st;
+		if(fstat(fd, &st) < 0) {
+			::close(fd);
+			throw FileIOException("Failed to read the files cache.");
+		}
+		
+		void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED) {
+			::close(fd);
+			throw FileIOException("Failed to map the files cache.");
+		}
+		
+		mFd = fd;
+		mMap = (uint8_t *)p;
+		mMapSize = st.st_size;
+	}
+	
+	void FilesCache::unmap()
+	{
+		if(mMap) {
+			munmap(mMap, mMapSize);
+			mMap = nullptr;
+			mMapSize = 0;
+		}
+		if(mFd >= 0) {
+			::close(mFd);
+			mFd = -1;
+		}
+	}
+	
+	void FilesCache::sync()
+	{
+		if(msync(mMap, mMapSize, MS_SYNC) < 0) {
+			throw FileIOException("Failed to write the files cache.");
+		}
+	}
+	
+	void FilesCache::create(uint32_t capacity)
+	{
+		// the new cache is written aside and renamed over the old one
+		std::string tmpPath = mPath + ".tmp";
+		int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if(fd < 0) {
+			throw FileIOException("Failed to create the files cache.");
+		}
+		
+		Header h;
+		memset(&h, 0, sizeof(h));
+		h.magic = FILES_CACHE_MAGIC;
+		h.version = FILES_CACHE_VERSION;
+		h.capacity = capacity;
+		h.dataSize = 8; // record offset 0 marks an empty slot
+		
+		size_t size = sizeof(Header) + (size_t)capacity * sizeof(Slot) + 65536;
+		if(ftruncate(fd, size) < 0 ||
+		   pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+		   rename(tmpPath.c_str(), mPath.c_str()) < 0) {
+			::close(fd);
+			unlink(tmpPath.c_str());
+			throw FileIOException("Failed to create the files cache.");
+		}
+		
+		unmap();
+		map(fd);
+	}
+	
+	void FilesCache::reserve(size_t recordBytes)
+	{
+		size_t needed = (records() - mMap) + header()->dataSize + recordBytes;
+		if(needed <= mMapSize) {
+			return;
+		}
+		
+		size_t newSize = std::max(needed, mMapSize * 2);
+		munmap(mMap, mMapSize);
+		mMap = nullptr;
+		
+		if(ftruncate(mFd, newSize) < 0) {
+			throw FileIOException("Failed to grow the files cache.");
+		}
+		
+		void *p = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+		if(p == MAP_FAILED) {
+			throw FileIOException("Failed to map the files cache.");
+		}
+		mMap = (uint8_t *)p;
+		mMapSize = newSize;
+	}
+	
+	int FilesCache::findSlot(uint64_t device, uint64_t inode) const
+	{
+		uint32_t mask = header()->capacity - 1;
+		const Slot *s = slots();
+		for(uint32_t i = hashFile(device, inode) & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+			if(!s[i].recordOffset) {
+				break;
+			}
+			if(s[i].device == device && s[i].inode == inode) {
+				return i;
+			}
+		}
+		
+		return -1;
+	}
+	
+	void FilesCache::put(const Slot& key, const uint8_t *record, size_t recordSize)
+	{
+		reserve(recordSize);
+		
+		// replace the file's slot if it has one, otherwise take the first
+		// empty slot or one left over from an older generation
+		Header *h = header();
+		uint32_t mask = h->capacity - 1;
+		Slot *s = slots();
+		int target = -1;
+		for(uint32_t i = hashFile(key.device, key.inode) & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+			if(s[i].recordOffset && s[i].device == key.device && s[i].inode == key.inode) {
+				target = i;
+				break;
+			}
+			if(target < 0 && (!s[i].recordOffset || s[i].generation != key.generation)) {
+				target = i;
+			}
+			if(!s[i].recordOffset) {
+				break;
+			}
+		}
+		
+		if(target < 0) {
+			throw FileIOException("The files cache is full.");
+		}
+		
+		if(!s[target].recordOffset) {
+			++h->count;
+		}
+		
+		memcpy(records() + h->dataSize, record, recordSize);
+		s[target] = key;
+		s[target].recordOffset = h->dataSize;
+		h->dataSize += recordSize;
+	}
+	
+	void FilesCache::rebuild(uint32_t capacity, uint32_t generation)
+	{
+		std::vector<Slot> liveSlots;
+		std::vector<uint8_t> liveRecords;
+		const Slot *s = slots();
+		for(uint32_t i = 0; i < header()->capacity; ++i) {
+			if(s[i].recordOffset && s[i].generation == generation) {
+				const uint8_t *record = records() + s[i].recordOffset;
+				size_t size = recordSize(record);
+				liveSlots.push_back(s[i]);
+				liveSlots.back().recordOffset = liveRecords.size();
+				liveRecords.insert(liveRecords.end(), record, record + size);
+			}
+		}
+		
+		create(capacity);
+		header()->dirty = 1;
+		
+		for(const Slot& slot : liveSlots) {
+			const uint8_t *record = &liveRecords[slot.recordOffset];
+			put(slot, record, recordSize(record));
+		}
+	}
+	
+	std::string FilesCache::snapshotName() const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return std::string(header()->snapshotName, strnlen(header()->snapshotName, sizeof(header()->snapshotName)));
+	}
+	
+	void FilesCache::snapshotDigest(uint8_t *outDigest) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		memcpy(outDigest, header()->snapshotDigest, SHA256_DIGEST_LENGTH);
+	}
+	
+	void FilesCache::clear()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		create(MIN_CAPACITY);
+		mTouchedSlots.clear();
+		mPendingFiles.clear();
+	}
+	
+	bool FilesCache::addUnchangedFile(std::shared_ptr<Snapshot> snapshot, const std::string& path, const FileInfo& fileInfo)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		
+		if(!fileInfo.inode() || fileInfo.type() != FileType::RegularFile) {
+			return false;
+		}
+
+		int n = findSlot(fileInfo.device(), fileInfo.inode());
+		if(n < 0) {
+			return false;
+		}
+
+		const Slot& slot = slots()[n];
+		if(slot.generation != header()->generation ||
+		   slot.size != fileInfo.length() ||
+		   slot.mtime != fileInfo.lastModifyTime()) {
+			return false;
+		}
+		
+		const Record *record = (const Record *)(records() + slot.recordOffset);
+		const Snapshot::ObjectID *objectIds = (const Snapshot::ObjectID *)(record + 1);
+		const uint32_t *objectSizes = (const uint32_t *)(objectIds + record->objectCount);
+		const char *recordPath = (const char *)(objectSizes + record->objectCount);
+		
+		// a rename changes the ctime, so a changed ctime is only accepted
+		// when the file was renamed
+		bool renamed = path.size() != record->pathLength || memcmp(path.data(), recordPath, path.size()) != 0;
+		if(slot.ctime != fileInfo.lastChangeTime() && !renamed) {
+			return false;
+		}
+		snapshot->addFileEntry(path.c_str(),
+							   fileInfo.userName().c_str(),
+							   fileInfo.groupName().c_str(),
+							   fileInfo.type(),
+							   fileInfo.mode(),
+							   (CompressionType)record->compression,
+							   slot.size,
+							   slot.mtime,
+							   record->rollingHashBits,
+							   record->md5,
+							   record->offset,
+							   record->packLength,
+							   record->objectCount,
+							   objectIds,
+							   objectSizes);
+		
+		mTouchedSlots.push_back(n);
+		return true;
+	}
+	
+	void FilesCache::fileAdded(const std::string& path, const FileInfo& fileInfo, time_t startTime)
+	{
+		if(!fileInfo.inode() ||
+		   fileInfo.type() != FileType::RegularFile ||
+		   fileInfo.lastModifyTime() >= startTime ||
+		   fileInfo.lastChangeTime() >= startTime) {
+			return;
+		}
+		
+		PendingFile file;
+		file.path = path;
+		file.device = fileInfo.device();
+		file.inode = fileInfo.inode();
+		file.size = fileInfo.length();
+		file.mtime = fileInfo.lastModifyTime();
+		file.ctime = fileInfo.lastChangeTime();
+		
+		std::lock_guard<std::mutex> lock(mMutex);
+		mPendingFiles.push_back(file);
+	}
+	
+	void FilesCache::commit(std::shared_ptr<Snapshot> snapshot, const char *name, const uint8_t *digest)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		
+		uint32_t generation = header()->generation + 1;
+		header()->dirty = 1;
+		sync();
+		
+		// files reused from the cache carry over to the new generation
+		size_t liveBytes = 0;
+		Slot *s = slots();
+		for(uint32_t n : mTouchedSlots) {
+			s[n].generation = generation;
+			liveBytes += recordSize(records() + s[n].recordOffset);
+		}
+		
+		size_t liveCount = mTouchedSlots.size() + mPendingFiles.size();
+		if((header()->count + mPendingFiles.size()) * 10 > (size_t)header()->capacity * 7 ||
+		   header()->dataSize > 2 * liveBytes + (1 << 20)) {
+			uint32_t capacity = MIN_CAPACITY;
+			while(capacity < liveCount * 2) {
+				capacity *= 2;
+			}
+			rebuild(capacity, generation);
+		}
+		
+		std::vector<uint8_t> record;
+		for(const PendingFile& file : mPendingFiles) {
+			const Snapshot::FileEntry *fe = snapshot->getFileEntry(file.path.c_str());
+			if(!fe) {
+				continue;
+			}
+			
+			record.assign(recordSize(fe->objectCount, file.path.size()), 0);
+			Record *r = (Record *)&record[0];
+			memcpy(r->md5, fe->md5, MD5_DIGEST_LENGTH);
+			r->compression = fe->compression;
+			r->rollingHashBits = fe->rollingHashBits;
+			r->objectCount = fe->objectCount;
+			r->offset = fe->offset;
+			r->packLength = fe->packLength;
+			r->pathLength = file.path.size();
+			
+			uint8_t *p = (uint8_t *)(r + 1);
+			memcpy(p, snapshot->indexToObjectID(fe->objectIdIndex), fe->objectCount * sizeof(Snapshot::ObjectID));
+			p += fe->objectCount * sizeof(Snapshot::ObjectID);
+			memcpy(p, snapshot->indexToObjectSize(fe->objectIdIndex), fe->objectCount * sizeof(uint32_t));
+			p += fe->objectCount * sizeof(uint32_t);
+			memcpy(p, file.path.data(), file.path.size());
+			
+			Slot key;
+			memset(&key, 0, sizeof(key));
+			key.device = file.device;
+			key.inode = file.inode;
+			key.size = file.size;
+			key.mtime = file.mtime;
+			key.ctime = file.ctime;
+			key.generation = generation;
+			put(key, &record[0], record.size());
+		}
+		
+		Header *h = header();
+		h->generation = generation;
+		memset(h->snapshotName, 0, sizeof(h->snapshotName));
+		if(strlen(name) < sizeof(h->snapshotName)) {
+			strcpy(h->snapshotName, name);
+		}
+		memcpy(h->snapshotDigest, digest, SHA256_DIGEST_LENGTH);
+		h->dirty = 0;
+		sync();
+		
+		mTouchedSlots.clear();
+		mPendingFiles.clear();
+	}
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+
+namespace Nebula
+{
+	class FileInfo;
+	class Snapshot;
+
+	/**
+	 * Local cache of the files backed up from this host, so unchanged files
+	 * can be added to a snapshot without reading them or loading a previous
+	 * snapshot.
+	 *
+	 * Files are keyed by device and inode, so entries survive renames, and
+	 * are considered unchanged if their size, modify time and change time
+	 * match. The change time is not compared for renamed files, as the
+	 * rename itself updates it. The cache is a memory mapped open
+	 * addressing hash table, followed by the object lists of the files.
+	 *
+	 * Only the files of the last committed snapshot are valid. Files not
+	 * part of it are dropped, since their objects may since have been
+	 * removed from the repository.
+	 */
+	class FilesCache
+	{
+	public:
+		/**
+		 * Opens the cache at @a path, creating it if missing or unusable.
+		 * Throws FileIOException if the cache can't be opened or is in use
+		 * by another process.
+		 */
+		explicit FilesCache(const char *path);
+		~FilesCache();
+		
+		/**
+		 * Name of the snapshot the cached files were committed in.
+		 */
+		std::string snapshotName() const;
+		
+		/**
+		 * Digest of the snapshot the cached files were committed in, as
+		 * recorded in its summary. The snapshot is rewritten with a new
+		 * digest when it is repacked.
+		 */
+		void snapshotDigest(uint8_t *outDigest) const;
+
+		/**
+		 * Drops every cached file.
+		 */
+		void clear();
+		
+		/**
+		 * Adds the file to the snapshot from the cache if it is unchanged.
+		 * Returns false if it isn't cached or has changed.
+		 */
+		bool addUnchangedFile(std::shared_ptr<Snapshot> snapshot, const std::string& path, const FileInfo& fileInfo);
+		
+		/**
+		 * Records a file added to the snapshot. The file is cached once the
+		 * snapshot is committed. Files changed at or after @a startTime are
+		 * not cached as they may change again within the same second.
+		 */
+		void fileAdded(const std::string& path, const FileInfo& fileInfo, time_t startTime);
+		
+		/**
+		 * Updates the cache with the files of @a snapshot once it has been
+		 * committed as @a name with @a digest.
+		 */
+		void commit(std::shared_ptr<Snapshot> snapshot, const char *name, const uint8_t *digest);
+	private:
+		struct Header;
+		struct Slot;
+		struct Record;
+		
+		struct PendingFile
+		{
+			std::string path;
+			uint64_t device;
+			uint64_t inode;
+			uint64_t size;
+			int64_t mtime;
+			int64_t ctime;
+		};
+		
+		std::string mPath;
+		int mLockFd;
+		int mFd;
+		uint8_t *mMap;
+		size_t mMapSize;
+		
+		std::vector<uint32_t> mTouchedSlots;
+		std::vector<PendingFile> mPendingFiles;
+		mutable std::mutex mMutex;
+		
+		Header *header() const { return (Header *)mMap; }
+		Slot *slots() const;
+		uint8_t *records() const;
+		
+		void create(uint32_t capacity);
+		void map(int fd);
+		void unmap();
+		void sync();
+		void reserve(size_t recordBytes);
+
+		int findSlot(uint64_t device, uint64_t inode) const;
+		static size_t recordSize(int objectCount, size_t pathLength);
+		static size_t recordSize(const uint8_t *record);
+		void put(const Slot& key, const uint8_t *record, size_t recordSize);
+		void rebuild(uint32_t capacity, uint32_t generation);
+	};
+}
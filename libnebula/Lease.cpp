@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Lease.h"
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+extern "C" {
+#include "compat/stdlib.h"
+}
+#include "Base32.h"
+#include "DataStore.h"
+#include "Exception.h"
+#include "MemoryInputStream.h"
+
+namespace Nebula
+{
+	Lease::Lease(DataStore& dataStore, Type type, int seconds, const Lease *compatible)
+	: mDataStore(dataStore)
+	, mType(type)
+	, mDuration((int64_t)seconds * 1000)
+	, mRenewed(0)
+	, mLost(false)
+	{
+		uint8_t randomId[10];
+		arc4random_buf(randomId, sizeof(randomId));
+		char encodedId[17];
+		base32encode(randomId, sizeof(randomId), encodedId, sizeof(encodedId));
+		mId = encodedId;
+		
+		int64_t time = now();
+		put(time);
+		
+		std::vector<std::string> names;
+		try {
+			mDataStore.list("/locks", [&names](const char *name, void *) {
+				if(name) {
+					names.push_back(name);
+				}
+			});
+		} catch(const std::exception&) {
+			// the directory may not exist yet
+		}
+		
+		bool conflict = false;
+		for(const std::string& name : names) {
+			// <s|x>-<expiry in milliseconds>-<id>
+			char leaseType;
+			unsigned long long expiry;
+			char id[32];
+			if(sscanf(name.c_str(), "%c-%llu-%31s", &leaseType, &expiry, id) != 3 || (leaseType != 's' && leaseType != 'x')) {
+				continue;
+			}
+			if(mId == id || (compatible && compatible->id() == id)) {
+				continue;
+			}
+			if((int64_t)expiry < time) {
+				try {
+					mDataStore.unlink(("/locks/" + name).c_str());
+				} catch(const std::exception&) {
+				}
+				continue;
+			}
+			if(leaseType == 'x' || mType == Type::Exclusive) {
+				conflict = true;
+			}
+		}
+		
+		if(conflict) {
+			try {
+				mDataStore.unlink(mPath.c_str());
+			} catch(const std::exception&) {
+			}
+			throw RepositoryException(mType == Type::Exclusive ? "The repository is in use by another client." : "The repository is being compacted by another client.");
+		}
+	}
+	
+	Lease::~Lease()
+	{
+		if(!mLost) {
+			try {
+				mDataStore.unlink(mPath.c_str());
+			} catch(const std::exception&) {
+			}
+		}
+	}
+	
+	void Lease::renew(bool force)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		int64_t time = now();
+		if(mLost || 2 * (time - mRenewed) > mDuration) {
+			mLost = true;
+			throw RepositoryException("The lease on the repository was lost.");
+		}
+		if(time == mRenewed || (!force && 3 * (time - mRenewed) < mDuration)) {
+			return;
+		}
+		
+		// a lease which expired may have been removed by another client
+		std::string oldPath = mPath;
+		put(time);
+		if(!mDataStore.unlink(oldPath.c_str())) {
+			mLost = true;
+			mDataStore.unlink(mPath.c_str());
+			throw RepositoryException("The lease on the repository was lost.");
+		}
+	}
+	
+	int64_t Lease::now()
+	{
+		using namespace std::chrono;
+		return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+	}
+	
+	void Lease::put(int64_t time)
+	{
+		mPath = std::string("/locks/") + (mType == Type::Exclusive ? "x" : "s") + "-" + std::to_string(time + mDuration) + "-" + mId;
+		mRenewed = time;
+		
+		static const uint8_t empty = 0;
+		MemoryInputStream stream(&empty, 0);
+		mDataStore.put(mPath.c_str(), stream);
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+namespace Nebula
+{
+	class DataStore;
+	
+	/**
+	 * A lease on a repository, held by an object under /locks whose name
+	 * records the type of the lease and when it expires. Shared leases are
+	 * held by clients writing snapshots and don't exclude one another, an
+	 * exclusive lease, held while objects are removed, excludes any other.
+	 *
+	 * A lease is taken by writing its object and then listing the others,
+	 * so of two conflicting leases taken at once at least one sees the
+	 * other and is given up. Holders renew their lease as they work, and
+	 * expired leases are ignored and removed. A holder considers its lease
+	 * lost once half its duration has passed without renewing it, so the
+	 * clocks of the clients must agree to within that.
+	 */
+	class Lease
+	{
+	public:
+		enum class Type
+		{
+			Shared,
+			Exclusive
+		};
+		
+		/**
+		 * Takes a lease lasting @a seconds unless renewed. Throws
+		 * RepositoryException if a conflicting lease is held, other than
+		 * @a compatible, a lease held by the same client.
+		 */
+		Lease(DataStore& dataStore, Type type, int seconds, const Lease *compatible = nullptr);
+		
+		/**
+		 * Gives up the lease.
+		 */
+		~Lease();
+		
+		/**
+		 * Renews the lease once a third of its duration has passed since it
+		 * was last renewed, or always if @a force is set. Throws
+		 * RepositoryException if the lease was lost.
+		 */
+		void renew(bool force = false);
+		
+		Type type() const { return mType; }
+		const std::string& id() const { return mId; }
+	private:
+		DataStore& mDataStore;
+		Type mType;
+		int64_t mDuration; // in milliseconds
+		std::string mId;
+		std::string mPath;
+		int64_t mRenewed;
+		bool mLost;
+		std::mutex mMutex;
+		
+		static int64_t now();
+		void put(int64_t time);
+	};
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+
+namespace Nebula
+{
+	/**
+	 * Loads and stores little-endian integers at unaligned addresses, for
+	 * parsing fixed layout records out of a buffer.
+	 */
+	namespace LittleEndian
+	{
+		inline uint16_t load16(const uint8_t *p)
+		{
+			return (uint16_t)p[0] | (uint16_t)p[1] << 8;
+		}
+		
+		inline uint32_t load32(const uint8_t *p)
+		{
+			return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		}
+		
+		inline uint64_t load64(const uint8_t *p)
+		{
+			return (uint64_t)load32(p) | (uint64_t)load32(p + 4) << 32;
+		}
+		
+		inline void store16(uint8_t *p, uint16_t v)
+		{
+			p[0] = v;
+			p[1] = v >> 8;
+		}
+		
+		inline void store32(uint8_t *p, uint32_t v)
+		{
+			p[0] = v;
+			p[1] = v >> 8;
+			p[2] = v >> 16;
+			p[3] = v >> 24;
+		}
+		
+		inline void store64(uint8_t *p, uint64_t v)
+		{
+			store32(p, v);
+			store32(p + 4, v >> 32);
+		}
+	}
+}
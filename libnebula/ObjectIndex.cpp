@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ObjectIndex.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include <set>
+#include "InputStream.h"
+#include "OutputStream.h"
+#include "LittleEndian.h"
+#include "Exception.h"
+
+namespace Nebula
+{
+	enum : uint32_t
+	{
+		OBJECT_INDEX_MAGIC = 0x494F424E, // "NBOI"
+		OBJECT_INDEX_VERSION = 1,
+		
+		INDEX_OBJECT_MAGIC = 0x5849424E, // "NBIX"
+		INDEX_OBJECT_VERSION = 2,
+		INDEX_ENTRY_SIZE = 32 + 32 + 4 + 4
+	};
+	
+	// followed by the entries and the names of the merged index objects
+	struct ObjectIndex::Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t nameCount;
+		uint32_t reserved;
+		uint64_t entryCount;
+		uint64_t stringsSize;
+	};
+	
+	static bool idLess(const ObjectIndex::Entry& a, const ObjectIndex::Entry& b)
+	{
+		return memcmp(a.id.id, b.id.id, sizeof(a.id.id)) < 0;
+	}
+	
+	static bool idEqual(const ObjectIndex::Entry& a, const ObjectIndex::Entry& b)
+	{
+		return memcmp(a.id.id, b.id.id, sizeof(a.id.id)) == 0;
+	}
+	
+	static bool isStandalone(const ObjectIndex::Entry& entry)
+	{
+		return memcmp(entry.id.id, entry.container.id, sizeof(entry.id.id)) == 0;
+	}
+	
+	static bool containerLess(const Snapshot::ObjectID& a, const Snapshot::ObjectID& b)
+	{
+		return memcmp(a.id, b.id, sizeof(a.id)) < 0;
+	}
+	
+	// an object stored on its own is preferred over a copy in a pack, as
+	// it can be referenced as a standalone object
+	static bool preferredLess(const ObjectIndex::Entry& a, const ObjectIndex::Entry& b)
+	{
+		int cmp = memcmp(a.id.id, b.id.id, sizeof(a.id.id));
+		return cmp < 0 || (cmp == 0 && isStandalone(a) && !isStandalone(b));
+	}
+	
+	ObjectIndex::ObjectIndex(const char *path)
+	: mPath(path)
+	, mLockFd(-1)
+	, mMap(nullptr)
+	, mMapSize(0)
+	{
+		mLockFd = ::open((mPath + ".lock").c_str(), O_RDWR | O_CREAT, 0600);
+		if(mLockFd < 0) {
+			throw FileIOException("Failed to open the object index.");
+		}
+		map();
+	}
+	
+	ObjectIndex::~ObjectIndex()
+	{
+		unmap();
+		::close(mLockFd);
+	}
+	
+	const ObjectIndex::Entry *ObjectIndex::entries() const
+	{
+		return (const Entry *)(mMap + sizeof(Header));
+	}
+	
+	const char *ObjectIndex::strings() const
+	{
+		return (const char *)(entries() + header()->entryCount);
+	}
+	
+	void ObjectIndex::map()
+	{
+		int fd = ::open(mPath.c_str(), O_RDONLY);
+		if(fd < 0) {
+			return;
+		}
+		
+		struct stat st;
+		void *p = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && st.st_size >= sizeof(Header)) {
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);
+		if(p == MAP_FAILED) {
+			return;
+		}
+		mMap = (uint8_t *)p;
+		mMapSize = st.st_size;
+		
+		// anything unexpected is treated as an empty table
+		const Header *h = header();
+		if(h->magic != OBJECT_INDEX_MAGIC || h->version != OBJECT_INDEX_VERSION ||
+		   h->entryCount > mMapSize / sizeof(Entry) ||
+		   sizeof(Header) + h->entryCount * sizeof(Entry) + h->stringsSize != mMapSize ||
+		   (h->stringsSize > 0 && strings()[h->stringsSize - 1] != 0)) {
+			unmap();
+		}
+	}
+	
+	void ObjectIndex::unmap()
+	{
+		if(mMap) {
+			munmap(mMap, mMapSize);
+			mMap = nullptr;
+			mMapSize = 0;
+		}
+	}
+	
+	bool ObjectIndex::find(const Snapshot::ObjectID& id, Entry *entry) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(!mMap) {
+			return false;
+		}
+		
+		Entry key;
+		key.id = id;
+		const Entry *begin = entries();
+		const Entry *end = begin + header()->entryCount;
+		const Entry *it = std::lower_bound(begin, end, key, idLess);
+		if(it == end || !idEqual(*it, key)) {
+			return false;
+		}
+		if(entry) {
+			*entry = *it;
+		}
+		return true;
+	}
+	
+	void ObjectIndex::forEach(const std::function<void (const Entry&)>& callback) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(mMap) {
+			std::for_each(entries(), entries() + header()->entryCount, callback);
+		}
+	}
+	
+	size_t ObjectIndex::size() const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return mMap ? header()->entryCount : 0;
+	}
+	
+	std::vector<std::string> ObjectIndex::indexNames() const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		std::vector<std::string> names;
+		if(mMap) {
+			const char *name = strings();
+			for(uint32_t i = 0; i < header()->nameCount; ++i) {
+				names.push_back(name);
+				name += names.back().size() + 1;
+			}
+		}
+		return names;
+	}
+	
+	void ObjectIndex::merge(const std::vector<std::string>& names, std::vector<Entry> added, std::vector<Snapshot::ObjectID> removed)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(flock(mLockFd, LOCK_EX) < 0) {
+			throw FileIOException("Failed to lock the object index.");
+		}
+		std::unique_ptr<int, void (*)(int *)> onExit(&mLockFd, [](int *fd) { flock(*fd, LOCK_UN); });
+		
+		// another process may have merged since the table was opened
+		unmap();
+		map();
+		
+		std::set<std::string> allNames(names.begin(), names.end());
+		if(mMap) {
+			const char *name = strings();
+			for(uint32_t i = 0; i < header()->nameCount; ++i) {
+				name += allNames.insert(name).first->size() + 1;
+			}
+		}
+		
+		std::stable_sort(added.begin(), added.end(), preferredLess);
+		added.erase(std::unique(added.begin(), added.end(), idEqual), added.end());
+		std::sort(removed.begin(), removed.end(), containerLess);
+		write(std::vector<std::string>(allNames.begin(), allNames.end()), mMap ? entries() : nullptr, added, removed);
+	}
+	
+	void ObjectIndex::clear()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(flock(mLockFd, LOCK_EX) < 0) {
+			throw FileIOException("Failed to lock the object index.");
+		}
+		std::unique_ptr<int, void (*)(int *)> onExit(&mLockFd, [](int *fd) { flock(*fd, LOCK_UN); });
+		
+		unmap();
+		write(std::vector<std::string>(), nullptr, std::vector<Entry>(), std::vector<Snapshot::ObjectID>());
+	}
+	
+	// writes the entries of the mapped table, if @a first is set, merged
+	// with @a added, which is sorted and unique, leaving out those held by
+	// the sorted @a removed
+	void ObjectIndex::write(const std::vector<std::string>& names, const Entry *first, const std::vector<Entry>& added, const std::vector<Snapshot::ObjectID>& removed)
+	{
+		std::string tmpPath = mPath + ".tmp";
+		std::unique_ptr<FILE, decltype(fclose) *> out(fopen(tmpPath.c_str(), "wb"), fclose);
+		if(!out) {
+			throw FileIOException("Failed to create the object index.");
+		}
+		
+		const Entry *last = first ? first + header()->entryCount : nullptr;
+		Header h;
+		memset(&h, 0, sizeof(h));
+		h.magic = OBJECT_INDEX_MAGIC;
+		h.version = OBJECT_INDEX_VERSION;
+		h.nameCount = names.size();
+		for(const std::string& name : names) {
+			h.stringsSize += name.size() + 1;
+		}
+		bool ok = fwrite(&h, sizeof(h), 1, out.get()) == 1;
+		
+		auto it = added.begin();
+		while(ok && (first != last || it != added.end())) {
+			const Entry *entry;
+			if(it == added.end() || (first != last && !idLess(*it, *first))) {
+				if(it != added.end() && idEqual(*it, *first)) {
+					entry = isStandalone(*it) && !isStandalone(*first) ? &*it : first;
+					++it;
+					++first;
+				} else {
+					entry = first++;
+				}
+			} else {
+				entry = &*it++;
+			}
+			if(!std::binary_search(removed.begin(), removed.end(), entry->container, containerLess)) {
+				ok = fwrite(entry, sizeof(Entry), 1, out.get()) == 1;
+				++h.entryCount;
+			}
+		}
+		for(const std::string& name : names) {
+			ok = ok && fwrite(name.c_str(), 1, name.size() + 1, out.get()) == name.size() + 1;
+		}
+		
+		// the count is only known once the entries are merged
+		ok = ok && fseek(out.get(), 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, out.get()) == 1;
+		ok = ok && fflush(out.get()) == 0 && fsync(fileno(out.get())) == 0;
+		out.reset();
+		if(!ok || rename(tmpPath.c_str(), mPath.c_str()) < 0) {
+			unlink(tmpPath.c_str());
+			throw FileIOException("Failed to write the object index.");
+		}
+		
+		unmap();
+		map();
+	}
+	
+	void ObjectIndex::save(std::vector<Entry>& entries, const std::vector<Snapshot::ObjectID>& removed, OutputStream& outStream)
+	{
+		std::sort(entries.begin(), entries.end(), idLess);
+		
+		uint8_t header[12];
+		LittleEndian::store32(header, INDEX_OBJECT_MAGIC);
+		LittleEndian::store32(header + 4, INDEX_OBJECT_VERSION);
+		LittleEndian::store32(header + 8, entries.size());
+		outStream.write(header, sizeof(header));
+		
+		for(const Entry& entry : entries) {
+			uint8_t record[INDEX_ENTRY_SIZE];
+			memcpy(record, entry.id.id, 32);
+			memcpy(record + 32, entry.container.id, 32);
+			LittleEndian::store32(record + 64, entry.offset);
+			LittleEndian::store32(record + 68, entry.length);
+			outStream.write(record, sizeof(record));
+		}
+		
+		uint8_t count[4];
+		LittleEndian::store32(count, removed.size());
+		outStream.write(count, sizeof(count));
+		for(const Snapshot::ObjectID& container : removed) {
+			outStream.write(container.id, sizeof(container.id));
+		}
+	}
+	
+	void ObjectIndex::load(InputStream& inStream, std::vector<Entry>& entries, std::vector<Snapshot::ObjectID>& removed)
+	{
+		uint8_t header[12];
+		inStream.readExpected(header, sizeof(header));
+		if(LittleEndian::load32(header) != INDEX_OBJECT_MAGIC) {
+			throw InvalidFormatException("Invalid object index.");
+		}
+		uint32_t version = LittleEndian::load32(header + 4);
+		if(version > INDEX_OBJECT_VERSION) {
+			throw InvalidFormatException("Unsupported object index version.");
+		}
+		
+		uint32_t count = LittleEndian::load32(header + 8);
+		if(inStream.size() >= 0 && (uint64_t)count * INDEX_ENTRY_SIZE > inStream.size()) {
+			throw InvalidFormatException("Invalid object index.");
+		}
+		// callers append the entries of many index objects, so the capacity
+		// grows geometrically rather than by each object's count
+		if(entries.capacity() < entries.size() + count) {
+			entries.reserve(std::max<size_t>(entries.size() + count, entries.capacity() * 2));
+		}
+		for(uint32_t i = 0; i < count; ++i) {
+			uint8_t record[INDEX_ENTRY_SIZE];
+			inStream.readExpected(record, sizeof(record));
+			Entry entry;
+			memcpy(entry.id.id, record, 32);
+			memcpy(entry.container.id, record + 32, 32);
+			entry.offset = LittleEndian::load32(record + 64);
+			entry.length = LittleEndian::load32(record + 68);
+			entries.push_back(entry);
+		}
+		
+		// version 1 indexes have no removed containers
+		if(version < 2) {
+			return;
+		}
+		uint8_t removedCount[4];
+		inStream.readExpected(removedCount, sizeof(removedCount));
+		count = LittleEndian::load32(removedCount);
+		if(inStream.size() >= 0 && (uint64_t)count * sizeof(Snapshot::ObjectID) > inStream.size()) {
+			throw InvalidFormatException("Invalid object index.");
+		}
+		for(uint32_t i = 0; i < count; ++i) {
+			Snapshot::ObjectID container;
+			inStream.readExpected(container.id, sizeof(container.id));
+			removed.push_back(container);
+		}
+	}
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Snapshot.h"
+
+namespace Nebula
+{
+	class InputStream;
+	class OutputStream;
+	
+	/**
+	 * Local lookup table of where the objects of a repository are stored,
+	 * merged from the index objects under /index.
+	 *
+	 * Each entry maps the id of an object to the object holding it, and
+	 * its byte range there. An object stored on its own is its own
+	 * container. A small file stored in a pack is found at its offset in
+	 * the pack, under the id it would have had on its own.
+	 *
+	 * The entries are sorted by id in a memory mapped file. Merges are
+	 * written to a new file which replaces the old one, so readers always
+	 * see a complete table.
+	 */
+	class ObjectIndex
+	{
+	public:
+		struct Entry
+		{
+			Snapshot::ObjectID id;
+			Snapshot::ObjectID container;
+			uint32_t offset;
+			uint32_t length; // 0 for the whole container
+		};
+		
+		/**
+		 * Opens the table at @a path. A missing or unreadable table is
+		 * treated as empty. Throws FileIOException if it can't be created.
+		 */
+		explicit ObjectIndex(const char *path);
+		~ObjectIndex();
+		
+		/**
+		 * Looks up @a id, copying its entry to @a entry if given.
+		 */
+		bool find(const Snapshot::ObjectID& id, Entry *entry = nullptr) const;
+		
+		/**
+		 * Calls @a callback for every entry, in the order of their ids.
+		 */
+		void forEach(const std::function<void (const Entry&)>& callback) const;
+		
+		size_t size() const;
+		
+		/**
+		 * Names of the index objects merged into the table.
+		 */
+		std::vector<std::string> indexNames() const;
+		
+		/**
+		 * Adds @a entries, read from the index objects @a names, and drops
+		 * the entries of objects held by one of @a removed, whether in the
+		 * table or added. An id already in the table keeps its entry,
+		 * unless the entry added is for the object stored on its own.
+		 */
+		void merge(const std::vector<std::string>& names, std::vector<Entry> entries, std::vector<Snapshot::ObjectID> removed = std::vector<Snapshot::ObjectID>());
+		
+		/**
+		 * Empties the table.
+		 */
+		void clear();
+		
+		/**
+		 * Writes @a entries, sorted by id, and the containers @a removed
+		 * from the repository as the plaintext of an index object.
+		 */
+		static void save(std::vector<Entry>& entries, const std::vector<Snapshot::ObjectID>& removed, OutputStream& outStream);
+		
+		/**
+		 * Reads an index object, appending its entries to @a entries and
+		 * its removed containers to @a removed.
+		 */
+		static void load(InputStream& inStream, std::vector<Entry>& entries, std::vector<Snapshot::ObjectID>& removed);
+	private:
+		struct Header;
+		
+		std::string mPath;
+		int mLockFd;
+		mutable std::mutex mMutex;
+		uint8_t *mMap;
+		size_t mMapSize;
+		
+		const Header *header() const { return (const Header *)mMap; }
+		const Entry *entries() const;
+		const char *strings() const;
+		
+		void map();
+		void unmap();
+		void write(const std::vector<std::string>& names, const Entry *first, const std::vector<Entry>& added, const std::vector<Snapshot::ObjectID>& removed);
+	};
+}
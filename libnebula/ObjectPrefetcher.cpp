@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "ObjectPrefetcher.h"
+#include "Exception.h"
+#include "TempFileStream.h"
+
+namespace Nebula
+{
+	ObjectPrefetcher::ObjectPrefetcher(const FetchFunction& fetch,
+									   const std::vector<std::string>& paths,
+									   const std::vector<size_t>& estimatedSizes,
+									   int maxObjects,
+									   size_t maxBytes,
+									   int numThreads)
+	: mFetch(fetch)
+	, mMaxObjects(std::max(maxObjects, 1))
+	, mMaxBytes(maxBytes)
+	, mStopping(false)
+	, mNextFetch(0)
+	, mNextTake(0)
+	, mBytesHeld(0)
+	{
+		mSlots.resize(paths.size());
+		for(int i = 0; i < mSlots.size(); ++i) {
+			mSlots[i].path = paths[i];
+			mSlots[i].estimatedSize = estimatedSizes[i];
+			mSlots[i].heldSize = 0;
+			mSlots[i].done = false;
+		}
+		
+		numThreads = std::min(std::max(numThreads, 1), mMaxObjects);
+		for(int i = 0; i < numThreads; ++i) {
+			mThreads.emplace_back(&ObjectPrefetcher::fetchObjects, this);
+		}
+	}
+	
+	ObjectPrefetcher::~ObjectPrefetcher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+		mCondition.notify_all();
+
+		for(auto& thread : mThreads) {
+			thread.join();
+		}
+	}
+	
+	bool ObjectPrefetcher::canFetchNext() const
+	{
+		if(mNextFetch >= mSlots.size() || mNextFetch >= mNextTake + mMaxObjects) {
+			return false;
+		}
+		
+		// always allow one object so an object larger than the limit
+		// can still be downloaded
+		return mBytesHeld == 0 || mBytesHeld + mSlots[mNextFetch].estimatedSize <= mMaxBytes;
+	}
+	
+	void ObjectPrefetcher::fetchObjects()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		for(;;) {
+			mCondition.wait(lock, [this]() {
+				return mStopping || mNextFetch >= mSlots.size() || canFetchNext();
+			});
+			if(mStopping || mNextFetch >= mSlots.size()) {
+				return;
+			}
+			
+			Slot& slot = mSlots[mNextFetch++];
+			slot.heldSize = slot.estimatedSize;
+			mBytesHeld += slot.heldSize;
+			lock.unlock();
+			
+			auto stream = std::make_shared<TempFileStream>();
+			std::exception_ptr error;
+			try {
+				mFetch(slot.path, *stream, [this](long, long) -> bool { return !mStopping; });
+			} catch(...) {
+				error = std::current_exception();
+			}
+
+			lock.lock();
+			
+			// the estimate is replaced by what the object actually holds
+			mBytesHeld = mBytesHeld - slot.heldSize + stream->size();
+			slot.heldSize = stream->size();
+			slot.stream = stream;
+			slot.error = error;
+			slot.done = true;
+			mCondition.notify_all();
+		}
+	}
+	
+	std::shared_ptr<TempFileStream> ObjectPrefetcher::take(int n)
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(n != mNextTake || n >= mSlots.size()) {
+			throw InvalidArgumentException("Objects must be taken in order.");
+		}
+		
+		Slot& slot = mSlots[n];
+		mCondition.wait(lock, [&slot]() { return slot.done; });
+		
+		++mNextTake;
+		mBytesHeld -= slot.heldSize;
+		mCondition.notify_all();
+
+		if(slot.error) {
+			std::rethrow_exception(slot.error);
+		}
+		
+		std::shared_ptr<TempFileStream> stream = std::move(slot.stream);
+		return stream;
+	}
+}
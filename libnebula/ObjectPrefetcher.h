@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ProgressFunction.h"
+
+namespace Nebula
+{
+	class OutputStream;
+	class TempFileStream;
+
+	/**
+	 * Downloads a list of objects ahead of the consumer.
+	 * Up to maxObjects objects past the one last taken are kept downloading
+	 * or downloaded, as long as the bytes they hold fit within maxBytes.
+	 * An object is counted with its estimated size while it downloads, and
+	 * with the size it was downloaded as once it is. Objects are held in
+	 * TempFileStreams, so those larger than its buffer are held on disk.
+	 * Objects must be taken in the order they were listed.
+	 */
+	class ObjectPrefetcher
+	{
+	public:
+		typedef std::function<void (const std::string& path, OutputStream& stream, ProgressFunction progress)> FetchFunction;
+
+		ObjectPrefetcher(const FetchFunction& fetch,
+						 const std::vector<std::string>& paths,
+						 const std::vector<size_t>& estimatedSizes,
+						 int maxObjects,
+						 size_t maxBytes,
+						 int numThreads);
+		~ObjectPrefetcher();
+		
+		/**
+		 * Waits for object @a n to be downloaded and returns it.
+		 * Rethrows the exception if the download failed.
+		 */
+		std::shared_ptr<TempFileStream> take(int n);
+	private:
+		struct Slot
+		{
+			std::string path;
+			size_t estimatedSize;
+			size_t heldSize;
+			bool done;
+			std::shared_ptr<TempFileStream> stream;
+			std::exception_ptr error;
+		};
+		
+		FetchFunction mFetch;
+		std::vector<Slot> mSlots;
+		int mMaxObjects;
+		size_t mMaxBytes;
+
+		std::mutex mMutex;
+		std::condition_variable mCondition;
+		std::atomic<bool> mStopping;
+		int mNextFetch;
+		int mNextTake;
+		size_t mBytesHeld;
+		std::vector<std::thread> mThreads;
+		
+		bool canFetchNext() const;
+		void fetchObjects();
+	};
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ReferenceCounts.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include "Exception.h"
+
+namespace Nebula
+{
+	enum : uint32_t
+	{
+		REFERENCE_COUNTS_MAGIC = 0x4352424E, // "NBRC"
+		REFERENCE_COUNTS_VERSION = 1
+	};
+	
+	// followed by the snapshot records, entries and strings
+	struct ReferenceCounts::Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t snapshotCount;
+		uint32_t reserved;
+		uint64_t entryCount;
+		uint64_t stringsSize;
+	};
+	
+	struct ReferenceCounts::SnapshotRecord
+	{
+		uint8_t digest[SHA256_DIGEST_LENGTH];
+		uint64_t nameOffset;
+	};
+	
+	// an object referenced by at least one snapshot, sorted by object
+	struct ReferenceCounts::Entry
+	{
+		uint64_t object;
+		uint32_t count;
+		uint32_t reserved;
+	};
+	
+	ReferenceCounts::ReferenceCounts(const char *path)
+	: mPath(path)
+	, mLockFd(-1)
+	, mMap(nullptr)
+	, mMapSize(0)
+	{
+		mLockFd = ::open((mPath + ".lock").c_str(), O_RDWR | O_CREAT, 0600);
+		if(mLockFd < 0) {
+			throw FileIOException("Failed to open the reference counts.");
+		}
+		map();
+	}
+	
+	ReferenceCounts::~ReferenceCounts()
+	{
+		unmap();
+		::close(mLockFd);
+	}
+	
+	const ReferenceCounts::SnapshotRecord *ReferenceCounts::snapshotRecords() const
+	{
+		return (const SnapshotRecord *)(mMap + sizeof(Header));
+	}
+	
+	const ReferenceCounts::Entry *ReferenceCounts::entries() const
+	{
+		return (const Entry *)(snapshotRecords() + header()->snapshotCount);
+	}
+	
+	const char *ReferenceCounts::strings() const
+	{
+		return (const char *)(entries() + header()->entryCount);
+	}
+	
+	void ReferenceCounts::map()
+	{
+		int fd = ::open(mPath.c_str(), O_RDONLY);
+		if(fd < 0) {
+			return;
+		}
+		
+		struct stat st;
+		void *p = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && st.st_size >= sizeof(Header)) {
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);
+		if(p == MAP_FAILED) {
+			return;
+		}
+		mMap = (uint8_t *)p;
+		mMapSize = st.st_size;
+		
+		// anything unexpected is treated as an empty table
+		const Header *h = header();
+		if(h->magic != REFERENCE_COUNTS_MAGIC || h->version != REFERENCE_COUNTS_VERSION ||
+		   h->snapshotCount > mMapSize / sizeof(SnapshotRecord) ||
+		   h->entryCount > mMapSize / sizeof(Entry) ||
+		   sizeof(Header) + h->snapshotCount * sizeof(SnapshotRecord) + h->entryCount * sizeof(Entry) + h->stringsSize != mMapSize ||
+		   (h->stringsSize > 0 && strings()[h->stringsSize - 1] != 0)) {
+			unmap();
+		}
+	}
+	
+	void ReferenceCounts::unmap()
+	{
+		if(mMap) {
+			munmap(mMap, mMapSize);
+			mMap = nullptr;
+			mMapSize = 0;
+		}
+	}
+	
+	std::vector<ReferenceCounts::SnapshotRefs> ReferenceCounts::snapshots() const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		std::vector<SnapshotRefs> snapshots;
+		if(mMap) {
+			for(uint32_t i = 0; i < header()->snapshotCount; ++i) {
+				SnapshotRefs refs;
+				refs.name = strings() + snapshotRecords()[i].nameOffset;
+				memcpy(refs.digest, snapshotRecords()[i].digest, sizeof(refs.digest));
+				snapshots.push_back(refs);
+			}
+		}
+		return snapshots;
+	}
+	
+	uint32_t ReferenceCounts::count(uint64_t object) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(!mMap) {
+			return 0;
+		}
+		
+		const Entry *begin = entries();
+		const Entry *end = begin + header()->entryCount;
+		const Entry *it = std::lower_bound(begin, end, object, [](const Entry& entry, uint64_t object) {
+			return entry.object < object;
+		});
+		return it != end && it->object == object ? it->count : 0;
+	}
+	
+	void ReferenceCounts::update(const std::vector<SnapshotRefs>& removed, const std::vector<SnapshotRefs>& added, std::vector<uint64_t> *freed)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(flock(mLockFd, LOCK_EX) < 0) {
+			throw FileIOException("Failed to lock the reference counts.");
+		}
+		std::unique_ptr<int, void (*)(int *)> onExit(&mLockFd, [](int *fd) { flock(*fd, LOCK_UN); });
+		
+		// another process may have updated the table since it was opened
+		unmap();
+		map();
+		
+		std::vector<SnapshotRefs> snapshots;
+		if(mMap) {
+			for(uint32_t i = 0; i < header()->snapshotCount; ++i) {
+				const char *name = strings() + snapshotRecords()[i].nameOffset;
+				bool isRemoved = std::any_of(removed.begin(), removed.end(), [name](const SnapshotRefs& refs) {
+					return refs.name == name;
+				});
+				if(!isRemoved) {
+					SnapshotRefs refs;
+					refs.name = name;
+					memcpy(refs.digest, snapshotRecords()[i].digest, sizeof(refs.digest));
+					snapshots.push_back(refs);
+				}
+			}
+		}
+		for(const SnapshotRefs& refs : added) {
+			SnapshotRefs record;
+			record.name = refs.name;
+			memcpy(record.digest, refs.digest, sizeof(record.digest));
+			snapshots.push_back(record);
+		}
+		
+		// the change in the count of each object
+		std::vector<std::pair<uint64_t, int32_t>> deltas;
+		for(const SnapshotRefs& refs : removed) {
+			for(uint64_t object : refs.objects) {
+				deltas.push_back(std::make_pair(object, -1));
+			}
+		}
+		for(const SnapshotRefs& refs : added) {
+			for(uint64_t object : refs.objects) {
+				deltas.push_back(std::make_pair(object, 1));
+			}
+		}
+		std::sort(deltas.begin(), deltas.end());
+		size_t n = 0;
+		for(size_t i = 0; i < deltas.size(); ++i) {
+			if(n > 0 && deltas[n - 1].first == deltas[i].first) {
+				deltas[n - 1].second += deltas[i].second;
+			} else {
+				deltas[n++] = deltas[i];
+			}
+		}
+		deltas.resize(n);
+		
+		write(snapshots, deltas, freed);
+	}
+	
+	void ReferenceCounts::clear()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if(flock(mLockFd, LOCK_EX) < 0) {
+			throw FileIOException("Failed to lock the reference counts.");
+		}
+		std::unique_ptr<int, void (*)(int *)> onExit(&mLockFd, [](int *fd) { flock(*fd, LOCK_UN); });
+		
+		unmap();
+		write(std::vector<SnapshotRefs>(), std::vector<std::pair<uint64_t, int32_t>>(), nullptr);
+	}
+	
+	// writes the counts of the mapped table with @a deltas, which is sorted
+	// by object, applied. Objects whose count falls to zero are appended
+	// to @a freed.
+	void ReferenceCounts::write(const std::vector<SnapshotRefs>& snapshots, const std::vector<std::pair<uint64_t, int32_t>>& deltas, std::vector<uint64_t> *freed)
+	{
+		std::string tmpPath = mPath + ".tmp";
+		std::unique_ptr<FILE, decltype(fclose) *> out(fopen(tmpPath.c_str(), "wb"), fclose);
+		if(!out) {
+			throw FileIOException("Failed to create the reference counts.");
+		}
+		
+		Header h;
+		memset(&h, 0, sizeof(h));
+		h.magic = REFERENCE_COUNTS_MAGIC;
+		h.version = REFERENCE_COUNTS_VERSION;
+		h.snapshotCount = snapshots.size();
+		bool ok = fwrite(&h, sizeof(h), 1, out.get()) == 1;
+		for(const SnapshotRefs& refs : snapshots) {
+			SnapshotRecord record;
+			memcpy(record.digest, refs.digest, sizeof(record.digest));
+			record.nameOffset = h.stringsSize;
+			h.stringsSize += refs.name.size() + 1;
+			ok = ok && fwrite(&record, sizeof(record), 1, out.get()) == 1;
+		}
+		
+		const Entry *first = mMap ? entries() : nullptr;
+		const Entry *last = mMap ? first + header()->entryCount : nullptr;
+		auto it = deltas.begin();
+		while(ok && (first != last || it != deltas.end())) {
+			Entry entry;
+			entry.reserved = 0;
+			int64_t count;
+			if(it == deltas.end() || (first != last && first->object <= it->first)) {
+				entry.object = first->object;
+				count = first->count;
+				if(it != deltas.end() && it->first == first->object) {
+					count += (it++)->second;
+				}
+				++first;
+			} else {
+				// an object which wasn't counted is never freed
+				entry.object = it->first;
+				count = (it++)->second;
+				if(count <= 0) {
+					continue;
+				}
+			}
+			
+			if(count <= 0) {
+				if(freed) {
+					freed->push_back(entry.object);
+				}
+				continue;
+			}
+			entry.count = count;
+			ok = fwrite(&entry, sizeof(entry), 1, out.get()) == 1;
+			++h.entryCount;
+		}
+		for(const SnapshotRefs& refs : snapshots) {
+			ok = ok && fwrite(refs.name.c_str(), 1, refs.name.size() + 1, out.get()) == refs.name.size() + 1;
+		}
+		
+		// the count is only known once the entries are written
+		ok = ok && fseek(out.get(), 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, out.get()) == 1;
+		ok = ok && fflush(out.get()) == 0 && fsync(fileno(out.get())) == 0;
+		out.reset();
+		if(!ok || rename(tmpPath.c_str(), mPath.c_str()) < 0) {
+			unlink(tmpPath.c_str());
+			throw FileIOException("Failed to write the reference counts.");
+		}
+		
+		unmap();
+		map();
+	}
+}
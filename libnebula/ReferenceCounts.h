@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <openssl/sha.h>
+
+namespace Nebula
+{
+	/**
+	 * Local count of the snapshots of a repository referencing each
+	 * object, so the objects freed by deleting a snapshot are found from
+	 * the snapshot alone.
+	 *
+	 * Objects are counted by the first 64 bits of their id. A collision
+	 * only keeps an object which could have been freed. The snapshots
+	 * counted are recorded with their digest, so a snapshot which has
+	 * since been rewritten or deleted elsewhere is noticed.
+	 *
+	 * Updates are written to a new file which replaces the old one, so
+	 * readers always see a complete table.
+	 */
+	class ReferenceCounts
+	{
+	public:
+		struct SnapshotRefs
+		{
+			std::string name;
+			
+			/// digest of the snapshot, from its summary, or zeros
+			uint8_t digest[SHA256_DIGEST_LENGTH];
+			
+			/// the objects referenced, sorted and unique
+			std::vector<uint64_t> objects;
+		};
+		
+		/**
+		 * Opens the table at @a path. A missing or unreadable table is
+		 * treated as empty. Throws FileIOException if it can't be created.
+		 */
+		explicit ReferenceCounts(const char *path);
+		~ReferenceCounts();
+		
+		/**
+		 * The snapshots counted, without their objects.
+		 */
+		std::vector<SnapshotRefs> snapshots() const;
+		
+		/**
+		 * Number of snapshots referencing @a object.
+		 */
+		uint32_t count(uint64_t object) const;
+		
+		/**
+		 * Uncounts @a removed and counts @a added, rewriting the table
+		 * once. The objects of @a removed left with no references are
+		 * appended to @a freed, if given.
+		 */
+		void update(const std::vector<SnapshotRefs>& removed, const std::vector<SnapshotRefs>& added, std::vector<uint64_t> *freed = nullptr);
+		
+		/**
+		 * Empties the table.
+		 */
+		void clear();
+	private:
+		struct Header;
+		struct SnapshotRecord;
+		struct Entry;
+		
+		std::string mPath;
+		int mLockFd;
+		mutable std::mutex mMutex;
+		uint8_t *mMap;
+		size_t mMapSize;
+		
+		const Header *header() const { return (const Header *)mMap; }
+		const SnapshotRecord *snapshotRecords() const;
+		const Entry *entries() const;
+		const char *strings() const;
+		
+		void map();
+		void unmap();
+		void write(const std::vector<SnapshotRefs>& snapshots, const std::vector<std::pair<uint64_t, int32_t>>& deltas, std::vector<uint64_t> *freed);
+	};
+}
@@ -15,10 +15,18 @@
  */
 #include "Repository.h"
 #include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include <math.h>
 #include <string>
 #include <set>
 #include <algorithm>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <exception>
 #include <boost/filesystem.hpp>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
@@ -40,6 +48,7 @@ extern "C" {
 #include "BufferedInputStream.h"
 #include "MultiInputStream.h"
 #include "TempFileStream.h"
+#include "ObjectPrefetcher.h"
 #include "FileStream.h"
 #include "MemoryOutputStream.h"
 #include "MemoryInputStream.h"
@@ -48,9 +57,132 @@ extern "C" {
 #include "Snapshot.h"
 #include "InputRangeStream.h"
 #include "StreamUtils.h"
+#include "DigestOutputStream.h"
+#include "SnapshotFileStream.h"
+#include "FilesCache.h"
+#include "SnapshotSummary.h"
+#include "Catalog.h"
+#include "ObjectIndex.h"
+#include "ReferenceCounts.h"
+#include "Lease.h"
+#include "LittleEndian.h"
 
 namespace Nebula
 {
+	// comparing the block against itself shifted by a byte lets memcmp
+	// do the work with its vectorized loop
+	static bool isZeroBlock(const uint8_t *block, size_t size)
+	{
+		return size == 0 || (block[0] == 0 && memcmp(block, block + 1, size - 1) == 0);
+	}
+	
+	static void digestZeros(EVP_MD_CTX *ctx, uint64_t length)
+	{
+		static const uint8_t zeros[65536] = { 0 };
+		while(length > 0) {
+			size_t n = std::min(length, (uint64_t)sizeof(zeros));
+			if(!EVP_DigestUpdate(ctx, zeros, n)) {
+				throw EncryptionFailedException("EVP_DigestUpdate failed.");
+			}
+			length -= n;
+		}
+	}
+	
+	static void writeZeros(OutputStream& stream, uint64_t length)
+	{
+		static const uint8_t zeros[65536] = { 0 };
+		while(length > 0) {
+			size_t n = std::min(length, (uint64_t)sizeof(zeros));
+			stream.write(zeros, n);
+			length -= n;
+		}
+	}
+	
+	// appends a run of zeros to the object list, extending the previous
+	// zero extent where possible
+	static void addZeroExtent(std::vector<Snapshot::ObjectID>& objectIds, std::vector<uint32_t>& objectSizes, uint64_t length)
+	{
+		const uint32_t maxExtentSize = 0xFFFFF000;
+		while(length > 0) {
+			if(objectIds.empty() || !objectIds.back().isZeroExtent() || objectSizes.back() >= maxExtentSize) {
+				Snapshot::ObjectID zeroId;
+				memset(zeroId.id, 0, sizeof(zeroId.id));
+				objectIds.push_back(zeroId);
+				objectSizes.push_back(0);
+			}
+			
+			uint32_t n = (uint32_t)std::min(length, (uint64_t)(maxExtentSize - objectSizes.back()));
+			objectSizes.back() += n;
+			length -= n;
+		}
+	}
+	
+	// calls @a fn for each index below @a count from up to @a numThreads
+	// threads, passing the index and the number of the thread. The first
+	// exception thrown stops the remaining calls and is rethrown.
+	static void parallelFor(size_t count, int numThreads, const std::function<void (size_t i, int thread)>& fn)
+	{
+		std::atomic<size_t> next(0);
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		auto work = [&](int thread) {
+			for(size_t i = next++; i < count; i = next++) {
+				try {
+					fn(i, thread);
+				} catch(...) {
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if(!error) {
+						error = std::current_exception();
+					}
+					next = count;
+				}
+			}
+		};
+		
+		numThreads = std::max(1, std::min<int>(numThreads, count));
+		std::vector<std::thread> threads;
+		for(int i = 1; i < numThreads; ++i) {
+			threads.emplace_back(work, i);
+		}
+		work(0);
+		for(std::thread& thread : threads) {
+			thread.join();
+		}
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+	
+	// calls @a fn for each object a snapshot references, including the
+	// directories of a tree snapshot
+	static void forEachReferencedObject(Snapshot& snapshot, const std::function<void (const Snapshot::ObjectID&)>& fn)
+	{
+		snapshot.forEachFileEntry([&snapshot, &fn](const Snapshot::FileEntry& fe) {
+			for(int j = 0; j < fe.objectCount; ++j) {
+				const Snapshot::ObjectID *objectId = snapshot.indexToObjectID(fe.objectIdIndex + j);
+				if(!objectId->isZeroExtent()) {
+					fn(*objectId);
+				}
+			}
+		});
+		for(const Snapshot::ObjectID& objectId : snapshot.treeObjects()) {
+			fn(objectId);
+		}
+	}
+	
+	// the first 64 bits of the ids of the objects a snapshot references,
+	// sorted and unique
+	static std::vector<uint64_t> referencedObjects(Snapshot& snapshot)
+	{
+		std::vector<uint64_t> ids;
+		forEachReferencedObject(snapshot, [&ids](const Snapshot::ObjectID& objectId) {
+			ids.push_back(LittleEndian::load64(objectId.id));
+		});
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		return ids;
+	}
+	
 	struct Repository::PackFileInfo
 	{
 		std::string path;
@@ -89,7 +221,8 @@ namespace Nebula
 					 uint64_t size,
 					 time_t mtime,
 					 uint8_t rollingHashBits,
-					 const uint8_t *md5);
+					 const uint8_t *md5,
+					 const Snapshot::ObjectID& objectId);
 	};
 	
 	Repository::PackUploadState::PackUploadState()
@@ -113,7 +246,8 @@ namespace Nebula
 								  uint64_t size,
 								  time_t mtime,
 								  uint8_t rollingHashBits,
-								  const uint8_t *md5)
+								  const uint8_t *md5,
+								  const Snapshot::ObjectID& objectId)
 	{
 		if(!HMAC_Update(&hmac, data, sizeData)) {
 			throw EncryptionFailedException("HMAC_Update failed.");
@@ -131,6 +265,7 @@ namespace Nebula
 		pi.rollingHashBits = rollingHashBits;
 		memcpy(pi.md5, md5, MD5_DIGEST_LENGTH);
 		pi.offset = packData.size();
+		pi.objectId = objectId;
 		
 		this->fileInfos.push_back(pi);
 		std::vector<uint8_t> buffer;
@@ -145,6 +280,13 @@ namespace Nebula
 	, minRollingHashBits(18)
 	, maxRollingHashBits(25)
 	, blockSplitCount(8)
+	, restoreThreads(4)
+	, prefetchObjects(4)
+	, prefetchBufferLimit(64 * 1024 * 1024)
+	, verifyDownloads(true)
+	, treeSnapshots(false)
+	, metadataThreads(8)
+	, leaseSeconds(600)
 	{
 	}
 	
@@ -167,6 +309,8 @@ namespace Nebula
 		explicit_bzero(mMacKey, EVP_MAX_KEY_LENGTH);
 		explicit_bzero(mHashKey, EVP_MAX_KEY_LENGTH);
 		explicit_bzero(mRollKey, EVP_MAX_KEY_LENGTH);
+		explicit_bzero(mCacheEncKey, sizeof(mCacheEncKey));
+		explicit_bzero(mCacheMacKey, sizeof(mCacheMacKey));
 		free(mMacKey);
 		free(mEncKey);
 		free(mHashKey);
@@ -235,6 +379,16 @@ namespace Nebula
 		writeRepositoryKey(password, logRounds, progress);
 	}
 	
+	void Repository::initializeRepository(const Repository& keySource, const char *password, uint8_t logRounds, ProgressFunction progress)
+	{
+		memcpy(mEncKey, keySource.mEncKey, EVP_MAX_KEY_LENGTH);
+		memcpy(mMacKey, keySource.mMacKey, EVP_MAX_KEY_LENGTH);
+		memcpy(mHashKey, keySource.mHashKey, EVP_MAX_KEY_LENGTH);
+		memcpy(mRollKey, keySource.mRollKey, EVP_MAX_KEY_LENGTH);
+		
+		writeRepositoryKey(password, logRounds, progress);
+	}
+	
 	bool Repository::unlockRepository(const char *password, ProgressFunction progress)
 	{
 		TempFileStream keyStream;
@@ -298,173 +452,2141 @@ namespace Nebula
 		return true;
 	}
 	
-	bool Repository::changePassword(const char *oldPassword, const char *newPassword, uint8_t logRounds, ProgressFunction progress)
-	{
-		if(!unlockRepository(oldPassword)) return false;
-		writeRepositoryKey(newPassword, logRounds, progress);
-		return true;
-	}
-	
-	void Repository::listSnapshots(const std::function<void (const char *)>& callback, ProgressFunction progress)
-	{
-		mDataStore->list("/snapshot", [&callback](const char *snapshot, void *) { callback(snapshot); }, nullptr, progress);
-	}
-	
-	std::shared_ptr<Snapshot> Repository::createSnapshot()
-	{
-		return std::make_shared<Snapshot>();
-	}
+	enum { OBJECT_SHARDS = 1024, SHARDS_PER_CHECKPOINT = 32 };
 	
-	std::shared_ptr<Snapshot> Repository::loadSnapshot(const char *name, ProgressFunction progress)
+	Repository::CompactStats Repository::compactRepository(bool dryRun, ProgressFunction progress)
 	{
-		std::shared_ptr<Snapshot> snapshot(std::make_shared<Snapshot>());
+		CompactStats stats;
+		memset(&stats, 0, sizeof(stats));
 		
-		TempFileStream tmpSnapshotStream;
-		mDataStore->get((std::string("/snapshot/") + name).c_str(), tmpSnapshotStream, progress);
+		std::unique_ptr<Lease> lease = dryRun ? nullptr : takeExclusiveLease();
+		auto renew = [&lease]() {
+			if(lease) {
+				lease->renew();
+			}
+		};
 		
-		TempFileStream snapshotStream;
-		StreamUtils::decompressDecryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpSnapshotStream.inputStream(), snapshotStream);
-		snapshot->load(*snapshotStream.inputStream());
+		std::vector<std::string> names;
+		listSnapshots([&names](const char *name) {
+			if(name) {
+				names.push_back(name);
+			}
+		});
+		std::sort(names.begin(), names.end());
+		stats.snapshots = names.size();
 		
-		return snapshot;
-	}
-	
-	void Repository::commitSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, ProgressFunction progress)
-	{
-		TempFileStream tmpStream;
-		snapshot->save(tmpStream);
-		auto snapshotStream = StreamUtils::compressEncryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream());
-		mDataStore->put((std::string("/snapshot/") + name).c_str(), *snapshotStream, progress);
-	}
-	
-	void Repository::computeBlockHMAC(const uint8_t *block, size_t size, uint8_t compression, uint8_t *outHMAC)
-	{
-		HMAC_CTX ctx;
-		std::unique_ptr<HMAC_CTX, decltype(HMAC_CTX_cleanup) *> onExit(&ctx, HMAC_CTX_cleanup);
-
-		if(!HMAC_Init(&ctx, mHashKey, SHA256_DIGEST_LENGTH, EVP_sha256())) {
-			throw EncryptionFailedException("HMAC_Init failed.");
-		}
+		// the objects of interrupted backups are kept for them to resume
+		std::vector<std::pair<std::string, uint32_t>> checkpoints = listCheckpoints(nullptr);
+		long progressTotal = names.size() + checkpoints.size() + OBJECT_SHARDS;
 		
-		// hmac which compression is used since that changes the block data
-		if(!HMAC_Update(&ctx, &compression, sizeof(compression))) {
-			throw EncryptionFailedException("HMAC_Update failed.");
-		}
+		// loading snapshots and listing shards aren't serialized, so data
+		// stores without concurrent access are compacted by one thread
+		int numThreads = mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
 		
-		if(!HMAC_Update(&ctx, block, size)) {
-			throw EncryptionFailedException("HMAC_Update failed.");
+		// mark the first 64 bits of the id of every referenced object. A
+		// collision only keeps an unreferenced object.
+		std::vector<std::vector<uint64_t>> marked(numThreads);
+		std::mutex progressMutex;
+		long progressCount = 0;
+		parallelFor(names.size() + checkpoints.size(), numThreads, [&](size_t i, int thread) {
+			renew();
+			std::shared_ptr<Snapshot> snapshot;
+			if(i < names.size()) {
+				snapshot = fetchSnapshot(names[i].c_str(), nullptr, true, DefaultProgressFunction);
+			} else {
+				const auto& checkpoint = checkpoints[i - names.size()];
+				snapshot = fetchCheckpoint(checkpoint.first, checkpoint.second, DefaultProgressFunction);
+			}
+			std::vector<uint64_t>& ids = marked[thread];
+			size_t first = ids.size();
+			std::vector<uint64_t> snapshotIds = referencedObjects(*snapshot);
+			ids.insert(ids.end(), snapshotIds.begin(), snapshotIds.end());
+			
+			// snapshots share most of their objects, so each is merged in
+			// as it is loaded
+			std::inplace_merge(ids.begin(), ids.begin() + first, ids.end());
+			ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+			
+			std::lock_guard<std::mutex> lock(progressMutex);
+			if(!progress(++progressCount, progressTotal)) {
+				throw CancelledException("User cancelled.");
+			}
+		});
+		
+		std::vector<uint64_t> referenced;
+		for(std::vector<uint64_t>& ids : marked) {
+			size_t first = referenced.size();
+			referenced.insert(referenced.end(), ids.begin(), ids.end());
+			std::inplace_merge(referenced.begin(), referenced.begin() + first, referenced.end());
+			referenced.erase(std::unique(referenced.begin(), referenced.end()), referenced.end());
+			std::vector<uint64_t>().swap(ids);
 		}
+		stats.referencedObjects = referenced.size();
 		
-		if(!HMAC_Final(&ctx, outHMAC, nullptr)) {
-			throw EncryptionFailedException("HMAC_Final failed.");
+		// the swept shards of an interrupted compaction are skipped if the
+		// snapshots haven't changed since. The state is the HMAC of the
+		// snapshot names followed by a flag for each shard.
+		std::string joinedNames;
+		for(const std::string& name : names) {
+			joinedNames += name + '\n';
 		}
-	}
-	
-	void Repository::compressEncryptAndUploadBlock(CompressionType compressType, const Snapshot::ObjectID& objectId, const uint8_t *block, size_t size, ProgressFunction progress)
-	{
-		// if the block already exists in the repository, skip the upload
-		std::string uploadPath = "/data/" + objectIdToString(objectId);
-		if(mDataStore->exist(uploadPath.c_str())) {
-			if(!progress(size, size)) {
+		std::vector<uint8_t> state(SHA256_DIGEST_LENGTH + OBJECT_SHARDS, 0);
+		HMAC(EVP_sha256(), mMacKey, SHA256_DIGEST_LENGTH, (const uint8_t *)joinedNames.data(), joinedNames.size(), state.data(), nullptr);
+		try {
+			if(mDataStore->exist("/compact")) {
+				TempFileStream tmpStream;
+				getObject("/compact", tmpStream, DefaultProgressFunction);
+				
+				TempFileStream stateStream;
+				StreamUtils::decompressDecryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream(), stateStream);
+				auto stateInStream = stateStream.inputStream();
+				std::vector<uint8_t> savedState(state.size());
+				if(stateInStream->size() == savedState.size()) {
+					stateInStream->readExpected(savedState.data(), savedState.size());
+					if(memcmp(savedState.data(), state.data(), SHA256_DIGEST_LENGTH) == 0) {
+						state = savedState;
+					}
+				}
+			}
+		} catch(const std::exception&) {
+			// a damaged state starts over
+		}
+		uint8_t *swept = state.data() + SHA256_DIGEST_LENGTH;
+		
+		auto saveState = [this, &state]() {
+			MemoryInputStream stateStream(state.data(), state.size());
+			auto encryptedStream = StreamUtils::compressEncryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mEncKey, mMacKey, stateStream);
+			mDataStore->put("/compact", *encryptedStream);
+		};
+		
+		int sinceCheckpoint = 0;
+		parallelFor(OBJECT_SHARDS, numThreads, [&](size_t shard, int) {
+			renew();
+			if(swept[shard]) {
+				std::lock_guard<std::mutex> lock(progressMutex);
+				if(!progress(++progressCount, progressTotal)) {
+					throw CancelledException("User cancelled.");
+				}
+				return;
+			}
+			
+			// the shard is the first 10 bits of the id
+			uint8_t shardBits[2] = { (uint8_t)(shard >> 2), (uint8_t)((shard & 3) << 6) };
+			char shardString[5];
+			base32encode(shardBits, sizeof(shardBits), shardString, sizeof(shardString));
+			std::string shardName(shardString, 2);
+			
+			// shards without objects may not exist. Failing to list one
+			// stops the sweep, which resumes from the last checkpoint.
+			std::vector<std::string> objects;
+			std::string shardPath = "/data/" + shardName;
+			if(mDataStore->exist(shardPath.c_str())) {
+				mDataStore->list(shardPath.c_str(), [&objects](const char *name, void *) {
+					if(name) {
+						objects.push_back(name);
+					}
+				});
+			}
+			
+			uint64_t unreferencedObjects = 0;
+			uint64_t unreferencedBytes = 0;
+			uint64_t deletedObjects = 0;
+			for(const std::string& object : objects) {
+				std::string encodedId = shardName + object;
+				Snapshot::ObjectID objectId;
+				try {
+					if(encodedId.size() != 52 || base32decode(encodedId.c_str(), encodedId.size(), objectId.id, sizeof(objectId.id)) != sizeof(objectId.id)) {
+						continue;
+					}
+				} catch(const std::exception&) {
+					continue;
+				}
+				if(std::binary_search(referenced.begin(), referenced.end(), LittleEndian::load64(objectId.id))) {
+					continue;
+				}
+				
+				std::string path = "/data/" + shardName + "/" + object;
+				int64_t size = mDataStore->size(path.c_str());
+				++unreferencedObjects;
+				unreferencedBytes += std::max<int64_t>(size, 0);
+				if(!dryRun && mDataStore->unlink(path.c_str())) {
+					++deletedObjects;
+				}
+			}
+			
+			std::lock_guard<std::mutex> lock(progressMutex);
+			stats.scannedObjects += objects.size();
+			stats.unreferencedObjects += unreferencedObjects;
+			stats.unreferencedBytes += unreferencedBytes;
+			stats.deletedObjects += deletedObjects;
+			swept[shard] = 1;
+			bool cancelled = !progress(++progressCount, progressTotal);
+			if(!dryRun && (++sinceCheckpoint == SHARDS_PER_CHECKPOINT || cancelled)) {
+				saveState();
+				sinceCheckpoint = 0;
+			}
+			if(cancelled) {
 				throw CancelledException("User cancelled.");
 			}
-			return;
+		});
+		
+		if(!dryRun && mDataStore->exist("/compact")) {
+			mDataStore->unlink("/compact");
 		}
 		
-		MemoryInputStream blockStream(block, size);
-		auto encryptedStream = StreamUtils::compressEncryptHMAC(compressType, EVP_aes_256_cbc(), mEncKey, mMacKey, blockStream);
+		// the index objects are consolidated into one, keeping the entries
+		// of the objects which are still referenced, or held by a pack
+		// which is, and which weren't removed since
+		if(!dryRun) {
+			std::vector<std::string> indexNames = listIndexObjects();
+			std::vector<std::vector<ObjectIndex::Entry>> indexEntries(numThreads);
+			std::vector<std::vector<Snapshot::ObjectID>> indexRemovals(numThreads);
+			parallelFor(indexNames.size(), numThreads, [&](size_t i, int thread) {
+				std::vector<ObjectIndex::Entry>& entries = indexEntries[thread];
+				size_t first = entries.size();
+				getIndexObject(indexNames[i], entries, indexRemovals[thread]);
+				entries.erase(std::remove_if(entries.begin() + first, entries.end(), [&referenced](const ObjectIndex::Entry& entry) {
+					return !std::binary_search(referenced.begin(), referenced.end(), LittleEndian::load64(entry.container.id));
+				}), entries.end());
+			});
+			
+			std::set<std::string> removed;
+			for(const std::vector<Snapshot::ObjectID>& containers : indexRemovals) {
+				for(const Snapshot::ObjectID& container : containers) {
+					removed.insert(std::string((const char *)container.id, sizeof(container.id)));
+				}
+			}
+			std::map<std::string, ObjectIndex::Entry> consolidated;
+			for(std::vector<ObjectIndex::Entry>& entries : indexEntries) {
+				for(const ObjectIndex::Entry& entry : entries) {
+					if(removed.count(std::string((const char *)entry.container.id, sizeof(entry.container.id)))) {
+						continue;
+					}
+					auto inserted = consolidated.insert(std::make_pair(std::string((const char *)entry.id.id, sizeof(entry.id.id)), entry));
+					if(!inserted.second && memcmp(entry.id.id, entry.container.id, sizeof(entry.id.id)) == 0) {
+						inserted.first->second = entry;
+					}
+				}
+				std::vector<ObjectIndex::Entry>().swap(entries);
+			}
+			
+			std::string name;
+			if(!consolidated.empty()) {
+				std::vector<ObjectIndex::Entry> entries;
+				entries.reserve(consolidated.size());
+				for(const auto& entry : consolidated) {
+					entries.push_back(entry.second);
+				}
+				name = putIndexObject(entries, std::vector<Snapshot::ObjectID>());
+			}
+			for(const std::string& indexName : indexNames) {
+				if(indexName != name) {
+					mDataStore->unlink(("/index/" + indexName).c_str());
+				}
+			}
+			
+			if(mObjectIndex) {
+				updateObjectIndex(*mObjectIndex, DefaultProgressFunction);
+			}
+		}
 		
-		mDataStore->put(uploadPath.c_str(), *encryptedStream, progress);
+		return stats;
 	}
 	
-	std::shared_ptr<Repository::PackUploadState> Repository::createPackState()
-	{
-		return std::make_shared<PackUploadState>();
-	}
+	enum { REPACK_SIZE = 8 * 1024 * 1024 };
 	
-	void Repository::uploadFile(std::shared_ptr<Snapshot> snapshot, const char *destPath, FileStream& fileStream, FileTransferProgressFunction progress)
-	{
-		uploadFile(nullptr, snapshot, destPath, fileStream);
-	}
-
-	void Repository::uploadFile(std::shared_ptr<PackUploadState> packUploadState, std::shared_ptr<Snapshot> snapshot, const char *destPath, FileStream& fileStream, FileTransferProgressFunction progress)
+	Repository::RepackStats Repository::repackRepository(double liveness, uint64_t maxBytes, int maxSeconds, ProgressFunction progress)
 	{
-		using namespace boost;
+		RepackStats stats;
+		memset(&stats, 0, sizeof(stats));
+		time_t startTime = time(nullptr);
 		
-		CompressionType compressionType = CompressionType::LZMA2;
-
-		RollingHash rh(mRollKey, 8192);
-		uint8_t fileMD5[MD5_DIGEST_LENGTH];
-	
-		FileInfo fileInfo( fileStream.path().c_str() );
-		if(!fileInfo.exists()) {
-			throw FileNotFoundException("File not found.");
-		}
-
-		std::vector<Snapshot::ObjectID> objectIds;
-		objectIds.reserve(32);
+		// the new packs are unreferenced until the snapshots are rewritten
+		takeSharedLease();
 		
-		EVP_MD_CTX md5;
-		EVP_MD_CTX_init(&md5);
-		std::unique_ptr<EVP_MD_CTX, decltype(EVP_MD_CTX_cleanup) *>
-			cleanup(&md5, EVP_MD_CTX_cleanup);
+		std::vector<std::string> names;
+		listSnapshots([&names](const char *name) {
+			if(name) {
+				names.push_back(name);
+			}
+		});
+		std::sort(names.begin(), names.end());
+		int numThreads = mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
 		
-		if(!EVP_DigestInit(&md5, EVP_md5())) {
-			throw EncryptionFailedException("EVP_DigestInit failed.");
+		// the referenced members of each pack by offset, with the path of a
+		// file stored in it, and the snapshots referencing the pack
+		struct Member
+		{
+			uint32_t packLength;
+			std::string path;
+		};
+		struct Pack
+		{
+			std::map<uint32_t, Member> members;
+			std::set<size_t> snapshots;
+			int64_t size;
+			uint64_t liveBytes;
+		};
+		std::map<std::string, Pack> packs;
+		std::mutex packsMutex;
+		parallelFor(names.size(), numThreads, [&](size_t i, int) {
+			std::shared_ptr<Snapshot> snapshot = loadSnapshot(names[i].c_str());
+			std::map<std::string, std::map<uint32_t, Member>> found;
+			snapshot->forEachFileEntry([&snapshot, &found](const Snapshot::FileEntry& fe) {
+				if(fe.packLength == 0 || fe.objectCount != 1) {
+					return;
+				}
+				const Snapshot::ObjectID *packId = snapshot->indexToObjectID(fe.objectIdIndex);
+				std::map<uint32_t, Member>& members = found[std::string((const char *)packId->id, sizeof(packId->id))];
+				if(!members.count(fe.offset)) {
+					Member& member = members[fe.offset];
+					member.packLength = fe.packLength;
+					member.path = snapshot->indexToString(fe.pathIndex);
+					member.path += member.path.empty() ? "" : "/";
+					member.path += snapshot->indexToString(fe.nameIndex);
+				}
+			});
+			
+			std::lock_guard<std::mutex> lock(packsMutex);
+			for(auto& packMembers : found) {
+				Pack& pack = packs[packMembers.first];
+				pack.members.insert(packMembers.second.begin(), packMembers.second.end());
+				pack.snapshots.insert(i);
+			}
+		});
+		stats.packs = packs.size();
+		
+		std::vector<std::pair<const std::string, Pack> *> packList;
+		for(auto& pack : packs) {
+			packList.push_back(&pack);
 		}
+		parallelFor(packList.size(), numThreads, [this, &packList](size_t i, int) {
+			Snapshot::ObjectID packId;
+			memcpy(packId.id, packList[i]->first.data(), sizeof(packId.id));
+			Pack& pack = packList[i]->second;
+			pack.size = mDataStore->size(("/data/" + objectIdToString(packId)).c_str());
+			pack.liveBytes = 0;
+			for(const auto& member : pack.members) {
+				pack.liveBytes += member.second.packLength;
+			}
+		});
 		
-		size_t fileLength = fileInfo.length();
-		int rollingHashBits = 0;
+		std::vector<std::pair<const std::string, Pack> *> candidates;
+		for(auto *pack : packList) {
+			if(pack->second.size > 0 && pack->second.liveBytes < liveness * pack->second.size) {
+				candidates.push_back(pack);
+			}
+		}
+		std::sort(candidates.begin(), candidates.end(), [](const std::pair<const std::string, Pack> *a, const std::pair<const std::string, Pack> *b) {
+			return (double)a->second.liveBytes / a->second.size < (double)b->second.liveBytes / b->second.size;
+		});
 		
-		std::string ext = fileInfo.extension();
-		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-
-		// default extension exclusion list from compression
-		// helps speed up things since these types generally don't compress well
-		static std::set<std::string> noCompressExt = {
-			".png", ".jpg", ".jpeg", ".gif",
-			".mov",	".mkv",	".avi",	".mp2",	".mp3",	".mp4",
-			".mpg",	".m4a",	".m4v",	".3gp",	".3gpp", ".3g2", ".3gpp2",
-			".wma",	".wmv",
-			".ogg",	".aac",
-			".zip",	".gz", ".bz2", ".xz", ".lz", ".lzo", ".lzma",
-			".z", ".7z", ".s7z", ".rar",
-			".apk", ".ipa", ".jar"
+		// download the packs within the budget
+		std::vector<std::pair<const std::string, Pack> *> repacked;
+		std::vector<std::unique_ptr<TempFileStream>> packStreams;
+		for(auto *pack : candidates) {
+			if(maxSeconds > 0 && time(nullptr) - startTime >= maxSeconds) {
+				break;
+			}
+			if(maxBytes > 0 && stats.downloadedBytes + pack->second.size > maxBytes) {
+				continue;
+			}
+			
+			Snapshot::ObjectID packId;
+			memcpy(packId.id, pack->first.data(), sizeof(packId.id));
+			std::unique_ptr<TempFileStream> packStream(new TempFileStream());
+			getObject("/data/" + objectIdToString(packId), *packStream, DefaultProgressFunction);
+			
+			repacked.push_back(pack);
+			packStreams.push_back(std::move(packStream));
+			stats.downloadedBytes += pack->second.size;
+			stats.reclaimableBytes += pack->second.size - pack->second.liveBytes;
+			progress(repacked.size(), candidates.size());
+		}
+		stats.repackedPacks = repacked.size();
+		
+		// the members are encrypted on their own, so they are copied into
+		// the new packs as they are. Ordering them by path keeps the files
+		// of a directory together.
+		struct Move
+		{
+			size_t pack;
+			uint32_t offset;
+			const Member *member;
 		};
+		std::vector<Move> moves;
+		for(size_t i = 0; i < repacked.size(); ++i) {
+			for(const auto& member : repacked[i]->second.members) {
+				Move move = { i, member.first, &member.second };
+				moves.push_back(move);
+			}
+		}
+		std::stable_sort(moves.begin(), moves.end(), [](const Move& a, const Move& b) {
+			return Snapshot::comparePaths(a.member->path.c_str(), b.member->path.c_str()) < 0;
+		});
 		
-		if(noCompressExt.find(ext) != noCompressExt.end()) {
-			compressionType = CompressionType::NoCompression;
+		// the ids of the moved members, so they are indexed in the new packs
+		std::map<std::pair<std::string, uint32_t>, Snapshot::ObjectID> memberIds;
+		if(!repacked.empty()) {
+			std::set<std::string> repackedIds;
+			for(auto *pack : repacked) {
+				repackedIds.insert(pack->first);
+			}
+			auto addMember = [&repackedIds, &memberIds](const ObjectIndex::Entry& entry) {
+				std::string container((const char *)entry.container.id, sizeof(entry.container.id));
+				if(entry.length > 0 && repackedIds.count(container)) {
+					memberIds[std::make_pair(container, entry.offset)] = entry.id;
+				}
+			};
+			if(mObjectIndex) {
+				mObjectIndex->forEach(addMember);
+			} else {
+				for(const std::string& name : listIndexObjects()) {
+					std::vector<ObjectIndex::Entry> entries;
+					std::vector<Snapshot::ObjectID> removed;
+					getIndexObject(name, entries, removed);
+					std::for_each(entries.begin(), entries.end(), addMember);
+				}
+			}
 		}
-
-		// normalize destPath
-		filesystem::path normalizedPath = filesystem::path(destPath).relative_path().lexically_normal();
-
-		// don't bother with splitting the file if it's < 1MB
-		// just upload as is
-		if(fileLength < mOptions.smallFileSize) {
-			
-			std::unique_ptr<uint8_t, decltype(free) *> buffer( (uint8_t *)malloc(fileLength), free );
-
-			fileStream.readExpected(buffer.get(), fileLength);
+		
+		// the new pack and offset of each moved member
+		std::map<std::pair<std::string, uint32_t>, std::pair<Snapshot::ObjectID, uint32_t>> relocations;
+		std::vector<uint8_t> buffer;
+		for(size_t first = 0, last; first < moves.size(); first = last) {
+			uint64_t packSize = 0;
+			for(last = first; last < moves.size() && (last == first || packSize + moves[last].member->packLength <= REPACK_SIZE); ++last) {
+				packSize += moves[last].member->packLength;
+			}
 			
-			if(!EVP_DigestUpdate(&md5, buffer.get(), fileLength)) {
-				throw EncryptionFailedException("EVP_DigestUpdate failed.");
+			HMAC_CTX hmac;
+			HMAC_CTX_init(&hmac);
+			std::unique_ptr<HMAC_CTX, decltype(HMAC_CTX_cleanup) *> cleanup(&hmac, HMAC_CTX_cleanup);
+			if(!HMAC_Init(&hmac, mHashKey, SHA256_DIGEST_LENGTH, EVP_sha256())) {
+				throw EncryptionFailedException("HMAC_Init failed.");
 			}
 			
-			Snapshot::ObjectID objectId;
-			computeBlockHMAC(buffer.get(), fileLength, (uint8_t)compressionType, objectId.id);
+			TempFileStream packStream;
+			std::vector<uint32_t> offsets;
+			uint32_t offset = 0;
+			for(size_t i = first; i < last; ++i) {
+				const Move& move = moves[i];
+				buffer.resize(move.member->packLength);
+				auto inStream = packStreams[move.pack]->inputStream();
+				if(inStream->skip(move.offset) != move.offset) {
+					throw InvalidDataException("Pack member is out of range.");
+				}
+				inStream->readExpected(buffer.data(), buffer.size());
+				if(!HMAC_Update(&hmac, buffer.data(), buffer.size())) {
+					throw EncryptionFailedException("HMAC_Update failed.");
+				}
+				packStream.write(buffer.data(), buffer.size());
+				offsets.push_back(offset);
+				offset += buffer.size();
+			}
 			
+			Snapshot::ObjectID packId;
+			if(!HMAC_Final(&hmac, packId.id, nullptr)) {
+				throw EncryptionFailedException("HMAC_Final failed.");
+			}
+			std::string packPath = "/data/" + objectIdToString(packId);
+			if(!mDataStore->exist(packPath.c_str())) {
+				mDataStore->put(packPath.c_str(), *packStream.inputStream());
+				stats.uploadedBytes += offset;
+			}
+			++stats.newPacks;
+			renewLease();
+			addIndexEntry(packId, packId, 0, 0);
 			
-			if(packUploadState) {
-				bool writePack = false;
-
-				if(!packUploadState->rollingHash) {
-					packUploadState->rollingHash.reset(new RollingHash(mRollKey, 8192));
-					if(!HMAC_Init(&packUploadState->hmac, mHashKey, SHA256_DIGEST_LENGTH, EVP_sha256())) {
-						throw EncryptionFailedException("HMAC_Init failed.");
-					}
+			for(size_t i = first; i < last; ++i) {
+				auto member = std::make_pair(repacked[moves[i].pack]->first, moves[i].offset);
+				relocations[member] = std::make_pair(packId, offsets[i - first]);
+				auto memberId = memberIds.find(member);
+				if(memberId != memberIds.end()) {
+					addIndexEntry(memberId->second, packId, offsets[i - first], moves[i].member->packLength);
 				}
-
+			}
+		}
+		
+		// the new packs may have been removed if the lease was lost
+		renewLease(true);
+		
+		std::set<size_t> affected;
+		for(auto *pack : repacked) {
+			affected.insert(pack->second.snapshots.begin(), pack->second.snapshots.end());
+		}
+		std::vector<size_t> rewrites(affected.begin(), affected.end());
+		parallelFor(rewrites.size(), numThreads, [&](size_t i, int) {
+			const char *name = names[rewrites[i]].c_str();
+			std::shared_ptr<Snapshot> snapshot = fetchSnapshot(name, nullptr, true, DefaultProgressFunction);
+			std::shared_ptr<Snapshot> rewritten(createSnapshot(snapshot));
+			snapshot->forEachFileEntry([&](const Snapshot::FileEntry& fe) {
+				std::string path = snapshot->indexToString(fe.pathIndex);
+				path += path.empty() ? "" : "/";
+				path += snapshot->indexToString(fe.nameIndex);
+				
+				const Snapshot::ObjectID *objectIds = fe.objectCount > 0 ? snapshot->indexToObjectID(fe.objectIdIndex) : nullptr;
+				const uint32_t *objectSizes = fe.objectCount > 0 ? snapshot->indexToObjectSize(fe.objectIdIndex) : nullptr;
+				uint32_t offset = fe.offset;
+				if(fe.packLength > 0 && fe.objectCount == 1) {
+					auto it = relocations.find(std::make_pair(std::string((const char *)objectIds->id, sizeof(objectIds->id)), fe.offset));
+					if(it != relocations.end()) {
+						objectIds = &it->second.first;
+						offset = it->second.second;
+					}
+				}
+				
+				rewritten->addFileEntry(path.c_str(),
+										snapshot->indexToString(fe.userIndex),
+										snapshot->indexToString(fe.groupIndex),
+										(FileType)fe.type,
+										fe.mode,
+										(CompressionType)fe.compression,
+										fe.size,
+										fe.mtime,
+										fe.rollingHashBits,
+										fe.md5,
+										offset,
+										fe.packLength,
+										fe.objectCount,
+										objectIds,
+										objectSizes);
+			});
+			
+			SnapshotSummary summary;
+			bool hasSummary = loadSnapshotSummary(name, summary);
+			uint8_t digest[SHA256_DIGEST_LENGTH];
+			putSnapshot(rewritten, name, !snapshot->treeObjects().empty(), hasSummary ? &summary : nullptr, digest, DefaultProgressFunction);
+		});
+		stats.rewrittenSnapshots = rewrites.size();
+		flushIndexEntries();
+		
+		return stats;
+	}
+	
+	// a referenced object, or a member of a pack when length isn't 0
+	struct VerifyRange
+	{
+		Snapshot::ObjectID id;
+		uint32_t offset;
+		uint32_t length;
+		
+		bool operator<(const VerifyRange& other) const
+		{
+			int cmp = memcmp(id.id, other.id.id, sizeof(id.id));
+			return cmp != 0 ? cmp < 0 : (offset != other.offset ? offset < other.offset : length < other.length);
+		}
+		
+		bool operator==(const VerifyRange& other) const
+		{
+			return memcmp(id.id, other.id.id, sizeof(id.id)) == 0 && offset == other.offset && length == other.length;
+		}
+	};
+	
+	// a file to decode, copied out of its snapshot
+	struct VerifyFile
+	{
+		std::string name;
+		Snapshot::FileEntry entry;
+		std::vector<Snapshot::ObjectID> objectIds;
+		std::vector<uint32_t> objectSizes;
+		size_t shard; // of its first object
+	};
+	
+	static size_t objectShard(const Snapshot::ObjectID& objectId)
+	{
+		return ((size_t)objectId.id[0] << 2) | (objectId.id[1] >> 6);
+	}
+	
+	Repository::VerifyStats Repository::verifyRepository(double samplePercent, const std::function<void (const char *what, const char *error)>& problem, ProgressFunction progress)
+	{
+		VerifyStats stats;
+		memset(&stats, 0, sizeof(stats));
+		
+		std::vector<std::string> names;
+		listSnapshots([&names](const char *name) {
+			if(name) {
+				names.push_back(name);
+			}
+		});
+		std::sort(names.begin(), names.end());
+		stats.snapshots = names.size();
+		long progressTotal = names.size() + OBJECT_SHARDS;
+		
+		int numThreads = mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
+		
+		// files are sampled by their MD5, so copies of a file in several
+		// snapshots are sampled together and decoded once
+		uint64_t sampleSeed;
+		arc4random_buf(&sampleSeed, sizeof(sampleSeed));
+		uint64_t sampleThreshold = (uint64_t)(std::max(0.0, std::min(samplePercent, 100.0)) * 100);
+		
+		std::mutex problemMutex;
+		std::vector<std::pair<std::string, std::string>> problems;
+		auto reportProblem = [&](const std::string& what, const std::string& error) {
+			std::lock_guard<std::mutex> lock(problemMutex);
+			problems.push_back(std::make_pair(what, error));
+			if(problem) {
+				problem(what.c_str(), error.c_str());
+			}
+		};
+		
+		std::vector<std::vector<VerifyRange>> marked(numThreads);
+		std::vector<std::vector<VerifyFile>> sampled(numThreads);
+		std::mutex progressMutex;
+		long progressCount = 0;
+		parallelFor(names.size(), numThreads, [&](size_t i, int thread) {
+			std::shared_ptr<Snapshot> snapshot;
+			try {
+				snapshot = fetchSnapshot(names[i].c_str(), nullptr, true, DefaultProgressFunction);
+			} catch(const std::exception& e) {
+				reportProblem("/snapshot/" + names[i], e.what());
+				std::lock_guard<std::mutex> lock(progressMutex);
+				++stats.damagedSnapshots;
+				progress(++progressCount, progressTotal);
+				return;
+			}
+			
+			std::vector<VerifyRange>& ranges = marked[thread];
+			size_t first = ranges.size();
+			snapshot->forEachFileEntry([&](const Snapshot::FileEntry& fe) {
+				if(fe.objectCount == 0) {
+					return;
+				}
+				
+				const Snapshot::ObjectID *objectIds = snapshot->indexToObjectID(fe.objectIdIndex);
+				const uint32_t *objectSizes = snapshot->indexToObjectSize(fe.objectIdIndex);
+				const Snapshot::ObjectID *firstObject = nullptr;
+				for(int j = 0; j < fe.objectCount; ++j) {
+					if(!objectIds[j].isZeroExtent()) {
+						firstObject = firstObject ? firstObject : &objectIds[j];
+						ranges.push_back(VerifyRange{ objectIds[j], fe.packLength > 0 ? fe.offset : 0, fe.packLength });
+					}
+				}
+				
+				if(firstObject && (LittleEndian::load64(fe.md5) ^ sampleSeed) % 10000 < sampleThreshold) {
+					VerifyFile file;
+					file.name = snapshot->indexToString(fe.pathIndex);
+					file.name += file.name.empty() ? "" : "/";
+					file.name = names[i] + ":" + file.name + snapshot->indexToString(fe.nameIndex);
+					file.entry = fe;
+					file.objectIds.assign(objectIds, objectIds + fe.objectCount);
+					file.objectSizes.assign(objectSizes, objectSizes + fe.objectCount);
+					file.shard = objectShard(*firstObject);
+					sampled[thread].push_back(std::move(file));
+				}
+			});
+			for(const Snapshot::ObjectID& objectId : snapshot->treeObjects()) {
+				ranges.push_back(VerifyRange{ objectId, 0, 0 });
+			}
+			
+			std::sort(ranges.begin() + first, ranges.end());
+			ranges.erase(std::unique(ranges.begin() + first, ranges.end()), ranges.end());
+			std::inplace_merge(ranges.begin(), ranges.begin() + first, ranges.end());
+			ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+			
+			std::lock_guard<std::mutex> lock(progressMutex);
+			progress(++progressCount, progressTotal);
+		});
+		
+		std::vector<VerifyRange> referenced;
+		for(std::vector<VerifyRange>& ranges : marked) {
+			size_t first = referenced.size();
+			referenced.insert(referenced.end(), ranges.begin(), ranges.end());
+			std::inplace_merge(referenced.begin(), referenced.begin() + first, referenced.end());
+			referenced.erase(std::unique(referenced.begin(), referenced.end()), referenced.end());
+			std::vector<VerifyRange>().swap(ranges);
+		}
+		for(size_t i = 0; i < referenced.size(); ++i) {
+			if(i == 0 || memcmp(referenced[i].id.id, referenced[i - 1].id.id, sizeof(referenced[i].id.id)) != 0) {
+				++stats.objects;
+			}
+		}
+		
+		std::vector<VerifyFile> files;
+		for(std::vector<VerifyFile>& threadFiles : sampled) {
+			std::move(threadFiles.begin(), threadFiles.end(), std::back_inserter(files));
+			std::vector<VerifyFile>().swap(threadFiles);
+		}
+		std::sort(files.begin(), files.end(), [](const VerifyFile& a, const VerifyFile& b) {
+			int cmp = memcmp(a.entry.md5, b.entry.md5, sizeof(a.entry.md5));
+			return cmp != 0 ? cmp < 0 : a.entry.size < b.entry.size;
+		});
+		files.erase(std::unique(files.begin(), files.end(), [](const VerifyFile& a, const VerifyFile& b) {
+			return memcmp(a.entry.md5, b.entry.md5, sizeof(a.entry.md5)) == 0 && a.entry.size == b.entry.size;
+		}), files.end());
+		std::stable_sort(files.begin(), files.end(), [](const VerifyFile& a, const VerifyFile& b) {
+			return a.shard < b.shard;
+		});
+		
+		// like compaction, the checked shards of an interrupted check are
+		// skipped if the snapshots and the sample percentage haven't changed
+		// since. The state is the HMAC of the snapshot names and the sample
+		// percentage, a flag for each shard, the counts of problems found,
+		// and the problems as pairs of strings.
+		std::string joinedNames;
+		for(const std::string& name : names) {
+			joinedNames += name + '\n';
+		}
+		joinedNames += std::to_string(samplePercent);
+		const size_t countsOffset = SHA256_DIGEST_LENGTH + OBJECT_SHARDS;
+		const size_t problemsOffset = countsOffset + 4 * sizeof(uint64_t);
+		std::vector<uint8_t> state(problemsOffset, 0);
+		HMAC(EVP_sha256(), mMacKey, SHA256_DIGEST_LENGTH, (const uint8_t *)joinedNames.data(), joinedNames.size(), state.data(), nullptr);
+		try {
+			if(mDataStore->exist("/check")) {
+				TempFileStream tmpStream;
+				getObject("/check", tmpStream, DefaultProgressFunction);
+				
+				TempFileStream stateStream;
+				StreamUtils::decompressDecryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream(), stateStream);
+				auto stateInStream = stateStream.inputStream();
+				std::vector<uint8_t> savedState(std::max<long>(stateInStream->size(), 0));
+				stateInStream->readExpected(savedState.data(), savedState.size());
+				if(savedState.size() >= state.size() && memcmp(savedState.data(), state.data(), SHA256_DIGEST_LENGTH) == 0) {
+					std::vector<std::pair<std::string, std::string>> savedProblems;
+					const char *p = (const char *)savedState.data() + problemsOffset;
+					const char *end = (const char *)savedState.data() + savedState.size();
+					while(p < end) {
+						const char *error = (const char *)memchr(p, 0, end - p);
+						const char *next = error ? (const char *)memchr(error + 1, 0, end - error - 1) : nullptr;
+						if(!next) {
+							throw InvalidFormatException("Invalid check state.");
+						}
+						savedProblems.push_back(std::make_pair(std::string(p), std::string(error + 1)));
+						p = next + 1;
+					}
+					
+					memcpy(state.data(), savedState.data(), problemsOffset);
+					for(const auto& savedProblem : savedProblems) {
+						reportProblem(savedProblem.first, savedProblem.second);
+					}
+				}
+			}
+		} catch(const std::exception&) {
+			// a damaged state starts over
+		}
+		uint8_t *checked = state.data() + SHA256_DIGEST_LENGTH;
+		stats.missingObjects = LittleEndian::load64(&state[countsOffset]);
+		stats.damagedObjects = LittleEndian::load64(&state[countsOffset + 8]);
+		stats.sampledFiles = LittleEndian::load64(&state[countsOffset + 16]);
+		stats.damagedFiles = LittleEndian::load64(&state[countsOffset + 24]);
+		
+		auto saveState = [&]() {
+			LittleEndian::store64(&state[countsOffset], stats.missingObjects);
+			LittleEndian::store64(&state[countsOffset + 8], stats.damagedObjects);
+			LittleEndian::store64(&state[countsOffset + 16], stats.sampledFiles);
+			LittleEndian::store64(&state[countsOffset + 24], stats.damagedFiles);
+			
+			std::vector<uint8_t> savedState(state);
+			{
+				std::lock_guard<std::mutex> lock(problemMutex);
+				for(const auto& found : problems) {
+					savedState.insert(savedState.end(), found.first.c_str(), found.first.c_str() + found.first.size() + 1);
+					savedState.insert(savedState.end(), found.second.c_str(), found.second.c_str() + found.second.size() + 1);
+				}
+			}
+			
+			MemoryInputStream stateStream(savedState.data(), savedState.size());
+			auto encryptedStream = StreamUtils::compressEncryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mEncKey, mMacKey, stateStream);
+			mDataStore->put("/check", *encryptedStream);
+		};
+		
+		// a shard of the referenced objects is checked by one thread, along
+		// with the sampled files starting in it. The checked shards are
+		// recorded every SHARDS_PER_CHECKPOINT shards, as when compacting.
+		auto shardLess = [](const VerifyRange& range, size_t shard) {
+			return objectShard(range.id) < shard;
+		};
+		auto fileShardLess = [](const VerifyFile& file, size_t shard) {
+			return file.shard < shard;
+		};
+		int sinceCheckpoint = 0;
+		parallelFor(OBJECT_SHARDS, numThreads, [&](size_t shard, int) {
+			if(checked[shard]) {
+				std::lock_guard<std::mutex> lock(progressMutex);
+				progress(++progressCount, progressTotal);
+				return;
+			}
+			
+			uint64_t missingObjects = 0;
+			uint64_t damagedObjects = 0;
+			auto end = std::lower_bound(referenced.begin(), referenced.end(), shard + 1, shardLess);
+			for(auto it = std::lower_bound(referenced.begin(), end, shard, shardLess); it != end;) {
+				auto next = it;
+				while(next != end && memcmp(next->id.id, it->id.id, sizeof(it->id.id)) == 0) {
+					++next;
+				}
+				
+				std::string path = "/data/" + objectIdToString(it->id);
+				TempFileStream tmpStream;
+				try {
+					getObject(path, tmpStream, DefaultProgressFunction);
+				} catch(const std::exception& e) {
+					++missingObjects;
+					reportProblem(path, e.what());
+					it = next;
+					continue;
+				}
+				
+				// the members of a pack are checked separately
+				auto objectStream = tmpStream.inputStream();
+				for(; it != next; ++it) {
+					try {
+						objectStream->rewind();
+						if(it->length > 0) {
+							InputRangeStream rangeStream(*objectStream, it->offset, it->length);
+							StreamUtils::verifyHMAC(mMacKey, rangeStream);
+						} else {
+							StreamUtils::verifyHMAC(mMacKey, *objectStream);
+						}
+					} catch(const std::exception& e) {
+						++damagedObjects;
+						reportProblem(path, e.what());
+						it = next;
+						break;
+					}
+				}
+			}
+			
+			uint64_t sampledFiles = 0;
+			uint64_t damagedFiles = 0;
+			auto filesEnd = std::lower_bound(files.begin(), files.end(), shard + 1, fileShardLess);
+			for(auto file = std::lower_bound(files.begin(), filesEnd, shard, fileShardLess); file != filesEnd; ++file) {
+				try {
+					DigestOutputStream digestStream(EVP_md5());
+					digestStream.setExpectedDigest(file->entry.md5, MD5_DIGEST_LENGTH);
+					for(size_t j = 0; j < file->objectIds.size(); ++j) {
+						if(file->objectIds[j].isZeroExtent()) {
+							writeZeros(digestStream, file->objectSizes[j]);
+						} else {
+							downloadObject(file->entry, file->objectIds[j], digestStream, DefaultProgressFunction);
+						}
+					}
+					digestStream.close();
+				} catch(const std::exception& e) {
+					++damagedFiles;
+					reportProblem(file->name, e.what());
+				}
+				++sampledFiles;
+			}
+			
+			std::lock_guard<std::mutex> lock(progressMutex);
+			stats.missingObjects += missingObjects;
+			stats.damagedObjects += damagedObjects;
+			stats.sampledFiles += sampledFiles;
+			stats.damagedFiles += damagedFiles;
+			checked[shard] = 1;
+			bool cancelled = !progress(++progressCount, progressTotal);
+			if(++sinceCheckpoint == SHARDS_PER_CHECKPOINT || cancelled) {
+				saveState();
+				sinceCheckpoint = 0;
+			}
+			if(cancelled) {
+				throw CancelledException("User cancelled.");
+			}
+		});
+		
+		if(mDataStore->exist("/check")) {
+			mDataStore->unlink("/check");
+		}
+		
+		return stats;
+	}
+	
+	// an object of the source to copy: one stored on its own or, without
+	// shared keys, a member of a pack when range.length isn't 0
+	struct SyncObject
+	{
+		VerifyRange range;
+		CompressionType compression;
+		Snapshot::ObjectID syncedId; // its id in the destination
+		
+		bool operator<(const SyncObject& other) const
+		{
+			return range < other.range;
+		}
+	};
+	
+	Repository::SyncStats Repository::syncRepository(Repository& source, const std::vector<std::string>& names, ProgressFunction progress)
+	{
+		SyncStats stats;
+		memset(&stats, 0, sizeof(stats));
+		
+		std::set<std::string> existing;
+		try {
+			listSnapshots([&existing](const char *name) {
+				if(name) {
+					existing.insert(name);
+				}
+			});
+		} catch(const std::exception&) {
+			// a new repository may not have the directory
+		}
+		std::vector<std::string> syncNames = names;
+		if(syncNames.empty()) {
+			source.listSnapshots([&syncNames](const char *name) {
+				if(name) {
+					syncNames.push_back(name);
+				}
+			});
+		}
+		std::sort(syncNames.begin(), syncNames.end());
+		syncNames.erase(std::unique(syncNames.begin(), syncNames.end()), syncNames.end());
+		syncNames.erase(std::remove_if(syncNames.begin(), syncNames.end(), [&existing](const std::string& name) {
+			return existing.count(name) > 0;
+		}), syncNames.end());
+		if(syncNames.empty()) {
+			return stats;
+		}
+		
+		bool sharedKeys = sharesKeys(source);
+		int numThreads = mDataStore->supportsConcurrentAccess() && source.mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
+		std::mutex progressMutex;
+		long progressCount = 0;
+		long progressTotal = 2 * syncNames.size();
+		
+		// without shared keys the members of a pack are copied one by one,
+		// as each gets an id of its own
+		auto rangeOf = [sharedKeys](const Snapshot::ObjectID& objectId, const Snapshot::FileEntry& fe) {
+			VerifyRange range = { objectId, 0, 0 };
+			if(!sharedKeys && fe.packLength > 0) {
+				range.offset = fe.offset;
+				range.length = fe.packLength;
+			}
+			return range;
+		};
+		
+		// the snapshots to commit hold a shared lease on this repository,
+		// so compaction doesn't remove the objects copied for them
+		std::vector<std::shared_ptr<Snapshot>> snapshots;
+		for(size_t i = 0; i < syncNames.size(); ++i) {
+			snapshots.push_back(createSnapshot());
+		}
+		
+		std::vector<std::shared_ptr<Snapshot>> sourceSnapshots(syncNames.size());
+		std::vector<std::vector<SyncObject>> found(numThreads);
+		parallelFor(syncNames.size(), numThreads, [&](size_t i, int thread) {
+			sourceSnapshots[i] = source.loadSnapshot(syncNames[i].c_str());
+			Snapshot& snapshot = *sourceSnapshots[i];
+			std::vector<SyncObject>& objects = found[thread];
+			snapshot.forEachFileEntry([&](const Snapshot::FileEntry& fe) {
+				for(int j = 0; j < fe.objectCount; ++j) {
+					const Snapshot::ObjectID *objectId = snapshot.indexToObjectID(fe.objectIdIndex + j);
+					if(!objectId->isZeroExtent()) {
+						SyncObject object;
+						object.range = rangeOf(*objectId, fe);
+						object.compression = (CompressionType)fe.compression;
+						object.syncedId = *objectId;
+						objects.push_back(object);
+					}
+				}
+			});
+			
+			std::lock_guard<std::mutex> lock(progressMutex);
+			progress(++progressCount, progressTotal);
+		});
+		
+		std::vector<SyncObject> objects;
+		for(std::vector<SyncObject>& threadObjects : found) {
+			objects.insert(objects.end(), threadObjects.begin(), threadObjects.end());
+			std::vector<SyncObject>().swap(threadObjects);
+		}
+		std::sort(objects.begin(), objects.end());
+		objects.erase(std::unique(objects.begin(), objects.end(), [](const SyncObject& a, const SyncObject& b) {
+			return a.range == b.range;
+		}), objects.end());
+		stats.objects = objects.size();
+		
+		// objects are copied a container at a time, so a pack is downloaded
+		// once. Each container is the index of its first object.
+		std::vector<size_t> containers;
+		for(size_t i = 0; i < objects.size(); ++i) {
+			if(i == 0 || memcmp(objects[i].range.id.id, objects[i - 1].range.id.id, sizeof(objects[i].range.id.id)) != 0) {
+				containers.push_back(i);
+			}
+		}
+		size_t numContainers = containers.size();
+		containers.push_back(objects.size());
+		progressTotal += numContainers;
+		
+		// with shared keys the ids are the same in both repositories, so
+		// the containers this one has are found without downloading them
+		std::vector<uint8_t> present(numContainers, 0);
+		if(sharedKeys && mObjectIndex) {
+			for(size_t c = 0; c < numContainers; ++c) {
+				present[c] = isObjectIndexed(objects[containers[c]].range.id);
+			}
+		} else if(sharedKeys) {
+			std::vector<std::vector<size_t>> shards(OBJECT_SHARDS);
+			for(size_t c = 0; c < numContainers; ++c) {
+				shards[objectShard(objects[containers[c]].range.id)].push_back(c);
+			}
+			parallelFor(OBJECT_SHARDS, numThreads, [&](size_t shard, int) {
+				if(shards[shard].empty()) {
+					return;
+				}
+				
+				std::string shardName = objectIdToString(objects[containers[shards[shard][0]]].range.id).substr(0, 2);
+				std::set<std::string> stored;
+				try {
+					mDataStore->list(("/data/" + shardName).c_str(), [&stored](const char *name, void *) {
+						if(name) {
+							stored.insert(name);
+						}
+					});
+				} catch(const std::exception&) {
+					// shards without objects may not exist
+				}
+				for(size_t c : shards[shard]) {
+					present[c] = stored.count(objectIdToString(objects[containers[c]].range.id).substr(3)) > 0;
+				}
+			});
+		}
+		
+		std::atomic<uint64_t> copiedObjects(0);
+		std::atomic<uint64_t> copiedBytes(0);
+		std::mutex syncedMutex;
+		std::set<std::string> synced; // ids taken by a thread to upload
+		parallelFor(numContainers, numThreads, [&](size_t c, int) {
+			const Snapshot::ObjectID& containerId = objects[containers[c]].range.id;
+			if(!present[c]) {
+				std::string path = "/data/" + objectIdToString(containerId);
+				TempFileStream objectStream;
+				source.getObject(path, objectStream, DefaultProgressFunction);
+				copiedBytes += objectStream.inputStream()->size();
+				
+				if(sharedKeys) {
+					renewLease();
+					mDataStore->put(path.c_str(), *objectStream.inputStream());
+					addIndexEntry(containerId, containerId, 0, 0);
+					++copiedObjects;
+				} else {
+					// decrypted, and encrypted again under an id computed
+					// with this repository's key
+					for(size_t i = containers[c]; i < containers[c + 1]; ++i) {
+						SyncObject& object = objects[i];
+						Snapshot::FileEntry fe;
+						memset(&fe, 0, sizeof(fe));
+						fe.compression = (uint8_t)object.compression;
+						fe.offset = object.range.offset;
+						fe.packLength = object.range.length;
+						TempFileStream decodedStream;
+						source.decodeObject(fe, *objectStream.inputStream(), decodedStream);
+						
+						auto blockStream = decodedStream.inputStream();
+						std::vector<uint8_t> block(blockStream->size());
+						if(!block.empty()) {
+							blockStream->readExpected(&block[0], block.size());
+						}
+						computeBlockHMAC(block.data(), block.size(), fe.compression, object.syncedId.id);
+						
+						// the same contents in several packs are uploaded by
+						// the first thread to decrypt them
+						{
+							std::lock_guard<std::mutex> lock(syncedMutex);
+							if(!synced.insert(std::string((const char *)object.syncedId.id, sizeof(object.syncedId.id))).second) {
+								continue;
+							}
+						}
+						if(compressEncryptAndUploadBlock(object.compression, object.syncedId, block.data(), block.size(), DefaultProgressFunction)) {
+							++copiedObjects;
+						}
+					}
+				}
+			}
+			
+			std::lock_guard<std::mutex> lock(progressMutex);
+			progress(++progressCount, progressTotal);
+		});
+		stats.copiedObjects = copiedObjects;
+		stats.copiedBytes = copiedBytes;
+		
+		// the snapshots are committed once all of their objects are stored
+		for(size_t i = 0; i < syncNames.size(); ++i) {
+			Snapshot& sourceSnapshot = *sourceSnapshots[i];
+			if(sharedKeys) {
+				snapshots[i]->addFiles(sourceSnapshot);
+			} else {
+				sourceSnapshot.forEachFileEntry([&](const Snapshot::FileEntry& fe) {
+					std::string path = sourceSnapshot.indexToString(fe.pathIndex);
+					path += path.empty() ? "" : "/";
+					path += sourceSnapshot.indexToString(fe.nameIndex);
+					
+					std::vector<Snapshot::ObjectID> objectIds;
+					for(int j = 0; j < fe.objectCount; ++j) {
+						SyncObject object;
+						object.range = rangeOf(*sourceSnapshot.indexToObjectID(fe.objectIdIndex + j), fe);
+						auto it = std::lower_bound(objects.begin(), objects.end(), object);
+						objectIds.push_back(object.range.id.isZeroExtent() ? object.range.id : it->syncedId);
+					}
+					
+					// members of packs are now objects of their own
+					snapshots[i]->addFileEntry(path.c_str(),
+											   sourceSnapshot.indexToString(fe.userIndex),
+											   sourceSnapshot.indexToString(fe.groupIndex),
+											   (FileType)fe.type,
+											   fe.mode,
+											   (CompressionType)fe.compression,
+											   fe.size,
+											   fe.mtime,
+											   fe.rollingHashBits,
+											   fe.md5,
+											   0,
+											   0,
+											   fe.objectCount,
+											   fe.objectCount > 0 ? &objectIds[0] : nullptr,
+											   fe.objectCount > 0 ? sourceSnapshot.indexToObjectSize(fe.objectIdIndex) : nullptr);
+				});
+			}
+			sourceSnapshots[i].reset();
+			
+			// the copy keeps the creation time and hostname of the original
+			SnapshotSummary summary;
+			bool hasSummary = source.loadSnapshotSummary(syncNames[i].c_str(), summary);
+			commitSnapshot(snapshots[i], syncNames[i].c_str(), hasSummary ? summary.tree : mOptions.treeSnapshots, hasSummary ? &summary : nullptr, DefaultProgressFunction);
+			++stats.snapshots;
+			progress(++progressCount, progressTotal);
+		}
+		
+		return stats;
+	}
+	
+	bool Repository::deleteSnapshot(const char *name, uint64_t *freedObjects)
+	{
+		if(freedObjects) {
+			*freedObjects = 0;
+		}
+		std::string snapshotPath = std::string("/snapshot/") + name;
+		if(!mDataStore->exist(snapshotPath.c_str())) {
+			return false;
+		}
+		
+		// clients writing snapshots may reuse the objects of the snapshot
+		// as soon as they are counted, so the counts are only updated while
+		// no other client writes. Otherwise the snapshot is only removed, and
+		// its objects are left for compactRepository().
+		std::unique_ptr<Lease> lease;
+		bool exclusive = false;
+		if(mReferenceCounts) {
+			try {
+				lease = takeExclusiveLease();
+				exclusive = true;
+			} catch(const RepositoryException&) {
+			}
+		}
+		
+		// the objects of the snapshot are found before it is removed
+		ReferenceCounts::SnapshotRefs refs;
+		std::map<uint64_t, Snapshot::ObjectID> objects;
+		bool countsComplete = false;
+		if(exclusive) {
+			countsComplete = updateReferenceCounts(*mReferenceCounts, DefaultProgressFunction);
+			std::shared_ptr<Snapshot> snapshot = fetchSnapshot(name, nullptr, true, DefaultProgressFunction);
+			forEachReferencedObject(*snapshot, [&objects](const Snapshot::ObjectID& objectId) {
+				objects[LittleEndian::load64(objectId.id)] = objectId;
+			});
+			refs.name = name;
+			for(const auto& object : objects) {
+				refs.objects.push_back(object.first);
+			}
+		}
+		
+		// a snapshot left without its summary is still usable
+		std::string summaryPath = std::string("/summary/") + name;
+		if(mDataStore->exist(summaryPath.c_str())) {
+			mDataStore->unlink(summaryPath.c_str());
+		}
+		mDataStore->unlink(snapshotPath.c_str());
+		
+		if(mMetadataCache) {
+			try {
+				mMetadataCache->unlink(snapshotPath.c_str());
+			} catch(const std::exception&) {
+			}
+		}
+		
+		if(!exclusive) {
+			return true;
+		}
+		std::vector<uint64_t> freed;
+		mReferenceCounts->update(std::vector<ReferenceCounts::SnapshotRefs>(1, refs), std::vector<ReferenceCounts::SnapshotRefs>(), &freed);
+		
+		// snapshots without a summary may have been rewritten unnoticed, so
+		// their counts can't be relied on
+		if(!countsComplete || freed.empty()) {
+			return true;
+		}
+		
+		// interrupted backups aren't counted, but resume with their objects
+		std::vector<uint64_t> checkpointed = checkpointedObjects();
+		freed.erase(std::remove_if(freed.begin(), freed.end(), [&checkpointed](uint64_t object) {
+			return std::binary_search(checkpointed.begin(), checkpointed.end(), object);
+		}), freed.end());
+		if(freed.empty()) {
+			return true;
+		}
+		
+		// the freed objects are dropped from the object index before they
+		// are removed, so no client deduplicates against them
+		std::vector<Snapshot::ObjectID> freedIds;
+		for(uint64_t object : freed) {
+			freedIds.push_back(objects[object]);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mIndexMutex);
+			mPendingIndexRemovals.insert(mPendingIndexRemovals.end(), freedIds.begin(), freedIds.end());
+			for(auto it = mPendingIndexEntries.begin(); it != mPendingIndexEntries.end(); ) {
+				if(std::binary_search(freed.begin(), freed.end(), LittleEndian::load64(it->second.container.id))) {
+					it = mPendingIndexEntries.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+		flushIndexEntries();
+		
+		int numThreads = mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
+		std::atomic<uint64_t> unlinked(0);
+		parallelFor(freedIds.size(), numThreads, [&](size_t i, int) {
+			if(mDataStore->unlink(("/data/" + objectIdToString(freedIds[i])).c_str())) {
+				++unlinked;
+			}
+		});
+		if(freedObjects) {
+			*freedObjects = unlinked;
+		}
+		return true;
+	}
+	
+	bool Repository::changePassword(const char *oldPassword, const char *newPassword, uint8_t logRounds, ProgressFunction progress)
+	{
+		if(!unlockRepository(oldPassword)) return false;
+		writeRepositoryKey(newPassword, logRounds, progress);
+		return true;
+	}
+	
+	void Repository::listSnapshots(const std::function<void (const char *)>& callback, ProgressFunction progress)
+	{
+		mDataStore->list("/snapshot", [&callback](const char *snapshot, void *) { callback(snapshot); }, nullptr, progress);
+	}
+	
+	void Repository::listSnapshotSummaries(const std::function<void (const char *, const SnapshotSummary *)>& callback, ProgressFunction progress)
+	{
+		std::vector<std::string> names;
+		mDataStore->list("/snapshot", [&names](const char *name, void *) {
+			if(name) {
+				names.push_back(name);
+			}
+		}, nullptr, progress);
+		
+		// repositories only have a summary directory once a snapshot has
+		// been committed with a summary
+		std::set<std::string> summaryNames;
+		try {
+			mDataStore->list("/summary", [&summaryNames](const char *name, void *) {
+				if(name) {
+					summaryNames.insert(name);
+				}
+			});
+		} catch(const std::exception&) {
+			summaryNames.clear();
+		}
+		
+		std::vector<std::unique_ptr<SnapshotSummary>> summaries(names.size());
+		int numThreads = std::min<int>(mOptions.metadataThreads, summaryNames.size());
+		parallelFor(names.size(), numThreads, [&](size_t i, int) {
+			if(summaryNames.count(names[i])) {
+				std::unique_ptr<SnapshotSummary> summary(new SnapshotSummary());
+				getSnapshotSummary(names[i].c_str(), *summary, DefaultProgressFunction);
+				summaries[i] = std::move(summary);
+			}
+		});
+		
+		for(size_t i = 0; i < names.size(); ++i) {
+			callback(names[i].c_str(), summaries[i].get());
+		}
+	}
+	
+	bool Repository::loadSnapshotSummary(const char *name, SnapshotSummary& summary, ProgressFunction progress)
+	{
+		if(!mDataStore->exist((std::string("/summary/") + name).c_str())) {
+			return false;
+		}
+		
+		getSnapshotSummary(name, summary, progress);
+		return true;
+	}
+	
+	void Repository::updateCatalog(Catalog& catalog, ProgressFunction progress)
+	{
+		// order the snapshots by creation time so unchanged versions of a
+		// file form ranges
+		std::vector<std::pair<time_t, std::string>> snapshots;
+		listSnapshotSummaries([&snapshots](const char *name, const SnapshotSummary *summary) {
+			snapshots.push_back(std::make_pair(summary ? summary->creationTime : 0, std::string(name)));
+		}, progress);
+		std::sort(snapshots.begin(), snapshots.end());
+		
+		std::vector<std::string> cataloged = catalog.snapshots();
+		std::set<std::string> known(cataloged.begin(), cataloged.end());
+		std::set<std::string> removed = known;
+		for(const auto& snapshot : snapshots) {
+			removed.erase(snapshot.second);
+		}
+		
+		// snapshots are loaded a few at a time to bound memory use
+		const size_t batchSize = 8;
+		std::vector<std::pair<std::string, std::shared_ptr<Snapshot>>> added;
+		for(const auto& snapshot : snapshots) {
+			if(known.count(snapshot.second)) {
+				continue;
+			}
+			
+			added.push_back(std::make_pair(snapshot.second, loadSnapshot(snapshot.second.c_str(), progress)));
+			if(added.size() == batchSize) {
+				catalog.update(removed, added);
+				removed.clear();
+				added.clear();
+			}
+		}
+		
+		if(!added.empty() || !removed.empty()) {
+			catalog.update(removed, added);
+		}
+	}
+	
+	void Repository::getSnapshotSummary(const char *name, SnapshotSummary& summary, ProgressFunction progress)
+	{
+		TempFileStream tmpStream;
+		getObject(std::string("/summary/") + name, tmpStream, progress);
+		
+		TempFileStream summaryStream;
+		StreamUtils::decompressDecryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream(), summaryStream);
+		summary.load(*summaryStream.inputStream());
+	}
+	
+	void Repository::takeSharedLease()
+	{
+		if(mOptions.leaseSeconds > 0) {
+			std::lock_guard<std::mutex> lock(mLeaseMutex);
+			if(!mLease) {
+				mLease.reset(new Lease(*mDataStore, Lease::Type::Shared, mOptions.leaseSeconds));
+			}
+		}
+	}
+	
+	std::shared_ptr<Snapshot> Repository::createSnapshot(std::shared_ptr<Snapshot> parent)
+	{
+		takeSharedLease();
+		
+		std::shared_ptr<Snapshot> snapshot(std::make_shared<Snapshot>());
+		snapshot->setParent(parent);
+		return snapshot;
+	}
+	
+	std::shared_ptr<Snapshot> Repository::loadSnapshot(const char *name, ProgressFunction progress)
+	{
+		return loadSnapshot(name, nullptr, progress);
+	}
+	
+	std::shared_ptr<Snapshot> Repository::loadSnapshot(const char *name, const char *subpath, ProgressFunction progress)
+	{
+		return fetchSnapshot(name, subpath, false, progress);
+	}
+	
+	// cached snapshots are stored flat, so a tree snapshot is downloaded
+	// when @a needTreeObjects is set to learn its directory objects
+	std::shared_ptr<Snapshot> Repository::fetchSnapshot(const char *name, const char *subpath, bool needTreeObjects, ProgressFunction progress)
+	{
+		SnapshotSummary summary;
+		bool cacheable = mMetadataCache && loadSnapshotSummary(name, summary);
+		if(cacheable && !(needTreeObjects && summary.tree)) {
+			std::shared_ptr<Snapshot> snapshot(std::make_shared<Snapshot>());
+			if(loadCachedSnapshot(name, summary.snapshotDigest, *snapshot)) {
+				return snapshot;
+			}
+		}
+		
+		std::shared_ptr<Snapshot> snapshot(std::make_shared<Snapshot>());
+		
+		TempFileStream tmpSnapshotStream;
+		mDataStore->get((std::string("/snapshot/") + name).c_str(), tmpSnapshotStream, progress);
+		
+		TempFileStream snapshotStream;
+		DigestOutputStream digestStream(snapshotStream, EVP_sha256());
+		StreamUtils::decompressDecryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpSnapshotStream.inputStream(), digestStream);
+		digestStream.close();
+		snapshot->load(*snapshotStream.inputStream(), [this](const Snapshot::ObjectID& objectId, OutputStream& outStream) {
+			TempFileStream objectStream;
+			getObject("/data/" + objectIdToString(objectId), objectStream, DefaultProgressFunction);
+			StreamUtils::decompressDecryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *objectStream.inputStream(), outStream);
+		}, subpath);
+		
+		// only whole snapshots are cached, and only if the summary is for
+		// the snapshot that was downloaded
+		if(cacheable && !subpath && memcmp(digestStream.digest(), summary.snapshotDigest, SHA256_DIGEST_LENGTH) == 0) {
+			cacheSnapshot(name, summary.snapshotDigest, *snapshot);
+		}
+		
+		return snapshot;
+	}
+	
+	bool Repository::loadCachedSnapshot(const char *name, const uint8_t *digest, Snapshot& snapshot)
+	{
+		// a missing, stale or damaged entry is downloaded again
+		try {
+			std::string cachePath = std::string("/snapshot/") + name;
+			if(!mMetadataCache->exist(cachePath.c_str())) {
+				return false;
+			}
+			
+			TempFileStream tmpStream;
+			mMetadataCache->get(cachePath.c_str(), tmpStream);
+			
+			TempFileStream cachedStream;
+			StreamUtils::decompressDecryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mCacheEncKey, mCacheMacKey, *tmpStream.inputStream(), cachedStream);
+			
+			auto inStream = cachedStream.inputStream();
+			uint8_t cachedDigest[SHA256_DIGEST_LENGTH];
+			inStream->readExpected(cachedDigest, sizeof(cachedDigest));
+			if(memcmp(cachedDigest, digest, SHA256_DIGEST_LENGTH) != 0) {
+				return false;
+			}
+			
+			snapshot.load(*inStream);
+			return true;
+		} catch(const std::exception&) {
+			return false;
+		}
+	}
+	
+	void Repository::cacheSnapshot(const char *name, const uint8_t *digest, Snapshot& snapshot)
+	{
+		// the cache is only an optimization, failing to write it isn't an error
+		try {
+			TempFileStream tmpStream;
+			tmpStream.write(digest, SHA256_DIGEST_LENGTH);
+			snapshot.save(tmpStream);
+			
+			auto encryptedStream = StreamUtils::compressEncryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mCacheEncKey, mCacheMacKey, *tmpStream.inputStream());
+			mMetadataCache->put((std::string("/snapshot/") + name).c_str(), *encryptedStream);
+		} catch(const std::exception&) {
+		}
+	}
+	
+	void Repository::commitSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, ProgressFunction progress)
+	{
+		SnapshotSummary summary;
+		summary.creationTime = time(nullptr);
+#ifndef _WIN32
+		char hostname[256] = { 0 };
+		if(gethostname(hostname, sizeof(hostname) - 1) == 0) {
+			summary.hostname = hostname;
+		}
+#endif
+		commitSnapshot(snapshot, name, mOptions.treeSnapshots, &summary, progress);
+	}
+	
+	// commits a snapshot with the creation time and hostname of @a summary,
+	// or without a summary if it is nullptr
+	void Repository::commitSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, bool tree, const SnapshotSummary *summary, ProgressFunction progress)
+	{
+		// the objects the snapshot reuses may have been removed if the
+		// lease was lost
+		renewLease(true);
+		
+		uint8_t digest[SHA256_DIGEST_LENGTH];
+		putSnapshot(snapshot, name, tree, summary, digest, progress);
+		flushIndexEntries();
+		
+		// the checkpoints of the backup aren't needed once it is committed
+		for(const auto& checkpoint : listCheckpoints(name)) {
+			mDataStore->unlink(("/checkpoint/" + checkpoint.first + "." + std::to_string(checkpoint.second)).c_str());
+		}
+		mCheckpointSequences.erase(name);
+		
+		if(mReferenceCounts) {
+			// replacing a counted snapshot uncounts objects which aren't
+			// known, so the counts start over
+			std::vector<ReferenceCounts::SnapshotRefs> counted = mReferenceCounts->snapshots();
+			bool replaced = std::any_of(counted.begin(), counted.end(), [name](const ReferenceCounts::SnapshotRefs& refs) {
+				return refs.name == name;
+			});
+			if(replaced) {
+				mReferenceCounts->clear();
+			} else {
+				ReferenceCounts::SnapshotRefs refs;
+				refs.name = name;
+				memcpy(refs.digest, digest, sizeof(refs.digest));
+				refs.objects = referencedObjects(*snapshot);
+				mReferenceCounts->update(std::vector<ReferenceCounts::SnapshotRefs>(), std::vector<ReferenceCounts::SnapshotRefs>(1, refs));
+			}
+		}
+		
+		if(mFilesCache) {
+			mFilesCache->commit(snapshot, name, digest);
+		}
+	}
+	
+	// writes the snapshot and, if @a summary is given, its summary with the
+	// creation time and hostname taken from it. The digest of the snapshot
+	// is written to @a outDigest.
+	void Repository::putSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, bool tree, const SnapshotSummary *summary, uint8_t *outDigest, ProgressFunction progress)
+	{
+		TempFileStream tmpStream;
+		DigestOutputStream digestStream(tmpStream, EVP_sha256());
+		if(tree) {
+			// directories loaded with the snapshot or its parent are known
+			// to exist
+			std::set<std::string> existingObjects;
+			for(const Snapshot::ObjectID& objectId : snapshot->treeObjects()) {
+				existingObjects.insert(objectIdToString(objectId));
+			}
+			if(snapshot->parent()) {
+				for(const Snapshot::ObjectID& objectId : snapshot->parent()->treeObjects()) {
+					existingObjects.insert(objectIdToString(objectId));
+				}
+			}
+			
+			snapshot->saveTree(digestStream, [this, &existingObjects](const uint8_t *data, size_t size) {
+				Snapshot::ObjectID objectId;
+				computeBlockHMAC(data, size, (uint8_t)CompressionType::LZMA2, objectId.id);
+				if(existingObjects.insert(objectIdToString(objectId)).second) {
+					compressEncryptAndUploadBlock(CompressionType::LZMA2, objectId, data, size, DefaultProgressFunction);
+				}
+				return objectId;
+			});
+		} else {
+			snapshot->save(digestStream);
+		}
+		digestStream.close();
+		auto snapshotStream = StreamUtils::compressEncryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream());
+		mDataStore->put((std::string("/snapshot/") + name).c_str(), *snapshotStream, progress);
+		memcpy(outDigest, digestStream.digest(), SHA256_DIGEST_LENGTH);
+		
+		if(!summary) {
+			return;
+		}
+		
+		// the summary is written after the snapshot, listing treats a
+		// snapshot without one as committed by an older version
+		SnapshotSummary newSummary(*snapshot);
+		newSummary.creationTime = summary->creationTime;
+		newSummary.hostname = summary->hostname;
+		newSummary.tree = tree;
+		memcpy(newSummary.snapshotDigest, digestStream.digest(), SHA256_DIGEST_LENGTH);
+		TempFileStream summaryStream;
+		newSummary.save(summaryStream);
+		auto encryptedSummaryStream = StreamUtils::compressEncryptHMAC(CompressionType::NoCompression, EVP_aes_256_cbc(), mEncKey, mMacKey, *summaryStream.inputStream());
+		mDataStore->put((std::string("/summary/") + name).c_str(), *encryptedSummaryStream);
+	}
+	
+	void Repository::checkpointSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, ProgressFunction progress)
+	{
+		std::shared_ptr<Snapshot> files = snapshot->takeJournal();
+		uint32_t sequence = 0;
+		if(!files) {
+			// a resumed backup follows the checkpoints it resumed from
+			for(const auto& checkpoint : listCheckpoints(name)) {
+				sequence = std::max(sequence, checkpoint.second + 1);
+			}
+			snapshot->startJournal();
+			files = snapshot;
+		} else {
+			size_t fileCount = 0;
+			files->forEachFileEntry([&fileCount](const Snapshot::FileEntry&) {
+				++fileCount;
+			});
+			if(fileCount == 0) {
+				return;
+			}
+			sequence = mCheckpointSequences[name] + 1;
+		}
+		
+		// the objects of the files are indexed before they are referenced
+		flushIndexEntries();
+		
+		TempFileStream tmpStream;
+		files->save(tmpStream);
+		auto checkpointStream = StreamUtils::compressEncryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream());
+		mDataStore->put(("/checkpoint/" + std::string(name) + "." + std::to_string(sequence)).c_str(), *checkpointStream, progress);
+		mCheckpointSequences[name] = sequence;
+	}
+	
+	std::shared_ptr<Snapshot> Repository::loadCheckpoint(const char *name, ProgressFunction progress)
+	{
+		std::vector<std::pair<std::string, uint32_t>> checkpoints = listCheckpoints(name);
+		if(checkpoints.empty()) {
+			return nullptr;
+		}
+		
+		// a file in several checkpoints keeps the entry of the latest
+		std::sort(checkpoints.begin(), checkpoints.end(), [](const std::pair<std::string, uint32_t>& a, const std::pair<std::string, uint32_t>& b) {
+			return a.second > b.second;
+		});
+		std::shared_ptr<Snapshot> snapshot(std::make_shared<Snapshot>());
+		for(const auto& checkpoint : checkpoints) {
+			snapshot->addFiles(*fetchCheckpoint(checkpoint.first, checkpoint.second, progress));
+		}
+		return snapshot;
+	}
+	
+	// checkpoints are stored as /checkpoint/<name>.<sequence>. Lists those
+	// of @a name, or all of them if it is nullptr.
+	std::vector<std::pair<std::string, uint32_t>> Repository::listCheckpoints(const char *name)
+	{
+		std::vector<std::pair<std::string, uint32_t>> checkpoints;
+		try {
+			mDataStore->list("/checkpoint", [name, &checkpoints](const char *object, void *) {
+				const char *dot = object ? strrchr(object, '.') : nullptr;
+				if(!dot || !dot[1] || strspn(dot + 1, "0123456789") != strlen(dot + 1)) {
+					return;
+				}
+				std::string checkpointName(object, dot - object);
+				if(!name || checkpointName == name) {
+					checkpoints.push_back(std::make_pair(checkpointName, (uint32_t)strtoul(dot + 1, nullptr, 10)));
+				}
+			});
+		} catch(const std::exception&) {
+			// repositories without checkpoints may not have the directory
+		}
+		return checkpoints;
+	}
+	
+	std::shared_ptr<Snapshot> Repository::fetchCheckpoint(const std::string& name, uint32_t sequence, ProgressFunction progress)
+	{
+		TempFileStream tmpStream;
+		getObject("/checkpoint/" + name + "." + std::to_string(sequence), tmpStream, progress);
+		
+		TempFileStream checkpointStream;
+		StreamUtils::decompressDecryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream(), checkpointStream);
+		std::shared_ptr<Snapshot> snapshot(std::make_shared<Snapshot>());
+		snapshot->load(*checkpointStream.inputStream());
+		return snapshot;
+	}
+	
+	// the first 64 bits of the ids of the objects the checkpoints
+	// reference, sorted and unique
+	std::vector<uint64_t> Repository::checkpointedObjects()
+	{
+		std::vector<uint64_t> ids;
+		for(const auto& checkpoint : listCheckpoints(nullptr)) {
+			std::vector<uint64_t> checkpointIds = referencedObjects(*fetchCheckpoint(checkpoint.first, checkpoint.second, DefaultProgressFunction));
+			ids.insert(ids.end(), checkpointIds.begin(), checkpointIds.end());
+		}
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		return ids;
+	}
+	
+	void Repository::setFilesCache(std::shared_ptr<FilesCache> filesCache)
+	{
+		// the cached files may refer to objects which are gone if the
+		// snapshot they were committed in has since been deleted, or
+		// repacked and so rewritten with a new digest
+		if(filesCache) {
+			std::string snapshotName = filesCache->snapshotName();
+			SnapshotSummary summary;
+			uint8_t digest[SHA256_DIGEST_LENGTH];
+			filesCache->snapshotDigest(digest);
+			if(snapshotName.empty() || !mDataStore->exist(("/snapshot/" + snapshotName).c_str()) ||
+			   (loadSnapshotSummary(snapshotName.c_str(), summary) && memcmp(summary.snapshotDigest, digest, SHA256_DIGEST_LENGTH) != 0)) {
+				filesCache->clear();
+			}
+		}
+		
+		mFilesCache = filesCache;
+	}
+	
+	void Repository::setObjectIndex(std::shared_ptr<ObjectIndex> objectIndex, ProgressFunction progress)
+	{
+		if(objectIndex) {
+			updateObjectIndex(*objectIndex, progress);
+		}
+		mObjectIndex = objectIndex;
+	}
+	
+	void Repository::updateObjectIndex(ObjectIndex& objectIndex, ProgressFunction progress)
+	{
+		std::vector<std::string> names = listIndexObjects();
+		std::sort(names.begin(), names.end());
+		
+		// index objects are only removed when compaction consolidates them,
+		// dropping the objects it deleted, so the index starts over
+		std::vector<std::string> merged = objectIndex.indexNames();
+		for(const std::string& name : merged) {
+			if(!std::binary_search(names.begin(), names.end(), name)) {
+				objectIndex.clear();
+				merged.clear();
+				break;
+			}
+		}
+		std::sort(merged.begin(), merged.end());
+		
+		std::vector<std::string> missing;
+		std::set_difference(names.begin(), names.end(), merged.begin(), merged.end(), std::back_inserter(missing));
+		if(missing.empty()) {
+			return;
+		}
+		
+		int numThreads = mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
+		std::vector<std::vector<ObjectIndex::Entry>> entries(numThreads);
+		std::vector<std::vector<Snapshot::ObjectID>> removed(numThreads);
+		std::mutex progressMutex;
+		long progressCount = 0;
+		parallelFor(missing.size(), numThreads, [&](size_t i, int thread) {
+			getIndexObject(missing[i], entries[thread], removed[thread]);
+			std::lock_guard<std::mutex> lock(progressMutex);
+			progress(++progressCount, missing.size());
+		});
+		
+		std::vector<ObjectIndex::Entry> allEntries;
+		std::vector<Snapshot::ObjectID> allRemoved;
+		for(int i = 0; i < numThreads; ++i) {
+			allEntries.insert(allEntries.end(), entries[i].begin(), entries[i].end());
+			allRemoved.insert(allRemoved.end(), removed[i].begin(), removed[i].end());
+			std::vector<ObjectIndex::Entry>().swap(entries[i]);
+		}
+		objectIndex.merge(missing, std::move(allEntries), std::move(allRemoved));
+	}
+	
+	void Repository::setReferenceCounts(std::shared_ptr<ReferenceCounts> referenceCounts, ProgressFunction progress)
+	{
+		if(referenceCounts) {
+			updateReferenceCounts(*referenceCounts, progress);
+		}
+		mReferenceCounts = referenceCounts;
+	}
+	
+	// counts the snapshots committed since the counts were updated.
+	// Returns false if a snapshot has no summary, so whether it changed
+	// isn't known.
+	bool Repository::updateReferenceCounts(ReferenceCounts& referenceCounts, ProgressFunction progress)
+	{
+		std::map<std::string, std::vector<uint8_t>> digests;
+		bool complete = true;
+		try {
+			listSnapshotSummaries([&digests, &complete](const char *name, const SnapshotSummary *summary) {
+				std::vector<uint8_t>& digest = digests[name];
+				digest.assign(SHA256_DIGEST_LENGTH, 0);
+				if(summary) {
+					memcpy(digest.data(), summary->snapshotDigest, SHA256_DIGEST_LENGTH);
+				} else {
+					complete = false;
+				}
+			});
+		} catch(const std::exception&) {
+			// repositories without snapshots may not have the directory.
+			// With none listed nothing is counted, so nothing is freed.
+			digests.clear();
+		}
+		
+		// the objects of a snapshot deleted or rewritten elsewhere are no
+		// longer known, so the counts start over
+		std::set<std::string> counted;
+		for(const ReferenceCounts::SnapshotRefs& refs : referenceCounts.snapshots()) {
+			auto it = digests.find(refs.name);
+			if(it == digests.end() || memcmp(it->second.data(), refs.digest, SHA256_DIGEST_LENGTH) != 0) {
+				referenceCounts.clear();
+				counted.clear();
+				break;
+			}
+			counted.insert(refs.name);
+		}
+		
+		std::vector<ReferenceCounts::SnapshotRefs> added;
+		for(const auto& digest : digests) {
+			if(!counted.count(digest.first)) {
+				ReferenceCounts::SnapshotRefs refs;
+				refs.name = digest.first;
+				memcpy(refs.digest, digest.second.data(), sizeof(refs.digest));
+				added.push_back(refs);
+			}
+		}
+		
+		int numThreads = mDataStore->supportsConcurrentAccess() ? mOptions.metadataThreads : 1;
+		std::mutex progressMutex;
+		long progressCount = 0;
+		parallelFor(added.size(), numThreads, [&](size_t i, int) {
+			std::shared_ptr<Snapshot> snapshot = fetchSnapshot(added[i].name.c_str(), nullptr, true, DefaultProgressFunction);
+			added[i].objects = referencedObjects(*snapshot);
+			std::lock_guard<std::mutex> lock(progressMutex);
+			progress(++progressCount, added.size());
+		});
+		if(!added.empty()) {
+			referenceCounts.update(std::vector<ReferenceCounts::SnapshotRefs>(), added);
+		}
+		return complete;
+	}
+	
+	void Repository::renewLease(bool force)
+	{
+		std::lock_guard<std::mutex> lock(mLeaseMutex);
+		if(mLease) {
+			mLease->renew(force);
+		}
+	}
+	
+	// an exclusive lease for removing objects, which the shared lease of
+	// this instance doesn't conflict with, or nullptr if leases aren't used
+	std::unique_ptr<Lease> Repository::takeExclusiveLease()
+	{
+		if(mOptions.leaseSeconds <= 0) {
+			return nullptr;
+		}
+		std::lock_guard<std::mutex> lock(mLeaseMutex);
+		return std::unique_ptr<Lease>(new Lease(*mDataStore, Lease::Type::Exclusive, mOptions.leaseSeconds, mLease.get()));
+	}
+	
+	void Repository::setMetadataCache(std::shared_ptr<DataStore> cacheStore)
+	{
+		deriveKey(mEncKey, "metadata-cache", mCacheEncKey);
+		deriveKey(mMacKey, "metadata-cache", mCacheMacKey);
+		mMetadataCache = cacheStore;
+	}
+	
+	void Repository::setRestoreSeeds(const std::vector<std::string>& paths)
+	{
+		using namespace boost;
+		
+		auto seedFiles = std::make_shared<std::vector<std::pair<std::string, uint64_t>>>();
+		for(const std::string& path : paths) {
+			// the files listed before a directory which can't be read are
+			// kept
+			try {
+				if(filesystem::is_directory(path)) {
+					for(auto& file : filesystem::recursive_directory_iterator(path)) {
+						if(filesystem::is_regular_file(file)) {
+							seedFiles->push_back(std::make_pair(file.path().string(), filesystem::file_size(file)));
+						}
+					}
+				} else if(filesystem::is_regular_file(path)) {
+					seedFiles->push_back(std::make_pair(path, filesystem::file_size(path)));
+				}
+			} catch(const filesystem::filesystem_error&) {
+			}
+		}
+		
+		std::lock_guard<std::mutex> lock(mSeedMutex);
+		mSeedFiles = seedFiles;
+		mSeedSplits.clear();
+	}
+	
+	std::string Repository::repositoryId() const
+	{
+		uint8_t id[SHA256_DIGEST_LENGTH];
+		deriveKey(mHashKey, "repository-id", id);
+		
+		char hex[33];
+		for(int i = 0; i < 16; ++i) {
+			snprintf(hex + i * 2, 3, "%02x", id[i]);
+		}
+		return hex;
+	}
+	
+	bool Repository::sharesKeys(const Repository& other) const
+	{
+		return memcmp(mEncKey, other.mEncKey, EVP_MAX_KEY_LENGTH) == 0 &&
+			   memcmp(mMacKey, other.mMacKey, EVP_MAX_KEY_LENGTH) == 0 &&
+			   memcmp(mHashKey, other.mHashKey, EVP_MAX_KEY_LENGTH) == 0 &&
+			   memcmp(mRollKey, other.mRollKey, EVP_MAX_KEY_LENGTH) == 0;
+	}
+	
+	void Repository::deriveKey(const uint8_t *key, const char *label, uint8_t *outKey) const
+	{
+		unsigned int keyLength = SHA256_DIGEST_LENGTH;
+		if(!HMAC(EVP_sha256(), key, SHA256_DIGEST_LENGTH, (const uint8_t *)label, strlen(label), outKey, &keyLength)) {
+			throw EncryptionFailedException("HMAC failed.");
+		}
+	}
+	
+	void Repository::computeBlockHMAC(const uint8_t *block, size_t size, uint8_t compression, uint8_t *outHMAC)
+	{
+		HMAC_CTX ctx;
+		std::unique_ptr<HMAC_CTX, decltype(HMAC_CTX_cleanup) *> onExit(&ctx, HMAC_CTX_cleanup);
+
+		if(!HMAC_Init(&ctx, mHashKey, SHA256_DIGEST_LENGTH, EVP_sha256())) {
+			throw EncryptionFailedException("HMAC_Init failed.");
+		}
+		
+		// hmac which compression is used since that changes the block data
+		if(!HMAC_Update(&ctx, &compression, sizeof(compression))) {
+			throw EncryptionFailedException("HMAC_Update failed.");
+		}
+		
+		if(!HMAC_Update(&ctx, block, size)) {
+			throw EncryptionFailedException("HMAC_Update failed.");
+		}
+		
+		if(!HMAC_Final(&ctx, outHMAC, nullptr)) {
+			throw EncryptionFailedException("HMAC_Final failed.");
+		}
+	}
+	
+	// uploads the block unless the repository has it, returning whether it
+	// was uploaded
+	bool Repository::compressEncryptAndUploadBlock(CompressionType compressType, const Snapshot::ObjectID& objectId, const uint8_t *block, size_t size, ProgressFunction progress)
+	{
+		renewLease();
+		
+		// if the block already exists in the repository, skip the upload.
+		// With an object index, blocks missing from it are uploaded
+		// without asking the data store.
+		std::string uploadPath = "/data/" + objectIdToString(objectId);
+		if(isObjectIndexed(objectId) || (!mObjectIndex && mDataStore->exist(uploadPath.c_str()))) {
+			addIndexEntry(objectId, objectId, 0, 0);
+			if(!progress(size, size)) {
+				throw CancelledException("User cancelled.");
+			}
+			return false;
+		}
+		
+		MemoryInputStream blockStream(block, size);
+		auto encryptedStream = StreamUtils::compressEncryptHMAC(compressType, EVP_aes_256_cbc(), mEncKey, mMacKey, blockStream);
+		
+		mDataStore->put(uploadPath.c_str(), *encryptedStream, progress);
+		addIndexEntry(objectId, objectId, 0, 0);
+		return true;
+	}
+	
+	// whether the object is indexed as stored on its own, rather than only
+	// as a member of a pack
+	bool Repository::isObjectIndexed(const Snapshot::ObjectID& objectId)
+	{
+		ObjectIndex::Entry entry;
+		if(mObjectIndex && mObjectIndex->find(objectId, &entry) &&
+		   memcmp(entry.container.id, objectId.id, sizeof(objectId.id)) == 0) {
+			return true;
+		}
+		std::lock_guard<std::mutex> lock(mIndexMutex);
+		auto it = mPendingIndexEntries.find(std::string((const char *)objectId.id, sizeof(objectId.id)));
+		return it != mPendingIndexEntries.end() && memcmp(it->second.container.id, objectId.id, sizeof(objectId.id)) == 0;
+	}
+	
+	// records where an object is stored, for the index object written with
+	// the next snapshot. Entries already in the object index are skipped,
+	// and an object stored on its own keeps that entry.
+	void Repository::addIndexEntry(const Snapshot::ObjectID& objectId, const Snapshot::ObjectID& container, uint32_t offset, uint32_t length)
+	{
+		ObjectIndex::Entry entry;
+		if(mObjectIndex && mObjectIndex->find(objectId, &entry) &&
+		   memcmp(entry.container.id, container.id, sizeof(container.id)) == 0 && entry.offset == offset) {
+			return;
+		}
+		
+		entry.id = objectId;
+		entry.container = container;
+		entry.offset = offset;
+		entry.length = length;
+		std::lock_guard<std::mutex> lock(mIndexMutex);
+		auto inserted = mPendingIndexEntries.insert(std::make_pair(std::string((const char *)objectId.id, sizeof(objectId.id)), entry));
+		if(!inserted.second && memcmp(objectId.id, container.id, sizeof(container.id)) == 0) {
+			inserted.first->second = entry;
+		}
+	}
+	
+	void Repository::flushIndexEntries()
+	{
+		std::vector<ObjectIndex::Entry> entries;
+		std::vector<Snapshot::ObjectID> removed;
+		{
+			std::lock_guard<std::mutex> lock(mIndexMutex);
+			for(const auto& entry : mPendingIndexEntries) {
+				entries.push_back(entry.second);
+			}
+			removed = mPendingIndexRemovals;
+		}
+		if(entries.empty() && removed.empty()) {
+			return;
+		}
+		
+		std::string name = putIndexObject(entries, removed);
+		if(mObjectIndex) {
+			mObjectIndex->merge(std::vector<std::string>(1, name), entries, removed);
+		}
+		
+		std::lock_guard<std::mutex> lock(mIndexMutex);
+		for(const ObjectIndex::Entry& entry : entries) {
+			mPendingIndexEntries.erase(std::string((const char *)entry.id.id, sizeof(entry.id.id)));
+		}
+		mPendingIndexRemovals.erase(mPendingIndexRemovals.begin(), mPendingIndexRemovals.begin() + removed.size());
+	}
+	
+	// index objects are named by the HMAC of their entries, so the index
+	// objects of concurrent commits never collide
+	std::string Repository::putIndexObject(std::vector<ObjectIndex::Entry>& entries, const std::vector<Snapshot::ObjectID>& removed)
+	{
+		TempFileStream tmpStream;
+		ObjectIndex::save(entries, removed, tmpStream);
+		
+		HMAC_CTX hmac;
+		HMAC_CTX_init(&hmac);
+		std::unique_ptr<HMAC_CTX, decltype(HMAC_CTX_cleanup) *> cleanup(&hmac, HMAC_CTX_cleanup);
+		if(!HMAC_Init(&hmac, mHashKey, SHA256_DIGEST_LENGTH, EVP_sha256())) {
+			throw EncryptionFailedException("HMAC_Init failed.");
+		}
+		auto inStream = tmpStream.inputStream();
+		uint8_t buffer[65536];
+		size_t n;
+		while((n = inStream->read(buffer, sizeof(buffer))) > 0) {
+			if(!HMAC_Update(&hmac, buffer, n)) {
+				throw EncryptionFailedException("HMAC_Update failed.");
+			}
+		}
+		uint8_t digest[SHA256_DIGEST_LENGTH];
+		if(!HMAC_Final(&hmac, digest, nullptr)) {
+			throw EncryptionFailedException("HMAC_Final failed.");
+		}
+		char name[53];
+		base32encode(digest, sizeof(digest), name, sizeof(name));
+		
+		auto encryptedStream = StreamUtils::compressEncryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream());
+		mDataStore->put((std::string("/index/") + name).c_str(), *encryptedStream);
+		return name;
+	}
+	
+	std::vector<std::string> Repository::listIndexObjects()
+	{
+		std::vector<std::string> names;
+		try {
+			mDataStore->list("/index", [&names](const char *name, void *) {
+				if(name) {
+					names.push_back(name);
+				}
+			});
+		} catch(const std::exception&) {
+			// repositories without index objects may not have the directory
+		}
+		return names;
+	}
+	
+	void Repository::getIndexObject(const std::string& name, std::vector<ObjectIndex::Entry>& entries, std::vector<Snapshot::ObjectID>& removed)
+	{
+		TempFileStream tmpStream;
+		getObject("/index/" + name, tmpStream, DefaultProgressFunction);
+		TempFileStream indexStream;
+		StreamUtils::decompressDecryptHMAC(CompressionType::LZMA2, EVP_aes_256_cbc(), mEncKey, mMacKey, *tmpStream.inputStream(), indexStream);
+		ObjectIndex::load(*indexStream.inputStream(), entries, removed);
+	}
+	
+	std::shared_ptr<Repository::PackUploadState> Repository::createPackState()
+	{
+		return std::make_shared<PackUploadState>();
+	}
+	
+	void Repository::uploadFile(std::shared_ptr<Snapshot> snapshot, const char *destPath, FileStream& fileStream, FileTransferProgressFunction progress)
+	{
+		uploadFile(nullptr, snapshot, destPath, fileStream);
+	}
+
+	void Repository::uploadFile(std::shared_ptr<PackUploadState> packUploadState, std::shared_ptr<Snapshot> snapshot, const char *destPath, FileStream& fileStream, FileTransferProgressFunction progress)
+	{
+		using namespace boost;
+		
+		renewLease();
+		
+		CompressionType compressionType = CompressionType::LZMA2;
+
+		RollingHash rh(mRollKey, 8192);
+		uint8_t fileMD5[MD5_DIGEST_LENGTH];
+	
+		time_t startTime = time(nullptr);
+		FileInfo fileInfo( fileStream.path().c_str() );
+		if(!fileInfo.exists()) {
+			throw FileNotFoundException("File not found.");
+		}
+
+		// normalize destPath
+		filesystem::path normalizedPath = filesystem::path(destPath).relative_path().lexically_normal();
+		
+		if((mFilesCache && mFilesCache->addUnchangedFile(snapshot, normalizedPath.string(), fileInfo)) ||
+		   addUnchangedFile(snapshot, normalizedPath.string(), fileInfo)) {
+			if(mFilesCache) {
+				mFilesCache->fileAdded(normalizedPath.string(), fileInfo, startTime);
+			}
+			if(!progress(0, 1, fileInfo.length(), fileInfo.length())) {
+				throw CancelledException("User cancelled.");
+			}
+			return;
+		}
+
+		std::vector<Snapshot::ObjectID> objectIds;
+		std::vector<uint32_t> objectSizes;
+		objectIds.reserve(32);
+		objectSizes.reserve(32);
+		
+		EVP_MD_CTX md5;
+		EVP_MD_CTX_init(&md5);
+		std::unique_ptr<EVP_MD_CTX, decltype(EVP_MD_CTX_cleanup) *>
+			cleanup(&md5, EVP_MD_CTX_cleanup);
+		
+		if(!EVP_DigestInit(&md5, EVP_md5())) {
+			throw EncryptionFailedException("EVP_DigestInit failed.");
+		}
+		
+		size_t fileLength = fileInfo.length();
+		int rollingHashBits = 0;
+		
+		std::string ext = fileInfo.extension();
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+		// default extension exclusion list from compression
+		// helps speed up things since these types generally don't compress well
+		static std::set<std::string> noCompressExt = {
+			".png", ".jpg", ".jpeg", ".gif",
+			".mov",	".mkv",	".avi",	".mp2",	".mp3",	".mp4",
+			".mpg",	".m4a",	".m4v",	".3gp",	".3gpp", ".3g2", ".3gpp2",
+			".wma",	".wmv",
+			".ogg",	".aac",
+			".zip",	".gz", ".bz2", ".xz", ".lz", ".lzo", ".lzma",
+			".z", ".7z", ".s7z", ".rar",
+			".apk", ".ipa", ".jar"
+		};
+		
+		if(noCompressExt.find(ext) != noCompressExt.end()) {
+			compressionType = CompressionType::NoCompression;
+		}
+
+		// don't bother with splitting the file if it's < 1MB
+		// just upload as is
+		if(fileLength < mOptions.smallFileSize) {
+			
+			std::unique_ptr<uint8_t, decltype(free) *> buffer( (uint8_t *)malloc(fileLength), free );
+
+			fileStream.readExpected(buffer.get(), fileLength);
+			
+			if(!EVP_DigestUpdate(&md5, buffer.get(), fileLength)) {
+				throw EncryptionFailedException("EVP_DigestUpdate failed.");
+			}
+			
+			Snapshot::ObjectID objectId;
+			computeBlockHMAC(buffer.get(), fileLength, (uint8_t)compressionType, objectId.id);
+			
+			// the same contents stored before, on their own or in a pack,
+			// aren't uploaded again
+			uint8_t md5[MD5_DIGEST_LENGTH];
+			MD5(buffer.get(), fileLength, md5);
+			if(addIndexedFile(snapshot, normalizedPath.string(), fileInfo, compressionType, md5, objectId)) {
+				if(mFilesCache) {
+					mFilesCache->fileAdded(normalizedPath.string(), fileInfo, startTime);
+				}
+				if(!progress(0, 1, fileLength, fileLength)) {
+					throw CancelledException("User cancelled.");
+				}
+				return;
+			}
+			
+			if(packUploadState) {
+				bool writePack = false;
+
+				if(!packUploadState->rollingHash) {
+					packUploadState->rollingHash.reset(new RollingHash(mRollKey, 8192));
+					if(!HMAC_Init(&packUploadState->hmac, mHashKey, SHA256_DIGEST_LENGTH, EVP_sha256())) {
+						throw EncryptionFailedException("HMAC_Init failed.");
+					}
+				}
+
 				HMAC_Update(&packUploadState->hmac, buffer.get(), fileLength);
 				const uint8_t *bufPtr = buffer.get();
 				const uint8_t *bufEnd = bufPtr + fileLength;
@@ -475,9 +2597,6 @@ namespace Nebula
 					}
 				}
 
-				uint8_t md5[MD5_DIGEST_LENGTH];
-				MD5(buffer.get(), fileLength, md5);
-
 				packUploadState->addFile(buffer.get(),
 										 fileLength,
 										 normalizedPath.string(),
@@ -489,7 +2608,12 @@ namespace Nebula
 										 fileInfo.length(),
 										 fileInfo.lastModifyTime(),
 										 0,
-										 md5);
+										 md5,
+										 objectId);
+				
+				if(mFilesCache) {
+					mFilesCache->fileAdded(normalizedPath.string(), fileInfo, startTime);
+				}
 				
 				if(writePack) {
 					finalizePack(snapshot, packUploadState, progress);
@@ -506,6 +2630,7 @@ namespace Nebula
 												  return progress(0, 1, bytesUploaded, bytesTotal);
 											  });
 				objectIds.push_back(objectId);
+				objectSizes.push_back(fileLength);
 			}
 			
 		} else {
@@ -528,44 +2653,70 @@ namespace Nebula
 			blockBuffer.reserve(std::min(1 << (1 + rollingHashBits), mOptions.maxBlockSize));
 
 			int blockCount = 0;
-			BufferedInputStream bufferedFile(fileStream);
-			while(!bufferedFile.isEof()) {
-				uint8_t b = bufferedFile.readByte();
-				blockBuffer.push_back(b);
-				if(blockBuffer.size() >= minBlockSize &&
-				   ((rh.roll(b) & hashMask) == 0 || blockBuffer.size() >= mOptions.maxBlockSize)) {
-					
-					if(!EVP_DigestUpdate(&md5, &blockBuffer[0], blockBuffer.size())) {
-						throw EncryptionFailedException("EVP_DigestUpdate failed.");
-					}
-					
-					Snapshot::ObjectID objectId;
-					// upload block
-					computeBlockHMAC(&blockBuffer[0], blockBuffer.size(), (uint8_t)compressionType, objectId.id);
-					compressEncryptAndUploadBlock(compressionType, objectId, &blockBuffer[0], blockBuffer.size(),
-												  [&progress, blockCount](long bytesUploaded, long bytesTotal) -> bool {
-													  return progress(blockCount, -1, bytesUploaded, bytesTotal);
-												  });
-					++blockCount;
-
-					objectIds.push_back(objectId);
-					blockBuffer.clear();
-				}
-			}
 			
-			if(!blockBuffer.empty()) {
-				Snapshot::ObjectID objectId;
-				if(!EVP_DigestUpdate(&md5, &blockBuffer[0], blockBuffer.size())) {
+			// uploads a block, or records it as a zero extent if it's all zeros
+			auto addBlock = [&](const uint8_t *block, size_t size) {
+				if(!EVP_DigestUpdate(&md5, block, size)) {
 					throw EncryptionFailedException("EVP_DigestUpdate failed.");
 				}
 				
-				computeBlockHMAC(&blockBuffer[0], blockBuffer.size(), (uint8_t)compressionType, objectId.id);
-				compressEncryptAndUploadBlock(compressionType, objectId, &blockBuffer[0], blockBuffer.size(),
+				if(isZeroBlock(block, size)) {
+					addZeroExtent(objectIds, objectSizes, size);
+					return;
+				}
+				
+				Snapshot::ObjectID objectId;
+				computeBlockHMAC(block, size, (uint8_t)compressionType, objectId.id);
+				compressEncryptAndUploadBlock(compressionType, objectId, block, size,
 											  [&progress, blockCount](long bytesUploaded, long bytesTotal) -> bool {
 												  return progress(blockCount, -1, bytesUploaded, bytesTotal);
 											  });
 				++blockCount;
 				objectIds.push_back(objectId);
+				objectSizes.push_back(size);
+			};
+			
+			// holes in sparse files are recorded as zero extents without
+			// being read. small holes are read as data so the number of
+			// objects stays bounded by the min block size.
+			uint64_t minHoleSize = 4 * minBlockSize;
+			uint64_t offset = 0;
+			while(offset < fileLength) {
+				uint64_t dataStart = fileLength, dataEnd = fileLength;
+				fileStream.findData(offset, dataStart, dataEnd);
+				if(dataStart - offset < minHoleSize) {
+					dataStart = offset;
+				}
+				
+				if(dataStart > offset) {
+					if(!blockBuffer.empty()) {
+						addBlock(&blockBuffer[0], blockBuffer.size());
+						blockBuffer.clear();
+					}
+					
+					digestZeros(&md5, dataStart - offset);
+					addZeroExtent(objectIds, objectSizes, dataStart - offset);
+				}
+				
+				if(dataEnd > dataStart) {
+					fileStream.seek(dataStart);
+					BufferedInputStream bufferedFile(fileStream);
+					for(uint64_t n = dataEnd - dataStart; n > 0 && !bufferedFile.isEof(); --n) {
+						uint8_t b = bufferedFile.readByte();
+						blockBuffer.push_back(b);
+						if(blockBuffer.size() >= minBlockSize &&
+						   ((rh.roll(b) & hashMask) == 0 || blockBuffer.size() >= mOptions.maxBlockSize)) {
+							addBlock(&blockBuffer[0], blockBuffer.size());
+							blockBuffer.clear();
+						}
+					}
+				}
+				
+				offset = dataEnd;
+			}
+			
+			if(!blockBuffer.empty()) {
+				addBlock(&blockBuffer[0], blockBuffer.size());
 			}
 		}
 		
@@ -588,7 +2739,12 @@ namespace Nebula
 							   0,
 							   0,
 							   objectIds.size(),
-							   &objectIds[0]);
+							   &objectIds[0],
+							   &objectSizes[0]);
+		
+		if(mFilesCache) {
+			mFilesCache->fileAdded(normalizedPath.string(), fileInfo, startTime);
+		}
 	}
 	
 	void Repository::finalizePack(std::shared_ptr<Snapshot> snapshot, std::shared_ptr<PackUploadState> uploadPackState, FileTransferProgressFunction progress)
@@ -596,44 +2752,49 @@ namespace Nebula
 		if(!uploadPackState->rollingHash) {
 			return;
 		}
+		renewLease();
 
 		Snapshot::ObjectID objectId;
 		if(!HMAC_Final(&uploadPackState->hmac, objectId.id, nullptr)) {
 			throw EncryptionFailedException("HMAC_Final failed.");
 		}
 		
+		// the members are encrypted even if the pack exists, as their
+		// lengths give the offsets, which are the same in the existing pack
 		int numObjects = uploadPackState->fileInfos.size();
-		std::string objPath = "/data/" + objectIdToString(objectId);
-		if(!mDataStore->exist(objPath.c_str())) {
-			std::vector<std::shared_ptr<InputStream>> inStreamList;
-			std::vector<InputStream *> inStreamListPtr;
-			inStreamList.reserve(numObjects);
-			uint32_t offset = 0;
-			for(int i = 0; i < numObjects; ++i)
-			{
-				PackFileInfo& fi = uploadPackState->fileInfos[i];
-				const std::vector<uint8_t>& data = uploadPackState->packData[i];
-				
-				MemoryInputStream stream(&data[0], data.size());
-				auto encryptedStream = StreamUtils::compressEncryptHMAC(fi.compression, EVP_aes_256_cbc(), mEncKey, mMacKey, stream);
-				inStreamList.push_back(encryptedStream);
-				inStreamListPtr.push_back(encryptedStream.get());
-				
-				fi.offset = offset;
-				fi.packLength = encryptedStream->size();
-
-				offset += fi.packLength;
-			}
+		std::vector<std::shared_ptr<InputStream>> inStreamList;
+		std::vector<InputStream *> inStreamListPtr;
+		inStreamList.reserve(numObjects);
+		uint32_t offset = 0;
+		for(int i = 0; i < numObjects; ++i)
+		{
+			PackFileInfo& fi = uploadPackState->fileInfos[i];
+			const std::vector<uint8_t>& data = uploadPackState->packData[i];
 			
+			MemoryInputStream stream(&data[0], data.size());
+			auto encryptedStream = StreamUtils::compressEncryptHMAC(fi.compression, EVP_aes_256_cbc(), mEncKey, mMacKey, stream);
+			inStreamList.push_back(encryptedStream);
+			inStreamListPtr.push_back(encryptedStream.get());
 			
+			fi.offset = offset;
+			fi.packLength = encryptedStream->size();
+
+			offset += fi.packLength;
+		}
+		
+		std::string objPath = "/data/" + objectIdToString(objectId);
+		if(!isObjectIndexed(objectId) && (mObjectIndex || !mDataStore->exist(objPath.c_str()))) {
 			MultiInputStream multiStream(inStreamListPtr);
 			mDataStore->put(objPath.c_str(), multiStream);
 		}
+		addIndexEntry(objectId, objectId, 0, 0);
 
 		
 		for(int i = 0; i < numObjects; ++i)
 		{
 			const PackFileInfo& fi = uploadPackState->fileInfos[i];
+			uint32_t objectSize = fi.size;
+			addIndexEntry(fi.objectId, objectId, fi.offset, fi.packLength);
 
 			snapshot->addFileEntry(fi.path.c_str(),
 								   fi.user.c_str(),
@@ -648,7 +2809,8 @@ namespace Nebula
 								   fi.offset,
 								   fi.packLength,
 								   1,
-								   &objectId);
+								   &objectId,
+								   &objectSize);
 		}
 		
 		uploadPackState->fileInfos.clear();
@@ -656,6 +2818,245 @@ namespace Nebula
 		uploadPackState->rollingHash.reset();
 	}
 	
+	// adds a small file whose contents are in the object index, or were
+	// indexed since it was last written, referencing them where they are
+	bool Repository::addIndexedFile(std::shared_ptr<Snapshot> snapshot, const std::string& path, const FileInfo& fileInfo, CompressionType compression, const uint8_t *md5, const Snapshot::ObjectID& objectId)
+	{
+		ObjectIndex::Entry entry;
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lock(mIndexMutex);
+			auto it = mPendingIndexEntries.find(std::string((const char *)objectId.id, sizeof(objectId.id)));
+			if(it != mPendingIndexEntries.end()) {
+				entry = it->second;
+				found = true;
+			}
+		}
+		if(!found && !(mObjectIndex && mObjectIndex->find(objectId, &entry))) {
+			return false;
+		}
+		
+		uint32_t objectSize = fileInfo.length();
+		snapshot->addFileEntry(path.c_str(),
+							   fileInfo.userName().c_str(),
+							   fileInfo.groupName().c_str(),
+							   fileInfo.type(),
+							   fileInfo.mode(),
+							   compression,
+							   fileInfo.length(),
+							   fileInfo.lastModifyTime(),
+							   0,
+							   md5,
+							   entry.length > 0 ? entry.offset : 0,
+							   entry.length,
+							   1,
+							   &entry.container,
+							   &objectSize);
+		return true;
+	}
+	
+	bool Repository::addUnchangedFile(std::shared_ptr<Snapshot> snapshot, const std::string& path, const FileInfo& fileInfo)
+	{
+		// a resumed backup looks in its checkpoints, then in their parent
+		std::shared_ptr<Snapshot> parent = snapshot->parent();
+		const Snapshot::FileEntry *fe = nullptr;
+		while(parent && !(fe = parent->getFileEntry(path.c_str()))) {
+			parent = parent->parent();
+		}
+		
+		if(!fe ||
+		   fe->type != (uint8_t)fileInfo.type() ||
+		   fe->size != fileInfo.length() ||
+		   fe->mtime != fileInfo.lastModifyTime()) {
+			return false;
+		}
+		
+		// the contents come from the parent, the metadata from the file
+		snapshot->addFileEntry(path.c_str(),
+							   fileInfo.userName().c_str(),
+							   fileInfo.groupName().c_str(),
+							   fileInfo.type(),
+							   fileInfo.mode(),
+							   (CompressionType)fe->compression,
+							   fe->size,
+							   fe->mtime,
+							   fe->rollingHashBits,
+							   fe->md5,
+							   fe->offset,
+							   fe->packLength,
+							   fe->objectCount,
+							   parent->indexToObjectID(fe->objectIdIndex),
+							   parent->indexToObjectSize(fe->objectIdIndex));
+		return true;
+	}
+	
+	// the objects of a file found in the seeds, by their index in the file
+	std::map<int, Repository::SeedChunk> Repository::findSeedChunks(const Snapshot::FileEntry& fe, const Snapshot::ObjectID *objectIds, const char *previousPath)
+	{
+		std::map<int, SeedChunk> found;
+		if(fe.packLength > 0) {
+			return found;
+		}
+		
+		// small files are a single object. Larger ones are split by the
+		// rolling hash, with a minimum block size depending on their size.
+		uint64_t minBlockSize = fe.rollingHashBits > 0 ? std::max<uint64_t>(4096, (fe.size + 65534) / 65535) : fe.size;
+		auto splitSeed = [&](const std::string& path, uint64_t size, std::map<std::string, SeedChunk>& chunks) {
+			if(fe.rollingHashBits == 0 && size != fe.size) {
+				return;
+			}
+			try {
+				splitSeedFile(path, size, fe.rollingHashBits, minBlockSize, (CompressionType)fe.compression, chunks);
+			} catch(const std::exception&) {
+				// seeds which can't be read are skipped
+			}
+		};
+		int wanted = 0;
+		auto findChunks = [&](const std::map<std::string, SeedChunk>& chunks) {
+			wanted = 0;
+			for(int i = 0; i < fe.objectCount; ++i) {
+				if(objectIds[i].isZeroExtent() || found.count(i)) {
+					continue;
+				}
+				auto chunk = chunks.find(std::string((const char *)objectIds[i].id, sizeof(objectIds[i].id)));
+				if(chunk != chunks.end()) {
+					found[i] = chunk->second;
+				} else {
+					++wanted;
+				}
+			}
+		};
+		
+		// the previous copy of the file most likely holds most of it
+		if(previousPath) {
+			std::map<std::string, SeedChunk> chunks;
+			boost::system::error_code ec;
+			uint64_t size = boost::filesystem::file_size(previousPath, ec);
+			if(!ec) {
+				splitSeed(previousPath, size, chunks);
+			}
+			findChunks(chunks);
+			if(wanted == 0) {
+				return found;
+			}
+		}
+		
+		// the seeds are split once for each way files are split, the first
+		// thread needing it splitting them while the others wait for it
+		std::shared_ptr<const std::vector<std::pair<std::string, uint64_t>>> seedFiles;
+		std::shared_ptr<SeedSplit> split;
+		{
+			std::lock_guard<std::mutex> lock(mSeedMutex);
+			if(!mSeedFiles || mSeedFiles->empty()) {
+				return found;
+			}
+			seedFiles = mSeedFiles;
+			std::shared_ptr<SeedSplit>& entry = mSeedSplits[std::make_tuple((int)fe.rollingHashBits, minBlockSize, (int)fe.compression)];
+			if(!entry) {
+				entry = std::make_shared<SeedSplit>();
+			}
+			split = entry;
+		}
+		std::call_once(split->once, [&]() {
+			for(const auto& seed : *seedFiles) {
+				splitSeed(seed.first, seed.second, split->chunks);
+			}
+		});
+		findChunks(split->chunks);
+		return found;
+	}
+	
+	// splits a seed as uploadFile() splits a file, indexing the blocks by
+	// the ids they would be uploaded with
+	void Repository::splitSeedFile(const std::string& path, uint64_t size, int rollingHashBits, uint64_t minBlockSize, CompressionType compression, std::map<std::string, SeedChunk>& chunks)
+	{
+		FileStream fileStream(path.c_str(), FileMode::Read);
+		std::vector<uint8_t> block;
+		uint64_t offset = 0;
+		auto addBlock = [&]() {
+			if(!block.empty() && !isZeroBlock(&block[0], block.size())) {
+				Snapshot::ObjectID objectId;
+				computeBlockHMAC(&block[0], block.size(), (uint8_t)compression, objectId.id);
+				SeedChunk chunk = { path, offset };
+				chunks.insert(std::make_pair(std::string((const char *)objectId.id, sizeof(objectId.id)), chunk));
+			}
+			offset += block.size();
+			block.clear();
+		};
+		
+		if(rollingHashBits == 0) {
+			block.resize(size);
+			if(size > 0) {
+				fileStream.readExpected(&block[0], size);
+			}
+			addBlock();
+			return;
+		}
+		
+		RollingHash rh(mRollKey, 8192);
+		uint64_t hashMask = (1 << rollingHashBits) - 1;
+		block.reserve(std::min(1 << (1 + rollingHashBits), mOptions.maxBlockSize));
+		BufferedInputStream bufferedFile(fileStream);
+		while(!bufferedFile.isEof()) {
+			uint8_t b = bufferedFile.readByte();
+			block.push_back(b);
+			if(block.size() >= minBlockSize &&
+			   ((rh.roll(b) & hashMask) == 0 || block.size() >= mOptions.maxBlockSize)) {
+				addBlock();
+			}
+		}
+		addBlock();
+	}
+	
+	// reads an object from a seed, returning false if the seed no longer
+	// holds its contents
+	bool Repository::readSeedChunk(const SeedChunk& chunk, CompressionType compression, const Snapshot::ObjectID& objectId, uint8_t *buffer, size_t size)
+	{
+		try {
+			FileStream seedStream(chunk.path.c_str(), FileMode::Read);
+			seedStream.seek(chunk.offset);
+			seedStream.readExpected(buffer, size);
+		} catch(const std::exception&) {
+			return false;
+		}
+		
+		Snapshot::ObjectID seedId;
+		computeBlockHMAC(buffer, size, (uint8_t)compression, seedId.id);
+		return memcmp(seedId.id, objectId.id, sizeof(seedId.id)) == 0;
+	}
+	
+	void Repository::getObject(const std::string& path, OutputStream& outStream, ProgressFunction progress)
+	{
+		if(mDataStore->supportsConcurrentAccess()) {
+			mDataStore->get(path.c_str(), outStream, progress);
+		} else {
+			std::lock_guard<std::mutex> lock(mDataStoreMutex);
+			mDataStore->get(path.c_str(), outStream, progress);
+		}
+	}
+	
+	void Repository::downloadObject(const Snapshot::FileEntry& fe, const Snapshot::ObjectID& objectId, OutputStream& outStream, ProgressFunction progress)
+	{
+		std::string objectPath = "/data/" + objectIdToString(objectId);
+
+		// download the object to tmpFile
+		TempFileStream tmpStream;
+		getObject(objectPath, tmpStream, progress);
+
+		auto downloadedStream = tmpStream.inputStream();
+		decodeObject(fe, *downloadedStream, outStream);
+	}
+	
+	void Repository::decodeObject(const Snapshot::FileEntry& fe, InputStream& objectStream, OutputStream& outStream)
+	{
+		if(fe.packLength > 0) {
+			InputRangeStream rangeStream(objectStream, fe.offset, fe.packLength);
+			StreamUtils::decompressDecryptHMAC((CompressionType)fe.compression, EVP_aes_256_cbc(), mEncKey, mMacKey, rangeStream, outStream);
+		} else {
+			StreamUtils::decompressDecryptHMAC((CompressionType)fe.compression, EVP_aes_256_cbc(), mEncKey, mMacKey, objectStream, outStream);
+		}
+	}
+	
 	bool Repository::downloadFile(std::shared_ptr<Snapshot> snapshot, const char *srcPath, OutputStream& fileStream, FileTransferProgressFunction progress)
 	{
 		using namespace boost;
@@ -665,30 +3066,223 @@ namespace Nebula
 			return false;
 		}
 
+		DigestOutputStream verifyStream(fileStream, EVP_md5());
+		verifyStream.setExpectedDigest(fe->md5, MD5_DIGEST_LENGTH);
+		OutputStream& outStream = mOptions.verifyDownloads ? (OutputStream&)verifyStream : fileStream;
+
+		const Snapshot::ObjectID *objectIds = snapshot->indexToObjectID(fe->objectIdIndex);
+		const uint32_t *objectSizes = snapshot->indexToObjectSize(fe->objectIdIndex);
+		if(fe->objectCount < 2 || mOptions.prefetchObjects < 1) {
+			for(int i = 0; i < fe->objectCount; ++i) {
+				if(objectIds[i].isZeroExtent()) {
+					writeZeros(outStream, objectSizes[i]);
+					continue;
+				}
+				
+				downloadObject(*fe, objectIds[i], outStream,
+							   [&progress, i, fe] (long bytesDownloaded, long bytesTotal) -> bool {
+								   return progress(i, fe->objectCount, bytesDownloaded, bytesTotal);
+							   });
+			}
+		} else {
+			// keep the next objects downloading while the current one is decoded
+			std::vector<std::string> objectPaths;
+			std::vector<size_t> estimatedSizes;
+			for(int i = 0; i < fe->objectCount; ++i) {
+				if(!objectIds[i].isZeroExtent()) {
+					objectPaths.push_back("/data/" + objectIdToString(objectIds[i]));
+					estimatedSizes.push_back(objectSizes[i] ? objectSizes[i] : fe->size / fe->objectCount);
+				}
+			}
+			
+			ObjectPrefetcher prefetcher([this] (const std::string& path, OutputStream& stream, ProgressFunction objectProgress) {
+											getObject(path, stream, objectProgress);
+										},
+										objectPaths,
+										estimatedSizes,
+										mOptions.prefetchObjects,
+										mOptions.prefetchBufferLimit,
+										mDataStore->supportsConcurrentAccess() ? mOptions.prefetchObjects : 1);
+			
+			int nextPrefetched = 0;
+			for(int i = 0; i < fe->objectCount; ++i) {
+				if(objectIds[i].isZeroExtent()) {
+					writeZeros(outStream, objectSizes[i]);
+					continue;
+				}
+				
+				size_t objectSize = estimatedSizes[nextPrefetched];
+				std::shared_ptr<TempFileStream> objectStream = prefetcher.take(nextPrefetched++);
+				decodeObject(*fe, *objectStream->inputStream(), outStream);
+				
+				if(!progress(i, fe->objectCount, objectSize, objectSize)) {
+					throw CancelledException("Download cancelled.");
+				}
+			}
+		}
+		
+		if(mOptions.verifyDownloads) {
+			verifyStream.close();
+		}
+		
+		return true;
+	}
+	
+	bool Repository::downloadFile(std::shared_ptr<Snapshot> snapshot, const char *srcPath, FileStream& fileStream, FileTransferProgressFunction progress, const char *previousPath)
+	{
+		const Snapshot::FileEntry *fe = snapshot->getFileEntry(srcPath);
+		if(!fe) {
+			return false;
+		}
+
 		const Snapshot::ObjectID *objectIds = snapshot->indexToObjectID(fe->objectIdIndex);
-		for(int i = 0; i < fe->objectCount; ++i) {
-			std::string objectPath = "/data/" + objectIdToString(objectIds[i]);
+		const uint32_t *objectSizes = snapshot->indexToObjectSize(fe->objectIdIndex);
+		int objectCount = fe->objectCount;
 
-			// download the object to tmpFile
-			TempFileStream tmpStream;
-			mDataStore->get(objectPath.c_str(), tmpStream,
-							[&progress, i, fe] (long bytesDownloaded, long bytesTotal) -> bool {
-								return progress(i, fe->objectCount, bytesDownloaded, bytesTotal);
-							});
+		// the offset of each object in the file is derived from the sizes
+		// of the objects before it
+		std::vector<uint64_t> offsets(objectCount);
+		uint64_t offset = 0;
+		for(int i = 0; i < objectCount; ++i) {
+			offsets[i] = offset;
+			offset += objectSizes[i];
+		}
+		
+		// packed files, and files from snapshots which have no object sizes
+		// recorded, can only be written sequentially. files with zero extents
+		// are always written by offset so the extents are left as holes.
+		bool sizesKnown = std::find(objectSizes, objectSizes + objectCount, 0) == objectSizes + objectCount;
+		bool hasZeroExtents = std::any_of(objectIds, objectIds + objectCount,
+										  [](const Snapshot::ObjectID& objectId) { return objectId.isZeroExtent(); });
+		if(fe->packLength > 0 || !sizesKnown || offset != fe->size) {
+			return downloadFile(snapshot, srcPath, (OutputStream&)fileStream, progress);
+		}
+		
+		// objects found in the seeds are copied from them instead
+		std::map<int, SeedChunk> seedChunks = findSeedChunks(*fe, objectIds, previousPath);
+		if((objectCount < 2 || mOptions.restoreThreads < 2) && !hasZeroExtents && seedChunks.empty()) {
+			return downloadFile(snapshot, srcPath, (OutputStream&)fileStream, progress);
+		}
+		
+		fileStream.truncate(fe->size);
 
-			auto downloadedStream = tmpStream.inputStream();
-			
-			if(fe->packLength > 0) {
-				InputRangeStream rangeStream(*downloadedStream, fe->offset, fe->packLength);
-				StreamUtils::decompressDecryptHMAC((CompressionType)fe->compression, EVP_aes_256_cbc(), mEncKey, mMacKey, rangeStream, fileStream);
-			} else {
-				StreamUtils::decompressDecryptHMAC((CompressionType)fe->compression, EVP_aes_256_cbc(), mEncKey, mMacKey, *downloadedStream, fileStream);
+		int numThreads = std::max(1, std::min(mOptions.restoreThreads, objectCount));
+
+		// objects are written as soon as they are decoded, but are digested
+		// in file order. decoded objects wait in pendingObjects until every
+		// object before them has been digested, and no object more than
+		// maxPending ahead of the digest is started, bounding memory use.
+		DigestOutputStream digestStream(EVP_md5());
+		digestStream.setExpectedDigest(fe->md5, MD5_DIGEST_LENGTH);
+		std::map<int, std::vector<uint8_t>> pendingObjects;
+		int nextDigestObject = 0;
+		int maxPending = numThreads * 2;
+		std::condition_variable digestCondition;
+
+		std::atomic<int> nextObject(0);
+		std::atomic<bool> failed(false);
+		std::mutex mutex;
+		std::exception_ptr error;
+		int objectsCompleted = 0;
+		long bytesCompleted = 0;
+		
+		auto restoreObjects = [&]() {
+			try {
+				std::vector<uint8_t> buffer;
+				int i;
+				while(!failed && (i = nextObject++) < objectCount) {
+					if(mOptions.verifyDownloads) {
+						std::unique_lock<std::mutex> lock(mutex);
+						digestCondition.wait(lock, [&]() { return failed || i < nextDigestObject + maxPending; });
+						if(failed) break;
+					}
+
+					// zero extents are left as holes and wait in pendingObjects
+					// as an empty buffer
+					bool zeroExtent = objectIds[i].isZeroExtent();
+					if(zeroExtent) {
+						buffer.clear();
+						fileStream.punchHole(offsets[i], objectSizes[i]);
+					} else {
+						buffer.resize(objectSizes[i]);
+						auto seedChunk = seedChunks.find(i);
+						if(seedChunk == seedChunks.end() ||
+						   !readSeedChunk(seedChunk->second, (CompressionType)fe->compression, objectIds[i], &buffer[0], buffer.size())) {
+							MemoryOutputStream objectStream(&buffer[0], buffer.size());
+							downloadObject(*fe, objectIds[i], objectStream, DefaultProgressFunction);
+							if(objectStream.size() != buffer.size()) {
+								throw InvalidDataException("Object size does not match the snapshot.");
+							}
+						}
+						
+						fileStream.writeAt(&buffer[0], buffer.size(), offsets[i]);
+					}
+					
+					std::lock_guard<std::mutex> lock(mutex);
+					++objectsCompleted;
+					bytesCompleted += objectSizes[i];
+					
+					if(mOptions.verifyDownloads) {
+						pendingObjects[i] = std::move(buffer);
+						buffer.clear();
+						for(auto next = pendingObjects.begin();
+							next != pendingObjects.end() && next->first == nextDigestObject;
+							next = pendingObjects.erase(next)) {
+							if(next->second.empty()) {
+								writeZeros(digestStream, objectSizes[next->first]);
+							} else {
+								digestStream.write(&next->second[0], next->second.size());
+							}
+							++nextDigestObject;
+						}
+						digestCondition.notify_all();
+					}
+					
+					if(!failed && !progress(objectsCompleted - 1, objectCount, bytesCompleted, fe->size)) {
+						throw CancelledException("User cancelled.");
+					}
+				}
+			} catch(...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if(!error) {
+					error = std::current_exception();
+				}
+				failed = true;
+				digestCondition.notify_all();
 			}
+		};
+		
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads - 1);
+		for(int i = 1; i < numThreads; ++i) {
+			threads.emplace_back(restoreObjects);
+		}
+		restoreObjects();
+		for(auto& thread : threads) {
+			thread.join();
+		}
+		
+		if(error) {
+			std::rethrow_exception(error);
 		}
 		
+		if(mOptions.verifyDownloads) {
+			digestStream.close();
+		}
+
 		return true;
 	}
 	
+	std::shared_ptr<SnapshotFileStream> Repository::openFile(std::shared_ptr<Snapshot> snapshot, const char *srcPath)
+	{
+		const Snapshot::FileEntry *fe = snapshot->getFileEntry(srcPath);
+		if(!fe) {
+			return nullptr;
+		}
+		
+		return std::make_shared<SnapshotFileStream>(*this, snapshot, *fe);
+	}
+	
 	std::string Repository::objectIdToString(const Snapshot::ObjectID& objectId) const
 	{
 		char outStr[53];
@@ -16,17 +16,28 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
 #include <vector>
 #include <functional>
 #include <inttypes.h>
 #include "ProgressFunction.h"
 #include "Snapshot.h"
 #include "CompressionType.h"
+#include "ObjectIndex.h"
 
 namespace Nebula
 {
 	class DataStore;
+	class SnapshotFileStream;
+	class FilesCache;
+	class Catalog;
+	class ReferenceCounts;
+	class Lease;
+	struct SnapshotSummary;
 	
 	/**
 	 * Represents a backup repository. The repository is backed by a data store
@@ -59,6 +70,33 @@ namespace Nebula
 			/// increases the average number of chunks the file with be split 
 			int blockSplitCount;
 			
+			/// number of objects downloaded and decoded concurrently when
+			/// restoring to a file
+			int restoreThreads;
+			
+			/// number of objects downloaded ahead of the one being decoded
+			/// when restoring to a stream
+			int prefetchObjects;
+			
+			/// maximum number of bytes held by objects downloaded ahead,
+			/// counted as downloaded: in memory, or in temporary files for
+			/// those larger than TempFileStream buffers (see ObjectPrefetcher)
+			size_t prefetchBufferLimit;
+			
+			/// verify the MD5 of downloaded files as they are written
+			bool verifyDownloads;
+			
+			/// commit snapshots as a tree of directory objects, which
+			/// snapshots share for the directories that haven't changed
+			bool treeSnapshots;
+			
+			/// number of snapshot summaries downloaded concurrently
+			int metadataThreads;
+			
+			/// seconds a lease on the repository lasts unless renewed, or 0
+			/// to take no leases (see createSnapshot())
+			int leaseSeconds;
+			
 			Options();
 		};
 		
@@ -80,6 +118,14 @@ namespace Nebula
 		 */
 		void initializeRepository(const char *password, uint8_t logRounds = 17, ProgressFunction progress = DefaultProgressFunction);
 		
+		/**
+		 * Initializes and creates a new repository with the keys of
+		 * @a keySource, an unlocked repository, under its own password.
+		 * Objects are then copied between them by syncRepository() without
+		 * being decrypted.
+		 */
+		void initializeRepository(const Repository& keySource, const char *password, uint8_t logRounds = 17, ProgressFunction progress = DefaultProgressFunction);
+		
 		/**
 		 * Unlocks an existing repository. This should be called before
 		 * any other operation except the creation of a new repository.
@@ -88,13 +134,143 @@ namespace Nebula
 		 */
 		bool unlockRepository(const char *password, ProgressFunction progress = DefaultProgressFunction);
 
+		struct CompactStats
+		{
+			uint64_t snapshots;
+			uint64_t referencedObjects;
+			uint64_t scannedObjects; // objects listed in the data store
+			uint64_t unreferencedObjects;
+			uint64_t unreferencedBytes; // where the data store reports sizes
+			uint64_t deletedObjects;
+		};
+		
 		/**
 		 * Compacts a repository.
-		 * The repository is scanned for snapshots and each object is checked
-		 * to ensure there is a reference to the object. At the end of the scan,
-		 * objects which have no references are removed.
+		 * The snapshots are loaded concurrently (see Options::metadataThreads)
+		 * to mark the objects they reference. The object shards are then
+		 * listed concurrently and the objects in each which have no
+		 * references are removed.
+		 *
+		 * Swept shards are recorded in the repository as they finish, so an
+		 * interrupted compaction resumes where it stopped if the snapshots
+		 * are unchanged. Returning false from @a progress cancels it with
+		 * CancelledException, once the swept shards are recorded. If
+		 * @a dryRun is set nothing is removed, and the stats report what
+		 * would be.
+		 *
+		 * The objects of a snapshot which is still being uploaded have no
+		 * references, so compaction takes an exclusive lease on the
+		 * repository, and throws RepositoryException if another client
+		 * holds a lease to write snapshots. Snapshots created by this
+		 * repository instance and not yet committed aren't protected.
+		 */
+		CompactStats compactRepository(bool dryRun = false, ProgressFunction progress = DefaultProgressFunction);
+		
+		struct RepackStats
+		{
+			uint64_t packs; // packs referenced by the snapshots
+			uint64_t repackedPacks;
+			uint64_t newPacks;
+			uint64_t downloadedBytes;
+			uint64_t uploadedBytes;
+			uint64_t reclaimableBytes; // freed by the next compaction
+			uint64_t rewrittenSnapshots;
+		};
+		
+		/**
+		 * Repacks the packs of small files which are mostly unreferenced.
+		 * Packs where less than @a liveness of the bytes are referenced by a
+		 * snapshot are downloaded, emptiest first, and their referenced
+		 * members are copied as they are, without decrypting them, into new
+		 * packs ordered by path. The snapshots referencing them are then
+		 * rewritten to point at the new packs, and the old packs are left
+		 * for compactRepository() to remove. The shared lease is held
+		 * meanwhile (see takeSharedLease()), so compaction can't remove the
+		 * new packs before a snapshot references them, and RepositoryException
+		 * is thrown if it was lost.
+		 *
+		 * No more packs are downloaded once @a maxBytes would be exceeded or
+		 * @a maxSeconds have passed, 0 meaning no limit. Packs whose size the
+		 * data store doesn't report are left as they are.
+		 */
+		RepackStats repackRepository(double liveness = 0.5, uint64_t maxBytes = 0, int maxSeconds = 0, ProgressFunction progress = DefaultProgressFunction);
+
+		struct VerifyStats
+		{
+			uint64_t snapshots;
+			uint64_t damagedSnapshots; // which couldn't be loaded
+			uint64_t objects; // referenced by the snapshots, a pack counting once
+			uint64_t missingObjects;
+			uint64_t damagedObjects; // whose HMAC doesn't match
+			uint64_t sampledFiles;
+			uint64_t damagedFiles; // which didn't decode or match their MD5
+		};
+
+		/**
+		 * Checks the integrity of the repository without restoring it.
+		 * The snapshots are loaded concurrently, as when compacting (see
+		 * Options::metadataThreads), and the objects they reference are
+		 * then downloaded concurrently by shard and their HMACs checked,
+		 * pack members separately, without decrypting them. About
+		 * @a samplePercent of the distinct files are also fully decoded
+		 * and their MD5 checked.
+		 *
+		 * Each problem found is passed to @a problem with the object or
+		 * file it concerns. Checked shards are recorded in the repository
+		 * with the problems found so far every few shards, and when the
+		 * check is cancelled, so an interrupted check resumes
+		 * where it stopped if the snapshots are unchanged, and reports the
+		 * earlier problems again.
+		 */
+		VerifyStats verifyRepository(double samplePercent = 0, const std::function<void (const char *what, const char *error)>& problem = nullptr, ProgressFunction progress = DefaultProgressFunction);
+
+		struct SyncStats
+		{
+			uint64_t snapshots; // copied
+			uint64_t objects; // referenced by them, without shared keys a pack member counting on its own
+			uint64_t copiedObjects; // which were missing from this repository
+			uint64_t copiedBytes; // downloaded from the source
+		};
+		
+		/**
+		 * Copies the snapshots @a names of @a source, an unlocked
+		 * repository, or all of its snapshots if @a names is empty, into
+		 * this repository. Snapshots already in this repository are
+		 * skipped.
+		 *
+		 * The snapshots are loaded concurrently (see
+		 * Options::metadataThreads), then the objects they reference which
+		 * this repository doesn't have are copied concurrently, found from
+		 * the object index if one is set, or else by listing the shards.
+		 * When both repositories have the same keys (see
+		 * initializeRepository()) the objects are copied as they are stored,
+		 * without decrypting them. Otherwise each object is decrypted and
+		 * encrypted again under this repository's keys, and the members of
+		 * packs are stored as objects of their own; as their ids change,
+		 * they are only known to be missing once decrypted.
+		 *
+		 * The snapshots are committed last, once all their objects are
+		 * copied, so an interrupted sync leaves no snapshot referencing
+		 * missing objects, and the objects it copied are skipped when it is
+		 * run again.
+		 */
+		SyncStats syncRepository(Repository& source, const std::vector<std::string>& names = std::vector<std::string>(), ProgressFunction progress = DefaultProgressFunction);
+
+		/**
+		 * Deletes a snapshot and its summary. Returns false if there is no
+		 * such snapshot.
+		 *
+		 * With reference counts (see setReferenceCounts()) the objects only
+		 * it referenced are found from the snapshot alone and removed, and
+		 * their number is written to @a freedObjects. They are dropped from
+		 * the object index first. Without them, while any snapshot has no
+		 * summary, or while another client holds a lease to write snapshots
+		 * (see compactRepository()), they are left for compactRepository().
+		 * The exclusive lease is taken before the counts are read, so no
+		 * client reuses the objects meanwhile; without it the counts are
+		 * left as they are.
 		 */
-		bool compactRepository();
+		bool deleteSnapshot(const char *name, uint64_t *freedObjects = nullptr);
 		
 		/**
 		 * Initiates a change password operation.
@@ -106,44 +282,229 @@ namespace Nebula
 		 * Lists available snapshots in the repository
 		 */
 		void listSnapshots(const std::function<void (const char *)>& callback, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Lists the snapshots with their summaries, which are downloaded
+		 * concurrently (see Options::metadataThreads). @a summary is nullptr
+		 * for snapshots committed without one.
+		 */
+		void listSnapshotSummaries(const std::function<void (const char *name, const SnapshotSummary *summary)>& callback, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Loads the summary of a snapshot. Returns false if the snapshot
+		 * has no summary.
+		 */
+		bool loadSnapshotSummary(const char *name, SnapshotSummary& summary, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Brings @a catalog up to date with the snapshots in the repository.
+		 * Snapshots are added in the order they were created, and removed
+		 * snapshots are dropped from it.
+		 */
+		void updateCatalog(Catalog& catalog, ProgressFunction progress = DefaultProgressFunction);
 
+		/**
+		 * Takes the shared lease on the repository, unless this instance
+		 * already holds it (see createSnapshot()). A backup takes it before
+		 * reading what it reuses, i.e. the files cache, the object index and
+		 * the parent snapshot, so compaction can't remove those objects in
+		 * between. Throws RepositoryException if another client is
+		 * compacting the repository.
+		 */
+		void takeSharedLease();
+		
 		/**
 		 * Creates a new snapshot. A snapshot is a collection of file.
+		 * If @a parent is given, files whose size and modify time match the
+		 * parent are added from the parent without being read.
+		 *
+		 * The first snapshot created takes the shared lease on the repository
+		 * (see Options::leaseSeconds), held until the repository instance is
+		 * destroyed, so clients can write snapshots concurrently while
+		 * nothing removes the objects they reuse. Throws RepositoryException
+		 * if another client is compacting the repository. The lease is
+		 * renewed as files are uploaded, and committing a snapshot throws
+		 * RepositoryException if it was lost meanwhile.
 		 */
-		std::shared_ptr<Snapshot> createSnapshot();
+		std::shared_ptr<Snapshot> createSnapshot(std::shared_ptr<Snapshot> parent = nullptr);
 		
 		/**
 		 * Creates a snapshot based on an existing snapshot.
 		 * Useful for making incremental backups.
 		 */
 		std::shared_ptr<Snapshot> loadSnapshot(const char *name, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Loads only the files at or under @a subpath. Snapshots committed
+		 * as a tree only fetch the directories needed, others, and those
+		 * in the metadata cache, are loaded whole.
+		 */
+		std::shared_ptr<Snapshot> loadSnapshot(const char *name, const char *subpath, ProgressFunction progress = DefaultProgressFunction);
 
 		/**
 		 * Uploads a file to the repository. Adds the entry to the snapshot.
 		 * Until a snapshot is committed, it is loose file which may be
 		 * compacted via the compactRepository() method.
+		 * Holes and runs of zeros in large files are stored as zero extents
+		 * which have no object. Small files whose contents are in the
+		 * object index, on their own or in a pack, reference them there
+		 * instead of being uploaded.
 		 */
 		void uploadFile(std::shared_ptr<Snapshot> snapshot, const char *destPath, FileStream& fileStream, FileTransferProgressFunction progress = DefaultFileTransferProgressFunction);
 		
 		/**
 		 * Downloads a file to the output stream.
+		 * If Options::verifyDownloads is set, the digest of the file is computed
+		 * as it is written and VerificationFailedException is thrown if it
+		 * does not match the snapshot.
 		 */
 		bool downloadFile(std::shared_ptr<Snapshot> snapshot, const char *srcPath, OutputStream& fileStream, FileTransferProgressFunction progress = DefaultFileTransferProgressFunction);
 
+		/**
+		 * Downloads a file to a file stream. The objects of the file are
+		 * downloaded and decoded concurrently (see Options::restoreThreads)
+		 * and each is written at its offset in the file. Zero extents are
+		 * restored as holes.
+		 *
+		 * If @a previousPath is given, the objects found in that older copy
+		 * of the file are copied from it before looking in the seeds (see
+		 * setRestoreSeeds()), the file being split on its own.
+		 */
+		bool downloadFile(std::shared_ptr<Snapshot> snapshot, const char *srcPath, FileStream& fileStream, FileTransferProgressFunction progress = DefaultFileTransferProgressFunction, const char *previousPath = nullptr);
+
+		/**
+		 * Opens a file in the snapshot for random access reads.
+		 * Returns nullptr if the file doesn't exist. The repository must
+		 * outlive the returned stream.
+		 */
+		std::shared_ptr<SnapshotFileStream> openFile(std::shared_ptr<Snapshot> snapshot, const char *srcPath);
+
 		std::shared_ptr<PackUploadState> createPackState();
 		void uploadFile(std::shared_ptr<PackUploadState> packUploadState, std::shared_ptr<Snapshot> snapshot, const char *destPath, FileStream& fileStream, FileTransferProgressFunction progress = DefaultFileTransferProgressFunction);
 		void finalizePack(std::shared_ptr<Snapshot> snapshot, std::shared_ptr<PackUploadState> uploadPackState, FileTransferProgressFunction progress = DefaultFileTransferProgressFunction);
 		
 		/**
-		 * Commits the snapshot to the repository.
+		 * Commits the snapshot to the repository, along with its summary.
+		 * With Options::treeSnapshots only the directories not already in
+		 * the repository are uploaded.
 		 */
 		void commitSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Records the files added to @a snapshot in the repository, so a
+		 * backup of @a name interrupted afterwards can resume with
+		 * loadCheckpoint() rather than read them again. The first call
+		 * writes every file and starts the snapshot's journal, later ones
+		 * only the files added since, so a checkpoint costs as much as the
+		 * files it adds. Files still in a pack which isn't finalized aren't
+		 * recorded. Compaction keeps the objects of checkpoints, and
+		 * committing the snapshot as @a name removes them.
+		 */
+		void checkpointSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Loads the files recorded by the checkpoints of an interrupted
+		 * backup of @a name, or returns nullptr if there are none. Given as
+		 * the parent of the snapshot resuming the backup, the files which
+		 * haven't changed since are added from it without being read. Its
+		 * own parent, if set, is looked at for files it doesn't have.
+		 */
+		std::shared_ptr<Snapshot> loadCheckpoint(const char *name, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Uses @a filesCache to add unchanged files without reading them.
+		 * The cache is cleared if the snapshot it was last committed in no
+		 * longer exists.
+		 */
+		void setFilesCache(std::shared_ptr<FilesCache> filesCache);
+		
+		/**
+		 * Uses @a objectIndex, usually kept in a local directory, to find
+		 * objects without asking the data store. The index objects in the
+		 * repository not yet in it are downloaded and merged first, and it
+		 * is rebuilt if any it was built from are gone. Objects missing
+		 * from it are uploaded again, which leaves them unchanged.
+		 *
+		 * Whether or not an index is used, the objects uploaded are
+		 * recorded in a new index object when a snapshot is committed.
+		 */
+		void setObjectIndex(std::shared_ptr<ObjectIndex> objectIndex, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Uses @a referenceCounts, usually kept in a local directory, to
+		 * count the snapshots referencing each object as snapshots are
+		 * committed and deleted. It is brought up to date first, counting
+		 * the snapshots committed elsewhere, and rebuilt if any snapshot it
+		 * counted has been deleted or rewritten elsewhere.
+		 */
+		void setReferenceCounts(std::shared_ptr<ReferenceCounts> referenceCounts, ProgressFunction progress = DefaultProgressFunction);
+		
+		/**
+		 * Keeps decoded snapshots in @a cacheStore, usually a local
+		 * directory, encrypted with keys derived from the repository's.
+		 * A cached snapshot is used when it matches the digest in the
+		 * snapshot's summary, so it is only downloaded again when it
+		 * changes. Snapshots without a summary aren't cached. The
+		 * repository must be unlocked.
+		 */
+		void setMetadataCache(std::shared_ptr<DataStore> cacheStore);
+		
+		/**
+		 * Restores files from the local files at @a paths, or under them
+		 * for directories, where they hold the same contents as objects of
+		 * the file, downloading only the other objects. The seeds are split
+		 * as uploadFile() splits the file restored, with the repository's
+		 * rolling hash and hash keys, the first time a file split alike is
+		 * restored to a FileStream without a previous copy holding all its
+		 * objects. Large files of different size classes split differently,
+		 * so the seeds are read again for each. Each object is checked again
+		 * as it is copied, so seeds which changed since, including files
+		 * restored over, fall back to downloading. Directories which can't
+		 * be read are skipped.
+		 */
+		void setRestoreSeeds(const std::vector<std::string>& paths);
+		
+		/**
+		 * An id for the repository, derived from its keys, for naming local
+		 * caches. Only available once the repository is unlocked.
+		 */
+		std::string repositoryId() const;
 
 	private:
+		friend class SnapshotFileStream;
+
 		enum { MAX_LOG_ROUNDS = 31 };
 
 		DataStore *mDataStore;
 		Options mOptions;
+		std::mutex mDataStoreMutex;
+		std::shared_ptr<FilesCache> mFilesCache;
+		std::shared_ptr<DataStore> mMetadataCache;
+		std::shared_ptr<ObjectIndex> mObjectIndex;
+		std::mutex mIndexMutex;
+		std::map<std::string, ObjectIndex::Entry> mPendingIndexEntries; // by id, not yet in an index object
+		std::vector<Snapshot::ObjectID> mPendingIndexRemovals;
+		std::shared_ptr<ReferenceCounts> mReferenceCounts;
+		std::unique_ptr<Lease> mLease; // shared, while writing snapshots
+		std::mutex mLeaseMutex;
+		std::map<std::string, uint32_t> mCheckpointSequences; // last written, by snapshot name
+		
+		// where the contents of an object are found in a seed
+		struct SeedChunk
+		{
+			std::string path;
+			uint64_t offset;
+		};
+		struct SeedSplit
+		{
+			std::once_flag once;
+			std::map<std::string, SeedChunk> chunks; // by object id
+		};
+		std::shared_ptr<const std::vector<std::pair<std::string, uint64_t>>> mSeedFiles; // with their sizes
+		std::map<std::tuple<int, uint64_t, int>, std::shared_ptr<SeedSplit>> mSeedSplits; // for each way of splitting the seeds
+		std::mutex mSeedMutex;
+		uint8_t mCacheEncKey[SHA256_DIGEST_LENGTH];
+		uint8_t mCacheMacKey[SHA256_DIGEST_LENGTH];
 
 		uint8_t *mEncKey;
 		uint8_t *mMacKey;
@@ -151,7 +512,39 @@ namespace Nebula
 		uint8_t *mRollKey;
 
 		void computeBlockHMAC(const uint8_t *block, size_t size, uint8_t compression, uint8_t *outHMAC);
-		void compressEncryptAndUploadBlock(CompressionType compressType, const Snapshot::ObjectID& objectId, const uint8_t *block, size_t size, ProgressFunction progress);
+		bool compressEncryptAndUploadBlock(CompressionType compressType, const Snapshot::ObjectID& objectId, const uint8_t *block, size_t size, ProgressFunction progress);
+
+		bool isObjectIndexed(const Snapshot::ObjectID& objectId);
+		void addIndexEntry(const Snapshot::ObjectID& objectId, const Snapshot::ObjectID& container, uint32_t offset, uint32_t length);
+		void flushIndexEntries();
+		std::vector<std::string> listIndexObjects();
+		std::string putIndexObject(std::vector<ObjectIndex::Entry>& entries, const std::vector<Snapshot::ObjectID>& removed);
+		void getIndexObject(const std::string& name, std::vector<ObjectIndex::Entry>& entries, std::vector<Snapshot::ObjectID>& removed);
+		void updateObjectIndex(ObjectIndex& objectIndex, ProgressFunction progress);
+		bool updateReferenceCounts(ReferenceCounts& referenceCounts, ProgressFunction progress);
+		void renewLease(bool force = false);
+		std::unique_ptr<Lease> takeExclusiveLease();
+
+		void commitSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, bool tree, const SnapshotSummary *summary, ProgressFunction progress);
+		bool addIndexedFile(std::shared_ptr<Snapshot> snapshot, const std::string& path, const FileInfo& fileInfo, CompressionType compression, const uint8_t *md5, const Snapshot::ObjectID& objectId);
+		std::vector<std::pair<std::string, uint32_t>> listCheckpoints(const char *name);
+		std::shared_ptr<Snapshot> fetchCheckpoint(const std::string& name, uint32_t sequence, ProgressFunction progress);
+		std::vector<uint64_t> checkpointedObjects();
+		bool addUnchangedFile(std::shared_ptr<Snapshot> snapshot, const std::string& path, const FileInfo& fileInfo);
+		std::map<int, SeedChunk> findSeedChunks(const Snapshot::FileEntry& fe, const Snapshot::ObjectID *objectIds, const char *previousPath);
+		void splitSeedFile(const std::string& path, uint64_t size, int rollingHashBits, uint64_t minBlockSize, CompressionType compression, std::map<std::string, SeedChunk>& chunks);
+		bool readSeedChunk(const SeedChunk& chunk, CompressionType compression, const Snapshot::ObjectID& objectId, uint8_t *buffer, size_t size);
+
+		void getObject(const std::string& path, OutputStream& outStream, ProgressFunction progress);
+		void getSnapshotSummary(const char *name, SnapshotSummary& summary, ProgressFunction progress);
+		void putSnapshot(std::shared_ptr<Snapshot> snapshot, const char *name, bool tree, const SnapshotSummary *summary, uint8_t *outDigest, ProgressFunction progress);
+		std::shared_ptr<Snapshot> fetchSnapshot(const char *name, const char *subpath, bool needTreeObjects, ProgressFunction progress);
+		bool loadCachedSnapshot(const char *name, const uint8_t *digest, Snapshot& snapshot);
+		void cacheSnapshot(const char *name, const uint8_t *digest, Snapshot& snapshot);
+		bool sharesKeys(const Repository& other) const;
+		void deriveKey(const uint8_t *key, const char *label, uint8_t *outKey) const;
+		void downloadObject(const Snapshot::FileEntry& fe, const Snapshot::ObjectID& objectId, OutputStream& outStream, ProgressFunction progress);
+		void decodeObject(const Snapshot::FileEntry& fe, InputStream& objectStream, OutputStream& outStream);
 
 		std::string objectIdToString(const Snapshot::ObjectID& objectId) const;
 		
@@ -17,8 +17,14 @@
 #include <math.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <string.h>
 #include <memory>
+#include <algorithm>
+#include <numeric>
 #include <mutex>
+#include <map>
+#include <tuple>
+#include <limits>
 #include <boost/filesystem.hpp>
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
@@ -35,10 +41,39 @@
 #include "LZMAUtils.h"
 #include "EncryptedOutputStream.h"
 #include "RollingHash.h"
+#include "LittleEndian.h"
 
 namespace Nebula
 {
+	enum { MAX_UNSORTED_FILES = 4096 };
+	
+	int Snapshot::comparePaths(const char *a, const char *b)
+	{
+		for(;; ++a, ++b) {
+			unsigned int ca = *a == '/' ? 1 : *a ? (uint8_t)*a + 1 : 0;
+			unsigned int cb = *b == '/' ? 1 : *b ? (uint8_t)*b + 1 : 0;
+			if(ca != cb) {
+				return ca < cb ? -1 : 1;
+			}
+			if(!ca) {
+				return 0;
+			}
+		}
+	}
+	
+	static uint32_t hashString(const char *str, size_t length)
+	{
+		// FNV-1a
+		uint32_t h = 2166136261u;
+		for(size_t i = 0; i < length; ++i) {
+			h = (h ^ (uint8_t)str[i]) * 16777619u;
+		}
+		return h;
+	}
+
 	Snapshot::Snapshot()
+	: mStringCount(0)
+	, mSortedFiles(0)
 	{
 	}
 	
@@ -59,7 +94,8 @@ namespace Nebula
 					  uint32_t offset,
 					  uint32_t packLength,
 					  int objectCount,
-					  const ObjectID *objectIds)
+					  const ObjectID *objectIds,
+					  const uint32_t *objectSizes)
 	{
 		using namespace boost;
 
@@ -69,6 +105,7 @@ namespace Nebula
 			throw InvalidArgumentException("Too many objects. Try a bigger block size.");
 		}
 
+		while(*path == '/') ++path;
 		filesystem::path pathname(path);
 		
 		FileEntry fe;
@@ -86,145 +123,1068 @@ namespace Nebula
 		fe.objectCount = objectCount;
 		fe.offset = offset;
 		fe.packLength = packLength;
-		fe.objectIdIndex = addObjectIds(objectIds, objectCount);
-		mFiles.insert(std::make_pair(path, fe));
+		fe.objectIdIndex = addObjectIds(objectIds, objectSizes, objectCount);
+		mFiles.push_back(fe);
+		
+		if(mJournal) {
+			mJournal->addFileEntry(path, user, group, type, mode, compression, size, mtime, rollingHashBits, md5, offset, packLength, objectCount, objectIds, objectSizes);
+		}
 	}
 	
-	const Snapshot::FileEntry *Snapshot::getFileEntry(const char *path)
+	void Snapshot::addFiles(Snapshot& other)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mMutex);
 		
-		auto f = mFiles.find(path);
-		if(f == mFiles.end()) {
-			return nullptr;
+		other.forEachFileEntry([this, &other](const FileEntry& fe) {
+			std::string path = other.indexToString(fe.pathIndex);
+			path += path.empty() ? "" : "/";
+			path += other.indexToString(fe.nameIndex);
+			addFileEntry(path.c_str(),
+						 other.indexToString(fe.userIndex),
+						 other.indexToString(fe.groupIndex),
+						 (FileType)fe.type,
+						 fe.mode,
+						 (CompressionType)fe.compression,
+						 fe.size,
+						 fe.mtime,
+						 fe.rollingHashBits,
+						 fe.md5,
+						 fe.offset,
+						 fe.packLength,
+						 fe.objectCount,
+						 fe.objectCount > 0 ? other.indexToObjectID(fe.objectIdIndex) : nullptr,
+						 fe.objectCount > 0 ? other.indexToObjectSize(fe.objectIdIndex) : nullptr);
+		});
+	}
+	
+	void Snapshot::startJournal()
+	{
+		std::lock_guard<std::recursive_mutex> lock(mMutex);
+		mJournal = std::make_shared<Snapshot>();
+	}
+	
+	std::shared_ptr<Snapshot> Snapshot::takeJournal()
+	{
+		std::lock_guard<std::recursive_mutex> lock(mMutex);
+		std::shared_ptr<Snapshot> journal = mJournal;
+		if(journal) {
+			mJournal = std::make_shared<Snapshot>();
 		}
+		return journal;
+	}
+	
+	const Snapshot::FileEntry *Snapshot::getFileEntry(const char *path)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mMutex);
 		
-		return &f->second;
+		int n = findFile(path);
+		return n >= 0 ? &mFiles[n] : nullptr;
 	}
 	
 	void Snapshot::forEachFileEntry(const std::function<void (const FileEntry&)>& callback)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mMutex);
-		for(auto fe : mFiles) {
-			callback(fe.second);
+		sortFiles();
+		for(const FileEntry& fe : mFiles) {
+			callback(fe);
 		}
 	}
 	
 	void Snapshot::forEachFileEntry(const char *subpath, const std::function<void (const FileEntry&)>& callback)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mMutex);
+		sortFiles();
+		
+		while(*subpath == '/') ++subpath;
 		std::string searchPath = subpath;
 		while(!searchPath.empty() && searchPath.back() == '/') {
 			searchPath.pop_back();
 		}
-
-		size_t n = searchPath.size();
-		auto found = mFiles.lower_bound(searchPath.c_str());
-		while(found != mFiles.end()) {
-			std::string filePath = std::string(indexToString(found->second.pathIndex)) + "/" + indexToString(found->second.nameIndex);
-			if(strncmp(searchPath.c_str(), filePath.c_str(), n) != 0) break;
-			if(!searchPath.empty() && filePath[n] != 0 && filePath[n] != '/') break;
-			callback(found->second);
-			++found;
+		
+		if(searchPath.empty()) {
+			for(const FileEntry& fe : mFiles) {
+				callback(fe);
+			}
+			return;
+		}
+		
+		int n = findFile(searchPath.c_str());
+		if(n >= 0) {
+			callback(mFiles[n]);
+		}
+		
+		// the directories under searchPath are contiguous
+		size_t length = searchPath.size();
+		auto first = std::lower_bound(mDirectories.begin(), mDirectories.end(), searchPath,
+									  [this](const Directory& dir, const std::string& path) {
+										  return comparePaths(indexToString(dir.pathIndex), path.c_str()) < 0;
+									  });
+		auto last = std::partition_point(first, mDirectories.end(),
+										 [this, &searchPath, length](const Directory& dir) {
+											 const char *dirPath = indexToString(dir.pathIndex);
+											 return strncmp(dirPath, searchPath.c_str(), length) == 0 &&
+												 (dirPath[length] == 0 || dirPath[length] == '/');
+										 });
+		if(first == last) {
+			return;
+		}
+		
+		size_t end = (last - 1)->firstFile + (last - 1)->fileCount;
+		for(size_t i = first->firstFile; i < end; ++i) {
+			callback(mFiles[i]);
 		}
 	}
 	
+	static int compareFiles(const Snapshot& a, const Snapshot::FileEntry& fa, const Snapshot& b, const Snapshot::FileEntry& fb)
+	{
+		int c = Snapshot::comparePaths(a.indexToString(fa.pathIndex), b.indexToString(fb.pathIndex));
+		return c != 0 ? c : strcmp(a.indexToString(fa.nameIndex), b.indexToString(fb.nameIndex));
+	}
+	
+	static bool idLess(const Snapshot::ObjectID& a, const Snapshot::ObjectID& b)
+	{
+		return memcmp(a.id, b.id, sizeof(a.id)) < 0;
+	}
+	
+	Snapshot::DiffStats Snapshot::diff(Snapshot& base, const DiffFunction& callback)
+	{
+		std::unique_lock<std::recursive_mutex> lock(mMutex, std::defer_lock);
+		std::unique_lock<std::recursive_mutex> baseLock(base.mMutex, std::defer_lock);
+		std::lock(lock, baseLock);
+		sortFiles();
+		base.sortFiles();
+		
+		DiffStats stats;
+		memset(&stats, 0, sizeof(stats));
+		
+		// the base's objects ordered by id, to look up the objects of
+		// changed files
+		std::vector<uint32_t> baseObjects(base.mObjectIDs.size());
+		std::iota(baseObjects.begin(), baseObjects.end(), 0);
+		std::sort(baseObjects.begin(), baseObjects.end(), [&base](uint32_t a, uint32_t b) {
+			return idLess(base.mObjectIDs[a], base.mObjectIDs[b]);
+		});
+		auto inBase = [&base, &baseObjects](const ObjectID& id) {
+			auto it = std::lower_bound(baseObjects.begin(), baseObjects.end(), id, [&base](uint32_t a, const ObjectID& id) {
+				return idLess(base.mObjectIDs[a], id);
+			});
+			return it != baseObjects.end() && memcmp(base.mObjectIDs[*it].id, id.id, sizeof(id.id)) == 0;
+		};
+		
+		// objects missing from the base with their sizes, counted once each
+		// at the end as files may share objects
+		std::vector<std::pair<uint32_t, uint64_t>> newObjects;
+		uint64_t newPackBytes = 0;
+		auto addNewObjects = [this, &inBase, &newObjects, &newPackBytes](const FileEntry& fe) {
+			if(fe.objectCount == 0) {
+				return;
+			}
+			if(fe.packLength > 0) {
+				// only this file's part of a pack is new
+				if(!inBase(mObjectIDs[fe.objectIdIndex])) {
+					newPackBytes += fe.packLength;
+				}
+				return;
+			}
+			for(uint32_t i = fe.objectIdIndex; i < fe.objectIdIndex + fe.objectCount; ++i) {
+				if(!mObjectIDs[i].isZeroExtent() && !inBase(mObjectIDs[i])) {
+					uint64_t size = mObjectSizes[i] ? mObjectSizes[i] : fe.size / fe.objectCount;
+					newObjects.push_back(std::make_pair(i, size));
+				}
+			}
+		};
+		
+		auto sameObjects = [this, &base](const FileEntry& a, const FileEntry& b) {
+			return a.objectCount == b.objectCount &&
+				a.offset == b.offset &&
+				a.packLength == b.packLength &&
+				std::equal(mObjectIDs.begin() + a.objectIdIndex, mObjectIDs.begin() + a.objectIdIndex + a.objectCount,
+						   base.mObjectIDs.begin() + b.objectIdIndex, [](const ObjectID& x, const ObjectID& y) {
+					return memcmp(x.id, y.id, sizeof(x.id)) == 0;
+				});
+		};
+		
+		auto report = [&callback](Change change, const Snapshot& snapshot, const FileEntry& fe, const FileEntry *baseEntry, const FileEntry *entry) {
+			if(callback) {
+				std::string path = snapshot.indexToString(fe.pathIndex);
+				path += path.empty() ? "" : "/";
+				path += snapshot.indexToString(fe.nameIndex);
+				callback(change, path.c_str(), baseEntry, entry);
+			}
+		};
+		
+		size_t i = 0, j = 0;
+		while(i < mFiles.size() || j < base.mFiles.size()) {
+			int c = i == mFiles.size() ? 1 : j == base.mFiles.size() ? -1 : compareFiles(*this, mFiles[i], base, base.mFiles[j]);
+			if(c < 0) {
+				const FileEntry& fe = mFiles[i++];
+				++stats.added;
+				stats.addedSize += fe.size;
+				addNewObjects(fe);
+				report(Change::Added, *this, fe, nullptr, &fe);
+			} else if(c > 0) {
+				const FileEntry& baseFe = base.mFiles[j++];
+				++stats.removed;
+				stats.removedSize += baseFe.size;
+				report(Change::Removed, base, baseFe, &baseFe, nullptr);
+			} else {
+				const FileEntry& fe = mFiles[i++];
+				const FileEntry& baseFe = base.mFiles[j++];
+				bool contentSame = sameObjects(fe, baseFe);
+				if(contentSame &&
+				   fe.size == baseFe.size &&
+				   fe.mtime == baseFe.mtime &&
+				   fe.type == baseFe.type &&
+				   fe.mode == baseFe.mode &&
+				   memcmp(fe.md5, baseFe.md5, MD5_DIGEST_LENGTH) == 0 &&
+				   strcmp(indexToString(fe.userIndex), base.indexToString(baseFe.userIndex)) == 0 &&
+				   strcmp(indexToString(fe.groupIndex), base.indexToString(baseFe.groupIndex)) == 0) {
+					continue;
+				}
+				
+				++stats.modified;
+				if(!contentSame) {
+					addNewObjects(fe);
+				}
+				report(Change::Modified, *this, fe, &baseFe, &fe);
+			}
+		}
+		
+		std::sort(newObjects.begin(), newObjects.end(), [this](const std::pair<uint32_t, uint64_t>& a, const std::pair<uint32_t, uint64_t>& b) {
+			return idLess(mObjectIDs[a.first], mObjectIDs[b.first]);
+		});
+		stats.newBytes = newPackBytes;
+		for(size_t k = 0; k < newObjects.size(); ++k) {
+			if(k == 0 || idLess(mObjectIDs[newObjects[k - 1].first], mObjectIDs[newObjects[k].first])) {
+				stats.newBytes += newObjects[k].second;
+			}
+		}
+		
+		return stats;
+	}
+	
 	void Snapshot::deleteFileEntry(const char *path)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mMutex);
+		sortFiles();
 
-		auto entry = mFiles.find(path);
-		if(entry != mFiles.end()) {
-			mFiles.erase(entry);
+		int n = findFile(path);
+		if(n >= 0) {
+			mFiles.erase(mFiles.begin() + n);
+			mSortedFiles = mFiles.size();
+			indexDirectories();
+		}
+	}
+	
+	bool Snapshot::fileLess(const FileEntry& a, const FileEntry& b) const
+	{
+		if(a.pathIndex != b.pathIndex) {
+			int c = comparePaths(indexToString(a.pathIndex), indexToString(b.pathIndex));
+			if(c != 0) {
+				return c < 0;
+			}
+		}
+		
+		return a.nameIndex != b.nameIndex && strcmp(indexToString(a.nameIndex), indexToString(b.nameIndex)) < 0;
+	}
+	
+	void Snapshot::sortFiles()
+	{
+		if(mSortedFiles == mFiles.size()) {
+			return;
+		}
+		
+		auto less = [this](const FileEntry& a, const FileEntry& b) { return fileLess(a, b); };
+		auto unsortedBegin = mFiles.begin() + mSortedFiles;
+		if(!std::is_sorted(unsortedBegin, mFiles.end(), less)) {
+			std::stable_sort(unsortedBegin, mFiles.end(), less);
+		}
+		std::inplace_merge(mFiles.begin(), unsortedBegin, mFiles.end(), less);
+		
+		// a path added more than once keeps the first entry
+		auto last = std::unique(mFiles.begin(), mFiles.end(), [](const FileEntry& a, const FileEntry& b) {
+			return a.pathIndex == b.pathIndex && a.nameIndex == b.nameIndex;
+		});
+		mFiles.erase(last, mFiles.end());
+		
+		mSortedFiles = mFiles.size();
+		indexDirectories();
+	}
+	
+	void Snapshot::indexDirectories()
+	{
+		mDirectories.clear();
+		for(uint32_t i = 0; i < mSortedFiles; ++i) {
+			if(mDirectories.empty() || mDirectories.back().pathIndex != mFiles[i].pathIndex) {
+				Directory dir;
+				dir.pathIndex = mFiles[i].pathIndex;
+				dir.firstFile = i;
+				dir.fileCount = 0;
+				mDirectories.push_back(dir);
+			}
+			++mDirectories.back().fileCount;
+		}
+	}
+	
+	int Snapshot::findDirectory(uint32_t pathIndex) const
+	{
+		const char *path = indexToString(pathIndex);
+		auto dir = std::lower_bound(mDirectories.begin(), mDirectories.end(), path,
+									[this](const Directory& dir, const char *path) {
+										return comparePaths(indexToString(dir.pathIndex), path) < 0;
+									});
+		if(dir == mDirectories.end() || comparePaths(indexToString(dir->pathIndex), path) != 0) {
+			return -1;
+		}
+		return dir - mDirectories.begin();
+	}
+	
+	int Snapshot::findFile(const char *path)
+	{
+		if(mFiles.size() - mSortedFiles > MAX_UNSORTED_FILES) {
+			sortFiles();
+		}
+		
+		// the path and name are looked up as interned strings, so files
+		// can be matched by index
+		while(*path == '/') ++path;
+		const char *slash = strrchr(path, '/');
+		const char *name = slash ? slash + 1 : path;
+		int pathIndex = findString(path, slash ? slash - path : 0);
+		int nameIndex = findString(name, strlen(name));
+		if(pathIndex < 0 || nameIndex < 0) {
+			return -1;
+		}
+		
+		int d = findDirectory(pathIndex);
+		if(d >= 0) {
+			auto begin = mFiles.begin() + mDirectories[d].firstFile;
+			auto end = begin + mDirectories[d].fileCount;
+			auto f = std::lower_bound(begin, end, name, [this](const FileEntry& fe, const char *name) {
+				return strcmp(indexToString(fe.nameIndex), name) < 0;
+			});
+			if(f != end && f->nameIndex == nameIndex) {
+				return f - mFiles.begin();
+			}
+		}
+		
+		for(size_t i = mSortedFiles; i < mFiles.size(); ++i) {
+			if(mFiles[i].pathIndex == pathIndex && mFiles[i].nameIndex == nameIndex) {
+				return i;
+			}
+		}
+		
+		return -1;
+	}
+	
+	bool Snapshot::ObjectID::isZeroExtent() const
+	{
+		static const uint8_t zeroId[SHA256_DIGEST_LENGTH] = { 0 };
+		return memcmp(id, zeroId, sizeof(zeroId)) == 0;
+	}
+	
+	// file entries are stored as fixed size little-endian records, read and
+	// written a block at a time
+	enum
+	{
+		FILE_RECORD_SIZE = 68,
+		RECORDS_PER_BLOCK = 4096
+	};
+	
+	typedef std::vector<uint8_t, ZeroedAllocator<uint8_t>> RecordBuffer;
+	
+	static void decodeFileEntry(const uint8_t *p, Snapshot::FileEntry& fe)
+	{
+		fe.nameIndex = LittleEndian::load32(p);
+		fe.pathIndex = LittleEndian::load32(p + 4);
+		fe.userIndex = LittleEndian::load32(p + 8);
+		fe.groupIndex = LittleEndian::load32(p + 12);
+		fe.mode = LittleEndian::load16(p + 16);
+		fe.compression = p[18];
+		// p[19] is reserved
+		fe.type = p[20];
+		fe.rollingHashBits = p[21];
+		fe.objectCount = LittleEndian::load16(p + 22);
+		fe.size = LittleEndian::load64(p + 24);
+		fe.mtime = LittleEndian::load64(p + 32);
+		memcpy(fe.md5, p + 40, MD5_DIGEST_LENGTH);
+		fe.offset = LittleEndian::load32(p + 56);
+		fe.packLength = LittleEndian::load32(p + 60);
+		fe.objectIdIndex = LittleEndian::load32(p + 64);
+	}
+	
+	static void encodeFileEntry(const Snapshot::FileEntry& fe, uint8_t *p)
+	{
+		LittleEndian::store32(p, fe.nameIndex);
+		LittleEndian::store32(p + 4, fe.pathIndex);
+		LittleEndian::store32(p + 8, fe.userIndex);
+		LittleEndian::store32(p + 12, fe.groupIndex);
+		LittleEndian::store16(p + 16, fe.mode);
+		p[18] = fe.compression;
+		p[19] = 0;
+		p[20] = fe.type;
+		p[21] = fe.rollingHashBits;
+		LittleEndian::store16(p + 22, fe.objectCount);
+		LittleEndian::store64(p + 24, fe.size);
+		LittleEndian::store64(p + 32, fe.mtime);
+		memcpy(p + 40, fe.md5, MD5_DIGEST_LENGTH);
+		LittleEndian::store32(p + 56, fe.offset);
+		LittleEndian::store32(p + 60, fe.packLength);
+		LittleEndian::store32(p + 64, fe.objectIdIndex);
+	}
+	
+	// version 4 snapshots store each field of the file entries as a column
+	// of varints, most of them deltas from the previous entry
+	class ColumnWriter
+	{
+	public:
+		void putVarInt(uint64_t v)
+		{
+			while(v >= 0x80) {
+				mData.push_back((uint8_t)v | 0x80);
+				v >>= 7;
+			}
+			mData.push_back((uint8_t)v);
+		}
+		
+		void putSigned(int64_t v)
+		{
+			putVarInt(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+		}
+		
+		void put(const uint8_t *data, size_t size)
+		{
+			mData.insert(mData.end(), data, data + size);
+		}
+		
+		void write(OutputStream& outStream)
+		{
+			uint8_t length[4];
+			LittleEndian::store32(length, mData.size());
+			outStream.write(length, sizeof(length));
+			outStream.write(mData.data(), mData.size());
+			mData.clear();
+		}
+	private:
+		RecordBuffer mData;
+	};
+	
+	class ColumnReader
+	{
+	public:
+		void read(InputStream& inStream)
+		{
+			uint8_t length[4];
+			inStream.readExpected(length, sizeof(length));
+			mData.resize(LittleEndian::load32(length));
+			inStream.readExpected(mData.data(), mData.size());
+			mPos = 0;
+		}
+		
+		uint64_t getVarInt()
+		{
+			uint64_t v = 0;
+			for(int shift = 0; shift < 64; shift += 7) {
+				uint8_t b = *get(1);
+				v |= (uint64_t)(b & 0x7f) << shift;
+				if(!(b & 0x80)) {
+					return v;
+				}
+			}
+			throw InvalidFormatException("Invalid snapshot column.");
+		}
+		
+		int64_t getSigned()
+		{
+			uint64_t v = getVarInt();
+			return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		}
+		
+		const uint8_t *get(size_t size)
+		{
+			if(size > mData.size() - mPos) {
+				throw InvalidFormatException("Invalid snapshot column.");
+			}
+			mPos += size;
+			return &mData[mPos - size];
+		}
+		
+		void finish()
+		{
+			if(mPos != mData.size()) {
+				throw InvalidFormatException("Invalid snapshot column.");
+			}
+		}
+	private:
+		RecordBuffer mData;
+		size_t mPos;
+	};
+	
+	// fields which are mostly the same for every file are coded together
+	// as an index into a dictionary
+	typedef std::tuple<uint32_t, uint32_t, uint16_t, uint8_t, uint8_t, uint8_t> FileAttributes;
+	
+	static FileAttributes fileAttributes(const Snapshot::FileEntry& fe)
+	{
+		return FileAttributes(fe.userIndex, fe.groupIndex, fe.mode, fe.type, fe.compression, fe.rollingHashBits);
+	}
+	
+	void Snapshot::saveColumns(OutputStream& outStream)
+	{
+		ColumnWriter column;
+		
+		for(uint32_t size : mObjectSizes) {
+			column.putVarInt(size);
+		}
+		column.write(outStream);
+		
+		std::map<FileAttributes, uint32_t> dictionary;
+		std::vector<FileAttributes> attributes;
+		for(const FileEntry& fe : mFiles) {
+			if(dictionary.insert(std::make_pair(fileAttributes(fe), (uint32_t)attributes.size())).second) {
+				attributes.push_back(fileAttributes(fe));
+			}
+		}
+		column.putVarInt(attributes.size());
+		for(const FileAttributes& a : attributes) {
+			column.putVarInt(std::get<0>(a));
+			column.putVarInt(std::get<1>(a));
+			column.putVarInt(std::get<2>(a));
+			uint8_t bytes[3] = { std::get<3>(a), std::get<4>(a), std::get<5>(a) };
+			column.put(bytes, sizeof(bytes));
+		}
+		column.write(outStream);
+		
+		for(const FileEntry& fe : mFiles) {
+			column.putVarInt(dictionary[fileAttributes(fe)]);
+		}
+		column.write(outStream);
+		
+		const FileEntry zero = FileEntry();
+		const FileEntry *prev = &zero;
+		for(const FileEntry& fe : mFiles) {
+			column.putSigned((int64_t)fe.pathIndex - prev->pathIndex);
+			prev = &fe;
+		}
+		column.write(outStream);
+		
+		prev = &zero;
+		for(const FileEntry& fe : mFiles) {
+			column.putSigned((int64_t)fe.nameIndex - prev->nameIndex);
+			prev = &fe;
+		}
+		column.write(outStream);
+		
+		for(const FileEntry& fe : mFiles) {
+			column.putVarInt(fe.size);
+		}
+		column.write(outStream);
+		
+		prev = &zero;
+		for(const FileEntry& fe : mFiles) {
+			column.putSigned((int64_t)((uint64_t)fe.mtime - (uint64_t)prev->mtime));
+			prev = &fe;
+		}
+		column.write(outStream);
+		
+		for(const FileEntry& fe : mFiles) {
+			column.put(fe.md5, MD5_DIGEST_LENGTH);
+		}
+		column.write(outStream);
+		
+		// objects are usually in the same order as the files
+		prev = &zero;
+		for(const FileEntry& fe : mFiles) {
+			column.putVarInt(fe.objectCount);
+			column.putSigned((int64_t)fe.objectIdIndex - ((int64_t)prev->objectIdIndex + prev->objectCount));
+			prev = &fe;
+		}
+		column.write(outStream);
+		
+		for(const FileEntry& fe : mFiles) {
+			column.putVarInt(fe.offset);
+			column.putVarInt(fe.packLength);
+		}
+		column.write(outStream);
+	}
+	
+	void Snapshot::loadColumns(InputStream& inStream, uint32_t numFiles)
+	{
+		uint64_t stringTableSize = mStringBuffer.size();
+		uint64_t numObjects = mObjectIDs.size();
+		auto stringIndex = [stringTableSize](int64_t idx) -> uint32_t {
+			if(idx < 0 || idx >= stringTableSize) {
+				throw InvalidFormatException("Invalid file entry.");
+			}
+			return idx;
+		};
+		
+		ColumnReader column;
+		column.read(inStream);
+		for(uint32_t& size : mObjectSizes) {
+			size = column.getVarInt();
+		}
+		column.finish();
+		
+		column.read(inStream);
+		std::vector<FileAttributes> attributes(std::min<uint64_t>(column.getVarInt(), numFiles));
+		for(FileAttributes& a : attributes) {
+			std::get<0>(a) = stringIndex(column.getVarInt());
+			std::get<1>(a) = stringIndex(column.getVarInt());
+			std::get<2>(a) = column.getVarInt();
+			const uint8_t *bytes = column.get(3);
+			std::get<3>(a) = bytes[0];
+			std::get<4>(a) = bytes[1];
+			std::get<5>(a) = bytes[2];
+		}
+		column.finish();
+		
+		mFiles.assign(numFiles, FileEntry());
+		
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			uint64_t idx = column.getVarInt();
+			if(idx >= attributes.size()) {
+				throw InvalidFormatException("Invalid file entry.");
+			}
+			std::tie(fe.userIndex, fe.groupIndex, fe.mode, fe.type, fe.compression, fe.rollingHashBits) = attributes[idx];
+		}
+		column.finish();
+		
+		int64_t pathIndex = 0;
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			pathIndex += column.getSigned();
+			fe.pathIndex = stringIndex(pathIndex);
+		}
+		column.finish();
+		
+		int64_t nameIndex = 0;
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			nameIndex += column.getSigned();
+			fe.nameIndex = stringIndex(nameIndex);
+		}
+		column.finish();
+		
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			fe.size = column.getVarInt();
+		}
+		column.finish();
+		
+		uint64_t mtime = 0;
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			mtime += column.getSigned();
+			fe.mtime = mtime;
+		}
+		column.finish();
+		
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			memcpy(fe.md5, column.get(MD5_DIGEST_LENGTH), MD5_DIGEST_LENGTH);
 		}
+		column.finish();
+		
+		int64_t nextObjectIdIndex = 0;
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			uint64_t objectCount = column.getVarInt();
+			int64_t objectIdIndex = nextObjectIdIndex + column.getSigned();
+			if(objectCount > std::numeric_limits<uint16_t>::max() || objectIdIndex < 0 ||
+			   objectIdIndex + objectCount > numObjects) {
+				throw InvalidFormatException("Invalid file entry.");
+			}
+			fe.objectCount = objectCount;
+			fe.objectIdIndex = objectIdIndex;
+			nextObjectIdIndex = objectIdIndex + objectCount;
+		}
+		column.finish();
+		
+		column.read(inStream);
+		for(FileEntry& fe : mFiles) {
+			fe.offset = column.getVarInt();
+			fe.packLength = column.getVarInt();
+		}
+		column.finish();
+	}
+	
+	void Snapshot::load(const uint8_t *data, size_t size)
+	{
+		MemoryInputStream inStream(data, size);
+		load(inStream);
 	}
 	
 	void Snapshot::load(InputStream& inStream)
+	{
+		load(inStream, nullptr);
+	}
+	
+	void Snapshot::load(InputStream& inStream, const GetTreeFunction& getTree, const char *subpath)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mMutex);
 		
-		uint32_t numFiles = inStream.readType<uint32_t>();
-		uint32_t stringTableSize = inStream.readType<uint32_t>() * 4;
-		uint32_t numObjects = inStream.readType<uint32_t>();
+		// version 1 snapshots have no marker or version
+		uint8_t header[4 + 4 + SHA256_DIGEST_LENGTH];
+		inStream.readExpected(header, 4);
+		mTreeObjects.clear();
+		if(LittleEndian::load32(header) == TREE_MARKER) {
+			inStream.readExpected(header + 4, 4 + SHA256_DIGEST_LENGTH);
+			if(LittleEndian::load32(header + 4) > TREE_VERSION) {
+				throw InvalidFormatException("Unsupported snapshot version.");
+			}
+			if(!getTree) {
+				throw InvalidArgumentException("Snapshot is a tree but has no way to get its directories.");
+			}
+			
+			ObjectID rootId;
+			memcpy(rootId.id, header + 8, SHA256_DIGEST_LENGTH);
+			
+			mStringBuffer.clear();
+			mStringIndex.clear();
+			mStringCount = 0;
+			mObjectIDs.clear();
+			mObjectSizes.clear();
+			mFiles.clear();
+			mSortedFiles = 0;
+			
+			if(subpath) {
+				while(*subpath == '/') ++subpath;
+			}
+			loadTreeNode(rootId, "", subpath, getTree);
+			
+			// directories are visited in order, so this only indexes them
+			sortFiles();
+			return;
+		}
+		
+		uint32_t version = 1;
+		const uint8_t *fields = header;
+		if(LittleEndian::load32(header) == VERSION_MARKER) {
+			inStream.readExpected(header + 4, 16);
+			version = LittleEndian::load32(header + 4);
+			if(version > VERSION) {
+				throw InvalidFormatException("Unsupported snapshot version.");
+			}
+			fields += 8;
+		} else {
+			inStream.readExpected(header + 4, 8);
+		}
+		uint32_t numFiles = LittleEndian::load32(fields);
+		uint32_t stringTableSize = LittleEndian::load32(fields + 4) * 4;
+		uint32_t numObjects = LittleEndian::load32(fields + 8);
 		
 		mStringBuffer.resize(stringTableSize);
 		inStream.readExpected(&mStringBuffer[0], stringTableSize);
-		
-		// build string table
-		const char *p = &mStringBuffer[0];
-		const char *end = p + stringTableSize;
-		while(p < end) {
-			mStringTable[p] = p - &mStringBuffer[0];
-			size_t n = strlen(p);
-			p += n + 1;
-			while(!*p && p < end) ++p;
+		if(stringTableSize > 0 && mStringBuffer.back() != 0) {
+			throw InvalidFormatException("Invalid string table.");
 		}
 		
 		mObjectIDs.resize(numObjects);
-		for(int i = 0; i < numObjects; ++i) {
-			inStream.readExpected(mObjectIDs[i].id, SHA256_DIGEST_LENGTH);
+		inStream.readExpected(mObjectIDs.data(), (size_t)numObjects * sizeof(ObjectID));
+		
+		mObjectSizes.assign(numObjects, 0);
+		mFiles.clear();
+		if(version >= 4) {
+			loadColumns(inStream, numFiles);
+		} else {
+			RecordBuffer buffer;
+			if(version >= 2) {
+				buffer.resize(RECORDS_PER_BLOCK * sizeof(uint32_t));
+				for(uint32_t i = 0; i < numObjects; i += RECORDS_PER_BLOCK) {
+					uint32_t count = std::min<uint32_t>(numObjects - i, RECORDS_PER_BLOCK);
+					inStream.readExpected(&buffer[0], count * sizeof(uint32_t));
+					for(uint32_t j = 0; j < count; ++j) {
+						mObjectSizes[i + j] = LittleEndian::load32(&buffer[j * sizeof(uint32_t)]);
+					}
+				}
+			}
+		
+			mFiles.reserve(numFiles);
+			buffer.resize(RECORDS_PER_BLOCK * FILE_RECORD_SIZE);
+			for(uint32_t i = 0; i < numFiles; i += RECORDS_PER_BLOCK) {
+				uint32_t count = std::min<uint32_t>(numFiles - i, RECORDS_PER_BLOCK);
+				inStream.readExpected(&buffer[0], count * FILE_RECORD_SIZE);
+				for(uint32_t j = 0; j < count; ++j) {
+					FileEntry fe;
+					decodeFileEntry(&buffer[j * FILE_RECORD_SIZE], fe);
+					if(fe.nameIndex >= stringTableSize || fe.pathIndex >= stringTableSize ||
+					   fe.userIndex >= stringTableSize || fe.groupIndex >= stringTableSize ||
+					   (uint64_t)fe.objectIdIndex + fe.objectCount > numObjects) {
+						throw InvalidFormatException("Invalid file entry.");
+					}
+					mFiles.push_back(fe);
+				}
+			}
 		}
 		
-		for(int i = 0; i < numFiles; ++i) {
-			FileEntry fe;
-			fe.nameIndex = inStream.readType<uint32_t>();
-			fe.pathIndex = inStream.readType<uint32_t>();
-			fe.userIndex = inStream.readType<uint32_t>();
-			fe.groupIndex = inStream.readType<uint32_t>();
-			fe.mode = inStream.readType<uint16_t>();
-			fe.compression = inStream.readType<uint8_t>();
-			inStream.readType<uint8_t>();
-			fe.type = inStream.readType<uint8_t>();
-			fe.rollingHashBits = inStream.readType<uint8_t>();
-			fe.objectCount = inStream.readType<uint16_t>();
-			fe.size = inStream.readType<uint64_t>();
-			fe.mtime = inStream.readType<uint64_t>();
-			inStream.readExpected(fe.md5, MD5_DIGEST_LENGTH);
-			fe.offset = inStream.readType<uint32_t>();
-			fe.packLength = inStream.readType<uint32_t>();
-			fe.objectIdIndex = inStream.readType<uint32_t>();
-			
-			std::string path = std::string(indexToString(fe.pathIndex)) + "/" + indexToString(fe.nameIndex);
-			mFiles[path] = fe;
+		// intern the strings in use, padding can't be told apart from
+		// empty strings in the table itself
+		mStringIndex.clear();
+		mStringCount = 0;
+		for(const FileEntry& fe : mFiles) {
+			indexString(fe.pathIndex);
+			indexString(fe.nameIndex);
+			indexString(fe.userIndex);
+			indexString(fe.groupIndex);
 		}
+
+		// snapshots are saved sorted, apart from ones written before the
+		// files were kept in this order
+		mSortedFiles = 0;
+		sortFiles();
 	}
 	
 	void Snapshot::save(OutputStream& outStream)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mMutex);
-
-		// file size, string table size, and block count
-		outStream.writeType<uint32_t>(mFiles.size());
-		outStream.writeType<uint32_t>((mStringBuffer.size() + 3) / 4); // string size is / 4
-		outStream.writeType<uint32_t>(mObjectIDs.size());
+		
+		// drops the paths added more than once, before they are counted
+		sortFiles();
+		
+		// marker, version, file count, string table size / 4, and object count
+		uint8_t header[20];
+		LittleEndian::store32(header, VERSION_MARKER);
+		LittleEndian::store32(header + 4, VERSION);
+		LittleEndian::store32(header + 8, mFiles.size());
+		LittleEndian::store32(header + 12, (mStringBuffer.size() + 3) / 4);
+		LittleEndian::store32(header + 16, mObjectIDs.size());
+		outStream.write(header, sizeof(header));
 		
 		// string table
 		outStream.write(&mStringBuffer[0], (mStringBuffer.size() + 3) & ~3);
 		
 		// block hashes
-		for(int i = 0; i < mObjectIDs.size(); ++i) {
-			outStream.write(mObjectIDs[i].id, SHA256_DIGEST_LENGTH);
+		outStream.write(mObjectIDs.data(), mObjectIDs.size() * sizeof(ObjectID));
+		
+		saveColumns(outStream);
+	}
+
+	// a directory and the directories under it, for building a tree
+	struct Snapshot::TreeNode
+	{
+		std::string name;
+		uint32_t firstFile;
+		uint32_t fileCount;
+		std::vector<uint32_t> children;
+	};
+	
+	enum
+	{
+		TREE_HEADER_SIZE = 20,
+		TREE_DIRECTORY_RECORD_SIZE = 4 + SHA256_DIGEST_LENGTH
+	};
+	
+	void Snapshot::saveTree(OutputStream& outStream, const PutTreeFunction& putTree)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mMutex);
+		
+		sortFiles();
+		
+		// directories are sorted so that the ones under a directory follow
+		// it, and each component of a path is the last child added to its
+		// parent when the path is reached
+		std::vector<TreeNode> nodes(1);
+		nodes[0].firstFile = 0;
+		nodes[0].fileCount = 0;
+		for(const Directory& dir : mDirectories) {
+			uint32_t node = 0;
+			const char *path = indexToString(dir.pathIndex);
+			while(*path) {
+				const char *slash = strchr(path, '/');
+				size_t length = slash ? slash - path : strlen(path);
+				if(length > 0) {
+					std::string name(path, length);
+					if(nodes[node].children.empty() || nodes[nodes[node].children.back()].name != name) {
+						TreeNode child;
+						child.name = name;
+						child.firstFile = 0;
+						child.fileCount = 0;
+						nodes[node].children.push_back(nodes.size());
+						nodes.push_back(child);
+					}
+					node = nodes[node].children.back();
+				}
+				path += slash ? length + 1 : length;
+			}
+			nodes[node].firstFile = dir.firstFile;
+			nodes[node].fileCount = dir.fileCount;
 		}
 		
-		for(auto& fkv : mFiles)
+		mTreeObjects.clear();
+		ObjectID rootId = saveTreeNode(nodes, 0, putTree);
+		
+		uint8_t header[4 + 4 + SHA256_DIGEST_LENGTH];
+		LittleEndian::store32(header, TREE_MARKER);
+		LittleEndian::store32(header + 4, TREE_VERSION);
+		memcpy(header + 8, rootId.id, SHA256_DIGEST_LENGTH);
+		outStream.write(header, sizeof(header));
+	}
+	
+	Snapshot::ObjectID Snapshot::saveTreeNode(const std::vector<TreeNode>& nodes, uint32_t node, const PutTreeFunction& putTree)
+	{
+		std::vector<ObjectID> childIds;
+		for(uint32_t child : nodes[node].children) {
+			childIds.push_back(saveTreeNode(nodes, child, putTree));
+		}
+		
+		// the directory has its own string table, so its encoding only
+		// depends on what is in it
+		std::vector<char, ZeroedAllocator<char>> strings;
+		std::map<std::string, uint32_t> stringIndices;
+		auto addString = [&strings, &stringIndices](const char *str) -> uint32_t {
+			auto it = stringIndices.find(str);
+			if(it != stringIndices.end()) {
+				return it->second;
+			}
+			uint32_t idx = strings.size();
+			strings.insert(strings.end(), str, str + strlen(str) + 1);
+			stringIndices[str] = idx;
+			return idx;
+		};
+		
+		const TreeNode& treeNode = nodes[node];
+		uint32_t numObjects = 0;
+		RecordBuffer fileRecords(treeNode.fileCount * FILE_RECORD_SIZE);
+		for(uint32_t i = 0; i < treeNode.fileCount; ++i) {
+			FileEntry fe = mFiles[treeNode.firstFile + i];
+			fe.nameIndex = addString(indexToString(fe.nameIndex));
+			fe.pathIndex = 0;
+			fe.userIndex = addString(indexToString(fe.userIndex));
+			fe.groupIndex = addString(indexToString(fe.groupIndex));
+			fe.objectIdIndex = numObjects;
+			numObjects += fe.objectCount;
+			encodeFileEntry(fe, &fileRecords[i * FILE_RECORD_SIZE]);
+		}
+		
+		RecordBuffer directoryRecords(treeNode.children.size() * TREE_DIRECTORY_RECORD_SIZE);
+		for(size_t i = 0; i < treeNode.children.size(); ++i) {
+			uint8_t *p = &directoryRecords[i * TREE_DIRECTORY_RECORD_SIZE];
+			LittleEndian::store32(p, addString(nodes[treeNode.children[i]].name.c_str()));
+			memcpy(p + 4, childIds[i].id, SHA256_DIGEST_LENGTH);
+		}
+		strings.resize((strings.size() + 3) & ~3);
+		
+		RecordBuffer data(TREE_HEADER_SIZE);
+		LittleEndian::store32(&data[0], treeNode.fileCount);
+		LittleEndian::store32(&data[4], treeNode.children.size());
+		LittleEndian::store32(&data[8], strings.size() / 4);
+		LittleEndian::store32(&data[12], numObjects);
+		LittleEndian::store32(&data[16], 0);
+		data.insert(data.end(), strings.begin(), strings.end());
+		for(uint32_t i = 0; i < treeNode.fileCount; ++i) {
+			const FileEntry& fe = mFiles[treeNode.firstFile + i];
+			const uint8_t *ids = mObjectIDs[fe.objectIdIndex].id;
+			data.insert(data.end(), ids, ids + fe.objectCount * sizeof(ObjectID));
+		}
+		for(uint32_t i = 0; i < treeNode.fileCount; ++i) {
+			const FileEntry& fe = mFiles[treeNode.firstFile + i];
+			for(int j = 0; j < fe.objectCount; ++j) {
+				uint8_t size[4];
+				LittleEndian::store32(size, mObjectSizes[fe.objectIdIndex + j]);
+				data.insert(data.end(), size, size + 4);
+			}
+		}
+		data.insert(data.end(), fileRecords.begin(), fileRecords.end());
+		data.insert(data.end(), directoryRecords.begin(), directoryRecords.end());
+		
+		ObjectID id = putTree(data.data(), data.size());
+		mTreeObjects.push_back(id);
+		return id;
+	}
+	
+	void Snapshot::loadTreeNode(const ObjectID& id, const std::string& path, const char *subpath, const GetTreeFunction& getTree)
+	{
+		mTreeObjects.push_back(id);
+		
+		RecordBuffer data;
 		{
-			const FileEntry& fe = fkv.second;
-			outStream.writeType<uint32_t>(fe.nameIndex);
-			outStream.writeType<uint32_t>(fe.pathIndex);
-			outStream.writeType<uint32_t>(fe.userIndex);
-			outStream.writeType<uint32_t>(fe.groupIndex);
-			outStream.writeType<uint16_t>(fe.mode);
-			outStream.writeType<uint8_t>(fe.compression);
-			outStream.writeType<uint8_t>(0);
-			outStream.writeType<uint8_t>(fe.type);
-			outStream.writeType<uint8_t>(fe.rollingHashBits);
-			outStream.writeType<uint16_t>(fe.objectCount);
-			outStream.writeType<uint64_t>(fe.size);
-			outStream.writeType<uint64_t>(fe.mtime);
-			outStream.write(fe.md5, MD5_DIGEST_LENGTH);
-			outStream.writeType<uint32_t>(fe.offset);
-			outStream.writeType<uint32_t>(fe.packLength);
-			outStream.writeType<uint32_t>(fe.objectIdIndex);
+			TempFileStream tmpStream;
+			getTree(id, tmpStream);
+			auto inStream = tmpStream.inputStream();
+			uint8_t buffer[4096];
+			size_t n;
+			while((n = inStream->read(buffer, sizeof(buffer))) > 0) {
+				data.insert(data.end(), buffer, buffer + n);
+			}
+		}
+		
+		if(data.size() < TREE_HEADER_SIZE) {
+			throw InvalidFormatException("Invalid directory object.");
+		}
+		uint64_t numFiles = LittleEndian::load32(&data[0]);
+		uint64_t numDirectories = LittleEndian::load32(&data[4]);
+		uint64_t stringTableSize = (uint64_t)LittleEndian::load32(&data[8]) * 4;
+		uint64_t numObjects = LittleEndian::load32(&data[12]);
+		
+		const uint8_t *strings = &data[TREE_HEADER_SIZE];
+		const uint8_t *objectIds = strings + stringTableSize;
+		const uint8_t *objectSizes = objectIds + numObjects * sizeof(ObjectID);
+		const uint8_t *fileRecords = objectSizes + numObjects * sizeof(uint32_t);
+		const uint8_t *directoryRecords = fileRecords + numFiles * FILE_RECORD_SIZE;
+		uint64_t expectedSize = TREE_HEADER_SIZE + stringTableSize + numObjects * (sizeof(ObjectID) + sizeof(uint32_t)) +
+			numFiles * FILE_RECORD_SIZE + numDirectories * TREE_DIRECTORY_RECORD_SIZE;
+		if(data.size() != expectedSize || (stringTableSize > 0 && strings[stringTableSize - 1] != 0)) {
+			throw InvalidFormatException("Invalid directory object.");
+		}
+		auto string = [strings, stringTableSize](uint32_t idx) -> const char * {
+			if(idx >= stringTableSize) {
+				throw InvalidFormatException("Invalid directory object.");
+			}
+			return (const char *)strings + idx;
+		};
+		
+		// the first component of the subpath picks the file or directory to
+		// load, a subpath without more components loads everything under it
+		std::string name;
+		const char *rest = nullptr;
+		if(subpath && *subpath) {
+			const char *slash = strchr(subpath, '/');
+			name.assign(subpath, slash ? slash - subpath : strlen(subpath));
+			rest = slash ? slash + 1 : nullptr;
+			while(rest && *rest == '/') ++rest;
+			if(rest && !*rest) {
+				rest = nullptr;
+			}
+		}
+		
+		uint32_t pathIndex = insertStringTable(path.c_str());
+		std::vector<uint32_t> sizes;
+		for(uint64_t i = 0; i < numFiles; ++i) {
+			FileEntry fe;
+			decodeFileEntry(fileRecords + i * FILE_RECORD_SIZE, fe);
+			if((uint64_t)fe.objectIdIndex + fe.objectCount > numObjects) {
+				throw InvalidFormatException("Invalid directory object.");
+			}
+			if(!name.empty() && (rest || name != string(fe.nameIndex))) {
+				continue;
+			}
+			
+			sizes.resize(fe.objectCount);
+			for(int j = 0; j < fe.objectCount; ++j) {
+				sizes[j] = LittleEndian::load32(objectSizes + (fe.objectIdIndex + j) * sizeof(uint32_t));
+			}
+			const ObjectID *ids = (const ObjectID *)(objectIds + fe.objectIdIndex * sizeof(ObjectID));
+			
+			fe.nameIndex = insertStringTable(string(fe.nameIndex));
+			fe.pathIndex = pathIndex;
+			fe.userIndex = insertStringTable(string(fe.userIndex));
+			fe.groupIndex = insertStringTable(string(fe.groupIndex));
+			fe.objectIdIndex = addObjectIds(ids, sizes.data(), fe.objectCount);
+			mFiles.push_back(fe);
+		}
+		
+		for(uint64_t i = 0; i < numDirectories; ++i) {
+			const uint8_t *p = directoryRecords + i * TREE_DIRECTORY_RECORD_SIZE;
+			const char *dirName = string(LittleEndian::load32(p));
+			if(!name.empty() && name != dirName) {
+				continue;
+			}
+			
+			ObjectID childId;
+			memcpy(childId.id, p + 4, SHA256_DIGEST_LENGTH);
+			loadTreeNode(childId, path.empty() ? dirName : path + "/" + dirName, rest, getTree);
 		}
 	}
 
@@ -244,27 +1204,87 @@ namespace Nebula
 		return &mObjectIDs[n];
 	}
 	
+	const uint32_t *Snapshot::indexToObjectSize(int n) const
+	{
+		if(n < 0 || n >= mObjectSizes.size()) {
+			throw IndexOutOfBoundException("Index is out of bound.");
+		}
+		return &mObjectSizes[n];
+	}
+	
 	int Snapshot::insertStringTable(const char *str)
 	{
-		auto strIndex = mStringTable.find(str);
-		if(strIndex != mStringTable.end()) {
-			return strIndex->second;
+		int idx = findString(str, strlen(str));
+		if(idx >= 0) {
+			return idx;
 		}
 
 		size_t n = strlen(str) + 1;
-		int idx = mStringBuffer.size();
+		idx = mStringBuffer.size();
 		mStringBuffer.resize((idx + n + 3) & ~3);
 		strncpy(&mStringBuffer[idx], str, n);
 
-		mStringTable[str] = idx;
+		indexString(idx);
 
 		return idx;
 	}
 	
-	int Snapshot::addObjectIds(const ObjectID *objectIds, int count)
+	int Snapshot::findString(const char *str, size_t length) const
+	{
+		if(mStringIndex.empty()) {
+			return -1;
+		}
+		
+		size_t mask = mStringIndex.size() - 1;
+		for(size_t i = hashString(str, length) & mask; mStringIndex[i]; i = (i + 1) & mask) {
+			const char *s = &mStringBuffer[mStringIndex[i] - 1];
+			if(strncmp(s, str, length) == 0 && s[length] == 0) {
+				return mStringIndex[i] - 1;
+			}
+		}
+		
+		return -1;
+	}
+	
+	void Snapshot::indexString(uint32_t offset)
+	{
+		const char *str = &mStringBuffer[offset];
+		size_t length = strlen(str);
+		if(findString(str, length) >= 0) {
+			return;
+		}
+		
+		if((mStringCount + 1) * 2 > mStringIndex.size()) {
+			std::vector<uint32_t> oldIndex(std::max<size_t>(mStringIndex.size() * 2, 1024), 0);
+			oldIndex.swap(mStringIndex);
+			
+			size_t mask = mStringIndex.size() - 1;
+			for(uint32_t entry : oldIndex) {
+				if(entry) {
+					const char *s = &mStringBuffer[entry - 1];
+					size_t i = hashString(s, strlen(s)) & mask;
+					while(mStringIndex[i]) i = (i + 1) & mask;
+					mStringIndex[i] = entry;
+				}
+			}
+		}
+		
+		size_t mask = mStringIndex.size() - 1;
+		size_t i = hashString(str, length) & mask;
+		while(mStringIndex[i]) i = (i + 1) & mask;
+		mStringIndex[i] = offset + 1;
+		++mStringCount;
+	}
+	
+	int Snapshot::addObjectIds(const ObjectID *objectIds, const uint32_t *objectSizes, int count)
 	{
 		int idx = mObjectIDs.size();
 		std::copy(objectIds, objectIds + count, std::back_inserter(mObjectIDs));
+		if(objectSizes) {
+			std::copy(objectSizes, objectSizes + count, std::back_inserter(mObjectSizes));
+		} else {
+			mObjectSizes.resize(mObjectSizes.size() + count, 0);
+		}
 		return idx;
 	}
 }
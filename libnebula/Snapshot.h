@@ -17,6 +17,7 @@
 #pragma once
 
 #include <mutex>
+#include <memory>
 #include <string>
 #include <map>
 #include <vector>
@@ -49,6 +50,12 @@ namespace Nebula
 		struct ObjectID
 		{
 			uint8_t id[SHA256_DIGEST_LENGTH];
+			
+			/**
+			 * An object id of all zeros marks a run of zero bytes which has
+			 * no object. The length of the run is the object size.
+			 */
+			bool isZeroExtent() const;
 		};
 		
 		struct FileEntry
@@ -83,32 +90,202 @@ namespace Nebula
 						  uint32_t offset,
 						  uint32_t packLength,
 						  int objectCount,
-						  const ObjectID *objectIds);
+						  const ObjectID *objectIds,
+						  const uint32_t *objectSizes = nullptr);
 
+		/**
+		 * Finds the file at @a path. A leading '/' is ignored. The returned
+		 * entry is only valid until the snapshot is next modified.
+		 */
 		const FileEntry *getFileEntry(const char *path);
 	
-
+		/**
+		 * Calls @a callback for every file, ordered by directory and then
+		 * by name.
+		 */
 		void forEachFileEntry(const std::function<void (const FileEntry&)>& callback);
 		
+		/**
+		 * Calls @a callback for the file at @a subpath, or for every file
+		 * under it if it is a directory.
+		 */
 		void forEachFileEntry(const char *subpath, const std::function<void (const FileEntry&)>& callback);
 
 		void deleteFileEntry(const char *path);
 		
+		/**
+		 * Adds the files of @a other, with their objects. Files already in
+		 * the snapshot are kept.
+		 */
+		void addFiles(Snapshot& other);
+		
+		/**
+		 * Starts recording the files added to the snapshot in a journal,
+		 * see takeJournal(). Removed files aren't recorded.
+		 */
+		void startJournal();
+		
+		/**
+		 * Returns the files added since startJournal() or the previous call
+		 * as a snapshot of their own, and starts recording anew. Returns
+		 * nullptr if no journal was started.
+		 */
+		std::shared_ptr<Snapshot> takeJournal();
+		
+		enum class Change
+		{
+			Added,
+			Removed,
+			Modified
+		};
+		
+		struct DiffStats
+		{
+			uint64_t added;
+			uint64_t removed;
+			uint64_t modified;
+			uint64_t addedSize; // total size of the added files
+			uint64_t removedSize; // total size of the removed files
+			uint64_t newBytes; // estimated size of the objects the base doesn't have
+		};
+		
+		/**
+		 * Receives a change found by diff(). @a baseEntry is nullptr for an
+		 * added file and @a entry is nullptr for a removed file.
+		 */
+		typedef std::function<void (Change change, const char *path, const FileEntry *baseEntry, const FileEntry *entry)> DiffFunction;
+		
+		/**
+		 * Compares this snapshot with @a base, calling @a callback for each
+		 * file added, removed or modified since it, in path order. The sorted
+		 * files of both snapshots are walked together and contents are
+		 * compared by their object ids, so no file data is read.
+		 */
+		DiffStats diff(Snapshot& base, const DiffFunction& callback = nullptr);
+		
+		/**
+		 * Encodes directory objects for saveTree(), returning the id the
+		 * object is stored under.
+		 */
+		typedef std::function<ObjectID (const uint8_t *data, size_t size)> PutTreeFunction;
+		
+		/**
+		 * Fetches the directory object @a id into @a outStream for load().
+		 */
+		typedef std::function<void (const ObjectID& id, OutputStream& outStream)> GetTreeFunction;
+		
 		void save(OutputStream& outStream);
 		void load(InputStream& inStream);
 		
+		/**
+		 * Saves the snapshot as a tree of directory objects, passed to
+		 * @a putTree children first, and writes a reference to the root
+		 * directory to @a outStream. The objects of directories which
+		 * haven't changed are identical between snapshots.
+		 */
+		void saveTree(OutputStream& outStream, const PutTreeFunction& putTree);
+		
+		/**
+		 * Loads a snapshot written by save() or saveTree(), fetching the
+		 * directories of a tree with @a getTree. If @a subpath is given,
+		 * only the files at or under it are loaded from a tree, and only
+		 * the directories leading to them are fetched.
+		 */
+		void load(InputStream& inStream, const GetTreeFunction& getTree, const char *subpath = nullptr);
+		
+		/**
+		 * Loads a snapshot from an already decoded buffer, such as a mapped
+		 * file.
+		 */
+		void load(const uint8_t *data, size_t size);
+		
 		const char *indexToString(int n) const;
 		const ObjectID *indexToObjectID(int n) const;
+
+		/**
+		 * Returns the decoded sizes of the objects starting at index @a n,
+		 * parallel to indexToObjectID(). A size of 0 means the size is unknown
+		 * (snapshots written before sizes were recorded).
+		 */
+		const uint32_t *indexToObjectSize(int n) const;
+		
+		/**
+		 * Compares paths a component at a time. '/' sorts before any other
+		 * character, so the paths under a directory, and the paths starting
+		 * with any given string, are contiguous.
+		 */
+		static int comparePaths(const char *a, const char *b);
+		
+		/**
+		 * The snapshot this one is based on. Files unchanged since the
+		 * parent are added from it without being read. Not saved.
+		 */
+		void setParent(std::shared_ptr<Snapshot> parent) { mParent = parent; }
+		std::shared_ptr<Snapshot> parent() const { return mParent; }
+		
+		/**
+		 * The directory objects the snapshot was last loaded from or saved
+		 * to as a tree.
+		 */
+		const std::vector<ObjectID, ZeroedAllocator<ObjectID>>& treeObjects() const { return mTreeObjects; }
 	private:
-		//
-		std::map<std::string, int> mStringTable;
+		enum : uint32_t
+		{
+			VERSION_MARKER = 0xFFFFFFFF,
+			VERSION = 4,
+			TREE_MARKER = 0xFFFFFFFE,
+			TREE_VERSION = 1
+		};
+
+
+		/**
+		 * A directory holding files, covering a range of mFiles.
+		 */
+		struct Directory
+		{
+			uint32_t pathIndex;
+			uint32_t firstFile;
+			uint32_t fileCount;
+		};
+		
+		// strings are interned in mStringBuffer. mStringIndex is an open
+		// addressing hash table of string offset + 1, 0 for an empty slot.
 		std::vector<char, ZeroedAllocator<char>> mStringBuffer;
+		std::vector<uint32_t> mStringIndex;
+		uint32_t mStringCount;
+
 		std::vector<ObjectID, ZeroedAllocator<ObjectID>> mObjectIDs;
-		std::map<std::string, FileEntry, std::less<std::string>, ZeroedAllocator<FileEntry>> mFiles;
+		std::vector<uint32_t> mObjectSizes;
+		
+		// files sorted by directory then name, the first mSortedFiles of
+		// which are sorted and indexed by mDirectories. Files added since
+		// are appended unsorted and merged in once there are enough of them
+		// or the files are enumerated.
+		std::vector<FileEntry, ZeroedAllocator<FileEntry>> mFiles;
+		size_t mSortedFiles;
+		std::vector<Directory> mDirectories;
+
+		std::shared_ptr<Snapshot> mParent;
+		std::vector<ObjectID, ZeroedAllocator<ObjectID>> mTreeObjects;
+		std::shared_ptr<Snapshot> mJournal;
 
 		std::recursive_mutex mMutex;
 	
 		int insertStringTable(const char *str);
-		int addObjectIds(const ObjectID *objectIds, int count);
+		int findString(const char *str, size_t length) const;
+		void indexString(uint32_t offset);
+		int addObjectIds(const ObjectID *objectIds, const uint32_t *objectSizes, int count);
+		
+		bool fileLess(const FileEntry& a, const FileEntry& b) const;
+		void sortFiles();
+		void indexDirectories();
+		void saveColumns(OutputStream& outStream);
+		void loadColumns(InputStream& inStream, uint32_t numFiles);
+		int findFile(const char *path);
+		int findDirectory(uint32_t pathIndex) const;
+		
+		struct TreeNode;
+		ObjectID saveTreeNode(const std::vector<TreeNode>& nodes, uint32_t node, const PutTreeFunction& putTree);
+		void loadTreeNode(const ObjectID& id, const std::string& path, const char *subpath, const GetTreeFunction& getTree);
 	};
 }
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "SnapshotFileStream.h"
+#include <string.h>
+#include <algorithm>
+#include "Exception.h"
+#include "Repository.h"
+#include "MemoryOutputStream.h"
+#include "TempFileStream.h"
+
+namespace Nebula
+{
+	SnapshotFileStream::SnapshotFileStream(Repository& repository, std::shared_ptr<Snapshot> snapshot, const Snapshot::FileEntry& fileEntry, int cacheSize)
+	: mRepository(repository)
+	, mSnapshot(snapshot)
+	, mFileEntry(fileEntry)
+	, mObjectIds(snapshot->indexToObjectID(fileEntry.objectIdIndex))
+	, mCacheSize(std::max(cacheSize, 1))
+	, mPosition(0)
+	{
+		const uint32_t *objectSizes = snapshot->indexToObjectSize(fileEntry.objectIdIndex);
+		
+		mOffsets.reserve(fileEntry.objectCount + 1);
+		mOffsets.push_back(0);
+		for(int i = 0; i < fileEntry.objectCount && objectSizes[i] > 0; ++i) {
+			mOffsets.push_back(mOffsets.back() + objectSizes[i]);
+		}
+	}
+	
+	int SnapshotFileStream::findObject(uint64_t offset)
+	{
+		if(offset >= mFileEntry.size) {
+			return -1;
+		}
+		
+		// decode objects of unknown size until the offset is covered
+		while(offset >= mOffsets.back()) {
+			if(mOffsets.size() > mFileEntry.objectCount) {
+				return -1;
+			}
+			loadObject(mOffsets.size() - 1);
+		}
+		
+		return std::upper_bound(mOffsets.begin(), mOffsets.end(), offset) - mOffsets.begin() - 1;
+	}
+	
+	SnapshotFileStream::ObjectData SnapshotFileStream::loadObject(int n)
+	{
+		for(auto it = mCache.begin(); it != mCache.end(); ++it) {
+			if(it->first == n) {
+				mCache.splice(mCache.begin(), mCache, it);
+				return it->second;
+			}
+		}
+		
+		ObjectData data = std::make_shared<std::vector<uint8_t>>();
+		if(n + 1 < mOffsets.size()) {
+			data->resize(mOffsets[n + 1] - mOffsets[n]);
+			MemoryOutputStream objectStream(data->data(), data->size());
+			mRepository.downloadObject(mFileEntry, mObjectIds[n], objectStream, DefaultProgressFunction);
+			if(objectStream.size() != data->size()) {
+				throw InvalidDataException("Object size does not match the snapshot.");
+			}
+		} else {
+			TempFileStream tmpStream;
+			mRepository.downloadObject(mFileEntry, mObjectIds[n], tmpStream, DefaultProgressFunction);
+			
+			auto objectStream = tmpStream.inputStream();
+			uint8_t buffer[65536];
+			size_t bytesRead;
+			while((bytesRead = objectStream->read(buffer, sizeof(buffer))) > 0) {
+				data->insert(data->end(), buffer, buffer + bytesRead);
+			}
+			mOffsets.push_back(mOffsets.back() + data->size());
+		}
+		
+		mCache.emplace_front(n, data);
+		if(mCache.size() > mCacheSize) {
+			mCache.pop_back();
+		}
+		
+		return data;
+	}
+	
+	size_t SnapshotFileStream::read(void *data, size_t size)
+	{
+		uint8_t *p = (uint8_t *)data;
+		size_t bytesRead = 0;
+		while(bytesRead < size) {
+			int n = findObject(mPosition);
+			if(n < 0) {
+				break;
+			}
+			
+			uint64_t objectOffset = mPosition - mOffsets[n];
+			size_t count = std::min((uint64_t)(size - bytesRead), mOffsets[n + 1] - mPosition);
+			if(mObjectIds[n].isZeroExtent()) {
+				memset(p, 0, count);
+			} else {
+				ObjectData objectData = loadObject(n);
+				memcpy(p, objectData->data() + objectOffset, count);
+			}
+			
+			p += count;
+			bytesRead += count;
+			mPosition += count;
+		}
+		
+		return bytesRead;
+	}
+	
+	size_t SnapshotFileStream::skip(size_t n)
+	{
+		uint64_t newPosition = std::min(mPosition + n, mFileEntry.size);
+		n = newPosition - mPosition;
+		mPosition = newPosition;
+		return n;
+	}
+	
+	bool SnapshotFileStream::canRewind() const
+	{
+		return true;
+	}
+	
+	void SnapshotFileStream::rewind()
+	{
+		mPosition = 0;
+	}
+	
+	long SnapshotFileStream::size() const
+	{
+		return mFileEntry.size;
+	}
+	
+	void SnapshotFileStream::seek(uint64_t offset)
+	{
+		mPosition = offset;
+	}
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <vector>
+#include "InputStream.h"
+#include "Snapshot.h"
+
+namespace Nebula
+{
+	class Repository;
+
+	/**
+	 * Seekable stream over a file in a snapshot.
+	 * Only the objects covering the range being read are downloaded, and
+	 * the most recently used decoded objects are kept in a small cache.
+	 * Use Repository::openFile() to create one.
+	 */
+	class SnapshotFileStream : public InputStream
+	{
+	public:
+		SnapshotFileStream(Repository& repository, std::shared_ptr<Snapshot> snapshot, const Snapshot::FileEntry& fileEntry, int cacheSize = 4);
+		
+		virtual size_t read(void *data, size_t size) override;
+		virtual size_t skip(size_t n) override;
+		virtual bool canRewind() const override;
+		virtual void rewind() override;
+		virtual long size() const override;
+		
+		/**
+		 * Moves the read position to @a offset. Seeking past the end of
+		 * the file is allowed, reads there return 0.
+		 */
+		void seek(uint64_t offset);
+		uint64_t tell() const { return mPosition; }
+	private:
+		typedef std::shared_ptr<std::vector<uint8_t>> ObjectData;
+
+		Repository& mRepository;
+		std::shared_ptr<Snapshot> mSnapshot;
+		Snapshot::FileEntry mFileEntry;
+		const Snapshot::ObjectID *mObjectIds;
+		
+		// file offset of the start of each object. holds objectCount + 1
+		// entries once every object size is known, snapshots without object
+		// sizes learn them as the objects are decoded.
+		std::vector<uint64_t> mOffsets;
+
+		int mCacheSize;
+		std::list<std::pair<int, ObjectData>> mCache;
+		uint64_t mPosition;
+		
+		int findObject(uint64_t offset);
+		ObjectData loadObject(int n);
+	};
+}
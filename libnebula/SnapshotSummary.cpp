@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "SnapshotSummary.h"
+#include <string.h>
+#include <vector>
+#include "InputStream.h"
+#include "OutputStream.h"
+#include "Snapshot.h"
+#include "LittleEndian.h"
+#include "Exception.h"
+
+namespace Nebula
+{
+	enum { SUMMARY_HEADER_SIZE = 4 + 4 + 8 + 8 + 8 + 8 + 4 + SHA256_DIGEST_LENGTH + 4 };
+	
+	SnapshotSummary::SnapshotSummary()
+	: fileCount(0)
+	, totalSize(0)
+	, objectCount(0)
+	, creationTime(0)
+	, tree(false)
+	{
+		memset(snapshotDigest, 0, sizeof(snapshotDigest));
+	}
+	
+	SnapshotSummary::SnapshotSummary(Snapshot& snapshot)
+	: SnapshotSummary()
+	{
+		snapshot.forEachFileEntry([this, &snapshot](const Snapshot::FileEntry& fe) {
+			++fileCount;
+			totalSize += fe.size;
+			for(int i = 0; i < fe.objectCount; ++i) {
+				if(!snapshot.indexToObjectID(fe.objectIdIndex + i)->isZeroExtent()) {
+					++objectCount;
+				}
+			}
+		});
+	}
+	
+	void SnapshotSummary::save(OutputStream& outStream) const
+	{
+		uint8_t header[SUMMARY_HEADER_SIZE];
+		LittleEndian::store32(header, MAGIC);
+		LittleEndian::store32(header + 4, VERSION);
+		LittleEndian::store64(header + 8, fileCount);
+		LittleEndian::store64(header + 16, totalSize);
+		LittleEndian::store64(header + 24, objectCount);
+		LittleEndian::store64(header + 32, creationTime);
+		LittleEndian::store32(header + 40, tree ? 1 : 0);
+		memcpy(header + 44, snapshotDigest, SHA256_DIGEST_LENGTH);
+		LittleEndian::store32(header + 44 + SHA256_DIGEST_LENGTH, hostname.size());
+		outStream.write(header, sizeof(header));
+		outStream.write(hostname.data(), hostname.size());
+	}
+	
+	void SnapshotSummary::load(InputStream& inStream)
+	{
+		uint8_t header[SUMMARY_HEADER_SIZE];
+		inStream.readExpected(header, sizeof(header));
+		if(LittleEndian::load32(header) != MAGIC) {
+			throw InvalidFormatException("Invalid snapshot summary.");
+		}
+		if(LittleEndian::load32(header + 4) > VERSION) {
+			throw InvalidFormatException("Unsupported snapshot summary version.");
+		}
+		fileCount = LittleEndian::load64(header + 8);
+		totalSize = LittleEndian::load64(header + 16);
+		objectCount = LittleEndian::load64(header + 24);
+		creationTime = LittleEndian::load64(header + 32);
+		tree = LittleEndian::load32(header + 40) & 1;
+		memcpy(snapshotDigest, header + 44, SHA256_DIGEST_LENGTH);
+		
+		uint32_t hostnameLength = LittleEndian::load32(header + 44 + SHA256_DIGEST_LENGTH);
+		if(hostnameLength > 1024) {
+			throw InvalidFormatException("Invalid snapshot summary.");
+		}
+		std::vector<char> buffer(hostnameLength);
+		inStream.readExpected(buffer.data(), hostnameLength);
+		hostname.assign(buffer.begin(), buffer.end());
+	}
+}
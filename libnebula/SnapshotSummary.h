@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <openssl/sha.h>
+
+namespace Nebula
+{
+	class InputStream;
+	class OutputStream;
+	class Snapshot;
+
+	/**
+	 * A small description of a committed snapshot, stored apart from it so
+	 * snapshots can be listed without downloading them.
+	 */
+	struct SnapshotSummary
+	{
+		SnapshotSummary();
+		
+		/**
+		 * Counts the files, sizes and objects of @a snapshot.
+		 */
+		explicit SnapshotSummary(Snapshot& snapshot);
+		
+		/// number of files in the snapshot
+		uint64_t fileCount;
+		
+		/// sum of the sizes of the files
+		uint64_t totalSize;
+		
+		/// number of objects referenced by the files, zero extents excluded
+		uint64_t objectCount;
+		
+		/// time the snapshot was committed
+		time_t creationTime;
+		
+		/// host the snapshot was committed from
+		std::string hostname;
+		
+		/// the snapshot was committed as a tree of directory objects
+		bool tree;
+		
+		/// SHA-256 of the encoded snapshot, before compression and encryption
+		uint8_t snapshotDigest[SHA256_DIGEST_LENGTH];
+		
+		void save(OutputStream& outStream) const;
+		void load(InputStream& inStream);
+	private:
+		enum : uint32_t
+		{
+			MAGIC = 0x5353424E, // NBSS
+			VERSION = 1
+		};
+	};
+}
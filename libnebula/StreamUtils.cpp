@@ -126,6 +126,33 @@ namespace Nebula
 			throw InvalidArgumentException("Input stream must be rewindable.");
 		}
 
+		verifyHMAC(macKey, inStream);
+		
+		uint8_t hmac[SHA256_DIGEST_LENGTH];
+		inStream.rewind();
+		inStream.readExpected(hmac, sizeof(hmac));
+
+		switch(compressType) {
+			case CompressionType::NoCompression:
+			{
+				DecryptedInputStream decStream(inStream, EVP_aes_256_cbc(), encKey);
+				decStream.copyTo(outStream);
+			}
+				break;
+			case CompressionType::LZMA2:
+			{
+				DecryptedInputStream decStream(inStream, EVP_aes_256_cbc(), encKey);
+				LZMAInputStream lzStream(decStream);
+				lzStream.copyTo(outStream);
+			}
+				break;
+			default:
+				throw InvalidArgumentException("Invalid compression type.");
+		}
+	}
+	
+	void StreamUtils::verifyHMAC(const uint8_t *macKey, InputStream& inStream)
+	{
 		uint8_t hmac1[SHA256_DIGEST_LENGTH];
 		
 		inStream.readExpected(hmac1, sizeof(hmac1));
@@ -152,30 +179,8 @@ namespace Nebula
 			throw EncryptionFailedException("Failed to compute HMAC.");
 		}
 		
-		// verify hmac
 		if(memcmp(hmac1, hmac2, sizeof(hmac1)) != 0) {
 			throw VerificationFailedException("Failed to verify HMAC.");
 		}
-		
-		inStream.rewind();
-		inStream.readExpected(hmac1, sizeof(hmac1));
-
-		switch(compressType) {
-			case CompressionType::NoCompression:
-			{
-				DecryptedInputStream decStream(inStream, EVP_aes_256_cbc(), encKey);
-				decStream.copyTo(outStream);
-			}
-				break;
-			case CompressionType::LZMA2:
-			{
-				DecryptedInputStream decStream(inStream, EVP_aes_256_cbc(), encKey);
-				LZMAInputStream lzStream(decStream);
-				lzStream.copyTo(outStream);
-			}
-				break;
-			default:
-				throw InvalidArgumentException("Invalid compression type.");
-		}
 	}
 }
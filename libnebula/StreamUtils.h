@@ -29,5 +29,12 @@ namespace Nebula
 	{
 		std::shared_ptr<InputStream> compressEncryptHMAC(CompressionType compressType, const EVP_CIPHER *cipher, const uint8_t *encKey, const uint8_t *macKey, InputStream& inStream);
 		void decompressDecryptHMAC(CompressionType compressType, const EVP_CIPHER *cipher, const uint8_t *encKey, const uint8_t *macKey, InputStream& inStream, OutputStream& outStream);
+		
+		/**
+		 * Checks the HMAC of a stream written by compressEncryptHMAC()
+		 * without decrypting it. Throws VerificationFailedException if it
+		 * doesn't match. The stream is left at its end.
+		 */
+		void verifyHMAC(const uint8_t *macKey, InputStream& inStream);
 	}
 }
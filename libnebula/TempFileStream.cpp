@@ -27,6 +27,7 @@ extern "C" {
 namespace Nebula
 {
 	TempFileStream::TempFileStream()
+	: mSize(0)
 	{
 		mBuffer = (uint8_t *)malloc(TEMP_BUFFER_SIZE);
 		mMemStream.reset(new MemoryOutputStream(mBuffer, TEMP_BUFFER_SIZE));
@@ -77,6 +78,7 @@ namespace Nebula
 		} else if(!mMemStream) {
 			throw FileIOException("Cannot write to temp stream after input stream has been obtained.");
 		}
+		mSize += size;
 	}
 	
 	std::shared_ptr<InputStream> TempFileStream::inputStream()
@@ -41,6 +41,9 @@ namespace Nebula
 
 		virtual void write(const void *data, size_t size) override;
 		
+		/// number of bytes written
+		uint64_t size() const { return mSize; }
+		
 		std::shared_ptr<InputStream> inputStream();
 	private:
 		enum { TEMP_BUFFER_SIZE = 4 * 1024 * 1024 };
@@ -49,5 +52,6 @@ namespace Nebula
 		std::unique_ptr<MemoryOutputStream> mMemStream;
 		std::unique_ptr<FileStream> mFileStream;
 		boost::filesystem::path mTmpFile;
+		uint64_t mSize;
 	};
 }
@@ -37,6 +37,7 @@ namespace Nebula
 		virtual void put(const char *path, InputStream& stream, ProgressFunction progress = DefaultProgressFunction) override;
 		virtual void list(const char *path, std::function<void (const char *, void *)> listCallback, void *userData, ProgressFunction progress = DefaultProgressFunction) override;
 		virtual bool unlink(const char *path, ProgressFunction progress = DefaultProgressFunction) override;
+		virtual bool supportsConcurrentAccess() const override { return true; }
 	private:
 		static bool sDoOnce;
 		static Aws::SDKOptions sAwsOptions;
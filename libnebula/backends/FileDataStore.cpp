@@ -92,7 +92,16 @@ namespace Nebula
 			filesystem::create_directories(fullPath.parent_path());
 		}
 		
-		std::unique_ptr<FILE, decltype(fclose) *> fp(fopen(fullPath.c_str(), "wb"), fclose);
+		// the file is written aside and renamed into place, so clients
+		// sharing the store never read a partly written file, and two
+		// writing the same object don't interleave
+		filesystem::path tmpDirectory = mStoreDirectory / ".tmp";
+		if(!filesystem::exists(tmpDirectory)) {
+			filesystem::create_directories(tmpDirectory);
+		}
+		filesystem::path tmpPath = tmpDirectory / filesystem::unique_path();
+		
+		std::unique_ptr<FILE, decltype(fclose) *> fp(fopen(tmpPath.c_str(), "wb"), fclose);
 		if(!fp) {
 			throw FileIOException(fullPath.string() + ": " + strerror(errno));
 		}
@@ -107,6 +116,8 @@ namespace Nebula
 		while((n = stream.read(buffer, sizeof(buffer))) > 0) {
 			if(fwrite(buffer, 1, n, fp.get()) < n) {
 				if(ferror(fp.get())) {
+					fclose(fp.release());
+					filesystem::remove(tmpPath);
 					throw FileIOException(fullPath.string() + ": Write error.");
 				}
 			}
@@ -114,16 +125,28 @@ namespace Nebula
 			// if cancel has been requested, remove the in progress file
 			if(!progress(bytesWritten, fileSize)) {
 				fclose(fp.release());
-				filesystem::remove(fullPath);
+				filesystem::remove(tmpPath);
 				throw CancelledException("User cancelled.");
 			}
 			
 			bytesWritten += n;
 		}
+		
+		if(fclose(fp.release()) != 0) {
+			filesystem::remove(tmpPath);
+			throw FileIOException(fullPath.string() + ": Write error.");
+		}
+		
+		system::error_code ec;
+		filesystem::rename(tmpPath, fullPath, ec);
+		if(ec) {
+			filesystem::remove(tmpPath);
+			throw FileIOException(fullPath.string() + ": " + ec.message());
+		}
 
 		progress(bytesWritten, fileSize);
 	}
-
+	
 	void FileDataStore::list(const char *path, std::function<void (const char *, void *)> listCallback, void *userData, ProgressFunction progress)
 	{
 		using namespace boost;
@@ -155,4 +178,14 @@ namespace Nebula
 			return true;
 		}
 	}
+	
+	int64_t FileDataStore::size(const char *path, ProgressFunction progress)
+	{
+		using namespace boost;
+		
+		progress(1, 1);
+		system::error_code ec;
+		uintmax_t fileSize = filesystem::file_size(mStoreDirectory / path, ec);
+		return ec ? -1 : fileSize;
+	}
 }
@@ -223,4 +223,13 @@ namespace Nebula
 	{
 		return sftp_unlink(mFtp, (mPath / path).c_str()) == 0;
 	}
+	
+	int64_t SSHDataStore::size(const char *path, ProgressFunction progress)
+	{
+		sftp_attributes attr = sftp_lstat(mFtp, (mPath / path).c_str());
+		if(!attr) return -1;
+		int64_t fileSize = attr->size;
+		sftp_attributes_free(attr);
+		return fileSize;
+	}
 }
@@ -79,6 +79,7 @@ namespace Nebula
 		virtual void put(const char *path, InputStream& stream, ProgressFunction progress = DefaultProgressFunction) override;
 		virtual void list(const char *path, std::function<void (const char *, void *)> listCallback, void *userData = nullptr, ProgressFunction progress = DefaultProgressFunction) override;
 		virtual bool unlink(const char *path, ProgressFunction progress = DefaultProgressFunction) override;
+		virtual int64_t size(const char *path, ProgressFunction progress = DefaultProgressFunction) override;
 	private:
 		boost::filesystem::path mPath;
 		ssh_session mSession;
@@ -14,7 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <memory>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <boost/filesystem.hpp>
+#include <openssl/md5.h>
 #include "libnebula/Repository.h"
 #include "libnebula/DataStore.h"
 #include "libnebula/backends/FileDataStore.h"
@@ -22,6 +27,17 @@
 #include "libnebula/MemoryInputStream.h"
 #include "libnebula/MemoryOutputStream.h"
 #include "libnebula/TempFileStream.h"
+#include "libnebula/SnapshotFileStream.h"
+#include "libnebula/FilesCache.h"
+#include "libnebula/SnapshotSummary.h"
+#include "libnebula/Catalog.h"
+#include "libnebula/ObjectIndex.h"
+#include "libnebula/ReferenceCounts.h"
+#include "libnebula/Lease.h"
+#include "libnebula/Base32.h"
+#include "libnebula/LittleEndian.h"
+#include "libnebula/FileInfo.h"
+#include "libnebula/Exception.h"
 
 #include "gtest/gtest.h"
 
@@ -217,3 +233,1876 @@ TEST(RepositoryTests, SnapshotTest)
 	EXPECT_FALSE(exists(tmpPath));
 }
 
+TEST(RepositoryTests, ParallelDownloadTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		Repository::Options options;
+		options.restoreThreads = 4;
+
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds, &options);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("@&*^%#bh1237"));
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		
+		std::vector<uint8_t> randomData1, randomData2;
+		randomData1.resize(4 * 1024 * 1024);
+		arc4random_buf(&randomData1[0], randomData1.size());
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		path outFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit3{ &outFile, [](path *p) { remove_all(*p); } };
+		
+		FILE *fp = fopen(tmpFile.c_str(), "wb");
+		EXPECT_TRUE(fp);
+		if(fp) {
+			fwrite(&randomData1[0], 1, randomData1.size(), fp);
+			fclose(fp);
+			
+			FileStream fs(tmpFile.c_str(), FileMode::Read);
+			EXPECT_NO_THROW(repo.uploadFile(snapshot, "/random/path/to/file", fs));
+			EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "test-snapshot"));
+			
+			std::shared_ptr<Snapshot> loadedSnapshot(repo.loadSnapshot("test-snapshot"));
+			const Snapshot::FileEntry *fe = loadedSnapshot->getFileEntry("random/path/to/file");
+			EXPECT_TRUE(fe);
+			EXPECT_GT(fe->objectCount, 1);
+			EXPECT_EQ(randomData1.size(), fe->size);
+			
+			{
+				FileStream outStream(outFile.c_str(), FileMode::Write);
+				EXPECT_FALSE(repo.downloadFile(loadedSnapshot, "/not/exist", outStream));
+				EXPECT_TRUE(repo.downloadFile(loadedSnapshot, "random/path/to/file", outStream));
+			}
+			
+			EXPECT_EQ(randomData1.size(), file_size(outFile));
+			randomData2.resize(randomData1.size());
+			FileStream inStream(outFile.c_str(), FileMode::Read);
+			inStream.readExpected(&randomData2[0], randomData2.size());
+			EXPECT_TRUE(memcmp(&randomData1[0], &randomData2[0], randomData1.size()) == 0);
+		}
+	}
+	
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+
+TEST(RepositoryTests, PrefetchDownloadTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		Repository::Options options;
+		options.prefetchObjects = 3;
+		options.prefetchBufferLimit = 256 * 1024;
+
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds, &options);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("@&*^%#bh1237"));
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		
+		std::vector<uint8_t> randomData1, randomData2;
+		randomData1.resize(4 * 1024 * 1024);
+		arc4random_buf(&randomData1[0], randomData1.size());
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.write(&randomData1[0], randomData1.size());
+		}
+		
+		FileStream inStream(tmpFile.c_str(), FileMode::Read);
+		EXPECT_NO_THROW(repo.uploadFile(snapshot, "/random/path/to/file", inStream));
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "test-snapshot"));
+		
+		std::shared_ptr<Snapshot> loadedSnapshot(repo.loadSnapshot("test-snapshot"));
+		const Snapshot::FileEntry *fe = loadedSnapshot->getFileEntry("random/path/to/file");
+		EXPECT_TRUE(fe);
+		EXPECT_GT(fe->objectCount, 1);
+		
+		int lastObject = -1;
+		randomData2.resize(randomData1.size());
+		MemoryOutputStream outStream(&randomData2[0], randomData2.size());
+		EXPECT_TRUE(repo.downloadFile(loadedSnapshot, "random/path/to/file", outStream,
+									  [&lastObject](int object, int objectCount, long, long) -> bool {
+										  EXPECT_EQ(lastObject + 1, object);
+										  lastObject = object;
+										  return true;
+									  }));
+		EXPECT_EQ(fe->objectCount - 1, lastObject);
+		EXPECT_EQ(randomData1.size(), outStream.size());
+		EXPECT_TRUE(memcmp(&randomData1[0], &randomData2[0], randomData1.size()) == 0);
+	}
+	
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, SparseFileTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("@&*^%#bh1237"));
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		
+		// random data, a hole, more random data and then zeros written out
+		std::vector<uint8_t> randomData1, randomData2;
+		randomData1.resize(24 * 1024 * 1024);
+		arc4random_buf(&randomData1[0], 1024 * 1024);
+		arc4random_buf(&randomData1[21 * 1024 * 1024], 1024 * 1024);
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		path outFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit3{ &outFile, [](path *p) { remove_all(*p); } };
+		
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.write(&randomData1[0], 1024 * 1024);
+			fs.writeAt(&randomData1[21 * 1024 * 1024], 3 * 1024 * 1024, 21 * 1024 * 1024);
+		}
+		
+		FileStream inStream(tmpFile.c_str(), FileMode::Read);
+		EXPECT_NO_THROW(repo.uploadFile(snapshot, "/sparse/file", inStream));
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "test-snapshot"));
+		
+		std::shared_ptr<Snapshot> loadedSnapshot(repo.loadSnapshot("test-snapshot"));
+		const Snapshot::FileEntry *fe = loadedSnapshot->getFileEntry("sparse/file");
+		EXPECT_TRUE(fe);
+		EXPECT_EQ(randomData1.size(), fe->size);
+		
+		const Snapshot::ObjectID *objectIds = loadedSnapshot->indexToObjectID(fe->objectIdIndex);
+		const uint32_t *objectSizes = loadedSnapshot->indexToObjectSize(fe->objectIdIndex);
+		uint64_t zeroBytes = 0;
+		for(int i = 0; i < fe->objectCount; ++i) {
+			if(objectIds[i].isZeroExtent()) {
+				zeroBytes += objectSizes[i];
+			}
+		}
+		EXPECT_GE(zeroBytes, 20 * 1024 * 1024);
+		
+		{
+			FileStream outStream(outFile.c_str(), FileMode::Write);
+			EXPECT_TRUE(repo.downloadFile(loadedSnapshot, "sparse/file", outStream));
+		}
+		
+		EXPECT_EQ(randomData1.size(), file_size(outFile));
+		randomData2.resize(randomData1.size());
+		{
+			FileStream fs(outFile.c_str(), FileMode::Read);
+			fs.readExpected(&randomData2[0], randomData2.size());
+			EXPECT_TRUE(memcmp(&randomData1[0], &randomData2[0], randomData1.size()) == 0);
+		}
+		
+		memset(&randomData2[0], 0xFF, randomData2.size());
+		MemoryOutputStream memStream(&randomData2[0], randomData2.size());
+		EXPECT_TRUE(repo.downloadFile(loadedSnapshot, "sparse/file", memStream));
+		EXPECT_EQ(randomData1.size(), memStream.size());
+		EXPECT_TRUE(memcmp(&randomData1[0], &randomData2[0], randomData1.size()) == 0);
+	}
+	
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, OpenFileTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("@&*^%#bh1237"));
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		
+		std::vector<uint8_t> randomData;
+		randomData.resize(4 * 1024 * 1024);
+		arc4random_buf(&randomData[0], randomData.size());
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		FileStream inStream(tmpFile.c_str(), FileMode::Read);
+		EXPECT_NO_THROW(repo.uploadFile(snapshot, "/random/path/to/file", inStream));
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "test-snapshot"));
+		
+		std::shared_ptr<Snapshot> loadedSnapshot(repo.loadSnapshot("test-snapshot"));
+		EXPECT_FALSE(repo.openFile(loadedSnapshot, "/not/exist"));
+		
+		std::shared_ptr<SnapshotFileStream> fileStream = repo.openFile(loadedSnapshot, "random/path/to/file");
+		EXPECT_TRUE(fileStream);
+		EXPECT_EQ(randomData.size(), fileStream->size());
+		
+		// read ranges at random offsets, spanning object boundaries
+		std::vector<uint8_t> buffer(300000);
+		for(int i = 0; i < 20; ++i) {
+			uint64_t offset = arc4random_uniform(randomData.size() - buffer.size());
+			fileStream->seek(offset);
+			EXPECT_EQ(buffer.size(), fileStream->read(&buffer[0], buffer.size()));
+			EXPECT_EQ(offset + buffer.size(), fileStream->tell());
+			EXPECT_TRUE(memcmp(&randomData[offset], &buffer[0], buffer.size()) == 0);
+		}
+		
+		// short read at the end of the file
+		fileStream->seek(randomData.size() - 100);
+		EXPECT_EQ(100, fileStream->read(&buffer[0], buffer.size()));
+		EXPECT_TRUE(memcmp(&randomData[randomData.size() - 100], &buffer[0], 100) == 0);
+		EXPECT_EQ(0, fileStream->read(&buffer[0], buffer.size()));
+		
+		fileStream->rewind();
+		EXPECT_EQ(buffer.size(), fileStream->read(&buffer[0], buffer.size()));
+		EXPECT_TRUE(memcmp(&randomData[0], &buffer[0], buffer.size()) == 0);
+	}
+	
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, ParentSnapshotTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("@&*^%#bh1237"));
+		
+		std::vector<uint8_t> randomData;
+		randomData.resize(1024 * 1024);
+		arc4random_buf(&randomData[0], randomData.size());
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		{
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			FileStream inStream(tmpFile.c_str(), FileMode::Read);
+			EXPECT_NO_THROW(repo.uploadFile(snapshot, "/random/path/to/file", inStream));
+			EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "snapshot-1"));
+		}
+		
+		// change the contents without changing the size or modify time,
+		// so the file is only read if the parent isn't used
+		std::time_t mtime = last_write_time(tmpFile);
+		arc4random_buf(&randomData[0], 4096);
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::ReadWrite);
+			fs.write(&randomData[0], 4096);
+		}
+		last_write_time(tmpFile, mtime);
+		
+		std::shared_ptr<Snapshot> parentSnapshot(repo.loadSnapshot("snapshot-1"));
+		const Snapshot::FileEntry *parentEntry = parentSnapshot->getFileEntry("random/path/to/file");
+		EXPECT_TRUE(parentEntry);
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot(parentSnapshot));
+		{
+			FileStream inStream(tmpFile.c_str(), FileMode::Read);
+			EXPECT_NO_THROW(repo.uploadFile(snapshot, "/random/path/to/file", inStream));
+		}
+		const Snapshot::FileEntry *fe = snapshot->getFileEntry("random/path/to/file");
+		EXPECT_TRUE(fe);
+		EXPECT_EQ(parentEntry->objectCount, fe->objectCount);
+		EXPECT_TRUE(memcmp(parentEntry->md5, fe->md5, MD5_DIGEST_LENGTH) == 0);
+		EXPECT_TRUE(memcmp(parentSnapshot->indexToObjectID(parentEntry->objectIdIndex),
+						   snapshot->indexToObjectID(fe->objectIdIndex),
+						   sizeof(Snapshot::ObjectID) * fe->objectCount) == 0);
+		
+		// without a parent the file is read again
+		std::shared_ptr<Snapshot> snapshot2(repo.createSnapshot());
+		{
+			FileStream inStream(tmpFile.c_str(), FileMode::Read);
+			EXPECT_NO_THROW(repo.uploadFile(snapshot2, "/random/path/to/file", inStream));
+		}
+		fe = snapshot2->getFileEntry("random/path/to/file");
+		EXPECT_TRUE(fe);
+		EXPECT_FALSE(memcmp(parentEntry->md5, fe->md5, MD5_DIGEST_LENGTH) == 0);
+	}
+	
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, FilesCacheTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	path cacheDir = unique_path();
+	EXPECT_TRUE( create_directory(cacheDir) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &cacheDir, [](path *p) { remove_all(*p); } };
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("@&*^%#bh1237"));
+		
+		std::vector<uint8_t> randomData;
+		randomData.resize(1024 * 1024);
+		arc4random_buf(&randomData[0], randomData.size());
+		
+		path tmpFile = cacheDir / "file";
+		path renamedFile = cacheDir / "renamed";
+		path cacheFile = cacheDir / "files";
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		// files changed within the second of the backup aren't cached
+		last_write_time(tmpFile, time(nullptr) - 60);
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		
+		{
+			std::shared_ptr<FilesCache> filesCache = std::make_shared<FilesCache>(cacheFile.c_str());
+			EXPECT_THROW(FilesCache(cacheFile.c_str()), Nebula::FileIOException);
+			repo.setFilesCache(filesCache);
+			
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			FileStream inStream(tmpFile.c_str(), FileMode::Read);
+			EXPECT_NO_THROW(repo.uploadFile(snapshot, "/random/path/to/file", inStream));
+			EXPECT_FALSE(filesCache->addUnchangedFile(repo.createSnapshot(), "random/path/to/file", FileInfo(tmpFile.c_str())));
+			EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "snapshot-1"));
+			EXPECT_EQ("snapshot-1", filesCache->snapshotName());
+			repo.setFilesCache(nullptr);
+		}
+		
+		{
+			std::shared_ptr<FilesCache> filesCache = std::make_shared<FilesCache>(cacheFile.c_str());
+			repo.setFilesCache(filesCache);
+			EXPECT_EQ("snapshot-1", filesCache->snapshotName());
+
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			EXPECT_TRUE(filesCache->addUnchangedFile(snapshot, "random/path/to/file", FileInfo(tmpFile.c_str())));
+			
+			const Snapshot::FileEntry *fe = snapshot->getFileEntry("random/path/to/file");
+			EXPECT_TRUE(fe);
+			EXPECT_EQ(randomData.size(), fe->size);
+			uint8_t md5[MD5_DIGEST_LENGTH];
+			MD5(&randomData[0], randomData.size(), md5);
+			EXPECT_TRUE(memcmp(md5, fe->md5, MD5_DIGEST_LENGTH) == 0);
+			
+			// still found after a rename
+			rename(tmpFile, renamedFile);
+			EXPECT_TRUE(filesCache->addUnchangedFile(snapshot, "random/path/to/renamed", FileInfo(renamedFile.c_str())));
+			
+			// but not once modified
+			{
+				FileStream fs(renamedFile.c_str(), FileMode::ReadWrite);
+				fs.write(&randomData[0], 16);
+			}
+			EXPECT_FALSE(filesCache->addUnchangedFile(snapshot, "random/path/to/renamed", FileInfo(renamedFile.c_str())));
+			rename(renamedFile, tmpFile);
+			repo.setFilesCache(nullptr);
+		}
+		
+		// the cache is dropped if its snapshot is deleted
+		EXPECT_TRUE(ds.unlink("/snapshot/snapshot-1"));
+		{
+			std::shared_ptr<FilesCache> filesCache = std::make_shared<FilesCache>(cacheFile.c_str());
+			repo.setFilesCache(filesCache);
+			EXPECT_EQ("", filesCache->snapshotName());
+			repo.setFilesCache(nullptr);
+		}
+	}
+	
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, TreeSnapshotTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		Repository::Options options;
+		options.treeSnapshots = true;
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds, &options);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("tr33"));
+		
+		auto countObjects = [&tmpPath]() {
+			int count = 0;
+			for(recursive_directory_iterator it(tmpPath / "data"), end; it != end; ++it) {
+				count += is_regular_file(it->path());
+			}
+			return count;
+		};
+		
+		std::vector<uint8_t> randomData(1000);
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		auto uploadRandomFile = [&](std::shared_ptr<Snapshot> snapshot, const char *destPath, bool regenerate) {
+			if(regenerate) {
+				arc4random_buf(&randomData[0], randomData.size());
+				FileStream fs(tmpFile.c_str(), FileMode::Write);
+				fs.write(&randomData[0], randomData.size());
+			}
+			FileStream inStream(tmpFile.c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, destPath, inStream);
+		};
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		uploadRandomFile(snapshot, "/a/b/file1", true);
+		uploadRandomFile(snapshot, "/c/file2", true);
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "tree-1"));
+		// two files, and the root, a, a/b and c directories
+		EXPECT_EQ(2 + 4, countObjects());
+		
+		std::shared_ptr<Snapshot> loadedSnapshot(repo.loadSnapshot("tree-1"));
+		EXPECT_TRUE(loadedSnapshot->getFileEntry("a/b/file1"));
+		ASSERT_TRUE(loadedSnapshot->getFileEntry("c/file2"));
+		std::vector<uint8_t> downloadedData(randomData.size());
+		MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+		EXPECT_TRUE(repo.downloadFile(loadedSnapshot, "c/file2", outStream));
+		EXPECT_EQ(randomData, downloadedData);
+		
+		std::shared_ptr<Snapshot> partialSnapshot(repo.loadSnapshot("tree-1", "a"));
+		EXPECT_TRUE(partialSnapshot->getFileEntry("a/b/file1"));
+		EXPECT_FALSE(partialSnapshot->getFileEntry("c/file2"));
+		
+		// adding a file to c leaves the a directories as they were
+		std::shared_ptr<Snapshot> snapshot2(repo.createSnapshot(loadedSnapshot));
+		loadedSnapshot->forEachFileEntry([&](const Snapshot::FileEntry& fe) {
+			std::string path = std::string(loadedSnapshot->indexToString(fe.pathIndex)) + "/" + loadedSnapshot->indexToString(fe.nameIndex);
+			snapshot2->addFileEntry(path.c_str(), loadedSnapshot->indexToString(fe.userIndex), loadedSnapshot->indexToString(fe.groupIndex),
+									(FileType)fe.type, fe.mode, (CompressionType)fe.compression, fe.size, fe.mtime,
+									fe.rollingHashBits, fe.md5, fe.offset, fe.packLength, fe.objectCount,
+									loadedSnapshot->indexToObjectID(fe.objectIdIndex), loadedSnapshot->indexToObjectSize(fe.objectIdIndex));
+		});
+		uploadRandomFile(snapshot2, "/c/file3", true);
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot2, "tree-2"));
+		EXPECT_EQ(2 + 4 + 3, countObjects());
+		
+		std::shared_ptr<Snapshot> loadedSnapshot2(repo.loadSnapshot("tree-2"));
+		EXPECT_TRUE(loadedSnapshot2->getFileEntry("a/b/file1"));
+		EXPECT_TRUE(loadedSnapshot2->getFileEntry("c/file2"));
+		EXPECT_TRUE(loadedSnapshot2->getFileEntry("c/file3"));
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, SnapshotSummaryTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		Repository::Options options;
+		options.metadataThreads = 3;
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds, &options);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("summ4ry"));
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &tmpFile, [](path *p) { remove_all(*p); } };
+		{
+			std::vector<uint8_t> randomData(1000);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		time_t startTime = time(nullptr);
+		for(int i = 0; i < 5; ++i) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			for(int j = 0; j <= i; ++j) {
+				FileStream inStream(tmpFile.c_str(), FileMode::Read);
+				repo.uploadFile(snapshot, ("/file" + std::to_string(j)).c_str(), inStream);
+			}
+			EXPECT_NO_THROW(repo.commitSnapshot(snapshot, ("snapshot-" + std::to_string(i)).c_str()));
+		}
+		
+		SnapshotSummary summary;
+		ASSERT_TRUE(repo.loadSnapshotSummary("snapshot-2", summary));
+		EXPECT_EQ(3, summary.fileCount);
+		EXPECT_EQ(3000, summary.totalSize);
+		EXPECT_EQ(3, summary.objectCount);
+		EXPECT_GE(summary.creationTime, startTime);
+		EXPECT_FALSE(summary.tree);
+		
+		// snapshots committed before summaries were stored have none
+		remove(tmpPath / "summary" / "snapshot-4");
+		EXPECT_FALSE(repo.loadSnapshotSummary("snapshot-4", summary));
+		
+		int listed = 0;
+		repo.listSnapshotSummaries([&listed](const char *name, const SnapshotSummary *summary) {
+			++listed;
+			std::string snapshotName = name;
+			if(snapshotName == "snapshot-4") {
+				EXPECT_FALSE(summary);
+			} else {
+				ASSERT_TRUE(summary);
+				EXPECT_EQ(snapshotName.back() - '0' + 1, summary->fileCount);
+			}
+		});
+		EXPECT_EQ(5, listed);
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, MetadataCacheTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	path cachePath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit2{ &cachePath, [](path *p) { remove_all(*p); } };
+		
+		FileDataStore ds(tmpPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("c4che"));
+		repo.setMetadataCache(std::make_shared<FileDataStore>(cachePath));
+		
+		path tmpFile = unique_path();
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit3{ &tmpFile, [](path *p) { remove_all(*p); } };
+		{
+			FileStream fs(tmpFile.c_str(), FileMode::Write);
+			fs.writeType<uint32_t>(1234);
+		}
+		auto commit = [&](const char *name, const char *file) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			FileStream inStream(tmpFile.c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, file, inStream);
+			repo.commitSnapshot(snapshot, name);
+		};
+		
+		commit("snapshot", "/file1");
+		EXPECT_TRUE(repo.loadSnapshot("snapshot")->getFileEntry("file1"));
+		ASSERT_TRUE(exists(cachePath / "snapshot" / "snapshot"));
+		
+		// the cached snapshot is used while it matches the summary
+		remove(tmpPath / "snapshot" / "snapshot");
+		EXPECT_TRUE(repo.loadSnapshot("snapshot")->getFileEntry("file1"));
+		
+		// the cache is encrypted and not readable as a snapshot
+		{
+			Snapshot snapshot;
+			FileStream cachedStream((cachePath / "snapshot" / "snapshot").c_str(), FileMode::Read);
+			EXPECT_ANY_THROW(snapshot.load(cachedStream));
+		}
+		
+		// a changed snapshot is downloaded again
+		commit("snapshot", "/file2");
+		std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot("snapshot"));
+		EXPECT_FALSE(snapshot->getFileEntry("file1"));
+		EXPECT_TRUE(snapshot->getFileEntry("file2"));
+		
+		// as is one whose cache entry is damaged
+		{
+			FileStream cachedStream((cachePath / "snapshot" / "snapshot").c_str(), FileMode::ReadWrite);
+			cachedStream.writeType<uint32_t>(0);
+		}
+		EXPECT_TRUE(repo.loadSnapshot("snapshot")->getFileEntry("file2"));
+	}
+	EXPECT_FALSE(exists(tmpPath));
+	EXPECT_FALSE(exists(cachePath));
+}
+
+TEST(RepositoryTests, CatalogTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("c4talog"));
+		
+		path oldFile = tmpPath / "old";
+		path newFile = tmpPath / "new";
+		for(const path& file : { oldFile, newFile }) {
+			std::vector<uint8_t> randomData(1000);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs(file.c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		// dir/file0 changes in snapshot-3, dir/fileN is added in snapshot-N
+		auto commit = [&](int i) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			for(int j = 0; j <= i; ++j) {
+				FileStream inStream((j == 0 && i >= 3 ? newFile : oldFile).c_str(), FileMode::Read);
+				repo.uploadFile(snapshot, ("/dir/file" + std::to_string(j)).c_str(), inStream);
+			}
+			repo.commitSnapshot(snapshot, ("snapshot-" + std::to_string(i)).c_str());
+		};
+		for(int i = 0; i < 5; ++i) {
+			commit(i);
+		}
+		
+		auto find = [](const Catalog& catalog, const char *pattern) {
+			std::vector<Catalog::FileVersion> versions;
+			catalog.find(pattern, [&versions](const Catalog::FileVersion& version) {
+				versions.push_back(version);
+			});
+			return versions;
+		};
+		
+		path catalogPath = tmpPath / "catalog";
+		{
+			Catalog catalog(catalogPath.c_str());
+			EXPECT_TRUE(catalog.snapshots().empty());
+			repo.updateCatalog(catalog);
+			EXPECT_EQ(5, catalog.snapshots().size());
+			
+			auto versions = find(catalog, "/dir/file0");
+			ASSERT_EQ(2, versions.size());
+			EXPECT_EQ("dir/file0", versions[0].path);
+			EXPECT_EQ(1000, versions[0].size);
+			EXPECT_EQ(std::vector<std::string>({ "snapshot-0", "snapshot-1", "snapshot-2" }), versions[0].snapshots);
+			EXPECT_EQ(std::vector<std::string>({ "snapshot-3", "snapshot-4" }), versions[1].snapshots);
+			EXPECT_NE(0, memcmp(versions[0].md5, versions[1].md5, MD5_DIGEST_LENGTH));
+			
+			EXPECT_EQ(6, find(catalog, "dir").size());
+			EXPECT_EQ(6, find(catalog, "").size());
+			EXPECT_EQ(0, find(catalog, "di").size());
+			EXPECT_EQ(2, find(catalog, "*/file[12]").size());
+			EXPECT_EQ(0, find(catalog, "missing/*").size());
+		}
+		
+		remove(repoPath / "snapshot" / "snapshot-1");
+		remove(repoPath / "summary" / "snapshot-1");
+		commit(5);
+		
+		{
+			Catalog catalog(catalogPath.c_str());
+			EXPECT_EQ(5, catalog.snapshots().size());
+			repo.updateCatalog(catalog);
+			EXPECT_EQ(std::vector<std::string>({ "snapshot-0", "snapshot-2", "snapshot-3", "snapshot-4", "snapshot-5" }), catalog.snapshots());
+			
+			auto versions = find(catalog, "dir/file0");
+			ASSERT_EQ(2, versions.size());
+			EXPECT_EQ(std::vector<std::string>({ "snapshot-0", "snapshot-2" }), versions[0].snapshots);
+			EXPECT_EQ(std::vector<std::string>({ "snapshot-3", "snapshot-4", "snapshot-5" }), versions[1].snapshots);
+			
+			versions = find(catalog, "dir/file1");
+			ASSERT_EQ(1, versions.size());
+			EXPECT_EQ(4, versions[0].snapshots.size());
+			EXPECT_EQ(1, find(catalog, "dir/file5").size());
+		}
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, CompactTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		Repository::Options options;
+		options.treeSnapshots = true;
+		options.metadataThreads = 1;
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds, &options);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("c0mpact"));
+		
+		auto countObjects = [&repoPath]() {
+			int count = 0;
+			for(recursive_directory_iterator it(repoPath / "data"), end; it != end; ++it) {
+				count += is_regular_file(it->path());
+			}
+			return count;
+		};
+		
+		std::map<std::string, std::vector<uint8_t>> contents;
+		auto uploadFile = [&](std::shared_ptr<Snapshot> snapshot, const char *name) {
+			path file = tmpPath / name;
+			if(!contents.count(name)) {
+				std::vector<uint8_t> randomData(1000);
+				arc4random_buf(&randomData[0], randomData.size());
+				FileStream fs(file.c_str(), FileMode::Write);
+				fs.write(&randomData[0], randomData.size());
+				contents[name] = randomData;
+			}
+			FileStream inStream(file.c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, (std::string("/") + name + "/" + name).c_str(), inStream);
+		};
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		uploadFile(snapshot, "a");
+		uploadFile(snapshot, "b");
+		repo.commitSnapshot(snapshot, "snapshot-1");
+		
+		snapshot = repo.createSnapshot();
+		uploadFile(snapshot, "a");
+		uploadFile(snapshot, "c");
+		repo.commitSnapshot(snapshot, "snapshot-2");
+		
+		// the objects of an abandoned backup and of a deleted snapshot
+		snapshot = repo.createSnapshot();
+		uploadFile(snapshot, "d");
+		EXPECT_TRUE(repo.deleteSnapshot("snapshot-1"));
+		EXPECT_FALSE(repo.deleteSnapshot("snapshot-1"));
+		EXPECT_FALSE(exists(repoPath / "summary" / "snapshot-1"));
+		
+		int objectCount = countObjects();
+		Repository::CompactStats dryRunStats = repo.compactRepository(true);
+		EXPECT_EQ(1, dryRunStats.snapshots);
+		EXPECT_EQ(objectCount, dryRunStats.scannedObjects);
+		EXPECT_EQ(objectCount, dryRunStats.referencedObjects + dryRunStats.unreferencedObjects);
+		// b, d and the directories of snapshot-1 other than a
+		EXPECT_EQ(4, dryRunStats.unreferencedObjects);
+		EXPECT_GT(dryRunStats.unreferencedBytes, 0);
+		EXPECT_EQ(0, dryRunStats.deletedObjects);
+		EXPECT_EQ(objectCount, countObjects());
+		
+		// a cancelled compaction resumes after the shards it recorded
+		EXPECT_THROW(repo.compactRepository(false, [](long n, long total) {
+			return n != 1 + 100;
+		}), CancelledException);
+		EXPECT_TRUE(exists(repoPath / "compact"));
+		
+		path strayObject = repoPath / "data" / "aa" / std::string(50, 'b');
+		{
+			create_directories(strayObject.parent_path());
+			FileStream fs(strayObject.c_str(), FileMode::Write);
+			fs.write("x", 1);
+		}
+		
+		repo.compactRepository();
+		EXPECT_FALSE(exists(repoPath / "compact"));
+		EXPECT_TRUE(exists(strayObject));
+		EXPECT_EQ(objectCount - dryRunStats.unreferencedObjects + 1, countObjects());
+		
+		Repository::CompactStats stats = repo.compactRepository();
+		EXPECT_EQ(1, stats.deletedObjects);
+		EXPECT_FALSE(exists(strayObject));
+		
+		// a shard which can't be listed fails the compaction rather than
+		// being skipped
+		path unlistable = repoPath / "data" / "ab";
+		for(char c = 'b'; exists(unlistable); ++c) {
+			unlistable = repoPath / "data" / (std::string("a") + c);
+		}
+		{
+			FileStream fs(unlistable.c_str(), FileMode::Write);
+			fs.write("x", 1);
+		}
+		EXPECT_ANY_THROW(repo.compactRepository());
+		remove(unlistable);
+		EXPECT_NO_THROW(repo.compactRepository());
+		
+		std::shared_ptr<Snapshot> loadedSnapshot(repo.loadSnapshot("snapshot-2"));
+		for(const char *name : { "a", "c" }) {
+			std::vector<uint8_t> downloadedData(1000);
+			MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+			EXPECT_TRUE(repo.downloadFile(loadedSnapshot, (std::string(name) + "/" + name).c_str(), outStream));
+			EXPECT_EQ(contents[name], downloadedData);
+		}
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, RepackTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("rep4ck"));
+		
+		std::vector<std::vector<uint8_t>> contents(20);
+		for(size_t i = 0; i < contents.size(); ++i) {
+			contents[i].resize(1000 + i);
+			arc4random_buf(&contents[i][0], contents[i].size());
+			FileStream fs((tmpPath / std::to_string(i)).c_str(), FileMode::Write);
+			fs.write(&contents[i][0], contents[i].size());
+		}
+		
+		// every file is packed, the second snapshot keeps a few of them
+		auto backup = [&](std::shared_ptr<Snapshot> parent, size_t count, const char *name) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot(parent));
+			auto packState = repo.createPackState();
+			for(size_t i = 0; i < count; ++i) {
+				FileStream inStream((tmpPath / std::to_string(i)).c_str(), FileMode::Read);
+				repo.uploadFile(packState, snapshot, ("/dir/" + std::to_string(i)).c_str(), inStream);
+			}
+			repo.finalizePack(snapshot, packState);
+			repo.commitSnapshot(snapshot, name);
+		};
+		backup(nullptr, contents.size(), "snapshot-1");
+		backup(repo.loadSnapshot("snapshot-1"), 3, "snapshot-2");
+		std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot("snapshot-2"));
+		const Snapshot::ObjectID oldPackId = *snapshot->indexToObjectID(snapshot->getFileEntry("dir/0")->objectIdIndex);
+		EXPECT_GT(snapshot->getFileEntry("dir/0")->packLength, 0);
+		
+		// nothing to do while every member is referenced
+		Repository::RepackStats stats = repo.repackRepository();
+		EXPECT_EQ(0, stats.repackedPacks);
+		
+		EXPECT_TRUE(repo.deleteSnapshot("snapshot-1"));
+		
+		// a budget smaller than any pack downloads nothing
+		stats = repo.repackRepository(0.5, 1);
+		EXPECT_EQ(0, stats.repackedPacks);
+		EXPECT_EQ(0, stats.downloadedBytes);
+		
+		stats = repo.repackRepository();
+		EXPECT_GE(stats.packs, 1);
+		EXPECT_GE(stats.repackedPacks, 1);
+		EXPECT_EQ(1, stats.newPacks);
+		EXPECT_EQ(1, stats.rewrittenSnapshots);
+		EXPECT_GT(stats.reclaimableBytes, stats.uploadedBytes);
+		
+		// packs with no members left are removed along with the repacked ones
+		Repository::CompactStats compactStats = repo.compactRepository();
+		EXPECT_GE(compactStats.deletedObjects, stats.repackedPacks);
+		
+		snapshot = repo.loadSnapshot("snapshot-2");
+		EXPECT_NE(0, memcmp(oldPackId.id, snapshot->indexToObjectID(snapshot->getFileEntry("dir/0")->objectIdIndex)->id, sizeof(oldPackId.id)));
+		for(size_t i = 0; i < 3; ++i) {
+			std::vector<uint8_t> downloadedData(contents[i].size());
+			MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+			EXPECT_TRUE(repo.downloadFile(snapshot, ("dir/" + std::to_string(i)).c_str(), outStream));
+			EXPECT_EQ(contents[i], downloadedData);
+		}
+		
+		SnapshotSummary summary;
+		ASSERT_TRUE(repo.loadSnapshotSummary("snapshot-2", summary));
+		EXPECT_EQ(3, summary.fileCount);
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, ObjectIndexTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("ind3x"));
+		auto index = std::make_shared<ObjectIndex>((tmpPath / "objects").c_str());
+		EXPECT_NO_THROW(repo.setObjectIndex(index));
+		EXPECT_EQ(0, index->size());
+		
+		for(int i = 0; i < 4; ++i) {
+			std::vector<uint8_t> randomData(1000 + i);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / std::to_string(i)).c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		// file 0 is an object of its own, the others are packed
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		{
+			FileStream inStream((tmpPath / "0").c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, "0", inStream);
+		}
+		auto packState = repo.createPackState();
+		for(int i = 1; i < 4; ++i) {
+			FileStream inStream((tmpPath / std::to_string(i)).c_str(), FileMode::Read);
+			repo.uploadFile(packState, snapshot, std::to_string(i).c_str(), inStream);
+		}
+		repo.finalizePack(snapshot, packState);
+		repo.commitSnapshot(snapshot, "snapshot-1");
+		
+		// the object, the pack and its members
+		EXPECT_EQ(5, index->size());
+		EXPECT_EQ(1, index->indexNames().size());
+		const Snapshot::ObjectID objectId = *snapshot->indexToObjectID(snapshot->getFileEntry("0")->objectIdIndex);
+		ObjectIndex::Entry entry;
+		ASSERT_TRUE(index->find(objectId, &entry));
+		EXPECT_EQ(0, memcmp(entry.container.id, objectId.id, sizeof(objectId.id)));
+		EXPECT_EQ(0, entry.length);
+		
+		std::map<uint32_t, uint32_t> members;
+		index->forEach([&members](const ObjectIndex::Entry& entry) {
+			if(entry.length > 0) {
+				members[entry.offset] = entry.length;
+			}
+		});
+		for(int i = 1; i < 4; ++i) {
+			const Snapshot::FileEntry *fe = snapshot->getFileEntry(std::to_string(i).c_str());
+			ASSERT_TRUE(members.count(fe->offset));
+			EXPECT_EQ(fe->packLength, members[fe->offset]);
+		}
+		
+		// another client merges the index objects
+		Repository repo2(&ds);
+		EXPECT_TRUE(repo2.unlockRepository("ind3x"));
+		auto index2 = std::make_shared<ObjectIndex>((tmpPath / "objects2").c_str());
+		repo2.setObjectIndex(index2);
+		EXPECT_EQ(5, index2->size());
+		
+		// indexed objects aren't looked up, so a missing one isn't noticed
+		char encodedId[53];
+		base32encode(objectId.id, sizeof(objectId.id), encodedId, sizeof(encodedId));
+		path objectPath = repoPath / "data" / std::string(encodedId, 2) / (encodedId + 2);
+		ASSERT_TRUE(exists(objectPath));
+		copy_file(objectPath, tmpPath / "saved");
+		remove(objectPath);
+		snapshot = repo.createSnapshot();
+		{
+			FileStream inStream((tmpPath / "0").c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, "0", inStream);
+		}
+		repo.commitSnapshot(snapshot, "snapshot-2");
+		EXPECT_FALSE(exists(objectPath));
+		copy_file(tmpPath / "saved", objectPath);
+		
+		// compaction leaves one index object without the pack
+		EXPECT_TRUE(repo.deleteSnapshot("snapshot-1"));
+		repo.compactRepository();
+		EXPECT_EQ(1, std::distance(directory_iterator(repoPath / "index"), directory_iterator()));
+		EXPECT_EQ(1, index->size());
+		EXPECT_TRUE(index->find(objectId));
+		repo2.setObjectIndex(index2);
+		EXPECT_EQ(1, index2->size());
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, SmallFileDedupeTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("d3dupe"));
+		repo.setObjectIndex(std::make_shared<ObjectIndex>((tmpPath / "objects").c_str()));
+		
+		std::vector<std::vector<uint8_t>> contents(4);
+		for(size_t i = 0; i < contents.size(); ++i) {
+			contents[i].resize(10000 + i);
+			arc4random_buf(&contents[i][0], contents[i].size());
+			FileStream fs((tmpPath / std::to_string(i)).c_str(), FileMode::Write);
+			fs.write(&contents[i][0], contents[i].size());
+		}
+		
+		auto countObjects = [&repoPath]() {
+			size_t count = 0;
+			for(recursive_directory_iterator it(repoPath / "data"), end; it != end; ++it) {
+				count += is_regular_file(it->path());
+			}
+			return count;
+		};
+		
+		// each backup has no parent, and stores the files under new names.
+		// The order differs so a new pack wouldn't match the old one.
+		auto backup = [&](const char *name, bool reversed) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			auto packState = repo.createPackState();
+			for(size_t j = 0; j < contents.size(); ++j) {
+				size_t i = reversed ? contents.size() - 1 - j : j;
+				FileStream inStream((tmpPath / std::to_string(i)).c_str(), FileMode::Read);
+				repo.uploadFile(packState, snapshot, (std::string(name) + "/" + std::to_string(i)).c_str(), inStream);
+			}
+			repo.finalizePack(snapshot, packState);
+			repo.commitSnapshot(snapshot, name);
+		};
+		backup("snapshot-1", false);
+		size_t objectCount = countObjects();
+		backup("snapshot-2", true);
+		EXPECT_EQ(objectCount, countObjects());
+		
+		std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot("snapshot-2"));
+		for(size_t i = 0; i < contents.size(); ++i) {
+			const Snapshot::FileEntry *fe = snapshot->getFileEntry(("snapshot-2/" + std::to_string(i)).c_str());
+			ASSERT_NE(nullptr, fe);
+			EXPECT_GT(fe->packLength, 0);
+			
+			std::vector<uint8_t> downloadedData(contents[i].size());
+			MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+			EXPECT_TRUE(repo.downloadFile(snapshot, ("snapshot-2/" + std::to_string(i)).c_str(), outStream));
+			EXPECT_EQ(contents[i], downloadedData);
+		}
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, ReferenceCountsTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("r3fs"));
+		auto index = std::make_shared<ObjectIndex>((tmpPath / "objects").c_str());
+		repo.setObjectIndex(index);
+		auto refs = std::make_shared<ReferenceCounts>((tmpPath / "refs").c_str());
+		repo.setReferenceCounts(refs);
+		
+		for(const char *name : { "a", "b", "c" }) {
+			std::vector<uint8_t> randomData(1000);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / name).c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		std::map<std::string, Snapshot::ObjectID> objectIds;
+		auto commit = [&](Repository& repo, const char *name, std::initializer_list<const char *> files) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			for(const char *file : files) {
+				FileStream inStream((tmpPath / file).c_str(), FileMode::Read);
+				repo.uploadFile(snapshot, file, inStream);
+				objectIds[file] = *snapshot->indexToObjectID(snapshot->getFileEntry(file)->objectIdIndex);
+			}
+			repo.commitSnapshot(snapshot, name);
+		};
+		auto objectPath = [&](const char *file) {
+			char encodedId[53];
+			base32encode(objectIds[file].id, sizeof(objectIds[file].id), encodedId, sizeof(encodedId));
+			return repoPath / "data" / std::string(encodedId, 2) / (encodedId + 2);
+		};
+		auto count = [&](const char *file) {
+			return refs->count(LittleEndian::load64(objectIds[file].id));
+		};
+		
+		commit(repo, "snapshot-1", { "a", "b" });
+		commit(repo, "snapshot-2", { "a", "c" });
+		EXPECT_EQ(2, refs->snapshots().size());
+		EXPECT_EQ(2, count("a"));
+		EXPECT_EQ(1, count("b"));
+		
+		// only b is freed, and is dropped from the index
+		uint64_t freedObjects = 0;
+		EXPECT_TRUE(repo.deleteSnapshot("snapshot-1", &freedObjects));
+		EXPECT_EQ(1, freedObjects);
+		EXPECT_FALSE(exists(objectPath("b")));
+		EXPECT_TRUE(exists(objectPath("a")));
+		EXPECT_FALSE(index->find(objectIds["b"]));
+		EXPECT_TRUE(index->find(objectIds["a"]));
+		EXPECT_EQ(1, count("a"));
+		EXPECT_EQ(0, count("b"));
+		
+		// a snapshot committed elsewhere is counted before deleting
+		{
+			Repository repo2(&ds);
+			EXPECT_TRUE(repo2.unlockRepository("r3fs"));
+			commit(repo2, "snapshot-3", { "c" });
+		}
+		EXPECT_TRUE(repo.deleteSnapshot("snapshot-2", &freedObjects));
+		EXPECT_EQ(1, freedObjects);
+		EXPECT_FALSE(exists(objectPath("a")));
+		EXPECT_TRUE(exists(objectPath("c")));
+		
+		// b can be backed up again once it was dropped from the index
+		commit(repo, "snapshot-4", { "b" });
+		EXPECT_TRUE(exists(objectPath("b")));
+		
+		// another client merging the index objects doesn't find a
+		auto index2 = std::make_shared<ObjectIndex>((tmpPath / "objects2").c_str());
+		Repository repo3(&ds);
+		EXPECT_TRUE(repo3.unlockRepository("r3fs"));
+		repo3.setObjectIndex(index2);
+		EXPECT_FALSE(index2->find(objectIds["a"]));
+		EXPECT_TRUE(index2->find(objectIds["c"]));
+		
+		// nothing is left for compaction
+		EXPECT_EQ(0, repo.compactRepository().unreferencedObjects);
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, DeleteWhileWritingTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	// runs a callback when the snapshot being deleted is fetched
+	struct HookDataStore : public FileDataStore
+	{
+		HookDataStore(const path& storeDirectory) : FileDataStore(storeDirectory) { }
+		
+		virtual void get(const char *path, OutputStream& stream, ProgressFunction progress) override
+		{
+			if(hook && strcmp(path, "/snapshot/victim") == 0) {
+				std::function<void ()> callback = std::move(hook);
+				hook = nullptr;
+				callback();
+			}
+			FileDataStore::get(path, stream, progress);
+		}
+		
+		std::function<void ()> hook;
+	};
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		HookDataStore ds(repoPath);
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("v1ct1m"));
+		auto refs = std::make_shared<ReferenceCounts>((tmpPath / "refs").c_str());
+		repo.setReferenceCounts(refs);
+		
+		std::vector<uint8_t> randomData(1000);
+		arc4random_buf(&randomData[0], randomData.size());
+		{
+			FileStream fs((tmpPath / "shared").c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		auto commit = [&](Repository& repo, const char *name) {
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			FileStream inStream((tmpPath / "shared").c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, "shared", inStream);
+			repo.commitSnapshot(snapshot, name);
+		};
+		commit(repo, "victim");
+		
+		// another client backs up the same file while the victim is being
+		// deleted, reusing its object, and releases its lease as it exits.
+		// If it has to wait, it backs up once the victim is deleted.
+		FileDataStore writerStore(repoPath);
+		auto backup = [&]() {
+			Repository writer(&writerStore);
+			EXPECT_TRUE(writer.unlockRepository("v1ct1m"));
+			commit(writer, "reuser");
+		};
+		bool committed = false;
+		ds.hook = [&]() {
+			try {
+				backup();
+				committed = true;
+			} catch(const RepositoryException&) {
+			}
+		};
+		EXPECT_TRUE(repo.deleteSnapshot("victim"));
+		EXPECT_FALSE(ds.hook);
+		if(!committed) {
+			backup();
+		}
+		
+		std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot("reuser"));
+		std::vector<uint8_t> downloadedData(randomData.size());
+		MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+		EXPECT_NO_THROW(EXPECT_TRUE(repo.downloadFile(snapshot, "shared", outStream)));
+		EXPECT_EQ(randomData, downloadedData);
+		EXPECT_EQ(0, repo.verifyRepository().missingObjects);
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, VerifyTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		Repository::Options options;
+		options.treeSnapshots = true;
+		options.metadataThreads = 2;
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds, &options);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("ch3ck"));
+		
+		for(const char *name : { "0", "1", "2", "3", "big" }) {
+			std::vector<uint8_t> randomData(1000);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / name).c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+		}
+		
+		// four files in a pack and one on its own
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		auto packState = repo.createPackState();
+		for(const char *name : { "0", "1", "2", "3" }) {
+			FileStream inStream((tmpPath / name).c_str(), FileMode::Read);
+			repo.uploadFile(packState, snapshot, (std::string("/packed/") + name).c_str(), inStream);
+		}
+		repo.finalizePack(snapshot, packState);
+		{
+			FileStream inStream((tmpPath / "big").c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, "/big", inStream);
+		}
+		repo.commitSnapshot(snapshot, "snapshot-1");
+		
+		auto objectPath = [&](const char *file) {
+			const Snapshot::ObjectID *objectId = snapshot->indexToObjectID(snapshot->getFileEntry(file)->objectIdIndex);
+			char encodedId[53];
+			base32encode(objectId->id, sizeof(objectId->id), encodedId, sizeof(encodedId));
+			return repoPath / "data" / std::string(encodedId, 2) / (encodedId + 2);
+		};
+		
+		std::vector<std::string> problems;
+		auto problem = [&problems](const char *what, const char *error) {
+			problems.push_back(what);
+		};
+		
+		Repository::VerifyStats stats = repo.verifyRepository(100, problem);
+		EXPECT_EQ(1, stats.snapshots);
+		EXPECT_EQ(0, stats.damagedSnapshots);
+		// the pack, big and at least the root directory
+		EXPECT_GE(stats.objects, 3);
+		EXPECT_EQ(5, stats.sampledFiles);
+		EXPECT_EQ(0, stats.missingObjects + stats.damagedObjects + stats.damagedFiles);
+		EXPECT_TRUE(problems.empty());
+		EXPECT_FALSE(exists(repoPath / "check"));
+		
+		// a damaged object is found without sampling any file
+		{
+			path bigPath = objectPath("big");
+			std::vector<uint8_t> data(file_size(bigPath));
+			{
+				FileStream fs(bigPath.c_str(), FileMode::Read);
+				fs.readExpected(&data[0], data.size());
+			}
+			data.back() ^= 1;
+			FileStream fs(bigPath.c_str(), FileMode::Write);
+			fs.write(&data[0], data.size());
+		}
+		stats = repo.verifyRepository(0, problem);
+		EXPECT_EQ(1, stats.damagedObjects);
+		EXPECT_EQ(0, stats.sampledFiles);
+		ASSERT_EQ(1, problems.size());
+		EXPECT_NE(std::string::npos, problems[0].find("/data/"));
+		
+		// an interrupted check resumes, reporting what it found before
+		problems.clear();
+		EXPECT_ANY_THROW(repo.verifyRepository(0, problem, [](long n, long total) {
+			if(n == 1 + 600) {
+				throw std::runtime_error("interrupted");
+			}
+			return true;
+		}));
+		EXPECT_TRUE(exists(repoPath / "check"));
+		problems.clear();
+		stats = repo.verifyRepository(0, problem);
+		EXPECT_EQ(1, stats.damagedObjects);
+		EXPECT_EQ(1, problems.size());
+		EXPECT_FALSE(exists(repoPath / "check"));
+		
+		// but one with another sample percentage starts over
+		EXPECT_THROW(repo.verifyRepository(100, problem, [](long n, long total) {
+			return n != 1 + 600;
+		}), CancelledException);
+		EXPECT_TRUE(exists(repoPath / "check"));
+		problems.clear();
+		stats = repo.verifyRepository(0, problem);
+		EXPECT_EQ(1, stats.damagedObjects);
+		EXPECT_EQ(0, stats.sampledFiles);
+		EXPECT_EQ(0, stats.damagedFiles);
+		EXPECT_EQ(1, problems.size());
+		
+		// every file in a missing pack fails to decode
+		remove(objectPath("packed/0"));
+		problems.clear();
+		stats = repo.verifyRepository(100, problem);
+		EXPECT_EQ(1, stats.missingObjects);
+		EXPECT_EQ(1, stats.damagedObjects);
+		EXPECT_EQ(5, stats.sampledFiles);
+		EXPECT_EQ(5, stats.damagedFiles);
+		EXPECT_EQ(7, problems.size());
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, ConcurrentWritersTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("h0sts", 10));
+		
+		const int numHosts = 8;
+		std::vector<std::string> names = { "common" };
+		for(int i = 0; i < numHosts; ++i) {
+			names.push_back("host-" + std::to_string(i));
+		}
+		std::map<std::string, std::vector<uint8_t>> contents;
+		for(const std::string& name : names) {
+			std::vector<uint8_t> randomData(100000);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / name).c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+			contents[name] = randomData;
+		}
+		
+		// each host backs up the common file and its own from a process of
+		// its own, all at once
+		std::vector<pid_t> children;
+		for(int i = 0; i < numHosts; ++i) {
+			pid_t pid = fork();
+			ASSERT_GE(pid, 0);
+			if(pid == 0) {
+				int status = 1;
+				try {
+					FileDataStore hostStore(repoPath.c_str());
+					Repository hostRepo(&hostStore);
+					if(hostRepo.unlockRepository("h0sts")) {
+						std::string host = "host-" + std::to_string(i);
+						std::shared_ptr<Snapshot> snapshot(hostRepo.createSnapshot());
+						for(const std::string& name : { std::string("common"), host }) {
+							FileStream inStream((tmpPath / name).c_str(), FileMode::Read);
+							hostRepo.uploadFile(snapshot, name.c_str(), inStream);
+						}
+						hostRepo.commitSnapshot(snapshot, host.c_str());
+						status = 0;
+					}
+				} catch(const std::exception&) {
+				}
+				_exit(status);
+			}
+			children.push_back(pid);
+		}
+		for(pid_t pid : children) {
+			int status = -1;
+			EXPECT_EQ(pid, waitpid(pid, &status, 0));
+			EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		}
+		
+		EXPECT_TRUE(repo.unlockRepository("h0sts"));
+		int snapshotCount = 0;
+		repo.listSnapshots([&snapshotCount](const char *name) {
+			snapshotCount += name != nullptr;
+		});
+		EXPECT_EQ(numHosts, snapshotCount);
+		for(int i = 0; i < numHosts; ++i) {
+			std::string host = "host-" + std::to_string(i);
+			std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot(host.c_str()));
+			for(const std::string& name : { std::string("common"), host }) {
+				std::vector<uint8_t> downloadedData(contents[name].size());
+				MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+				EXPECT_TRUE(repo.downloadFile(snapshot, name.c_str(), outStream));
+				EXPECT_EQ(contents[name], downloadedData);
+			}
+		}
+		EXPECT_EQ(0, repo.verifyRepository(100).damagedObjects);
+		EXPECT_TRUE(is_empty(repoPath / "locks"));
+		
+		// compaction waits for writers to finish
+		{
+			Repository writer(&ds);
+			EXPECT_TRUE(writer.unlockRepository("h0sts"));
+			std::shared_ptr<Snapshot> snapshot(writer.createSnapshot());
+			EXPECT_THROW(repo.compactRepository(), RepositoryException);
+			EXPECT_NO_THROW(repo.compactRepository(true));
+			
+			// and the freed objects of a deleted snapshot are left for it
+			auto refs = std::make_shared<ReferenceCounts>((tmpPath / "refs").c_str());
+			repo.setReferenceCounts(refs);
+			uint64_t freedObjects = 1;
+			EXPECT_TRUE(repo.deleteSnapshot("host-0", &freedObjects));
+			EXPECT_EQ(0, freedObjects);
+		}
+		EXPECT_EQ(1, repo.compactRepository().deletedObjects);
+		
+		// so does a backup still reading what it reuses
+		{
+			Repository writer(&ds);
+			EXPECT_TRUE(writer.unlockRepository("h0sts"));
+			writer.takeSharedLease();
+			EXPECT_THROW(repo.compactRepository(), RepositoryException);
+		}
+		
+		// writers wait for compaction to finish
+		{
+			Lease lease(ds, Lease::Type::Exclusive, 60);
+			Repository writer(&ds);
+			EXPECT_TRUE(writer.unlockRepository("h0sts"));
+			EXPECT_THROW(writer.createSnapshot(), RepositoryException);
+		}
+		
+		// a writer which stalled past its lease can't commit, as the
+		// objects it reused may have been removed meanwhile
+		{
+			Repository::Options options;
+			options.leaseSeconds = 1;
+			Repository writer(&ds, &options);
+			EXPECT_TRUE(writer.unlockRepository("h0sts"));
+			std::shared_ptr<Snapshot> snapshot(writer.createSnapshot());
+			std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+			EXPECT_NO_THROW(repo.compactRepository());
+			EXPECT_THROW(writer.commitSnapshot(snapshot, "stalled"), RepositoryException);
+		}
+		EXPECT_FALSE(exists(repoPath / "snapshot" / "stalled"));
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, CheckpointTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		EXPECT_TRUE( create_directory(repoPath) );
+		FileDataStore ds(repoPath.c_str());
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("r3sum3", 10));
+		
+		std::vector<std::string> names = { "a", "b", "c" };
+		std::map<std::string, std::vector<uint8_t>> contents;
+		for(const std::string& name : names) {
+			std::vector<uint8_t> randomData(100000);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / name).c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+			contents[name] = randomData;
+		}
+		auto upload = [&](std::shared_ptr<Snapshot> snapshot, const std::string& name) {
+			FileStream inStream((tmpPath / name).c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, name.c_str(), inStream);
+		};
+		
+		EXPECT_NO_THROW(repo.commitSnapshot(repo.createSnapshot(), "empty"));
+		
+		// a backup checkpointed twice, then interrupted
+		{
+			std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+			upload(snapshot, "a");
+			EXPECT_NO_THROW(repo.checkpointSnapshot(snapshot, "backup"));
+			upload(snapshot, "b");
+			EXPECT_NO_THROW(repo.checkpointSnapshot(snapshot, "backup"));
+			EXPECT_NO_THROW(repo.checkpointSnapshot(snapshot, "backup"));
+		}
+		EXPECT_TRUE(exists(repoPath / "checkpoint" / "backup.0"));
+		EXPECT_TRUE(exists(repoPath / "checkpoint" / "backup.1"));
+		EXPECT_FALSE(exists(repoPath / "checkpoint" / "backup.2"));
+		
+		// the uploaded objects survive compaction
+		EXPECT_EQ(0, repo.compactRepository().deletedObjects);
+		
+		// change the contents without changing the size or modify time, so
+		// the file is only read again if the checkpoint isn't used
+		std::time_t mtime = last_write_time(tmpPath / "a");
+		{
+			std::vector<uint8_t> randomData(4096);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / "a").c_str(), FileMode::ReadWrite);
+			fs.write(&randomData[0], randomData.size());
+		}
+		last_write_time(tmpPath / "a", mtime);
+		
+		std::shared_ptr<Snapshot> checkpoint(repo.loadCheckpoint("backup"));
+		ASSERT_TRUE(checkpoint);
+		EXPECT_TRUE(checkpoint->getFileEntry("a"));
+		EXPECT_TRUE(checkpoint->getFileEntry("b"));
+		EXPECT_FALSE(checkpoint->getFileEntry("c"));
+		EXPECT_FALSE(repo.loadCheckpoint("other"));
+		
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot(checkpoint));
+		for(const std::string& name : names) {
+			upload(snapshot, name);
+		}
+		EXPECT_TRUE(memcmp(checkpoint->getFileEntry("a")->md5, snapshot->getFileEntry("a")->md5, MD5_DIGEST_LENGTH) == 0);
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "backup"));
+		EXPECT_TRUE(is_empty(repoPath / "checkpoint"));
+		EXPECT_FALSE(repo.loadCheckpoint("backup"));
+		
+		std::shared_ptr<Snapshot> committed(repo.loadSnapshot("backup"));
+		for(const std::string& name : { std::string("b"), std::string("c") }) {
+			std::vector<uint8_t> downloadedData(contents[name].size());
+			MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+			EXPECT_TRUE(repo.downloadFile(committed, name.c_str(), outStream));
+			EXPECT_EQ(contents[name], downloadedData);
+		}
+		EXPECT_EQ(0, repo.verifyRepository().damagedObjects);
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, SyncTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		std::vector<path> repoPaths = { tmpPath / "source", tmpPath / "shared", tmpPath / "other" };
+		for(const path& repoPath : repoPaths) {
+			EXPECT_TRUE( create_directory(repoPath) );
+		}
+		FileDataStore sourceStore(repoPaths[0].c_str());
+		FileDataStore sharedStore(repoPaths[1].c_str());
+		FileDataStore otherStore(repoPaths[2].c_str());
+		Repository source(&sourceStore);
+		Repository shared(&sharedStore);
+		Repository other(&otherStore);
+		EXPECT_NO_THROW(source.initializeRepository("s0urc3", 10));
+		EXPECT_NO_THROW(shared.initializeRepository(source, "sh4r3d", 10));
+		EXPECT_NO_THROW(other.initializeRepository("0th3r", 10));
+		
+		// a large file split in blocks, and small files in a pack
+		std::map<std::string, std::vector<uint8_t>> contents;
+		for(const auto& file : std::map<std::string, size_t>{ { "large", 3000000 }, { "small-1", 1000 }, { "small-2", 2000 }, { "later", 5000 } }) {
+			std::vector<uint8_t> randomData(file.second);
+			arc4random_buf(&randomData[0], randomData.size());
+			FileStream fs((tmpPath / file.first).c_str(), FileMode::Write);
+			fs.write(&randomData[0], randomData.size());
+			contents[file.first] = randomData;
+		}
+		auto backup = [&](const char *name, const std::vector<std::string>& files) {
+			std::shared_ptr<Snapshot> snapshot(source.createSnapshot());
+			std::shared_ptr<Repository::PackUploadState> packState = source.createPackState();
+			for(const std::string& file : files) {
+				FileStream inStream((tmpPath / file).c_str(), FileMode::Read);
+				source.uploadFile(packState, snapshot, file.c_str(), inStream);
+			}
+			source.finalizePack(snapshot, packState);
+			source.commitSnapshot(snapshot, name);
+		};
+		backup("first", { "large", "small-1", "small-2" });
+		backup("second", { "large", "small-1", "small-2", "later" });
+		
+		auto expectRestored = [&](Repository& repo, const char *name, const std::vector<std::string>& files) {
+			std::shared_ptr<Snapshot> snapshot(repo.loadSnapshot(name));
+			for(const std::string& file : files) {
+				std::vector<uint8_t> downloadedData(contents[file].size());
+				MemoryOutputStream outStream(&downloadedData[0], downloadedData.size());
+				EXPECT_TRUE(repo.downloadFile(snapshot, file.c_str(), outStream));
+				EXPECT_EQ(contents[file], downloadedData);
+			}
+		};
+		
+		// with shared keys the objects are copied as they are, and only
+		// those missing
+		Repository::SyncStats stats = shared.syncRepository(source, { "first" });
+		EXPECT_EQ(1, stats.snapshots);
+		EXPECT_GT(stats.objects, 1);
+		EXPECT_EQ(stats.objects, stats.copiedObjects);
+		stats = shared.syncRepository(source);
+		EXPECT_EQ(1, stats.snapshots);
+		EXPECT_EQ(1, stats.copiedObjects);
+		EXPECT_EQ(0, shared.syncRepository(source).snapshots);
+		expectRestored(shared, "first", { "large", "small-1", "small-2" });
+		expectRestored(shared, "second", { "large", "small-1", "small-2", "later" });
+		std::shared_ptr<Snapshot> sourceSnapshot(source.loadSnapshot("second"));
+		std::shared_ptr<Snapshot> sharedSnapshot(shared.loadSnapshot("second"));
+		EXPECT_EQ(0, sharedSnapshot->diff(*sourceSnapshot).modified);
+		
+		// otherwise they are encrypted again, the members of the packs on
+		// their own, so the small files in both packs are uploaded once
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		stats = other.syncRepository(source);
+		EXPECT_EQ(2, stats.snapshots);
+		EXPECT_EQ(stats.objects - 2, stats.copiedObjects);
+		expectRestored(other, "first", { "large", "small-1", "small-2" });
+		expectRestored(other, "second", { "large", "small-1", "small-2", "later" });
+		EXPECT_EQ(0, other.loadSnapshot("first")->getFileEntry("small-1")->packLength);
+		
+		// the copies keep the time and host they were taken at
+		SnapshotSummary sourceSummary, otherSummary;
+		EXPECT_TRUE(source.loadSnapshotSummary("first", sourceSummary));
+		EXPECT_TRUE(other.loadSnapshotSummary("first", otherSummary));
+		EXPECT_EQ(sourceSummary.creationTime, otherSummary.creationTime);
+		EXPECT_EQ(sourceSummary.hostname, otherSummary.hostname);
+		
+		for(Repository *repo : { &shared, &other }) {
+			Repository::VerifyStats verifyStats = repo->verifyRepository(100);
+			EXPECT_EQ(0, verifyStats.missingObjects + verifyStats.damagedObjects + verifyStats.damagedFiles);
+		}
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
+
+TEST(RepositoryTests, DeltaRestoreTest)
+{
+	using namespace boost::filesystem;
+	using namespace Nebula;
+	
+	// counts the objects downloaded
+	struct CountingDataStore : public FileDataStore
+	{
+		CountingDataStore(const path& storeDirectory) : FileDataStore(storeDirectory), objectGets(0) { }
+		
+		virtual void get(const char *path, OutputStream& stream, ProgressFunction progress) override
+		{
+			if(strncmp(path, "/data/", 6) == 0) {
+				++objectGets;
+			}
+			FileDataStore::get(path, stream, progress);
+		}
+		
+		std::atomic<int> objectGets;
+	};
+	
+	path tmpPath = unique_path();
+	EXPECT_TRUE( create_directory(tmpPath) );
+	
+	{
+		std::unique_ptr<path, std::function<void (path *)>>
+			onExit{ &tmpPath, [](path *p) { remove_all(*p); } };
+		
+		path repoPath = tmpPath / "repo";
+		path seedPath = tmpPath / "seed";
+		EXPECT_TRUE( create_directory(repoPath) );
+		EXPECT_TRUE( create_directory(seedPath) );
+		CountingDataStore ds(repoPath);
+		Repository repo(&ds);
+		
+		EXPECT_NO_THROW(repo.initializeRepository("d3lt4", 10));
+		
+		std::map<std::string, std::vector<uint8_t>> contents;
+		std::shared_ptr<Snapshot> snapshot(repo.createSnapshot());
+		for(const auto& file : std::map<std::string, size_t>{ { "image", 3000000 }, { "note", 1000 } }) {
+			std::vector<uint8_t> randomData(file.second);
+			arc4random_buf(&randomData[0], randomData.size());
+			{
+				FileStream fs((tmpPath / file.first).c_str(), FileMode::Write);
+				fs.write(&randomData[0], randomData.size());
+			}
+			FileStream inStream((tmpPath / file.first).c_str(), FileMode::Read);
+			repo.uploadFile(snapshot, file.first.c_str(), inStream);
+			contents[file.first] = randomData;
+		}
+		EXPECT_NO_THROW(repo.commitSnapshot(snapshot, "vm"));
+		snapshot = repo.loadSnapshot("vm");
+		int objectCount = snapshot->getFileEntry("image")->objectCount;
+		EXPECT_GT(objectCount, 2);
+		
+		auto writeSeed = [&](const std::string& name, const std::vector<uint8_t>& data) {
+			FileStream fs((seedPath / name).c_str(), FileMode::Write);
+			fs.write(&data[0], data.size());
+		};
+		auto restore = [&](const std::string& name, const char *previousPath = nullptr) {
+			ds.objectGets = 0;
+			path restoredPath = tmpPath / ("restored-" + name);
+			{
+				FileStream outStream(restoredPath.c_str(), FileMode::Write);
+				EXPECT_TRUE(repo.downloadFile(snapshot, name.c_str(), outStream, DefaultFileTransferProgressFunction, previousPath));
+			}
+			std::vector<uint8_t> restoredData(contents[name].size());
+			FileStream inStream(restoredPath.c_str(), FileMode::Read);
+			inStream.readExpected(&restoredData[0], restoredData.size());
+			EXPECT_EQ(contents[name], restoredData);
+			return (int)ds.objectGets;
+		};
+		
+		// an older copy with a few bytes changed and some inserted only
+		// needs the objects around the changes
+		std::vector<uint8_t> older = contents["image"];
+		arc4random_buf(&older[0], 16);
+		older.insert(older.begin() + 1500000, 1000, 0x55);
+		writeSeed("older", older);
+		repo.setRestoreSeeds({ seedPath.string() });
+		int objectGets = restore("image");
+		EXPECT_GT(objectGets, 0);
+		EXPECT_LT(objectGets, objectCount);
+		
+		// an identical copy, and a small file
+		writeSeed("copy", contents["image"]);
+		writeSeed("note", contents["note"]);
+		repo.setRestoreSeeds({ seedPath.string() });
+		EXPECT_EQ(0, restore("image"));
+		EXPECT_EQ(0, restore("note"));
+		
+		// seeds changed since they were split are downloaded instead
+		std::vector<uint8_t> randomData(contents["image"].size());
+		arc4random_buf(&randomData[0], randomData.size());
+		writeSeed("older", randomData);
+		writeSeed("copy", randomData);
+		EXPECT_EQ(objectCount, restore("image"));
+		
+		// the previous copy of a file is used before the seeds, or without
+		// any
+		writeSeed("previous", older);
+		objectGets = restore("image", (seedPath / "previous").c_str());
+		EXPECT_GT(objectGets, 0);
+		EXPECT_LT(objectGets, objectCount);
+		repo.setRestoreSeeds({});
+		writeSeed("previous", contents["image"]);
+		EXPECT_EQ(0, restore("image", (seedPath / "previous").c_str()));
+		EXPECT_EQ(objectCount, restore("image", (seedPath / "missing").c_str()));
+		
+		// seeds which are missing are skipped
+		EXPECT_NO_THROW(repo.setRestoreSeeds({ (tmpPath / "missing").string(), seedPath.string() }));
+		EXPECT_EQ(0, restore("note"));
+	}
+	EXPECT_FALSE(exists(tmpPath));
+}
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2017 Sound <sound@sagaforce.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include "libnebula/Snapshot.h"
+#include "libnebula/TempFileStream.h"
+#include "libnebula/InputStream.h"
+#include "libnebula/MemoryOutputStream.h"
+#include "gtest/gtest.h"
+
+static void addTestFile(Nebula::Snapshot& snapshot, const char *path, uint64_t size = 0)
+{
+	using namespace Nebula;
+	
+	uint8_t md5[MD5_DIGEST_LENGTH] = { 0 };
+	Snapshot::ObjectID objectId = { { 1 } };
+	uint32_t objectSize = size;
+	snapshot.addFileEntry(path, "user", "group", FileType::RegularFile, 0644,
+						  CompressionType::LZMA2, size, 0, 0, md5, 0, 0, 1, &objectId, &objectSize);
+}
+
+static std::vector<std::string> listFiles(Nebula::Snapshot& snapshot, const char *subpath)
+{
+	std::vector<std::string> files;
+	snapshot.forEachFileEntry(subpath, [&snapshot, &files](const Nebula::Snapshot::FileEntry& fe) {
+		std::string path = snapshot.indexToString(fe.pathIndex);
+		files.push_back((path.empty() ? "" : path + "/") + snapshot.indexToString(fe.nameIndex));
+	});
+	return files;
+}
+
+TEST(SnapshotTests, LookupTest)
+{
+	using namespace Nebula;
+	
+	Snapshot snapshot;
+	addTestFile(snapshot, "a/b/file1", 1);
+	addTestFile(snapshot, "/a/b/file2", 2);
+	addTestFile(snapshot, "a/b c/file3", 3);
+	addTestFile(snapshot, "a/b/d/file4", 4);
+	addTestFile(snapshot, "top", 5);
+	addTestFile(snapshot, "a/b/file1", 6);
+	
+	ASSERT_TRUE(snapshot.getFileEntry("a/b/file1"));
+	EXPECT_EQ(1, snapshot.getFileEntry("a/b/file1")->size);
+	ASSERT_TRUE(snapshot.getFileEntry("/a/b/file2"));
+	EXPECT_EQ(2, snapshot.getFileEntry("a/b/file2")->size);
+	ASSERT_TRUE(snapshot.getFileEntry("top"));
+	EXPECT_EQ(5, snapshot.getFileEntry("/top")->size);
+	EXPECT_FALSE(snapshot.getFileEntry("a/b"));
+	EXPECT_FALSE(snapshot.getFileEntry("a/b/file5"));
+	EXPECT_FALSE(snapshot.getFileEntry("x/file1"));
+	
+	std::vector<std::string> expected = { "a/b/file1", "a/b/file2", "a/b/d/file4" };
+	EXPECT_EQ(expected, listFiles(snapshot, "a/b"));
+	EXPECT_EQ(expected, listFiles(snapshot, "/a/b/"));
+	expected = { "a/b/file1" };
+	EXPECT_EQ(expected, listFiles(snapshot, "a/b/file1"));
+	expected = { "a/b/file1", "a/b/file2", "a/b/d/file4", "a/b c/file3" };
+	EXPECT_EQ(expected, listFiles(snapshot, "a"));
+	EXPECT_TRUE(listFiles(snapshot, "a/b/d/file").empty());
+	EXPECT_EQ(5, listFiles(snapshot, "").size());
+	
+	snapshot.deleteFileEntry("a/b/file2");
+	EXPECT_FALSE(snapshot.getFileEntry("a/b/file2"));
+	expected = { "a/b/file1", "a/b/d/file4" };
+	EXPECT_EQ(expected, listFiles(snapshot, "a/b"));
+}
+
+TEST(SnapshotTests, SaveLoadTest)
+{
+	using namespace Nebula;
+	
+	Snapshot snapshot;
+	for(int i = 0; i < 10000; ++i) {
+		addTestFile(snapshot, ("dir" + std::to_string(i % 37) + "/sub" + std::to_string(i % 5) + "/file" + std::to_string(i)).c_str(), i);
+	}
+	addTestFile(snapshot, "top", 10000);
+	
+	// a path added twice is saved once, and counted once in the header
+	addTestFile(snapshot, "dir0/sub0/file0", 1);
+	
+	TempFileStream tmpStream;
+	snapshot.save(tmpStream);
+	
+	Snapshot loadedSnapshot;
+	loadedSnapshot.load(*tmpStream.inputStream());
+	for(int i = 0; i < 10000; ++i) {
+		const Snapshot::FileEntry *fe = loadedSnapshot.getFileEntry(("dir" + std::to_string(i % 37) + "/sub" + std::to_string(i % 5) + "/file" + std::to_string(i)).c_str());
+		ASSERT_TRUE(fe);
+		EXPECT_EQ(i, fe->size);
+	}
+	ASSERT_TRUE(loadedSnapshot.getFileEntry("top"));
+	EXPECT_EQ(listFiles(snapshot, "dir3"), listFiles(loadedSnapshot, "dir3"));
+	EXPECT_EQ(10000 / 37 + 1, listFiles(loadedSnapshot, "dir3").size());
+	EXPECT_EQ(10001, listFiles(loadedSnapshot, "").size());
+	EXPECT_EQ(0, loadedSnapshot.getFileEntry("dir0/sub0/file0")->size);
+	
+	// files can still be added to a loaded snapshot
+	addTestFile(loadedSnapshot, "dir3/sub0/new", 1);
+	ASSERT_TRUE(loadedSnapshot.getFileEntry("dir3/sub0/new"));
+}
+
+TEST(SnapshotTests, LoadBufferTest)
+{
+	using namespace Nebula;
+	
+	Snapshot snapshot;
+	for(int i = 0; i < 5000; ++i) {
+		addTestFile(snapshot, ("dir" + std::to_string(i % 3) + "/file" + std::to_string(i)).c_str(), 0x100000000ULL + i);
+	}
+	
+	std::vector<uint8_t> buffer(1024 * 1024);
+	MemoryOutputStream outStream(buffer.data(), buffer.size());
+	snapshot.save(outStream);
+	
+	// header fields are little-endian
+	const uint8_t header[] = { 0xff, 0xff, 0xff, 0xff, 4, 0, 0, 0, 0x88, 0x13, 0, 0 };
+	ASSERT_EQ(0, memcmp(header, outStream.data(), sizeof(header)));
+	
+	Snapshot loadedSnapshot;
+	loadedSnapshot.load(outStream.data(), outStream.size());
+	const Snapshot::FileEntry *fe = loadedSnapshot.getFileEntry("dir1/file4999");
+	ASSERT_TRUE(fe);
+	EXPECT_EQ(0x100000000ULL + 4999, fe->size);
+	EXPECT_EQ(1, fe->objectCount);
+	EXPECT_EQ(4999, *loadedSnapshot.indexToObjectSize(fe->objectIdIndex));
+	EXPECT_EQ(1, loadedSnapshot.indexToObjectID(fe->objectIdIndex)->id[0]);
+	EXPECT_EQ(listFiles(snapshot, "dir2"), listFiles(loadedSnapshot, "dir2"));
+	
+	// a truncated snapshot fails to load
+	Snapshot truncatedSnapshot;
+	EXPECT_ANY_THROW(truncatedSnapshot.load(outStream.data(), outStream.size() - 1));
+}
+
+TEST(SnapshotTests, TreeTest)
+{
+	using namespace Nebula;
+	
+	// directory objects kept in memory, keyed by a counter
+	std::map<std::string, std::vector<uint8_t>> objects;
+	std::map<std::string, int> objectIds;
+	int putCount = 0;
+	auto putTree = [&objects, &objectIds, &putCount](const uint8_t *data, size_t size) {
+		std::string content((const char *)data, size);
+		if(!objectIds.count(content)) {
+			int n = objectIds.size() + 1;
+			objectIds[content] = n;
+			++putCount;
+		}
+		Snapshot::ObjectID id = { { 0 } };
+		memcpy(id.id, &objectIds[content], sizeof(int));
+		objects[std::string((const char *)id.id, sizeof(id.id))].assign(data, data + size);
+		return id;
+	};
+	int getCount = 0;
+	auto getTree = [&objects, &getCount](const Snapshot::ObjectID& id, OutputStream& outStream) {
+		const std::vector<uint8_t>& data = objects.at(std::string((const char *)id.id, sizeof(id.id)));
+		outStream.write(data.data(), data.size());
+		++getCount;
+	};
+	
+	Snapshot snapshot;
+	for(int i = 0; i < 1000; ++i) {
+		addTestFile(snapshot, ("a" + std::to_string(i % 10) + "/b" + std::to_string(i % 3) + "/file" + std::to_string(i)).c_str(), i);
+	}
+	addTestFile(snapshot, "top", 1000);
+	addTestFile(snapshot, "x/y/z/deep", 1001);
+	
+	TempFileStream treeStream;
+	snapshot.saveTree(treeStream, putTree);
+	// root, a0-a9 with b0-b2 each, x, y and z
+	EXPECT_EQ(1 + 10 * 4 + 3, putCount);
+	EXPECT_EQ(putCount, snapshot.treeObjects().size());
+	
+	Snapshot loadedSnapshot;
+	loadedSnapshot.load(*treeStream.inputStream(), getTree);
+	EXPECT_EQ(putCount, getCount);
+	for(int i = 0; i < 1000; ++i) {
+		const Snapshot::FileEntry *fe = loadedSnapshot.getFileEntry(("a" + std::to_string(i % 10) + "/b" + std::to_string(i % 3) + "/file" + std::to_string(i)).c_str());
+		ASSERT_TRUE(fe);
+		EXPECT_EQ(i, fe->size);
+		EXPECT_EQ(i, *loadedSnapshot.indexToObjectSize(fe->objectIdIndex));
+	}
+	ASSERT_TRUE(loadedSnapshot.getFileEntry("x/y/z/deep"));
+	EXPECT_EQ(listFiles(snapshot, ""), listFiles(loadedSnapshot, ""));
+	
+	// changing a file only changes the directories leading to it
+	addTestFile(loadedSnapshot, "a3/b1/new", 1);
+	putCount = 0;
+	TempFileStream treeStream2;
+	loadedSnapshot.saveTree(treeStream2, putTree);
+	EXPECT_EQ(3, putCount);
+	
+	// loading a subpath only fetches the directories on the way to it
+	getCount = 0;
+	Snapshot partialSnapshot;
+	partialSnapshot.load(*treeStream2.inputStream(), getTree, "/a3/b1");
+	EXPECT_EQ(3, getCount);
+	EXPECT_TRUE(partialSnapshot.getFileEntry("a3/b1/new"));
+	EXPECT_FALSE(partialSnapshot.getFileEntry("a3/b0/file3"));
+	EXPECT_FALSE(partialSnapshot.getFileEntry("top"));
+	EXPECT_EQ(listFiles(loadedSnapshot, "a3/b1"), listFiles(partialSnapshot, ""));
+	
+	Snapshot fileSnapshot;
+	fileSnapshot.load(*treeStream2.inputStream(), getTree, "top");
+	ASSERT_TRUE(fileSnapshot.getFileEntry("top"));
+	EXPECT_EQ(1, listFiles(fileSnapshot, "").size());
+	
+	// a tree can't be loaded without fetching its directories
+	Snapshot flatSnapshot;
+	EXPECT_ANY_THROW(flatSnapshot.load(*treeStream2.inputStream()));
+}
+
+TEST(SnapshotTests, ColumnsTest)
+{
+	using namespace Nebula;
+	
+	Snapshot snapshot;
+	for(int i = 0; i < 10000; ++i) {
+		uint8_t md5[MD5_DIGEST_LENGTH];
+		memset(md5, i, sizeof(md5));
+		Snapshot::ObjectID objectIds[2] = { { { (uint8_t)i } }, { { (uint8_t)(i + 1) } } };
+		uint32_t objectSizes[2] = { (uint32_t)i, 1 };
+		snapshot.addFileEntry(("dir" + std::to_string(i % 7) + "/file" + std::to_string(i)).c_str(),
+							  i % 3 ? "user" : "other", "group", FileType::RegularFile, i % 2 ? 0644 : 0755,
+							  CompressionType::LZMA2, 1000000000000ULL + i, 1500000000 - i * 10, 20, md5,
+							  i % 5, i % 5 ? 100 : 0, i % 3, objectIds, objectSizes);
+	}
+	
+	TempFileStream tmpStream;
+	snapshot.save(tmpStream);
+	// smaller than the fixed size records of version 3 alone
+	auto inStream = tmpStream.inputStream();
+	EXPECT_LT(inStream->size(), 10000 * 68 + 9999 * (32 + 4));
+	
+	Snapshot loadedSnapshot;
+	loadedSnapshot.load(*inStream);
+	for(int i = 0; i < 10000; ++i) {
+		const Snapshot::FileEntry *fe = loadedSnapshot.getFileEntry(("dir" + std::to_string(i % 7) + "/file" + std::to_string(i)).c_str());
+		ASSERT_TRUE(fe);
+		EXPECT_STREQ(i % 3 ? "user" : "other", loadedSnapshot.indexToString(fe->userIndex));
+		EXPECT_STREQ("group", loadedSnapshot.indexToString(fe->groupIndex));
+		EXPECT_EQ(i % 2 ? 0644 : 0755, fe->mode);
+		EXPECT_EQ((uint8_t)FileType::RegularFile, fe->type);
+		EXPECT_EQ(20, fe->rollingHashBits);
+		EXPECT_EQ(1000000000000ULL + i, fe->size);
+		EXPECT_EQ(1500000000 - i * 10, fe->mtime);
+		EXPECT_EQ((uint8_t)i, fe->md5[MD5_DIGEST_LENGTH - 1]);
+		EXPECT_EQ(i % 5, fe->offset);
+		EXPECT_EQ(i % 5 ? 100 : 0, fe->packLength);
+		ASSERT_EQ(i % 3, fe->objectCount);
+		for(int j = 0; j < fe->objectCount; ++j) {
+			EXPECT_EQ((uint8_t)(i + j), loadedSnapshot.indexToObjectID(fe->objectIdIndex + j)->id[0]);
+			EXPECT_EQ(j ? 1 : i, *loadedSnapshot.indexToObjectSize(fe->objectIdIndex + j));
+		}
+	}
+}
+
+TEST(SnapshotTests, VersionThreeTest)
+{
+	using namespace Nebula;
+	
+	// a version 3 snapshot with fixed size file records
+	std::vector<uint8_t> data = {
+		0xff, 0xff, 0xff, 0xff, 3, 0, 0, 0,
+		1, 0, 0, 0, // files
+		4, 0, 0, 0, // string table size / 4
+		1, 0, 0, 0, // objects
+		'a', 0, 'f', 0, 'u', 0, 'g', 0, 0, 0, 0, 0, 0, 0, 0, 0
+	};
+	data.resize(data.size() + 32, 7);
+	const uint8_t record[] = {
+		2, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 6, 0, 0, 0, // name, path, user, group
+		0xa4, 0x01, 1, 0, 1, 18, 1, 0, // mode, compression, reserved, type, rollingHashBits, objectCount
+		5, 0, 0, 0, 0, 0, 0, 0, // size
+		9, 0, 0, 0, 0, 0, 0, 0, // mtime
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 // offset, packLength, objectIdIndex
+	};
+	const uint8_t size[] = { 5, 0, 0, 0 };
+	data.insert(data.end(), size, size + sizeof(size));
+	data.insert(data.end(), record, record + sizeof(record));
+	
+	Snapshot snapshot;
+	snapshot.load(data.data(), data.size());
+	const Snapshot::FileEntry *fe = snapshot.getFileEntry("a/f");
+	ASSERT_TRUE(fe);
+	EXPECT_STREQ("u", snapshot.indexToString(fe->userIndex));
+	EXPECT_EQ(0644, fe->mode);
+	EXPECT_EQ(5, fe->size);
+	EXPECT_EQ(9, fe->mtime);
+	EXPECT_EQ(5, *snapshot.indexToObjectSize(fe->objectIdIndex));
+	EXPECT_EQ(7, snapshot.indexToObjectID(fe->objectIdIndex)->id[0]);
+}
+
+TEST(SnapshotTests, DiffTest)
+{
+	using namespace Nebula;
+	
+	auto addFile = [](Snapshot& snapshot, const char *path, uint8_t id, uint32_t size, uint16_t mode = 0644) {
+		uint8_t md5[MD5_DIGEST_LENGTH] = { id };
+		Snapshot::ObjectID objectId = { { id } };
+		snapshot.addFileEntry(path, "user", "group", FileType::RegularFile, mode,
+							  CompressionType::LZMA2, size, 0, 0, md5, 0, 0, 1, &objectId, &size);
+	};
+	
+	Snapshot base;
+	addFile(base, "a/1", 1, 100);
+	addFile(base, "a/2", 2, 200);
+	addFile(base, "b/3", 3, 300);
+	addFile(base, "c", 4, 50);
+	
+	Snapshot snapshot;
+	addFile(snapshot, "a/1", 1, 100);
+	addFile(snapshot, "a/2", 5, 250);
+	addFile(snapshot, "a/new", 6, 70);
+	addFile(snapshot, "c", 4, 50, 0600);
+	addFile(snapshot, "d", 1, 100); // a copy of a/1
+	addFile(snapshot, "e", 6, 70); // a copy of a/new
+	
+	std::vector<std::string> changes;
+	Snapshot::DiffStats stats = snapshot.diff(base, [&changes](Snapshot::Change change, const char *path, const Snapshot::FileEntry *baseEntry, const Snapshot::FileEntry *entry) {
+		switch(change) {
+			case Snapshot::Change::Added:
+				EXPECT_FALSE(baseEntry);
+				changes.push_back(std::string("A ") + path);
+				break;
+			case Snapshot::Change::Removed:
+				EXPECT_FALSE(entry);
+				changes.push_back(std::string("D ") + path);
+				break;
+			case Snapshot::Change::Modified:
+				EXPECT_TRUE(baseEntry && entry);
+				changes.push_back(std::string("M ") + path);
+				break;
+		}
+	});
+	
+	EXPECT_EQ(std::vector<std::string>({ "M c", "A d", "A e", "M a/2", "A a/new", "D b/3" }), changes);
+	EXPECT_EQ(3, stats.added);
+	EXPECT_EQ(1, stats.removed);
+	EXPECT_EQ(2, stats.modified);
+	EXPECT_EQ(240, stats.addedSize);
+	EXPECT_EQ(300, stats.removedSize);
+	EXPECT_EQ(320, stats.newBytes);
+	
+	stats = snapshot.diff(snapshot);
+	EXPECT_EQ(0, stats.added + stats.removed + stats.modified);
+	EXPECT_EQ(0, stats.newBytes);
+}
+
+TEST(SnapshotTests, JournalTest)
+{
+	using namespace Nebula;
+	
+	auto addFile = [](Snapshot& snapshot, const char *path, uint8_t id) {
+		uint8_t md5[MD5_DIGEST_LENGTH] = { id };
+		Snapshot::ObjectID objectId = { { id } };
+		uint32_t size = 100;
+		snapshot.addFileEntry(path, "user", "group", FileType::RegularFile, 0644,
+							  CompressionType::LZMA2, size, 0, 0, md5, 0, 0, 1, &objectId, &size);
+	};
+	
+	Snapshot snapshot;
+	EXPECT_FALSE(snapshot.takeJournal());
+	addFile(snapshot, "a/1", 1);
+	snapshot.startJournal();
+	addFile(snapshot, "a/2", 2);
+	addFile(snapshot, "b", 3);
+	
+	std::shared_ptr<Snapshot> journal = snapshot.takeJournal();
+	ASSERT_TRUE(journal);
+	EXPECT_FALSE(journal->getFileEntry("a/1"));
+	EXPECT_TRUE(journal->getFileEntry("a/2"));
+	EXPECT_TRUE(journal->getFileEntry("b"));
+	
+	journal = snapshot.takeJournal();
+	ASSERT_TRUE(journal);
+	EXPECT_FALSE(journal->getFileEntry("b"));
+	
+	// files already in the snapshot keep their entry
+	Snapshot merged;
+	addFile(merged, "b", 9);
+	merged.addFiles(snapshot);
+	EXPECT_TRUE(merged.getFileEntry("a/1"));
+	EXPECT_TRUE(merged.getFileEntry("a/2"));
+	const Snapshot::FileEntry *fe = merged.getFileEntry("b");
+	ASSERT_TRUE(fe);
+	EXPECT_EQ(9, merged.indexToObjectID(fe->objectIdIndex)->id[0]);
+}
@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <openssl/evp.h>
+#include <openssl/md5.h>
 #include <memory>
 #include <vector>
 #include <random>
@@ -34,6 +35,7 @@ extern "C" {
 #include "libnebula/EncryptedOutputStream.h"
 #include "libnebula/DecryptedInputStream.h"
 #include "libnebula/MultiInputStream.h"
+#include "libnebula/DigestOutputStream.h"
 #include "gtest/gtest.h"
 
 
@@ -279,3 +281,36 @@ TEST(StreamTests, MultiInputStreamReads)
 	EXPECT_EQ(mi.read(&outData[0], 4096), 0);
 	
 }
+
+TEST(StreamTests, DigestOutputStreamVerify)
+{
+	using namespace Nebula;
+	
+	std::vector<uint8_t> inData, outData;
+	inData.resize(100000);
+	outData.resize(100000);
+	arc4random_buf(&inData[0], inData.size());
+	
+	uint8_t md5[MD5_DIGEST_LENGTH];
+	MD5(&inData[0], inData.size(), md5);
+	
+	{
+		MemoryOutputStream outStream(&outData[0], outData.size());
+		DigestOutputStream digestStream(outStream, EVP_md5());
+		digestStream.setExpectedDigest(md5, sizeof(md5));
+		MemoryInputStream inStream(&inData[0], inData.size());
+		copyStream(inStream, digestStream, 1 + (rand() % 4096));
+		EXPECT_NO_THROW(digestStream.close());
+		EXPECT_EQ(digestStream.digestSize(), MD5_DIGEST_LENGTH);
+		EXPECT_TRUE(memcmp(digestStream.digest(), md5, sizeof(md5)) == 0);
+		EXPECT_TRUE(memcmp(&inData[0], &outData[0], inData.size()) == 0);
+	}
+	
+	{
+		md5[0] ^= 1;
+		DigestOutputStream digestStream(EVP_md5());
+		digestStream.setExpectedDigest(md5, sizeof(md5));
+		digestStream.write(&inData[0], inData.size());
+		EXPECT_THROW(digestStream.close(), VerificationFailedException);
+	}
+}